@@ -18,13 +18,24 @@
 #include <time.h>
 #include <map>
 #include <deque>
+#include <vector>
 #include <string>
 
 /** Do we use this? -- Brain */
 typedef void* VoidPointer;
 
-/** A private data store for an Extensible class */
-typedef std::map<std::string,char*> ExtensibleStore;
+/** Identifies one kind of extension data. See Extensible::RegisterExt.
+ */
+typedef unsigned int ExtensionSlot;
+
+/** Frees one item of extension data
+ */
+typedef void (*ExtensionDestructor)(char*);
+
+/** A private data store for an Extensible class.
+ * Pairs of slot and data, sorted by slot.
+ */
+typedef std::vector<std::pair<ExtensionSlot, char*> > ExtensibleStore;
 
 /** Needed */
 class InspIRCd;
@@ -58,6 +69,12 @@ class CoreExport classbase
  * objects, channel objects and server objects, without breaking other modules (this is more sensible than using
  * a flags variable, and each module defining bits within the flag as 'theirs' as it is less prone to conflict and
  * supports arbitary data storage).
+ *
+ * Each key is registered once, process wide, and given a small integer slot. Objects only hold the slots
+ * they have data for, in a short sorted array, so a lookup by slot is a few integer comparisons. Modules
+ * which look up their data often should register their key once with RegisterExt(), or use ExtensionItem,
+ * and pass the slot around. The versions taking a string key are kept for compatibility, and look the
+ * key up in the registry first.
  */
 class CoreExport Extensible : public classbase
 {
@@ -65,9 +82,57 @@ class CoreExport Extensible : public classbase
 	 * Holds all extensible metadata for the class.
 	 */
 	ExtensibleStore Extension_Items;
+
+	/** Find a slot in the store, or where it would go
+	 */
+	ExtensibleStore::iterator Position(ExtensionSlot slot)
+	{
+		ExtensibleStore::iterator i = Extension_Items.begin();
+		while ((i != Extension_Items.end()) && (i->first < slot))
+			i++;
+		return i;
+	}
 	
 public:
 
+	/** Register an extension key, or get the slot it already has.
+	 * Slots are never reused, and stay valid for the life of the process.
+	 * @param key The key name
+	 * @return The slot for this key
+	 */
+	static ExtensionSlot RegisterExt(const std::string &key);
+
+	/** Look up the slot of an extension key without registering it
+	 * @param key The key name
+	 * @param slot Receives the slot, if the key is registered
+	 * @return True if the key is registered
+	 */
+	static bool FindExt(const std::string &key, ExtensionSlot &slot);
+
+	/** Set the function used to free a slot's data when an object which
+	 * still holds it is destroyed, or NULL for none (the default).
+	 */
+	static void SetExtDestructor(ExtensionSlot slot, ExtensionDestructor destroy);
+
+	/** Extend an Extensible class.
+	 *
+	 * @param slot The slot which identifies the extension data, from RegisterExt()
+	 * @param p This parameter is a pointer to any data you wish to associate with the object
+	 *
+	 * If the data already exists, you may not insert it twice, Extensible::Extend will
+	 * return false in this case.
+	 *
+	 * @return Returns true on success, false if otherwise
+	 */
+	template<typename T> bool Extend(ExtensionSlot slot, T* p)
+	{
+		ExtensibleStore::iterator i = Position(slot);
+		if ((i != Extension_Items.end()) && (i->first == slot))
+			return false;
+		this->Extension_Items.insert(i, std::make_pair(slot, (char*)p));
+		return true;
+	}
+
 	/** Extend an Extensible class.
 	 *
 	 * @param key The key parameter is an arbitary string which identifies the extension data
@@ -82,11 +147,16 @@ public:
 	 */
 	template<typename T> bool Extend(const std::string &key, T* p)
 	{
-		/* This will only add an item if it doesnt already exist,
-		 * the return value is a std::pair of an iterator to the
-		 * element, and a bool saying if it was actually inserted.
-		 */
-		return this->Extension_Items.insert(std::make_pair(key, (char*)p)).second;
+		return this->Extend(RegisterExt(key), p);
+	}
+
+	/** Extend an Extensible class with a slot holding no data, for boolean values.
+	 * @param slot The slot which identifies the extension data, from RegisterExt()
+	 * @return Returns true on success, false if otherwise
+	 */
+	bool Extend(ExtensionSlot slot)
+	{
+		return this->Extend(slot, (char*)NULL);
 	}
 
 	/** Extend an Extensible class.
@@ -102,13 +172,15 @@ public:
 	 */
 	bool Extend(const std::string &key)
 	{
-		/* This will only add an item if it doesnt already exist,
-		 * the return value is a std::pair of an iterator to the
-		 * element, and a bool saying if it was actually inserted.
-		 */
-		return this->Extension_Items.insert(std::make_pair(key, (char*)NULL)).second;
+		return this->Extend(RegisterExt(key), (char*)NULL);
 	}
 
+	/** Shrink an Extensible class.
+	 * @param slot The slot which identifies the extension data, from RegisterExt()
+	 * @return Returns true on success.
+	 */
+	bool Shrink(ExtensionSlot slot);
+
 	/** Shrink an Extensible class.
 	 *
 	 * @param key The key parameter is an arbitary string which identifies the extension data
@@ -118,6 +190,25 @@ public:
 	 * @return Returns true on success.
 	 */
 	bool Shrink(const std::string &key);
+
+	/** Get an extension item.
+	 * @param slot The slot which identifies the extension data, from RegisterExt()
+	 * @param p If the item does not exist, this value will be NULL. Otherwise a pointer to the item you requested will be placed in this templated parameter.
+	 * @return Returns true if the item was found and false if it was not, regardless of wether 'p' is NULL.
+	 */
+	template<typename T> bool GetExt(ExtensionSlot slot, T* &p)
+	{
+		for (ExtensibleStore::iterator i = Extension_Items.begin(); (i != Extension_Items.end()) && (i->first <= slot); i++)
+		{
+			if (i->first == slot)
+			{
+				p = (T*)i->second;	/* Item found */
+				return true;
+			}
+		}
+		p = NULL;		/* Item not found */
+		return false;
+	}
 	
 	/** Get an extension item.
 	 *
@@ -127,17 +218,21 @@ public:
 	 */
 	template<typename T> bool GetExt(const std::string &key, T* &p)
 	{
-		ExtensibleStore::iterator iter = this->Extension_Items.find(key); /* Find the item */
-		if(iter != this->Extension_Items.end())
-		{
-			p = (T*)iter->second;	/* Item found */
-			return true;
-		}
-		else
-		{
-			p = NULL;		/* Item not found */
-			return false;
-		}
+		ExtensionSlot slot;
+		if (FindExt(key, slot))
+			return this->GetExt(slot, p);
+		p = NULL;
+		return false;
+	}
+
+	/** Check if an extension item exists.
+	 * @param slot The slot which identifies the extension data, from RegisterExt()
+	 * @return Returns true if the item was found and false if it was not.
+	 */
+	bool GetExt(ExtensionSlot slot)
+	{
+		char* dummy;
+		return this->GetExt(slot, dummy);
 	}
 	
 	/** Get an extension item.
@@ -151,7 +246,8 @@ public:
 	 */
 	bool GetExt(const std::string &key)
 	{
-		return (this->Extension_Items.find(key) != this->Extension_Items.end());
+		char* dummy;
+		return this->GetExt(key, dummy);
 	}
 
 	/** Get a list of all extension items names.
@@ -159,6 +255,79 @@ public:
 	 * @return This function writes a list of all extension items stored in this object by name into the given deque and returns void.
 	 */
 	void GetExtList(std::deque<std::string> &list);
+
+	/** Destructor. Frees any items left in slots which have a destructor set.
+	 */
+	~Extensible();
+};
+
+/** A typed extension key. A module creates one of these for each kind of data
+ * it attaches to users or channels, and uses it in place of a string key:
+ *
+ *   ExtensionItem<std::string> account("accountname");
+ *   std::string* acct = account.Get(user);
+ *
+ * While the ExtensionItem exists, data it set which is still attached when the
+ * object is destroyed is deleted along with it.
+ */
+template<typename T> class ExtensionItem
+{
+	ExtensionSlot slot;
+
+	static void Destroy(char* p)
+	{
+		delete (T*)p;
+	}
+
+ public:
+	/** Register the key and take ownership of its data
+	 * @param key The key name. Other modules may still use the string API with it.
+	 */
+	ExtensionItem(const std::string &key) : slot(Extensible::RegisterExt(key))
+	{
+		Extensible::SetExtDestructor(slot, &Destroy);
+	}
+
+	~ExtensionItem()
+	{
+		Extensible::SetExtDestructor(slot, NULL);
+	}
+
+	/** @return The item attached to an object, or NULL
+	 */
+	T* Get(Extensible* e) const
+	{
+		T* p;
+		e->GetExt(slot, p);
+		return p;
+	}
+
+	/** Attach an item to an object
+	 * @return False if the object already has one
+	 */
+	bool Set(Extensible* e, T* p) const
+	{
+		return e->Extend(slot, p);
+	}
+
+	/** Detach and delete the item attached to an object, if any
+	 */
+	void Unset(Extensible* e) const
+	{
+		T* p;
+		if (e->GetExt(slot, p))
+		{
+			e->Shrink(slot);
+			delete p;
+		}
+	}
+
+	/** @return The slot for this key
+	 */
+	ExtensionSlot GetSlot() const
+	{
+		return slot;
+	}
 };
 
 /** BoolSet is a utility class designed to hold eight bools in a bitmask.
@@ -20,6 +20,7 @@
 #include <vector>
 #include <string>
 #include <map>
+#include "hashcomp.h"
 
 /** RFC1459 channel modes
  */
@@ -68,7 +69,9 @@ class BanItem : public HostItem
  */
 typedef std::vector<BanItem> 	BanList;
 
-/** A list of users on a channel
+/** A set of users, each with a display string.
+ * Used for message exemption lists, and by modules which replace the
+ * NAMES list of a channel. Channel membership itself is a MemberList.
  */
 typedef std::map<userrec*,std::string> CUList;
 
@@ -93,9 +96,243 @@ enum UserChannelModes {
 	UCMODE_HOP	= 4	/* Halfopped user */
 };
 
+/** Holds one user's membership of one channel.
+ * There is exactly one of these for each user/channel pair. The record
+ * is owned by the channel's MemberList, which keeps it in a dense array
+ * for fanout, and it is also linked into the user's UserChanList so that
+ * the channels of a user can be walked without any lookups at all.
+ */
+class CoreExport Membership
+{
+ public:
+	/** The user who is on the channel
+	 */
+	userrec* user;
+
+	/** The channel the user is on
+	 */
+	chanrec* chan;
+
+	/** Previous membership in the user's channel list
+	 */
+	Membership* prev_chan;
+
+	/** Next membership in the user's channel list
+	 */
+	Membership* next_chan;
+
+	/** Position of this record within the channel's member array
+	 */
+	unsigned int slot;
+
+	/** Zero or more of the UCMODE_* bits
+	 */
+	char status;
+
+	/** The prefixes the user has, such as @ or +, as bits from
+	 * ModeParser::GetPrefixBit(). Change these with chanrec::SetPrefix().
+	 */
+	unsigned int prefixes;
+
+	Membership(userrec* u, chanrec* c) : user(u), chan(c), prev_chan(NULL), next_chan(NULL), slot(0), status(0), prefixes(0) { }
+
+	/** Allocate a record from the membership pool. See SlabPool.
+	 */
+	static void* operator new(size_t size);
+
+	/** Return a record to the membership pool
+	 */
+	static void operator delete(void* p, size_t size);
+};
+
+/** The members of a channel.
+ * Membership records are stored contiguously so that sending a line to a
+ * channel is a linear walk, and a small open addressed table keyed on the
+ * userrec pointer gives a constant time membership test. Removal swaps the
+ * last record into the vacated slot, so the order of the members is not
+ * stable across parts.
+ */
+class CoreExport MemberList
+{
+ private:
+	/** Dense array of members
+	 */
+	std::vector<Membership*> members;
+
+	/** Linear probed index into members, a power of two in size.
+	 * Empty buckets are NULL; deletion shifts entries back rather than
+	 * leaving tombstones.
+	 */
+	std::vector<Membership*> table;
+
+	/** Bucket of a user pointer before masking
+	 */
+	static unsigned int Hash(const userrec* user)
+	{
+		size_t p = (size_t)user;
+		return (unsigned int)(p ^ (p >> 4) ^ (p >> 12) ^ (p >> 20));
+	}
+
+	/** Rebuild the index with the given number of buckets
+	 */
+	void Resize(size_t buckets);
+
+ public:
+	typedef std::vector<Membership*>::iterator iterator;
+	typedef std::vector<Membership*>::const_iterator const_iterator;
+	typedef std::vector<Membership*>::reverse_iterator reverse_iterator;
+
+	iterator begin() { return members.begin(); }
+	iterator end() { return members.end(); }
+	const_iterator begin() const { return members.begin(); }
+	const_iterator end() const { return members.end(); }
+	reverse_iterator rbegin() { return members.rbegin(); }
+	reverse_iterator rend() { return members.rend(); }
+	size_t size() const { return members.size(); }
+	bool empty() const { return members.empty(); }
+
+	/** Find the membership record of a user
+	 * @param user The user to look for
+	 * @return The record, or NULL if the user is not a member
+	 */
+	Membership* find(const userrec* user) const
+	{
+		if (table.empty())
+			return NULL;
+		size_t mask = table.size() - 1;
+		for (size_t b = Hash(user) & mask; table[b]; b = (b + 1) & mask)
+			if (table[b]->user == user)
+				return table[b];
+		return NULL;
+	}
+
+	/** Add a user, or return their existing record
+	 * @param user The user to add
+	 * @param chan The channel this list belongs to
+	 * @return The membership record of the user
+	 */
+	Membership* insert(userrec* user, chanrec* chan);
+
+	/** Remove a user from the list.
+	 * The record is not freed, that is up to the caller.
+	 * @param user The user to remove
+	 * @return The removed record, or NULL if the user was not a member
+	 */
+	Membership* erase(userrec* user);
+
+	/** Count the members which have any of the given UCMODE_* bits
+	 * @param mask One or more UCMODE_* bits
+	 * @return Number of matching members
+	 */
+	size_t count(char mask) const;
+};
+
+/** The channels a user is on, as an intrusive list through their
+ * Membership records. Most recently joined channels come first.
+ */
+class CoreExport UserChanList
+{
+ private:
+	/** First membership of the user
+	 */
+	Membership* head;
+
+	/** Number of memberships in the list
+	 */
+	size_t count;
+
+ public:
+	/** Forward iterator, dereferences to a Membership*.
+	 * It is safe to remove the current record after advancing past it.
+	 */
+	class iterator
+	{
+		Membership* m;
+	 public:
+		iterator(Membership* p = NULL) : m(p) { }
+		Membership* operator*() const { return m; }
+		iterator& operator++() { m = m->next_chan; return *this; }
+		iterator operator++(int) { iterator t(*this); m = m->next_chan; return t; }
+		bool operator==(const iterator& other) const { return m == other.m; }
+		bool operator!=(const iterator& other) const { return m != other.m; }
+	};
+
+	UserChanList() : head(NULL), count(0) { }
+
+	iterator begin() const { return iterator(head); }
+	iterator end() const { return iterator(); }
+	size_t size() const { return count; }
+	bool empty() const { return !count; }
+
+	/** Forget all memberships without touching them
+	 */
+	void clear() { head = NULL; count = 0; }
+
+	/** Link a new membership in at the head of the list
+	 */
+	void push_front(Membership* m)
+	{
+		m->prev_chan = NULL;
+		m->next_chan = head;
+		if (head)
+			head->prev_chan = m;
+		head = m;
+		count++;
+	}
+
+	/** Unlink a membership from the list
+	 */
+	void unlink(Membership* m)
+	{
+		if (m->prev_chan)
+			m->prev_chan->next_chan = m->next_chan;
+		else
+			head = m->next_chan;
+		if (m->next_chan)
+			m->next_chan->prev_chan = m->prev_chan;
+		m->prev_chan = m->next_chan = NULL;
+		count--;
+	}
+};
+
+/** Shorthand for an iterator into a UserChanList
+ */
+typedef UserChanList::iterator UCListIter;
+
 /* Forward declaration -- required */
 class InspIRCd;
 
+/** Ways of formatting a NAMES reply, which a user chooses by sending
+ * PROTOCTL for the matching capability. Held in userrec::NamesFormat.
+ */
+enum NamesFormat {
+	NAMES_ALLPREFIXES = 1,	/* NAMESX: show every prefix, not just the highest */
+	NAMES_FULLHOST = 2	/* UHNAMES: show nick!user@host, not just the nick */
+};
+
+/** A NAMES reply for one channel in one NamesFormat, as it appears to the
+ * channel's own members. It is split into pieces which each fit in one 353
+ * numeric addressed to any nick, so it can be sent with no further work.
+ */
+class CoreExport NamesCache
+{
+ public:
+	/** Text of each 353 numeric, after the colon
+	 */
+	std::vector<std::string> chunks;
+
+	/** False if the reply must be built again before use
+	 */
+	bool valid;
+
+	/** False if a member has a visibility handler, in which case the
+	 * reply depends on who asks and is never cached
+	 */
+	bool shared;
+
+	NamesCache() : valid(false), shared(true) { }
+};
+
 /** A stored prefix and its rank
  */
 typedef std::pair<char, unsigned int> prefixtype;
@@ -104,10 +341,6 @@ typedef std::pair<char, unsigned int> prefixtype;
  */
 typedef std::vector<prefixtype> pfxcontainer;
 
-/** A list of users with zero or more prefixes set on them
- */
-typedef std::map<userrec*, std::vector<prefixtype> > prefixlist;
-
 /** Holds all relevent information for a channel.
  * This class represents a channel, and contains its name, modes, time created, topic, topic set time,
  * etc, and an instance of the BanList type.
@@ -128,15 +361,49 @@ class CoreExport chanrec : public Extensible
 	 */
 	void SetDefaultModes();
 
-	/** A list of prefixes associated with each user in the channel
-	 * (e.g. &%+ etc)
-	 */
-	prefixlist prefixes;
-
 	/** Maximum number of bans (cached)
 	 */
 	int maxbans;
 
+	/** NAMES replies, indexed by NamesFormat bits
+	 */
+	NamesCache names[4];
+
+	/** Mode strings from ChanModes(), without and with the key
+	 */
+	std::string modestring[2];
+
+	/** What the mode strings were built from. Modes are often changed by
+	 * writing to modes, limit and key directly, so ChanModes() compares
+	 * against these rather than relying on being told.
+	 */
+	char modesnap[64];
+	short int limitsnap;
+	char keysnap[32];
+	unsigned int paramserial;
+	unsigned int paramsnap;
+	bool modesvalid;
+
+	/** Build a channel mode string from scratch
+	 */
+	std::string BuildModes(bool showkey);
+
+	/** Text of one member in a NAMES reply, including the trailing space
+	 * @param member The member
+	 * @param memb Their membership of this channel, or NULL
+	 * @param shown The nick to show, which a module may have replaced
+	 * @param format NamesFormat bits
+	 */
+	std::string NamesEntry(userrec* member, Membership* memb, const char* shown, int format);
+
+	/** Append an entry to a cached NAMES reply, starting a new 353 if needed
+	 */
+	void AppendName(NamesCache &cache, const std::string &entry);
+
+	/** Get the NAMES reply for a format, building it if needed
+	 */
+	NamesCache& GetNames(int format);
+
  public:
 	/** The channel's name.
 	 */
@@ -150,33 +417,9 @@ class CoreExport chanrec : public Extensible
 	 */
 	char modes[64];
 
-	/** User lists.
-	 * There are four user lists, one for 
-	 * all the users, one for the ops, one for
-	 * the halfops and another for the voices.
-	 */
-	CUList internal_userlist;
-
-	/** Opped users.
-	 * There are four user lists, one for 
-	 * all the users, one for the ops, one for
-	 * the halfops and another for the voices.
+	/** Members of the channel, with their UCMODE_* status bits.
 	 */
-	CUList internal_op_userlist;
-
-	/** Halfopped users.
-	 * There are four user lists, one for 
-	 * all the users, one for the ops, one for
-	 * the halfops and another for the voices.
-	 */
-	CUList internal_halfop_userlist;
-
-	/** Voiced users.
-	 * There are four user lists, one for
-	 * all the users, one for the ops, one for
-	 * the halfops and another for the voices.
-	 */
-	CUList internal_voice_userlist;
+	MemberList members;
 
 	/** Parameters for custom modes.
 	 * One for each custom mode letter.
@@ -257,76 +500,43 @@ class CoreExport chanrec : public Extensible
 	 */
 	long GetUserCounter();
 
-	/** Add a user pointer to the internal reference list
-	 * @param user The user to add
-	 *
-	 * The data inserted into the reference list is a table as it is
-	 * an arbitary pointer compared to other users by its memory address,
-	 * as this is a very fast 32 or 64 bit integer comparison.
-	 */
-	void AddUser(userrec* user);
-
-	/** Add a user pointer to the internal reference list of opped users
-	 * @param user The user to add
-	 */
-	void AddOppedUser(userrec* user);
-
-	/** Add a user pointer to the internal reference list of halfopped users
+	/** Add a user to the channel's member list.
+	 * The new membership is also linked into the user's own list of
+	 * channels. If the user is already a member their existing record is
+	 * returned unchanged.
 	 * @param user The user to add
+	 * @return The membership record of the user on this channel
 	 */
-	void AddHalfoppedUser(userrec* user);
+	Membership* AddUser(userrec* user);
 
-	/** Add a user pointer to the internal reference list of voiced users
-	 * @param user The user to add
-	 */
-	void AddVoicedUser(userrec* user);
-
-	/** Delete a user pointer to the internal reference list
+	/** Remove a user from the channel's member list, and unlink and free
+	 * their membership record.
 	 * @param user The user to delete
 	 * @return number of users left on the channel after deletion of the user
 	 */
 	unsigned long DelUser(userrec* user);
 
-	/** Delete a user pointer to the internal reference list of opped users
-	 * @param user The user to delete
-	 */
-	void DelOppedUser(userrec* user);
-
-	/** Delete a user pointer to the internal reference list of halfopped users
-	 * @param user The user to delete
-	 */
-	void DelHalfoppedUser(userrec* user);
-
-	/** Delete a user pointer to the internal reference list of voiced users
-	 * @param user The user to delete
-	 */
-	void DelVoicedUser(userrec* user);
-
-	/** Obtain the internal reference list
-	 * The internal reference list contains a list of userrec*.
-	 * These are used for rapid comparison to determine
-	 * channel membership for PRIVMSG, NOTICE, QUIT, PART etc.
-	 * The resulting pointer to the vector should be considered
-	 * readonly and only modified via AddUser and DelUser.
+	/** Obtain the member list.
+	 * Each entry is a Membership* holding the user and their status bits.
+	 * The list should be considered readonly and only modified via
+	 * AddUser and DelUser.
 	 *
-	 * @return This function returns pointer to a map of userrec pointers (CUList*).
-	 */
-	CUList* GetUsers();
-
-	/** Obtain the internal reference list of opped users
-	 * @return This function returns pointer to a map of userrec pointers (CUList*).
+	 * @return This function returns a pointer to the channel's MemberList.
 	 */
-	CUList* GetOppedUsers();
+	MemberList* GetUsers();
 
-	/** Obtain the internal reference list of halfopped users
-	 * @return This function returns pointer to a map of userrec pointers (CUList*).
+	/** Obtain the membership record of a user on this channel
+	 * @param user The user to look for
+	 * @return The record, or NULL if the user is not on this channel
 	 */
-	CUList* GetHalfoppedUsers();
+	Membership* GetMembership(userrec* user);
 
-	/** Obtain the internal reference list of voiced users
-	 * @return This function returns pointer to a map of userrec pointers (CUList*).
+	/** Convert a status character such as '@' into the UCMODE_* bit it
+	 * stands for.
+	 * @param status A status character, or 0
+	 * @return The matching UCMODE_* bit, or 0 for everyone
 	 */
-	CUList* GetVoicedUsers();
+	static char StatusToMask(char status);
 
 	/** Returns true if the user given is on the given channel.
 	 * @param The user to look for
@@ -339,6 +549,14 @@ class CoreExport chanrec : public Extensible
 	 */
 	chanrec(InspIRCd* Instance);
 
+	/** Allocate a chanrec from the channel pool. See SlabPool.
+	 */
+	static void* operator new(size_t size);
+
+	/** Return a chanrec to the channel pool
+	 */
+	static void operator delete(void* p, size_t size);
+
 	/** Make src kick user from this channel with the given reason.
 	 * @param src The source of the kick
 	 * @param user The user being kicked (must be on this channel)
@@ -451,19 +669,39 @@ class CoreExport chanrec : public Extensible
 	long GetMaxBans();
 
 	/** Return the channel's modes with parameters.
+	 * The string is kept until the modes change, so repeated calls cost
+	 * a comparison rather than a rebuild.
 	 * @param showkey If this is set to true, the actual key is shown,
 	 * otherwise it is replaced with '&lt;KEY&gt;'
-	 * @return The channel mode string
+	 * @return The channel mode string, valid until the modes change
 	 */
 	char* ChanModes(bool showkey);
 
-	/** Spool the NAMES list for this channel to the given user
+	/** Spool the NAMES list for this channel to the given user.
+	 * Members of the channel are sent a cached copy of the list, in the
+	 * format chosen by userrec::NamesFormat, unless a module supplies a
+	 * list of its own.
 	 * @param user The user to spool the NAMES list to
 	 * @param ulist The user list to send, NULL to use the
 	 * channel's default names list of everyone
 	 */
 	void UserList(userrec *user, CUList* ulist = NULL);
 
+	/** Discard the cached NAMES replies. Anything which changes how a
+	 * member appears in NAMES and which the channel is not told about,
+	 * such as a change of nick, host or visibility handler, must call
+	 * this; userrec::InvalidateCache() does so for all of a user's channels.
+	 */
+	void InvalidateNames();
+
+	/** Check if a member of this channel should appear in a NAMES reply
+	 * @param user The user requesting the NAMES list
+	 * @param member The member to check
+	 * @param has_user True if user is on this channel
+	 * @return True if the member may be shown to user
+	 */
+	bool ShowInNames(userrec* user, userrec* member, bool has_user);
+
 	/** Get the number of invisible users on this channel
 	 * @return Number of invisible users
 	 */
@@ -494,6 +732,13 @@ class CoreExport chanrec : public Extensible
 	 */
 	const char* GetPrefixChar(userrec *user);
 
+	/** Get the highest prefix of a member, as GetPrefixChar(userrec*)
+	 * but without looking the membership up
+	 * @param memb A membership of this channel
+	 * @return A character array containing the prefix string
+	 */
+	const char* GetPrefixChar(Membership* memb);
+
 	/** Return all of a users mode prefixes into a char* string.
 	 * @param user The user to look up
 	 * @return A list of all prefix characters. The prefixes will always
@@ -502,6 +747,13 @@ class CoreExport chanrec : public Extensible
 	 */
 	const char* GetAllPrefixChars(userrec* user);
 
+	/** Return all of a member's prefixes, as GetAllPrefixChars(userrec*)
+	 * but without looking the membership up
+	 * @param memb A membership of this channel
+	 * @return A list of all prefix characters, greatest first
+	 */
+	const char* GetAllPrefixChars(Membership* memb);
+
 	/** Get the value of a users prefix on this channel.
 	 * @param user The user to look up
 	 * @return The module or core-defined value of the users prefix.
@@ -526,9 +778,10 @@ class CoreExport chanrec : public Extensible
 	 * Only the core should call this method, usually  from
 	 * within the mode parser or when the first user joins
 	 * the channel (to grant ops to them)
-	 * @param user The user to associate the privilage with
+	 * @param user The user to associate the privilage with, who must be on the channel
 	 * @param prefix The prefix character to associate
-	 * @param prefix_rank The rank (value) of this prefix character
+	 * @param prefix_rank The rank (value) of this prefix character. Unused; the
+	 * rank is that of the mode handler which registered the prefix.
 	 * @param adding True if adding the prefix, false when removing
 	 */
 	void SetPrefix(userrec* user, char prefix, unsigned int prefix_rank, bool adding);
@@ -545,7 +798,138 @@ class CoreExport chanrec : public Extensible
 
 	/** Destructor for chanrec
 	 */
-	virtual ~chanrec() { /* stub */ }
+	virtual ~chanrec();
+};
+
+/** The progress of one user's /LIST through the channel directory.
+ * The position is kept as the key of the last channel sent rather than
+ * an iterator, so channels may come and go between batches.
+ */
+class CoreExport ListCursor : public classbase
+{
+ public:
+	/** Only list channels with more users than this, if nonzero
+	 */
+	long minusers;
+	/** Only list channels with fewer users than this, if nonzero
+	 */
+	long maxusers;
+	/** Mask matched against channel names and topics
+	 */
+	std::string glob;
+	/** The literal text the mask starts with, or empty to walk channels
+	 * by size rather than by name and topic
+	 */
+	irc::string prefix;
+	/** True once the name range is done and the topic range is being walked
+	 */
+	bool topics;
+	/** True once anything has been walked, so the keys below are valid
+	 */
+	bool started;
+	/** Key of the last channel walked, by size, name or topic
+	 */
+	std::pair<long, irc::string> lastsize;
+	irc::string lastname;
+	std::pair<irc::string, irc::string> lasttopic;
+
+	ListCursor(const std::string &mask, long mi, long ma);
+};
+
+/** An index of the channels which have users, maintained as users join
+ * and part and topics change, which /LIST is answered from.
+ *
+ * Channels are ordered by size, largest first, so that '>n' and '<n'
+ * filters are ranges of one map; and by name and by topic, so that a mask
+ * which starts with literal text only visits the channels it might match.
+ * A LIST is sent a batch at a time: another batch goes out each time the
+ * user's sendq has drained, rather than queueing every channel at once.
+ */
+class CoreExport ChannelDirectory : public classbase
+{
+ public:
+	/** Size index key: the negated user count, then the name
+	 */
+	typedef std::pair<long, irc::string> SizeKey;
+	/** Topic index key: the topic, then the name
+	 */
+	typedef std::pair<irc::string, irc::string> TopicKey;
+
+	typedef std::map<SizeKey, chanrec*> SizeIndex;
+	typedef std::map<irc::string, chanrec*> NameIndex;
+	typedef std::map<TopicKey, chanrec*> TopicIndex;
+
+ private:
+	InspIRCd* ServerInstance;
+
+	/** Where a channel sits in each index
+	 */
+	struct Entry
+	{
+		SizeIndex::iterator size;
+		NameIndex::iterator name;
+		TopicIndex::iterator topic;
+	};
+
+	std::map<chanrec*, Entry> entries;
+	SizeIndex bysize;
+	NameIndex byname;
+	TopicIndex bytopic;
+
+	/** Number of users with a /LIST in progress
+	 */
+	int listers;
+
+	/** Send one channel's 322 line if the user may see it
+	 * @return The number of bytes sent
+	 */
+	size_t SendChannel(userrec* user, ListCursor* cursor, chanrec* chan);
+
+ public:
+	/** Create an empty directory
+	 */
+	ChannelDirectory(InspIRCd* Instance);
+
+	/** Bring a channel's entries up to date after its user count has
+	 * changed. Channels with no users are removed.
+	 */
+	void Update(chanrec* chan);
+
+	/** Bring a channel's topic entry up to date after a topic change
+	 */
+	void Retopic(chanrec* chan);
+
+	/** Remove a channel from the directory, if it is in it
+	 */
+	void Del(chanrec* chan);
+
+	/** Start a /LIST for a user, sending the 321 header and the first
+	 * batch. A user who is already listing is ignored.
+	 * @param mask Mask to match names and topics against, or empty for all
+	 * @param minusers Lower user count bound, exclusive, or 0
+	 * @param maxusers Upper user count bound, exclusive, or 0
+	 */
+	void StartList(userrec* user, const std::string &mask, long minusers, long maxusers);
+
+	/** Send the next batch of a user's /LIST, if one is in progress,
+	 * sending 323 and finishing it once all channels have been walked.
+	 * Called when the user's sendq has drained. For a socket hooked by a
+	 * module, this is every write event, and a batch is only sent once the
+	 * module is holding less than one.
+	 */
+	void ContinueList(userrec* user);
+
+	/** Abandon a user's /LIST, if one is in progress
+	 */
+	void EndList(userrec* user);
+
+	/** @return The number of users with a /LIST in progress
+	 */
+	int GetListers();
+
+	/** @return The number of channels in the directory
+	 */
+	size_t size();
 };
 
 #endif
@@ -19,6 +19,7 @@
 
 #include "users.h"
 #include "channels.h"
+#include "namehash.h"
 
 /* list of available internal commands */
 enum Internals
@@ -26,51 +27,147 @@ enum Internals
 	WHOWAS_ADD = 1,
 	WHOWAS_STATS = 2,
 	WHOWAS_PRUNE = 3,
-	WHOWAS_MAINTAIN = 4
+	WHOWAS_MAINTAIN = 4,
+	WHOWAS_RESIZE = 5
 };
 
 /* Forward ref for timer */
 class WhoWasMaintainTimer;
 
-/* Forward ref for typedefs */
-class WhoWasGroup;
-
 /** InspTimer that is used to maintain the whowas list, called once an hour
  */
 extern WhoWasMaintainTimer* timer;
 
-/** A group of users related by nickname
+/** Used to hold WHOWAS information.
+ * Entries are allocated in slabs by cmd_whowas and reused, so all their
+ * strings are held inline. Each entry is on two lists: every entry in the
+ * order it was added, oldest first, and the entries for one nickname.
  */
-typedef std::deque<WhoWasGroup*> whowas_set;
+class WhoWasGroup : public classbase
+{
+ public:
+	/** Nickname, as the user had it
+	 */
+	char nick[NICKMAX];
+	/** Real host
+	 */
+	char host[65];
+	/** Displayed host
+	 */
+	char dhost[65];
+	/** Ident
+	 */
+	char ident[IDENTMAX+2];
+	/** Server name. Server names are never freed, so this is not copied.
+	 */
+	const char* server;
+	/** Fullname (GECOS)
+	 */
+	char gecos[MAXGECOS+1];
+	/** Signon time
+	 */
+	time_t signon;
+	/** Time the entry was added, used for expiry
+	 */
+	time_t added;
 
-/** Sets of users in the whowas system
+	/** Previous and next entry by time added, or the next free entry
+	 */
+	WhoWasGroup* prev;
+	WhoWasGroup* next;
+	/** Previous and next entry for the same nickname
+	 */
+	WhoWasGroup* older;
+	WhoWasGroup* newer;
+
+	/** Fill this entry from a user
+	 */
+	void Set(userrec* user, time_t now);
+};
+
+/** The entries for one nickname, oldest first
  */
-typedef std::map<irc::string,whowas_set*> whowas_users;
+struct whowas_set
+{
+	WhoWasGroup* oldest;
+	WhoWasGroup* newest;
+	int count;
+};
 
-/** Sets of time and users in whowas list
+/** Sets of users in the whowas system, by nickname
  */
-typedef std::deque<std::pair<time_t,irc::string> > whowas_users_fifo;
+typedef NameHash<whowas_set, NICKMAX> whowas_users;
 
 /** Handle /WHOWAS. These command handlers can be reloaded by the core,
  * and handle basic RFC1459 commands. Commands within modules work
  * the same way, however, they can be fully unloaded, where these
  * may not.
+ *
+ * Entries are held in slabs of fixed size records, up to a limit set by
+ * <whowas:maxmemory>. Once the limit is reached, the oldest entry is reused
+ * for each new one, so adding an entry never allocates and never walks the
+ * list.
  */
 class cmd_whowas : public command_t
 {
   private:
-	/** Whowas container, contains a map of vectors of users tracked by WHOWAS
+	/** Whowas container, the entries for each nickname
 	 */
 	whowas_users whowas;
-	
-	/** Whowas container, contains a map of time_t to users tracked by WHOWAS
+
+	/** All entries, oldest first
+	 */
+	WhoWasGroup* oldest;
+	WhoWasGroup* newest;
+
+	/** Unused entries in allocated slabs
+	 */
+	WhoWasGroup* freelist;
+
+	/** Allocated slabs of entries
+	 */
+	std::vector<WhoWasGroup*> slabs;
+
+	/** Number of entries in the slabs, in use or free
+	 */
+	size_t allocated;
+
+	/** Number of entries in use
 	 */
-	whowas_users_fifo whowas_fifo;
+	size_t used;
+
+	/** Maximum number of entries, from <whowas:maxmemory>
+	 */
+	size_t capacity;
+
+	/** Entries allocated at a time
+	 */
+	static const size_t SlabSize = 256;
 
 	/* String holding stats so it can be collected
 	 */
 	std::string stats;
 
+	/** Get an entry to fill, reusing the oldest one if at capacity
+	 */
+	WhoWasGroup* Alloc();
+
+	/** Unlink an entry and return it to the free list
+	 */
+	void Release(WhoWasGroup* a);
+
+	/** Release every entry for a nickname
+	 */
+	void ReleaseNick(const char* nick);
+
+	/** Add a filled entry, applying the group size and group count limits
+	 */
+	void Insert(const WhoWasGroup& entry);
+
+	/** Free every entry and slab
+	 */
+	void Clear();
+
   public:
 	cmd_whowas(InspIRCd* Instance);
 	/** Handle command.
@@ -91,39 +188,10 @@ class cmd_whowas : public command_t
 	void GetStats(Extensible* ext);
 	void PruneWhoWas(time_t t);
 	void MaintainWhoWas(time_t t);
-	virtual ~cmd_whowas();
-};
-
-/** Used to hold WHOWAS information
- */
-class WhoWasGroup : public classbase
-{
- public:
-	/** Real host
-	 */
-	char* host;
-	/** Displayed host
-	 */
-	char* dhost;
-	/** Ident
-	 */
-	char* ident;
-	/** Server name
-	 */
-	const char* server;
-	/** Fullname (GECOS)
+	/** Take up a new <whowas:maxmemory>, rebuilding only if entries must go
 	 */
-	char* gecos;
-	/** Signon time
-	 */
-	time_t signon;
-
-	/** Initialize this WhoQasFroup with a user
-	 */
-	WhoWasGroup(userrec* user);
-	/** Destructor
-	 */
-	~WhoWasGroup();
+	void Resize(time_t t);
+	virtual ~cmd_whowas();
 };
 
 class WhoWasMaintainTimer : public InspTimer
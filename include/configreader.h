@@ -255,6 +255,11 @@ class CoreExport ServerConfig : public Extensible
 	 */
 	int WhoWasMaxGroups;
 
+	/** Max bytes of memory used to hold WhoWas entries.
+	 *  When full, the oldest entry is reused for each new one.
+	 */
+	unsigned int WhoWasMaxMemory;
+
 	/** Max seconds a user is kept in WhoWas before being pruned.
 	 */
 	int WhoWasMaxKeep;
@@ -405,6 +410,10 @@ class CoreExport ServerConfig : public Extensible
 	 */
 	int dns_timeout;
 
+	/** The most entries the DNS cache may hold
+	 */
+	int dns_cachesize;
+
 	/** The size of the read() buffer in the user
 	 * handling code, used to read data into a user's
 	 * recvQ.
@@ -422,6 +431,32 @@ class CoreExport ServerConfig : public Extensible
 	 */
 	unsigned int SoftLimit;
 
+	/** Number of connections a single IP may make in a burst
+	 * before <connthrottle:iprate> applies, or 0 to disable.
+	 */
+	unsigned int ThrottleIPBurst;
+
+	/** Connections per minute a single IP may sustain
+	 */
+	unsigned int ThrottleIPRate;
+
+	/** Number of connections a single CIDR range may make in a burst
+	 * before <connthrottle:cidrrate> applies, or 0 to disable.
+	 */
+	unsigned int ThrottleCIDRBurst;
+
+	/** Connections per minute a single CIDR range may sustain
+	 */
+	unsigned int ThrottleCIDRRate;
+
+	/** Prefix length used to group IPv4 clients for CIDR throttling
+	 */
+	unsigned int ThrottleIPv4CIDR;
+
+	/** Prefix length used to group IPv6 clients for CIDR throttling
+	 */
+	unsigned int ThrottleIPv6CIDR;
+
 	/** Maximum number of targets for a multi target command
 	 * such as PRIVMSG or KICK
 	 */
@@ -568,6 +603,11 @@ class CoreExport ServerConfig : public Extensible
 	 */
 	bool UndernetMsgPrefix;
 
+	/** If set to true, empty slabs in the object pools are returned to the
+	 *  operating system at each garbage collection.
+	 */
+	bool ReleaseSlabs;
+
 	/** If set to true, the full nick!user@host will be shown in the TOPIC command
 	 * for who set the topic last. If false, only the nick is shown.
 	 */
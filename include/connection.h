@@ -26,9 +26,10 @@ class CoreExport connection : public EventHandler
 {
  public:
 	/** Hostname of connection.
-	 * This should be valid as per RFC1035.
+	 * This should be valid as per RFC1035. Held in InspIRCd::Strings,
+	 * so it must be changed with userrec::SetHost(), never written to.
 	 */
-	char host[65];
+	const char* host;
 
 	/** Stats counter for bytes inbound
 	 */
@@ -115,9 +115,11 @@ class CoreExport CullList : public classbase
 
 	/** Holds a list of users being quit.
 	 * See the information for CullItem for
-	 * more information.
+	 * more information. Items are held by value in
+	 * a deque, so they need no allocation of their
+	 * own and are taken off the front in constant time.
 	 */
-	std::vector<CullItem> list;
+	std::deque<CullItem> list;
 
  public:
 	/** Constructor.
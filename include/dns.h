@@ -33,6 +33,9 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #define _DNS_H
 
 #include <string>
+#include <map>
+#include <list>
+#include <vector>
 #include "inspircd_config.h"
 #include "base.h"
 #include "socketengine.h"
@@ -49,6 +52,21 @@ using irc::sockets::insp_inaddr;
 class InspIRCd;
 class Module;
 
+/**
+ * Query and resource record types
+ */
+enum QueryType
+{
+	DNS_QUERY_NONE	= 0,		/* Uninitialized Query */
+	DNS_QUERY_A	= 1,		/* 'A' record: an ipv4 address */
+	DNS_QUERY_CNAME	= 5,		/* 'CNAME' record: An alias */
+	DNS_QUERY_PTR	= 12,		/* 'PTR' record: a hostname */
+	DNS_QUERY_AAAA	= 28,		/* 'AAAA' record: an ipv6 address */
+
+	DNS_QUERY_PTR4	= 0xFFFD,	/* Force 'PTR' to use IPV4 scemantics */
+	DNS_QUERY_PTR6	= 0xFFFE	/* Force 'PTR' to use IPV6 scemantics */
+};
+
 /**
  * Result status, used internally
  */
@@ -67,14 +85,19 @@ class CoreExport DNSResult : public classbase
 	/** The original request, a hostname or IP address
 	 */
 	std::string original;
+	/** The type of query
+	 */
+	QueryType type;
 
 	/** Build a DNS result.
 	 * @param i The request ID
 	 * @param res The request result, a hostname or IP
-	 * @param timetolive The request time-to-live
+	 * @param timetolive The request time-to-live. For an error, how long
+	 * the error may be cached for, or zero if it may not be
 	 * @param orig The original request, a hostname or IP
+	 * @param qt The type of query
 	 */
-	DNSResult(int i, const std::string &res, unsigned long timetolive, const std::string &orig) : id(i), result(res), ttl(timetolive), original(orig) { }
+	DNSResult(int i, const std::string &res, unsigned long timetolive, const std::string &orig, QueryType qt = DNS_QUERY_NONE) : id(i), result(res), ttl(timetolive), original(orig), type(qt) { }
 };
 
 /**
@@ -87,18 +110,24 @@ typedef std::pair<unsigned char*, std::string> DNSInfo;
 class CoreExport CachedQuery
 {
  public:
-	/** The cached result data, an IP or hostname
+	/** The cached result data, an IP or hostname, or for
+	 * a negative entry the error message
 	 */
 	std::string data;
 	/** The time when the item is due to expire
 	 */
 	time_t expires;
+	/** True if this records that the name does not exist, or
+	 * has no records of the type asked for
+	 */
+	bool negative;
 
 	/** Build a cached query
 	 * @param res The result data, an IP or hostname
 	 * @param ttl The time-to-live value of the query result
+	 * @param neg True if the result is a negative answer
 	 */
-	CachedQuery(const std::string &res, unsigned int ttl) : data(res)
+	CachedQuery(const std::string &res, unsigned int ttl, bool neg = false) : data(res), negative(neg)
 	{
 		expires = time(NULL) + ttl;
 	}
@@ -113,14 +142,6 @@ class CoreExport CachedQuery
 	}
 };
 
-/** DNS cache information. Holds IPs mapped to hostnames, and hostnames mapped to IPs.
- */
-#ifndef WIN32
-typedef nspace::hash_map<irc::string, CachedQuery, nspace::hash<irc::string> > dnscache;
-#else
-typedef nspace::hash_map<irc::string, CachedQuery, nspace::hash_compare<irc::string> > dnscache;
-#endif
-
 /**
  * Error types that class Resolver can emit to its error method.
  */
@@ -150,19 +171,97 @@ class DNSHeader;
  */
 struct ResourceRecord;
 
-/**
- * Query and resource record types
+/** DNS cache information. Holds IPs mapped to hostnames, and hostnames
+ * mapped to IPs, each under the type of query which found them. Names
+ * which turned out not to exist are held too, for as long as their
+ * zone's SOA record allows (RFC 2308), so that unresolvable ranges are
+ * not asked about again on every connect.
+ *
+ * The cache holds a limited number of entries. When full, the least
+ * recently used entry makes way for a new one. Entries are also kept
+ * in order of expiry, so that pruning touches only those which have
+ * expired.
  */
-enum QueryType
+class CoreExport DNSCache : public classbase
 {
-	DNS_QUERY_NONE	= 0,		/* Uninitialized Query */
-	DNS_QUERY_A	= 1,		/* 'A' record: an ipv4 address */
-	DNS_QUERY_CNAME	= 5,		/* 'CNAME' record: An alias */
-	DNS_QUERY_PTR	= 12,		/* 'PTR' record: a hostname */
-	DNS_QUERY_AAAA	= 28,		/* 'AAAA' record: an ipv6 address */
+ public:
+	/** An entry is found by the type of query and the name or IP asked about
+	 */
+	typedef std::pair<QueryType, irc::string> Key;
 
-	DNS_QUERY_PTR4	= 0xFFFD,	/* Force 'PTR' to use IPV4 scemantics */
-	DNS_QUERY_PTR6	= 0xFFFE	/* Force 'PTR' to use IPV6 scemantics */
+ private:
+	/** Keys in order of expiry
+	 */
+	typedef std::multimap<time_t, Key> ExpiryList;
+
+	/** A cached item, and its place in the expiry order
+	 */
+	struct Entry
+	{
+		Key key;
+		CachedQuery query;
+		ExpiryList::iterator expiry;
+
+		Entry(const Key &k, const CachedQuery &q) : key(k), query(q) { }
+	};
+
+	/** Entries, most recently used first
+	 */
+	typedef std::list<Entry> LRUList;
+
+	LRUList entries;
+	std::map<Key, LRUList::iterator> index;
+	ExpiryList expiry;
+
+	/** The most entries which may be held
+	 */
+	size_t maxsize;
+
+	unsigned long hits;
+	unsigned long neghits;
+	unsigned long misses;
+	unsigned long evictions;
+
+	void Erase(LRUList::iterator e);
+
+ public:
+	DNSCache(size_t max) : maxsize(max), hits(0), neghits(0), misses(0), evictions(0) { }
+
+	/** Find an unexpired entry, marking it as recently used
+	 * @return The entry, valid until the cache is next changed, or NULL
+	 */
+	CachedQuery* Find(const Key &key);
+
+	/** Add an entry, or replace the one under the same key
+	 */
+	void Add(const Key &key, const CachedQuery &query);
+
+	/** Remove an entry
+	 * @return True if there was one to remove
+	 */
+	bool Remove(const Key &key);
+
+	/** Remove every entry which has expired
+	 * @return The number of entries removed
+	 */
+	int Prune(time_t now);
+
+	/** Remove every entry
+	 * @return The number of entries removed
+	 */
+	int Clear();
+
+	/** Change the most entries which may be held, dropping the least
+	 * recently used entries if there are more than that already
+	 */
+	void SetMaxSize(size_t max);
+
+	size_t size() const { return index.size(); }
+	size_t GetMaxSize() const { return maxsize; }
+	unsigned long GetHits() const { return hits; }
+	unsigned long GetNegativeHits() const { return neghits; }
+	unsigned long GetMisses() const { return misses; }
+	unsigned long GetEvictions() const { return evictions; }
 };
 
 #ifdef IPV6
@@ -231,6 +330,16 @@ class CoreExport Resolver : public Extensible
 	 * Time left before cache expiry
 	 */
 	int time_left;
+
+ private:
+	friend class DNS;
+
+	/**
+	 * The next Resolver waiting on the same request. Lookups of
+	 * the same name and type which overlap share one request.
+	 */
+	Resolver* next;
+
  public:
 	/**
 	 * Initiate DNS lookup. Your class should not attempt to delete or free these
@@ -301,7 +410,8 @@ class CoreExport Resolver : public Extensible
 	 * is safe to call and use this method.
 	 * As specified in RFC1035, each dns request has a 16 bit ID value, ranging
 	 * from 0 to 65535. If there is an issue and the core cannot send your request,
-	 * this method will return -1.
+	 * this method will return -1. Resolvers looking up the same name and type at
+	 * the same time share a request, and so have the same id.
 	 */
 	int GetId();
 	/**
@@ -310,12 +420,62 @@ class CoreExport Resolver : public Extensible
 	Module* GetCreator();
 	/**
 	 * If the result is a cached result, this triggers the objects
-	 * OnLookupComplete. This is done because it is not safe to call
+	 * OnLookupComplete, or OnError if the name is cached as not
+	 * existing. This is done because it is not safe to call
 	 * the abstract virtual method from the constructor.
 	 */
 	void TriggerCachedResult();
 };
 
+/** One of the configured nameservers, and what the resolver has
+ * learned about how well it answers.
+ */
+class CoreExport NameServer : public classbase
+{
+ public:
+	/** The address as given in the configuration
+	 */
+	std::string address;
+#ifdef IPV6
+	/** The address, if the resolver socket is IPv6
+	 */
+	in6_addr addr6;
+#endif
+	/** The address, if the resolver socket is IPv4
+	 */
+	in_addr addr4;
+	/** Smoothed round trip time in microseconds, zero until measured
+	 */
+	unsigned long srtt;
+	/** Requests in a row which this server did not answer
+	 */
+	unsigned int failures;
+	/** Once failures reaches MAX_FAILURES, the server is only
+	 * asked again after this time
+	 */
+	time_t retryat;
+	/** Packets sent to this server, retransmissions included
+	 */
+	unsigned long sent;
+	/** Replies received from this server
+	 */
+	unsigned long answered;
+
+	/** Lookups go to other servers first once one has gone this
+	 * many requests in a row without answering
+	 */
+	static const unsigned int MAX_FAILURES = 3;
+
+	NameServer(const std::string &addr) : address(addr), srtt(0), failures(0), retryat(0), sent(0), answered(0) { }
+
+	/** @return True unless the server has stopped answering, and is not yet due to be tried again
+	 */
+	bool IsAnswering(time_t now) const
+	{
+		return ((failures < MAX_FAILURES) || (retryat <= now));
+	}
+};
+
 /** DNS is a singleton class used by the core to dispatch dns
  * requests to the dns server, and route incoming dns replies
  * back to Resolver objects, based upon the request ID. You
@@ -324,6 +484,9 @@ class CoreExport Resolver : public Extensible
 class CoreExport DNS : public EventHandler
 {
  private:
+	friend class DNSRequest;
+	friend class DNSTCPQuery;
+	friend class RequestTimeout;
 
 	/**
 	 * Creator/Owner object
@@ -352,9 +515,15 @@ class CoreExport DNS : public EventHandler
 	/**
 	 * Currently cached items
 	 */
-	dnscache* cache;
+	DNSCache* cache;
 
-	/** A timer which ticks every hour to remove expired
+	/**
+	 * Hostnames of recently connected IPs whose forward lookup matched
+	 * (or did not, for negative entries), keyed by IP
+	 */
+	DNSCache* confirmed;
+
+	/** A timer which ticks every minute to remove expired
 	 * items from the DNS cache.
 	 */
 	class CacheTimer* PruneTimer;
@@ -364,19 +533,114 @@ class CoreExport DNS : public EventHandler
 	 */
 	int MakePayload(const char* name, const QueryType rr, const unsigned short rr_class, unsigned char* payload);
 
+	/** A query as sent: its type and the name asked about
+	 */
+	typedef std::pair<QueryType, std::string> QueryKey;
+
+	/** Requests in flight, by query, so that a second lookup of
+	 * the same thing waits on the first rather than asking again
+	 */
+	std::map<QueryKey, int> inflight;
+
+	/** Number of lookups which joined a request already in flight
+	 */
+	unsigned long coalesced;
+
+	/** Negative answers are cached for no longer than this
+	 * many seconds, whatever their SOA says (RFC 2308 section 5)
+	 */
+	static const unsigned long MAX_NEGATIVE_TTL = 10800;
+
+	/** Replies read from the socket in each wakeup at most
+	 */
+	static const int MAX_REPLIES = 256;
+
+	/**
+	 * Send a query, or join one for the same name and type which is in flight
+	 * @return The request id, or -1 on failure
+	 */
+	int StartQuery(const char* name, const QueryType qt, const char* original);
+
+	/** Microseconds to wait for a first reply before retransmitting,
+	 * at least. The wait doubles with each retransmission.
+	 */
+	static const unsigned long MIN_RTO = 500000;
+
+	/** Microseconds to wait for a first reply at most. Round trip
+	 * times are not counted any higher than this either.
+	 */
+	static const unsigned long MAX_RTO = 2000000;
+
+	/** Seconds before a nameserver which stopped answering is tried again
+	 */
+	static const int RETRY_DOWN = 30;
+
+	/** At most this many nameservers are used, the rest are ignored
+	 */
+	static const unsigned int MAX_NAMESERVERS = 8;
+
+	/** Retransmissions sent, to any server
+	 */
+	unsigned long retransmits;
+
+	/** Queries repeated over TCP because the UDP reply was truncated
+	 */
+	unsigned long tcpqueries;
+
+	/**
+	 * Choose the server to send a request to next: the fastest one
+	 * which is answering, out of those not already tried
+	 * @param tried Bitmask of server indexes to pass over
+	 * @return A server index, or -1 if every server has been tried
+	 */
+	int PickServer(unsigned int tried);
+
+	/**
+	 * Fill in the socket address of a nameserver
+	 * @return The length of the address
+	 */
+	socklen_t ServerAddress(int server, sockaddr* addr);
+
+	/**
+	 * Find which nameserver a reply came from
+	 * @return The server index, or -1 if it is none of ours
+	 */
+	int FindServer(const sockaddr* from);
+
+	/**
+	 * Count a request which a nameserver did not answer in time,
+	 * or answered with a failure
+	 * @param penalty Microseconds to add to its round trip time
+	 */
+	void ServerFailed(int server, unsigned long penalty);
+
+	/**
+	 * Decode one reply packet and match it to its request
+	 * @param server The index of the server it came from, or -1 if unknown
+	 * @param stream True if the reply came over TCP, and may not be truncated
+	 */
+	DNSResult ParseResult(const unsigned char* buffer, int length, int server, bool stream);
+
+	/**
+	 * Hand a decoded reply to the Resolvers waiting for it
+	 */
+	void ProcessResult(DNSResult &res);
+
  public:
 
 	/**
-	 * Server address being used currently
+	 * Address family of the resolver socket
 	 */
 	int socketfamily;
-#ifdef IPV6
-	in6_addr myserver6;
-#endif
-	in_addr myserver4;
 
 	/**
-	 * Currently active Resolver classes
+	 * The nameservers in use, in configuration order
+	 */
+	std::vector<NameServer> servers;
+
+	/**
+	 * Currently active Resolver classes. Each is the head of a list,
+	 * through Resolver::next, of all Resolvers waiting on that id.
 	 */
 	Resolver* Classes[MAX_REQUEST_ID];
 
@@ -443,16 +707,52 @@ class CoreExport DNS : public EventHandler
 	DNSResult GetResult();
 
 	/**
-	 * Handle a SocketEngine read event
+	 * Handle a SocketEngine read event. Every reply waiting
+	 * on the socket is read, not just the first.
 	 * Inherited from EventHandler
 	 */
 	void HandleEvent(EventType et, int errornum = 0);
 
 	/**
-	 * Add a Resolver* to the list of active classes
+	 * Add a Resolver* to the list of active classes. If other
+	 * Resolvers are already waiting on its id, it joins them.
 	 */
 	bool AddResolverClass(Resolver* r);
 
+	/**
+	 * Report an error to every Resolver waiting on a request id,
+	 * and free them
+	 */
+	void FailResolvers(int id, ResolverError e, const std::string &errormessage);
+
+	/** @return The number of requests waiting for a reply
+	 */
+	size_t GetInFlight() const
+	{
+		return inflight.size();
+	}
+
+	/** @return The number of lookups which shared another's request
+	 */
+	unsigned long GetCoalesced() const
+	{
+		return coalesced;
+	}
+
+	/** @return The number of retransmitted queries
+	 */
+	unsigned long GetRetransmits() const
+	{
+		return retransmits;
+	}
+
+	/** @return The number of queries repeated over TCP
+	 */
+	unsigned long GetTCPQueries() const
+	{
+		return tcpqueries;
+	}
+
 	/**
 	 * Add a query to the list to be sent
 	 */
@@ -494,26 +794,56 @@ class CoreExport DNS : public EventHandler
 	void CleanResolvers(Module* module);
 
 	/** Return the cached value of an IP or hostname
+	 * @param qt The type of query
 	 * @param source An IP or hostname to find in the cache.
 	 * @return A pointer to a CachedQuery if the item exists,
 	 * otherwise NULL.
 	 */
-	CachedQuery* GetCache(const std::string &source);
+	CachedQuery* GetCache(QueryType qt, const std::string &source);
 
 	/** Delete a cached item from the DNS cache.
+	 * @param qt The type of query
 	 * @param source An IP or hostname to remove
 	 */
-	void DelCache(const std::string &source);
+	void DelCache(QueryType qt, const std::string &source);
 
 	/** Clear all items from the DNS cache immediately.
 	 */
 	int ClearCache();
 
 	/** Prune the DNS cache, e.g. remove all expired
-	 * items and rehash the cache buckets, but leave
-	 * items in the hash which are still valid.
+	 * items, but leave items which are still valid.
 	 */
 	int PruneCache();
+
+	/** @return The DNS cache, for its statistics
+	 */
+	const DNSCache* GetCacheStats() const
+	{
+		return cache;
+	}
+
+	/** Find the outcome of a recent reverse and forward lookup of an IP
+	 * @param ip The IP address
+	 * @return The confirmed hostname, or a negative entry if the forward
+	 * lookup did not match the IP, or NULL if there is no recent outcome
+	 */
+	CachedQuery* GetConfirmedHost(const std::string &ip);
+
+	/** Remember the outcome of a reverse and forward lookup of an IP
+	 * @param ip The IP address
+	 * @param host The hostname its PTR record gave
+	 * @param ttl Seconds the outcome holds for, the lesser of both lookups' TTLs
+	 * @param matched False if the hostname did not resolve back to the IP
+	 */
+	void AddConfirmedHost(const std::string &ip, const std::string &host, unsigned int ttl, bool matched);
+
+	/** @return The confirmed hostname cache, for its statistics
+	 */
+	const DNSCache* GetConfirmedStats() const
+	{
+		return confirmed;
+	}
 };
 
 #endif
@@ -37,6 +37,7 @@
 #include "command_parse.h"
 #include "snomasks.h"
 #include "cull_list.h"
+#include "stringtable.h"
 
 /** Returned by some functions to indicate failure.
  */
@@ -177,6 +178,56 @@ template<typename T, typename V, typename R> inline char* itoa(const T &in, V *r
 	return res;
 }
 
+/** Counts how long something took, in buckets of powers of two
+ * milliseconds, so that STATS can show its spread cheaply.
+ */
+class CoreExport LatencyHistogram : public classbase
+{
+ public:
+	/** Bucket n counts samples under 2^n milliseconds,
+	 * and the last counts everything slower
+	 */
+	static const int BUCKETS = 15;
+
+	unsigned long counts[BUCKETS];
+
+	unsigned long samples;
+
+	LatencyHistogram() : samples(0)
+	{
+		memset(counts, 0, sizeof(counts));
+	}
+
+	/** Count one sample
+	 * @param usec How long it took, in microseconds
+	 */
+	void Add(unsigned long usec)
+	{
+		int n = 0;
+		for (unsigned long ms = usec / 1000; ms && n < BUCKETS - 1; ms >>= 1)
+			n++;
+		counts[n]++;
+		samples++;
+	}
+
+	/** Find the bucket at or under which a share of the samples fall
+	 * @param percent The share, e.g. 50 for the median
+	 * @return The bucket's upper bound in milliseconds, or 0 if that is the last bucket
+	 */
+	unsigned long Percentile(int percent) const
+	{
+		unsigned long want = (samples * percent + 99) / 100;
+		unsigned long seen = 0;
+		for (int n = 0; n < BUCKETS - 1; n++)
+		{
+			seen += counts[n];
+			if (seen >= want)
+				return 1UL << n;
+		}
+		return 0;
+	}
+};
+
 /** This class contains various STATS counters
  * It is used by the InspIRCd class, which internally
  * has an instance of it.
@@ -218,6 +269,15 @@ class serverstats : public classbase
 	/** Total bytes of data received
 	 */
 	double statsRecv;
+	/** Time from a connection's PTR query to its answer
+	 */
+	LatencyHistogram statsDnsReverse;
+	/** Time from a connection's PTR answer to its forward answer
+	 */
+	LatencyHistogram statsDnsForward;
+	/** Time from accepting a connection to its hostname lookup finishing
+	 */
+	LatencyHistogram statsDnsConnect;
 	/** Cpu usage at last sample
 	 */
 	timeval LastCPU;
@@ -299,7 +359,7 @@ class CoreExport FileLogger : public EventHandler
 typedef std::vector<std::pair<std::string, long> > FailedPortList;
 
 /** A list of ip addresses cross referenced against clone counts */
-typedef std::map<irc::string, unsigned int> clonemap;
+typedef nspace::hash_map<irc::sockets::ipaddr_key, unsigned int, irc::sockets::ipaddr_hash> clonemap;
 
 /* Forward declaration - required */
 class XLineManager;
@@ -385,6 +445,11 @@ class CoreExport InspIRCd : public classbase
 	 */
 	void DoBackgroundUserStuff(time_t TIME);
 
+	/** Connect the users given to ConnectWhenReady() which are now ready,
+	 * called after each run of the socket engine
+	 */
+	void ConnectReadyUsers();
+
 	/** Returns true when all modules have done pre-registration checks on a user
 	 * @param user The user to verify
 	 * @return True if all modules have finished checking this user
@@ -501,6 +566,11 @@ class CoreExport InspIRCd : public classbase
 	 */
 	std::vector<userrec*> local_users;
 
+	/** Local clients which may have become ready to connect since the
+	 * socket engine was last run, see ConnectWhenReady()
+	 */
+	std::vector<userrec*> ready_users;
+
 	/** Oper list, a vector containing all local and remote opered users
 	 */
 	std::vector<userrec*> all_opers;
@@ -525,6 +595,25 @@ class CoreExport InspIRCd : public classbase
 	 */
 	XLineManager* XLines;
 
+	/** Admission manager. Checks new connections against Z-lines,
+	 * connect classes and connection throttles before a user is created
+	 */
+	AdmissionManager* Admission;
+
+	/** Indexes of registered users by nickname, host and server,
+	 * used to narrow WHO searches
+	 */
+	UserIndex* Indexes;
+
+	/** Index of channels by size, name and topic, which /LIST is
+	 * answered from
+	 */
+	ChannelDirectory* Directory;
+
+	/** Shared strings for host, displayed host and oper type fields
+	 */
+	StringTable* Strings;
+
 	/** A list of Module* module classes
 	 * Note that this list is always exactly 255 in size.
 	 * The actual number of loaded modules is available from GetModuleCount()
@@ -571,6 +660,13 @@ class CoreExport InspIRCd : public classbase
 	 */
 	void AddGlobalClone(userrec* user);
 
+	/** Connect a user as soon as it is ready to, rather than on the next pass
+	 * over all users. Call this when something the user was waiting on before
+	 * it could connect is done, such as its hostname lookup.
+	 * @param user A local user
+	 */
+	void ConnectWhenReady(userrec* user);
+
 	/** Number of users with a certain mode set on them
 	 */
 	int ModeCount(const char mode);
@@ -1086,6 +1182,11 @@ class CoreExport InspIRCd : public classbase
 	 */
 	void RehashServer();
 
+	/** Run OnGarbageCollect in all modules, then return unused pool memory
+	 * to the operating system if the configuration allows it
+	 */
+	void GarbageCollect();
+
 	/** Return the channel whos index number matches that provided
 	 * @param The index number of the channel to fetch
 	 * @return A channel record, or NUll if index < 0 or index >= InspIRCd::ChannelCount()
@@ -1251,12 +1352,6 @@ class CoreExport InspIRCd : public classbase
 	 */
 	void Cleanup();
 
-	/** This copies the user and channel hash_maps into new hash maps.
-	 * This frees memory used by the hash_map allocator (which it neglects
-	 * to free, most of the time, using tons of ram)
-	 */
-	void RehashUsersAndChans();
-
 	/** Resets the cached max bans value on all channels.
 	 * Called by rehash.
 	 */
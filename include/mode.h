@@ -386,6 +386,30 @@ class CoreExport ModeParser : public classbase
 	 */
 	std::string LastParse;
 
+	/** A channel mode with a prefix, and the bit it holds in
+	 * Membership::prefixes
+	 */
+	struct PrefixSlot
+	{
+		ModeHandler* handler;
+		char prefix;
+		unsigned int rank;
+		unsigned int bit;
+	};
+
+	/** Prefix modes in rank order, highest first
+	 */
+	std::vector<PrefixSlot> prefixslots;
+
+	/** The bit of each prefix character, or 0 if no mode has it
+	 */
+	unsigned int prefixbits[256];
+
+	/** Bits held by a prefix mode. A mode keeps its bit for as long as
+	 * it is loaded, so memberships never need to be renumbered.
+	 */
+	unsigned int usedprefixbits;
+
  public:
 
 	/** The constructor initializes all the RFC basic modes by using ModeParserAddMode().
@@ -478,6 +502,54 @@ class CoreExport ModeParser : public classbase
 	 */
 	ModeHandler* FindPrefix(unsigned const char pfxletter);
 
+	/** Get the bit which a prefix sets in Membership::prefixes
+	 * @param pfxletter The prefix, e.g. '@'
+	 * @return The bit, or 0 if no mode has this prefix
+	 */
+	unsigned int GetPrefixBit(unsigned const char pfxletter)
+	{
+		return prefixbits[pfxletter];
+	}
+
+	/** Get the highest ranked prefix in a set of prefix bits
+	 * @param prefixes Bits from Membership::prefixes
+	 * @return The prefix character, or 0 if there are none
+	 */
+	char GetPrefixChar(unsigned int prefixes)
+	{
+		if (prefixes)
+			for (std::vector<PrefixSlot>::const_iterator i = prefixslots.begin(); i != prefixslots.end(); i++)
+				if (prefixes & i->bit)
+					return i->prefix;
+		return 0;
+	}
+
+	/** Get the rank of the highest ranked prefix in a set of prefix bits
+	 * @param prefixes Bits from Membership::prefixes
+	 * @return The rank, or 0 if there are no prefixes
+	 */
+	unsigned int GetPrefixRank(unsigned int prefixes)
+	{
+		if (prefixes)
+			for (std::vector<PrefixSlot>::const_iterator i = prefixslots.begin(); i != prefixslots.end(); i++)
+				if (prefixes & i->bit)
+					return i->rank;
+		return 0;
+	}
+
+	/** Write all the prefixes in a set of prefix bits, highest ranked first
+	 * @param prefixes Bits from Membership::prefixes
+	 * @param out Receives the null terminated prefixes; must hold 33 characters
+	 */
+	void GetPrefixChars(unsigned int prefixes, char* out)
+	{
+		if (prefixes)
+			for (std::vector<PrefixSlot>::const_iterator i = prefixslots.begin(); i != prefixslots.end(); i++)
+				if (prefixes & i->bit)
+					*out++ = i->prefix;
+		*out = 0;
+	}
+
 	/** Returns a list of mode characters which are usermodes.
 	 * This is used in the 004 numeric when users connect.
 	 */
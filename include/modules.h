@@ -81,7 +81,7 @@ enum MessageType {
  * ipv4 servers, so this value will be ten times as
  * high on ipv6 servers.
  */
-#define NATIVE_API_VERSION 11025
+#define NATIVE_API_VERSION 11026
 #ifdef IPV6
 #define API_VERSION (NATIVE_API_VERSION * 10)
 #else
@@ -1344,6 +1344,8 @@ class CoreExport Module : public Extensible
 	 * for use by modules which may wrap connections within another API such as SSL for example.
 	 * return a non-zero result if you have handled the write operation, in which case the core
 	 * will not call write().
+	 * Once the socket is writeable the core also calls this with a NULL buffer and a count of
+	 * zero, so that a module which buffers what it is given can send it then, in one go.
 	 * @param fd The file descriptor of the socket
 	 * @param buffer A char* buffer being written
 	 * @param Number of characters to write
@@ -1351,6 +1353,14 @@ class CoreExport Module : public Extensible
 	 */
 	virtual int OnRawSocketWrite(int fd, const char* buffer, int count);
 
+	/** Called to find out how much a module which buffers writes to a socket is holding.
+	 * The core uses this to pace long replies, such as LIST, to the speed of the socket
+	 * rather than handing the module everything at once.
+	 * @param fd The file descriptor of the socket
+	 * @return Number of bytes given to OnRawSocketWrite() and not yet sent
+	 */
+	virtual size_t OnRawSocketQueued(int fd);
+
 	/** Called immediately before any socket is closed. When this event is called, shutdown()
 	 * has not yet been called on the socket.
 	 * @param fd The file descriptor of the socket prior to close()
@@ -0,0 +1,415 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2007 InspIRCd Development Team
+ * See: http://www.inspircd.org/wiki/index.php/Credits
+ *
+ * This program is free but copyrighted software; see
+ * the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#ifndef __NAMEHASH_H__
+#define __NAMEHASH_H__
+
+#include <string>
+#include <string.h>
+#include "inspircd_config.h"
+#include "hashcomp.h"
+
+/** An open addressing hash table which maps IRC names (nicknames or
+ * channel names) to objects, comparing names by RFC1459 case rules.
+ *
+ * Each bucket holds the case folded name inline, so a lookup folds the
+ * name it is given once, hashes it a word at a time, and then compares
+ * whole buckets with no further lowermap lookups or pointer chasing.
+ * Buckets are linear probed, and deletion shifts later entries of the
+ * probe run back rather than leaving tombstones, so the table never
+ * accumulates dead buckets and never needs to be rebuilt.
+ *
+ * The table grows when it is half full and shrinks when it is one eighth
+ * full. Rather than moving every entry at once, the previous table is kept
+ * and drained a few buckets at a time on each insertion or removal, while
+ * lookups consult both tables until the old one is empty.
+ *
+ * Names are stored up to KEYLEN-1 characters, and callers are expected to
+ * have truncated nicknames and channel names to that length already. A
+ * lookup of a longer name finds nothing rather than matching whatever is
+ * stored under its first KEYLEN-1 characters.
+ *
+ * The interface follows the subset of hash_map used on the user and
+ * channel lists: iterators expose the value as ->second, and as with
+ * hash_map, adding or removing entries invalidates all iterators.
+ */
+template<typename T, size_t KEYLEN> class NameHash
+{
+ public:
+	/** A bucket. An empty bucket has a hash of zero.
+	 */
+	struct Entry
+	{
+		/** The value stored under this name
+		 */
+		T second;
+		/** Hash of the folded name, never zero for a used bucket
+		 */
+		unsigned int hash;
+		/** The case folded name
+		 */
+		char first[KEYLEN];
+	};
+
+	/** Forward iterator over all entries, in no particular order
+	 */
+	class iterator
+	{
+		friend class NameHash;
+		NameHash* owner;
+		/** False while walking the current table, true for the old one
+		 */
+		bool inold;
+		size_t pos;
+
+		void Settle()
+		{
+			if (!inold)
+			{
+				while ((pos < owner->cursize) && (!owner->cur[pos].hash))
+					pos++;
+				if (pos < owner->cursize)
+					return;
+				inold = true;
+				pos = owner->oldpos;
+			}
+			while ((pos < owner->oldsize) && (!owner->old[pos].hash))
+				pos++;
+		}
+
+	 public:
+		iterator() : owner(NULL), inold(true), pos(0) { }
+		iterator(NameHash* o, bool io, size_t p) : owner(o), inold(io), pos(p) { }
+
+		Entry& operator*() const { return inold ? owner->old[pos] : owner->cur[pos]; }
+		Entry* operator->() const { return inold ? &owner->old[pos] : &owner->cur[pos]; }
+		iterator& operator++() { pos++; Settle(); return *this; }
+		iterator operator++(int) { iterator t(*this); ++(*this); return t; }
+		bool operator==(const iterator& other) const { return (inold == other.inold) && (pos == other.pos); }
+		bool operator!=(const iterator& other) const { return !(*this == other); }
+	};
+
+	typedef iterator const_iterator;
+
+ private:
+	/** The table new entries go into
+	 */
+	Entry* cur;
+	size_t cursize;
+
+	/** The table being drained after a resize, or NULL
+	 */
+	Entry* old;
+	size_t oldsize;
+
+	/** Buckets of the old table before this one have been moved over.
+	 * Lookups in the old table treat them as if they were not there.
+	 */
+	size_t oldpos;
+
+	/** Total number of entries in both tables
+	 */
+	size_t count;
+
+	/** Buckets of the old table moved per insertion or removal
+	 */
+	static const size_t DrainStep = 8;
+
+	/** Smallest table size
+	 */
+	static const size_t MinSize = 64;
+
+	/** Fold a name into a zero padded buffer and hash it.
+	 * @param name The name to fold
+	 * @param key Receives the folded name; must be KEYLEN bytes
+	 * @return The hash of the folded name, never zero
+	 */
+	static unsigned int Fold(const char* name, char* key)
+	{
+		size_t len = 0;
+		for (; (len < KEYLEN - 1) && (name[len]); len++)
+			key[len] = lowermap[(unsigned char)name[len]];
+		memset(key + len, 0, KEYLEN - len);
+
+		/* Mix the name eight bytes at a time. The padding is zero, so
+		 * the name's own terminator always falls in the last word.
+		 */
+		unsigned long long h = 0x9E3779B97F4A7C15ULL ^ len;
+		for (size_t i = 0; i <= len; i += 8)
+		{
+			unsigned long long w = 0;
+			memcpy(&w, key + i, (KEYLEN - i < 8) ? KEYLEN - i : 8);
+			h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+			h ^= h >> 32;
+		}
+		h *= 0xC4CEB9FE1A85EC53ULL;
+		h ^= h >> 29;
+
+		unsigned int r = (unsigned int)h;
+		return r ? r : 1;
+	}
+
+	/** Check that a name fits in a bucket without being truncated
+	 */
+	static bool Fits(const char* name)
+	{
+		size_t len = 0;
+		while ((len < KEYLEN) && (name[len]))
+			len++;
+		return (len < KEYLEN);
+	}
+
+	static bool Same(const Entry& e, unsigned int hash, const char* key)
+	{
+		return (e.hash == hash) && (!memcmp(e.first, key, KEYLEN));
+	}
+
+	/** Find a folded name in the current table
+	 * @return Bucket index, or cursize if absent
+	 */
+	size_t FindCur(unsigned int hash, const char* key) const
+	{
+		size_t mask = cursize - 1;
+		for (size_t b = hash & mask; cur[b].hash; b = (b + 1) & mask)
+			if (Same(cur[b], hash, key))
+				return b;
+		return cursize;
+	}
+
+	/** Step to the next bucket of the old table, skipping drained ones
+	 */
+	size_t NextOld(size_t b) const
+	{
+		b = (b + 1) & (oldsize - 1);
+		return (b < oldpos) ? oldpos : b;
+	}
+
+	/** Find a folded name in the old table.
+	 * Entries still in the old table whose home bucket has been drained
+	 * can only sit in the run which starts at oldpos, so probes which
+	 * would begin or wrap into the drained region resume from there.
+	 * @return Bucket index, or oldsize if absent
+	 */
+	size_t FindOld(unsigned int hash, const char* key) const
+	{
+		if (!old)
+			return oldsize;
+		size_t b = hash & (oldsize - 1);
+		if (b < oldpos)
+			b = oldpos;
+		for (size_t n = oldpos; (n < oldsize) && (old[b].hash); n++, b = NextOld(b))
+			if (Same(old[b], hash, key))
+				return b;
+		return oldsize;
+	}
+
+	/** Place an entry in the current table, which must not contain it
+	 */
+	Entry& Place(const Entry& e)
+	{
+		size_t mask = cursize - 1;
+		size_t b = e.hash & mask;
+		while (cur[b].hash)
+			b = (b + 1) & mask;
+		cur[b] = e;
+		return cur[b];
+	}
+
+	/** Move a few more buckets of the old table across
+	 */
+	void Drain(size_t buckets)
+	{
+		if (!old)
+			return;
+		for (; (buckets) && (oldpos < oldsize); buckets--, oldpos++)
+			if (old[oldpos].hash)
+				Place(old[oldpos]);
+		if (oldpos >= oldsize)
+		{
+			delete[] old;
+			old = NULL;
+			oldsize = oldpos = 0;
+		}
+	}
+
+	/** Start moving everything into a table of the given size
+	 */
+	void Resize(size_t buckets)
+	{
+		/* Only one resize runs at a time */
+		Drain(oldsize);
+		old = cur;
+		oldsize = cursize;
+		oldpos = 0;
+		cur = new Entry[buckets]();
+		cursize = buckets;
+	}
+
+	/** Remove the entry in a bucket of the current table
+	 */
+	void EraseCur(size_t b)
+	{
+		size_t mask = cursize - 1;
+		cur[b].hash = 0;
+		for (size_t j = (b + 1) & mask; cur[j].hash; j = (j + 1) & mask)
+		{
+			size_t home = cur[j].hash & mask;
+			bool stays = (b <= j) ? ((b < home) && (home <= j)) : ((b < home) || (home <= j));
+			if (!stays)
+			{
+				cur[b] = cur[j];
+				cur[j].hash = 0;
+				b = j;
+			}
+		}
+	}
+
+	/** Remove the entry in a bucket of the old table. Rather than shifting
+	 * entries around the drained region, the rest of the probe run is
+	 * moved into the current table.
+	 */
+	void EraseOld(size_t b)
+	{
+		old[b].hash = 0;
+		for (size_t j = NextOld(b); (j != b) && (old[j].hash); j = NextOld(j))
+		{
+			Place(old[j]);
+			old[j].hash = 0;
+		}
+	}
+
+	void Removed()
+	{
+		count--;
+		Drain(DrainStep);
+		if ((!old) && (cursize > MinSize) && (count * 8 < cursize))
+			Resize(cursize / 2);
+	}
+
+ public:
+	NameHash() : cur(new Entry[MinSize]()), cursize(MinSize), old(NULL), oldsize(0), oldpos(0), count(0) { }
+
+	~NameHash()
+	{
+		delete[] cur;
+		delete[] old;
+	}
+
+	iterator begin()
+	{
+		iterator i(this, false, 0);
+		i.Settle();
+		return i;
+	}
+
+	iterator end()
+	{
+		return iterator(this, true, oldsize);
+	}
+
+	size_t size() const
+	{
+		return count;
+	}
+
+	bool empty() const
+	{
+		return !count;
+	}
+
+	/** Find an entry by name
+	 * @param name The name to look for, in any case
+	 * @return An iterator to the entry, or end() if there is none or the
+	 * name is longer than any stored name can be
+	 */
+	iterator find(const char* name)
+	{
+		if (!Fits(name))
+			return end();
+
+		char key[KEYLEN];
+		unsigned int hash = Fold(name, key);
+		size_t b = FindCur(hash, key);
+		if (b != cursize)
+			return iterator(this, false, b);
+		b = FindOld(hash, key);
+		if (b != oldsize)
+			return iterator(this, true, b);
+		return end();
+	}
+
+	iterator find(const std::string& name)
+	{
+		return find(name.c_str());
+	}
+
+	/** Get the value stored under a name, adding an entry holding T()
+	 * if there is none. Names longer than KEYLEN-1 are truncated.
+	 * @param name The name to look up or add
+	 * @return A reference to the value, valid until the next change
+	 */
+	T& operator[](const char* name)
+	{
+		char key[KEYLEN];
+		unsigned int hash = Fold(name, key);
+
+		Drain(DrainStep);
+
+		size_t b = FindCur(hash, key);
+		if (b != cursize)
+			return cur[b].second;
+		b = FindOld(hash, key);
+		if (b != oldsize)
+			return old[b].second;
+
+		if ((count + 1) * 2 > cursize)
+			Resize(cursize * 2);
+
+		Entry e;
+		e.second = T();
+		e.hash = hash;
+		memcpy(e.first, key, KEYLEN);
+		count++;
+		return Place(e).second;
+	}
+
+	T& operator[](const std::string& name)
+	{
+		return (*this)[name.c_str()];
+	}
+
+	/** Remove the entry an iterator points at
+	 */
+	void erase(iterator i)
+	{
+		if (i.inold)
+			EraseOld(i.pos);
+		else
+			EraseCur(i.pos);
+		Removed();
+	}
+
+	/** Remove an entry by name
+	 * @return The number of entries removed, zero or one
+	 */
+	size_t erase(const std::string& name)
+	{
+		iterator i = find(name);
+		if (i == end())
+			return 0;
+		erase(i);
+		return 1;
+	}
+};
+
+#endif
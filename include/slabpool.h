@@ -0,0 +1,169 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2007 InspIRCd Development Team
+ * See: http://www.inspircd.org/wiki/index.php/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#ifndef __SLABPOOL_H__
+#define __SLABPOOL_H__
+
+#include "inspircd_config.h"
+#include <stddef.h>
+
+/** A pool of fixed size objects, carved out of large aligned slabs.
+ *
+ * Objects which are created and destroyed in large numbers, such as users,
+ * channels and memberships, take their memory from a pool by defining a
+ * class operator new and operator delete which call Allocate() and Free().
+ * All objects of one class then sit together in a few slabs instead of
+ * being spread across the heap between strings and buffers, so a connection
+ * flood followed by a mass quit leaves whole slabs empty rather than holes
+ * the allocator can never give back.
+ *
+ * Slabs are mapped directly from the operating system and aligned to their
+ * own size, so the slab an object belongs to is found by masking its
+ * address. Empty slabs are kept for reuse until Release() returns them.
+ *
+ * Every pool links itself into a list when constructed, which /STATS z
+ * walks to report on all of them. Pools are not thread safe.
+ */
+class CoreExport SlabPool
+{
+ public:
+	/** Size and alignment of one slab
+	 */
+	static const size_t SlabBytes = 65536;
+
+ private:
+	/** Header at the start of each slab
+	 */
+	struct Slab
+	{
+		/** Neighbours in the pool's list of slabs with free objects
+		 */
+		Slab* prev;
+		Slab* next;
+		/** Objects freed back to this slab
+		 */
+		void* freelist;
+		/** Objects never yet handed out start at this index
+		 */
+		unsigned int carved;
+		/** Objects in use
+		 */
+		unsigned int used;
+	};
+
+	/** Name shown in /STATS z
+	 */
+	const char* name;
+
+	/** Size of each object, rounded up to the alignment
+	 */
+	size_t objsize;
+
+	/** Objects in each slab
+	 */
+	unsigned int perslab;
+
+	/** Slabs with at least one free object. Partly used slabs are kept
+	 * towards the head and empty ones at the tail, so new objects fill
+	 * up slabs which are already in use and empty slabs stay empty.
+	 */
+	Slab* head;
+	Slab* tail;
+
+	/** Number of slabs mapped, and of those, how many are empty
+	 */
+	size_t slabs;
+	size_t empty;
+
+	/** Objects in use, and the most there have ever been
+	 */
+	size_t live;
+	size_t highwater;
+
+	/** Next pool in the list of all pools
+	 */
+	SlabPool* nextpool;
+
+	/** Offset of the first object from the start of a slab
+	 */
+	static const size_t HeaderBytes = 64;
+
+	void LinkHead(Slab* s);
+	void LinkTail(Slab* s);
+	void Unlink(Slab* s);
+	Slab* NewSlab();
+	char* Object(Slab* s, unsigned int n) const
+	{
+		return (char*)s + HeaderBytes + n * objsize;
+	}
+
+ public:
+	/** Create a pool
+	 * @param poolname Name to show in /STATS z, which must outlive the pool
+	 * @param size Size of the objects this pool holds
+	 */
+	SlabPool(const char* poolname, size_t size);
+
+	/** Allocate an object. Requests for any other size than the pool was
+	 * created with, such as from a derived class, go to the global heap.
+	 * @param size Size of the object
+	 * @return The memory. Throws std::bad_alloc if none can be had.
+	 */
+	void* Allocate(size_t size);
+
+	/** Free an object from Allocate()
+	 * @param p The object, or NULL
+	 * @param size The size given to Allocate()
+	 */
+	void Free(void* p, size_t size);
+
+	/** Return all empty slabs to the operating system
+	 * @return The number of bytes released
+	 */
+	size_t Release();
+
+	/** Call Release() on every pool
+	 * @return The number of bytes released
+	 */
+	static size_t ReleaseAll();
+
+	/** @return The first of all pools, for walking with GetNext()
+	 */
+	static SlabPool* GetFirst();
+
+	/** @return The next pool, or NULL
+	 */
+	SlabPool* GetNext() const { return nextpool; }
+
+	/** @return The pool name
+	 */
+	const char* GetName() const { return name; }
+
+	/** @return The number of objects in use
+	 */
+	size_t GetLive() const { return live; }
+
+	/** @return The number of objects which can be allocated without mapping a new slab
+	 */
+	size_t GetFree() const { return slabs * perslab - live; }
+
+	/** @return The highest number of objects in use at once
+	 */
+	size_t GetHighWater() const { return highwater; }
+
+	/** @return The number of bytes mapped for slabs
+	 */
+	size_t GetBytes() const { return slabs * SlabBytes; }
+};
+
+#endif
@@ -34,8 +34,10 @@
 #endif
 
 #include <errno.h>
+#include <string.h>
 #include "inspircd_config.h"
 #include "socketengine.h"
+#include "hash_map.h"
 
 /* Accept Define */
 #ifdef CONFIG_USE_IOCP
@@ -148,6 +150,96 @@ namespace irc
 		 */
 		CoreExport int insp_aton(const char* a, insp_inaddr* n);
 
+		/** A fixed size binary form of an IPv4 or IPv6 address, used as the key
+		 * of the clone counting maps and other per-IP indexes. IPv4 addresses
+		 * are stored in their IPv4-mapped IPv6 form (::ffff:a.b.c.d), so that one
+		 * key type covers both families and comparisons are a 16 byte memcmp.
+		 */
+		struct CoreExport ipaddr_key
+		{
+			/** The address in network byte order
+			 */
+			unsigned char bytes[16];
+
+			bool operator==(const ipaddr_key &other) const
+			{
+				return !memcmp(bytes, other.bytes, sizeof(bytes));
+			}
+
+			bool operator<(const ipaddr_key &other) const
+			{
+				return (memcmp(bytes, other.bytes, sizeof(bytes)) < 0);
+			}
+
+			/** Returns true if this is an IPv4 (or IPv4-mapped) address
+			 */
+			bool IsIPv4() const;
+
+			/** Clear all but the first 'bits' bits of the address
+			 * @param bits Prefix length, counted over all 128 bits of the key
+			 */
+			void Mask(unsigned int bits);
+		};
+
+		/** Hash functor for ipaddr_key, usable with both the gcc hash_map
+		 * (as the hash function) and the visual studio hash_map (as hash_compare).
+		 */
+		struct CoreExport ipaddr_hash
+		{
+			enum { bucket_size = 4, min_buckets = 8 };
+
+			/** Hash an address key
+			 */
+			size_t operator()(const ipaddr_key &key) const;
+
+			/** Order two address keys (visual studio only)
+			 */
+			bool operator()(const ipaddr_key &a, const ipaddr_key &b) const
+			{
+				return a < b;
+			}
+		};
+
+		/** Fill an address key from a sockaddr_in or sockaddr_in6.
+		 * @param addr The socket address
+		 * @param key The key to fill in. It is zeroed if the family is unknown.
+		 */
+		CoreExport void MakeIPKey(const sockaddr* addr, ipaddr_key &key);
+
+		/** Fill an address key from a human readable IPv4 or IPv6 address.
+		 * @param address The human readable address, e.g. 1.2.3.4
+		 * @param key The key to fill in
+		 * @return True if the address could be parsed
+		 */
+		CoreExport bool MakeIPKey(const char* address, ipaddr_key &key);
+
+		/** Convert an address key back to human readable form, in the same way
+		 * userrec::GetIPString() presents addresses (IPv6 addresses which would
+		 * begin with ':' are prefixed with '0').
+		 * @param key The key to convert
+		 * @param buf A buffer of at least 48 bytes
+		 * @return buf
+		 */
+		CoreExport const char* IPKeyToString(const ipaddr_key &key, char* buf);
+
+		/** Fill an address key from a human readable CIDR mask, e.g. 1.2.0.0/16.
+		 * A plain address is treated as a mask of the full address length.
+		 * @param mask The mask to parse
+		 * @param key The key to fill in, with the host bits cleared
+		 * @param bits Set to the prefix length counted over the whole 128 bit key,
+		 * so an IPv4 /16 is returned as 112.
+		 * @return True if the mask could be parsed
+		 */
+		CoreExport bool MakeCIDRKey(const char* mask, ipaddr_key &key, unsigned int &bits);
+
+		/** Convert a sockaddr_in or sockaddr_in6 to human readable form, in the
+		 * same way userrec::GetIPString() presents addresses.
+		 * @param addr The socket address
+		 * @param buf A buffer of at least 48 bytes
+		 * @return buf
+		 */
+		CoreExport const char* SockaddrToString(const sockaddr* addr, char* buf);
+
 		/** Make a socket file descriptor a blocking socket
 		 * @param s A valid file descriptor
 		 */
@@ -167,6 +259,96 @@ namespace irc
 	}
 }
 
+/** Reasons a connection may be turned away by the AdmissionManager,
+ * used to index its counters.
+ */
+enum AdmissionResult
+{
+	ADMIT_OK = 0,			/* Admitted */
+	ADMIT_ZLINED = 1,		/* Matches a Z-line */
+	ADMIT_DENIED = 2,		/* No connect class, or a deny class */
+	ADMIT_LOCALCLONES = 3,		/* Connect class localmax reached */
+	ADMIT_GLOBALCLONES = 4,		/* Connect class globalmax reached */
+	ADMIT_THROTTLE_IP = 5,		/* Per-IP connection rate exceeded */
+	ADMIT_THROTTLE_CIDR = 6,	/* Per-CIDR connection rate exceeded */
+	ADMIT_MAX = 7
+};
+
+/** The AdmissionManager is consulted by ListenSocket for every accepted client
+ * connection, before any userrec is created. It is the authoritative Z-line
+ * check for new connections, which userrec::AddClient does not repeat. It
+ * also applies the connect class deny and clone limit checks early, plus
+ * per-IP and per-CIDR connection rate limits configured in the
+ * <connthrottle> tag. A rejected connection is sent one preformatted ERROR
+ * line and closed, without touching the user hash, the socket engine, DNS
+ * or any module hooks.
+ */
+class CoreExport AdmissionManager : public classbase
+{
+ private:
+	/** A token bucket. Tokens are counted in sixtieths, so that a
+	 * rate given in connections per minute refills in whole units per second.
+	 */
+	struct Bucket
+	{
+		unsigned long level;
+		time_t last;
+	};
+
+	typedef nspace::hash_map<irc::sockets::ipaddr_key, Bucket, irc::sockets::ipaddr_hash> BucketMap;
+
+	/** Creator */
+	InspIRCd* ServerInstance;
+	/** Per-IP buckets */
+	BucketMap ipbuckets;
+	/** Per-CIDR buckets, keyed by masked address */
+	BucketMap cidrbuckets;
+	/** Last time full buckets were pruned */
+	time_t lastprune;
+	/** Counters, indexed by AdmissionResult */
+	unsigned long counters[ADMIT_MAX];
+
+	/** Take one token from a bucket, creating it full if it does not exist.
+	 * @return False if the bucket is empty
+	 */
+	bool Consume(BucketMap &buckets, const irc::sockets::ipaddr_key &key, unsigned long burst, unsigned long rate);
+
+	/** Remove buckets which have refilled completely
+	 */
+	void Prune(BucketMap &buckets, unsigned long burst, unsigned long rate);
+
+	/** Send the closing ERROR line for a rejected connection
+	 */
+	void Reject(int fd, int port, const char* ipaddr, const char* reason);
+
+ public:
+	/** Constructor */
+	AdmissionManager(InspIRCd* Instance);
+
+	/** Decide whether a newly accepted connection may proceed.
+	 * On rejection the client has already been sent its ERROR line, and the
+	 * caller must close the socket.
+	 * @param fd The new socket
+	 * @param port The local port the connection arrived on
+	 * @param client The remote address
+	 * @return ADMIT_OK, or the reason the connection was refused
+	 */
+	AdmissionResult Admit(int fd, int port, const sockaddr* client);
+
+	/** Get a counter
+	 * @param result The counter to read
+	 * @return Number of connections which have had this result
+	 */
+	unsigned long GetCount(AdmissionResult result)
+	{
+		return counters[result];
+	}
+
+	/** Drop all throttle state, e.g. when the configuration changes
+	 */
+	void ResetThrottles();
+};
+
 /** This class handles incoming connections on client ports.
  * It will create a new userrec for every valid connection
  * and assign it a file descriptor.
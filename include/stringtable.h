@@ -0,0 +1,114 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2007 InspIRCd Development Team
+ * See: http://www.inspircd.org/wiki/index.php/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#ifndef __STRINGTABLE_H__
+#define __STRINGTABLE_H__
+
+#include "inspircd_config.h"
+#include "base.h"
+#include <set>
+#include <string.h>
+#include <stddef.h>
+
+/** A table of shared, reference counted, immutable strings.
+ *
+ * Fields which many users hold the same value in, such as hostnames
+ * (most users on a network share a handful of cloaked vhosts) and oper
+ * types, point into this table instead of each carrying their own
+ * buffer. Two fields holding the same non-empty text hold the same
+ * pointer, so they can be compared with ==.
+ *
+ * Strings are stored with their reference count just in front of the
+ * text, so Release() needs no lookup until the last reference goes.
+ * The empty string is never stored: Acquire() returns a static "" for
+ * it, and Release() ignores any empty string, so fields can be
+ * initialised to "" without touching the table.
+ */
+class CoreExport StringTable : public classbase
+{
+	/** A stored string. Allocated with room for the whole text.
+	 */
+	struct Entry
+	{
+		unsigned int refs;
+		char text[1];
+	};
+
+	/** Orders stored strings by their text
+	 */
+	struct Less
+	{
+		bool operator()(const char* a, const char* b) const
+		{
+			return strcmp(a, b) < 0;
+		}
+	};
+
+	typedef std::set<const char*, Less> Table;
+
+	/** The text of every stored string
+	 */
+	Table table;
+
+	/** Bytes allocated for entries
+	 */
+	size_t bytes;
+
+	static Entry* Header(const char* s)
+	{
+		return (Entry*)(s - offsetof(Entry, text));
+	}
+
+ public:
+	StringTable() : bytes(0) { }
+
+	/** Take a reference to a string, storing it if it is new
+	 * @param s The text
+	 * @param maxlen If not zero, only this many characters of the text are used
+	 * @return The shared copy, valid until the reference is released
+	 */
+	const char* Acquire(const char* s, size_t maxlen = 0);
+
+	/** Drop a reference taken with Acquire()
+	 * @param s The pointer Acquire() returned, or any empty string
+	 */
+	void Release(const char* s);
+
+	/** Replace a field's string with another, releasing the old one
+	 * @param field The field, which holds a string from Acquire() or an empty string
+	 * @param s The new text
+	 * @param maxlen As for Acquire()
+	 */
+	void Assign(const char* &field, const char* s, size_t maxlen = 0)
+	{
+		const char* old = field;
+		field = Acquire(s, maxlen);
+		Release(old);
+	}
+
+	/** @return The number of distinct strings stored
+	 */
+	size_t size() const
+	{
+		return table.size();
+	}
+
+	/** @return The bytes allocated for stored strings
+	 */
+	size_t GetBytes() const
+	{
+		return bytes;
+	}
+};
+
+#endif
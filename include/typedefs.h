@@ -20,26 +20,19 @@
 #include "users.h"
 #include "channels.h"
 #include "hashcomp.h"
+#include "namehash.h"
 #include "inspstring.h"
 #include "ctables.h"
 #include "modules.h"
 #include "globals.h"
 
-#ifndef WIN32
-/** User hash (POSIX systems with GCC)
+/** User hash, mapping nicknames to users
  */
-typedef nspace::hash_map<std::string, userrec*, nspace::hash<string>, irc::StrHashComp> user_hash;
-/** Channel hash (POSIX systems with GCC)
- */
-typedef nspace::hash_map<std::string, chanrec*, nspace::hash<string>, irc::StrHashComp> chan_hash;
-#else
-/** User hash (windows systems with visual studio)
- */
-typedef nspace::hash_map<std::string, userrec*, nspace::hash_compare<string, less<string> > > user_hash;
-/** Channel hash (windows systems with visual studio)
+typedef NameHash<userrec*, NICKMAX> user_hash;
+
+/** Channel hash, mapping channel names to channels
  */
-typedef nspace::hash_map<std::string, chanrec*, nspace::hash_compare<string, less<string> > > chan_hash;
-#endif
+typedef NameHash<chanrec*, CHANMAX> chan_hash;
 
 /** Server name cache
  */
@@ -100,6 +100,9 @@ class ListModeBase : public ModeHandler
 	/** Storage key
 	 */
 	std::string infokey;
+	/** Slot registered for the storage key
+	 */
+	ExtensionSlot infoslot;
 	/** Numeric to use when outputting the list
 	 */
 	std::string listnumeric;
@@ -135,6 +138,7 @@ class ListModeBase : public ModeHandler
 	{
 		this->DoRehash();
 		infokey = "listbase_mode_" + std::string(1, mode) + "_list";
+		infoslot = Extensible::RegisterExt(infokey);
 	}
 
 	/** See mode.h 
@@ -142,7 +146,7 @@ class ListModeBase : public ModeHandler
 	std::pair<bool,std::string> ModeSet(userrec* source, userrec* dest, chanrec* channel, const std::string &parameter)
 	{
 		modelist* el;
-		channel->GetExt(infokey, el);
+		channel->GetExt(infoslot, el);
 		if (el)
 		{
 			for (modelist::iterator it = el->begin(); it != el->end(); it++)
@@ -163,7 +167,7 @@ class ListModeBase : public ModeHandler
 	virtual void DisplayList(userrec* user, chanrec* channel)
 	{
 		modelist* el;
-		channel->GetExt(infokey, el);
+		channel->GetExt(infoslot, el);
 		if (el)
 		{
 			for (modelist::reverse_iterator it = el->rbegin(); it != el->rend(); ++it)
@@ -181,7 +185,7 @@ class ListModeBase : public ModeHandler
 	virtual void RemoveMode(chanrec* channel)
 	{
 		modelist* el;
-		channel->GetExt(infokey, el);
+		channel->GetExt(infoslot, el);
 		if (el)
 		{
 			irc::modestacker modestack(false);
@@ -255,7 +259,7 @@ class ListModeBase : public ModeHandler
 	{
 		// Try and grab the list
 		modelist* el;
-		channel->GetExt(infokey, el);
+		channel->GetExt(infoslot, el);
 
 		if (adding)
 		{
@@ -264,7 +268,7 @@ class ListModeBase : public ModeHandler
 			{
 				// Make one
 				el = new modelist;
-				channel->Extend(infokey, el);
+				channel->Extend(infoslot, el);
 			}
 
 			// Clean the mask up
@@ -345,7 +349,7 @@ class ListModeBase : public ModeHandler
 						el->erase(it);
 						if (el->size() == 0)
 						{
-							channel->Shrink(infokey);
+							channel->Shrink(infoslot);
 							delete el;
 						}
 						return MODEACTION_ALLOW;
@@ -374,6 +378,13 @@ class ListModeBase : public ModeHandler
 		return infokey;
 	}
 
+	/** Get Extensible slot for this mode
+	 */
+	ExtensionSlot GetInfoSlot()
+	{
+		return infoslot;
+	}
+
 	/** Handle channel deletion.
 	 * See modules.h.
 	 * @param chan Channel being deleted
@@ -381,11 +392,11 @@ class ListModeBase : public ModeHandler
 	virtual void DoChannelDelete(chanrec* chan)
 	{
 		modelist* list;
-		chan->GetExt(infokey, list);
+		chan->GetExt(infoslot, list);
 
 		if (list)
 		{
-			chan->Shrink(infokey);
+			chan->Shrink(infoslot);
 			delete list;
 		}
 	}
@@ -399,7 +410,7 @@ class ListModeBase : public ModeHandler
 	virtual void DoSyncChannel(chanrec* chan, Module* proto, void* opaque)
 	{
 		modelist* list;
-		chan->GetExt(infokey, list);
+		chan->GetExt(infoslot, list);
 		irc::modestacker modestack(true);
 		std::deque<std::string> stackresult;
 		if (list)
@@ -15,6 +15,8 @@
 #define __USERS_H__
 
 #include <string>
+#include <map>
+#include <set>
 #include "inspircd_config.h"
 #include "socket.h"
 #include "channels.h"
@@ -89,9 +91,22 @@ class CoreExport UserResolver : public Resolver
 	/** File descriptor teh lookup is bound to
 	 */
 	int bound_fd;
+	/** IP the PTR query was sent for. The user's own may change before
+	 * the answers come back, such as when m_cgiirc replaces it.
+	 */
+	std::string bound_ip;
 	/** True if the lookup is forward, false if is a reverse lookup
 	 */
 	bool fwd;
+	/** When the user's PTR query was started
+	 */
+	timeval started;
+	/** When the user's PTR query was answered, for a forward lookup
+	 */
+	timeval reversed;
+	/** TTL of the PTR answer, for a forward lookup
+	 */
+	unsigned int reversettl;
  public:
 	/** Create a resolver.
 	 * @param Instance The creating instance
@@ -286,14 +301,6 @@ typedef std::vector<irc::string> InvitedList;
  */
 typedef std::vector<ConnectClass> ClassVector;
 
-/** Typedef for the list of user-channel records for a user
- */
-typedef std::map<chanrec*, char> UserChanList;
-
-/** Shorthand for an iterator into a UserChanList
- */
-typedef UserChanList::iterator UCListIter;
-
 /* Required forward declaration
  */
 class userrec;
@@ -373,29 +380,38 @@ class CoreExport userrec : public connection
 
  public:
 	/** Resolvers for looking up this users IP address
-	 * This will occur if and when res_reverse completes.
-	 * When this class completes its lookup, userrec::dns_done
-	 * will be set from false to true.
+	 * This is started as soon as res_reverse is answered,
+	 * cached or not. When this class completes its lookup,
+	 * userrec::dns_done will be set from false to true.
 	 */
 	UserResolver* res_forward;
 
 	/** Resolvers for looking up this users hostname
 	 * This is instantiated by userrec::StartDNSLookup(),
-	 * and on success, instantiates userrec::res_reverse.
+	 * and on success, instantiates userrec::res_forward.
 	 */
 	UserResolver* res_reverse;
 
 	/** User visibility state, see definition of VisData.
+	 * After changing this, call InvalidateCache() so that the NAMES
+	 * replies of the user's channels are built again.
 	 */
 	VisData* Visibility;
 
+	/** Zero or more NamesFormat bits, set by the modules which provide
+	 * NAMESX and UHNAMES when the user asks for them
+	 */
+	int NamesFormat;
+
 	/** Stored reverse lookup from res_forward
 	 */
 	std::string stored_host;
 
-	/** Starts a DNS lookup of the user's IP.
+	/** Starts a DNS lookup of the user's IP, as soon as it connects.
 	 * This will cause two UserResolver classes to be instantiated.
 	 * When complete, these objects set userrec::dns_done to true.
+	 * If the IP's hostname was confirmed recently, neither is needed
+	 * and userrec::dns_done is set straight away.
 	 */
 	void StartDNSLookup();
 
@@ -412,8 +428,10 @@ class CoreExport userrec : public connection
 
 	/** The host displayed to non-opers (used for cloaking etc).
 	 * This usually matches the value of userrec::host.
+	 * Held in InspIRCd::Strings; change it with ChangeDisplayedHost()
+	 * or SetDisplayedHost().
 	 */
-	char dhost[65];
+	const char* dhost;
 
 	/** The users full name (GECOS).
 	 */
@@ -464,8 +482,9 @@ class CoreExport userrec : public connection
 	 * This is used to check permissions in operclasses, so that
 	 * we can say 'yay' or 'nay' to any commands they issue.
 	 * The value of this is the value of a valid 'type name=' tag.
+	 * Held in InspIRCd::Strings; change it with SetOperType().
 	 */
-	char oper[NICKMAX];
+	const char* oper;
 
 	/** True when DNS lookups are completed.
 	 * The UserResolver classes res_forward and res_reverse will
@@ -515,10 +534,19 @@ class CoreExport userrec : public connection
 	bool muted;
 
 	/** IPV4 or IPV6 ip address. Use SetSockAddr to set this and GetProtocolFamily/
-	 * GetIPString/GetPort to obtain its values.
+	 * GetIPString/GetPort to obtain its values. If you change the address held
+	 * here directly, call RefreshIPCache() afterwards.
 	 */
 	sockaddr* ip;
 
+	/** Presentation form of ip, as returned by GetIPString()
+	 */
+	char ipstring[48];
+
+	/** Binary form of ip, used as the key for clone counting
+	 */
+	irc::sockets::ipaddr_key ipkey;
+
 	/** Initialize the clients sockaddr
 	 * @param protocol_family The protocol family of the IP address, AF_INET or AF_INET6
 	 * @param ip A human-readable IP address for this user matching the protcol_family
@@ -526,6 +554,11 @@ class CoreExport userrec : public connection
 	 */
 	void SetSockAddr(int protocol_family, const char* ip, int port);
 
+	/** Recalculate ipstring and ipkey from ip. This is called by SetSockAddr,
+	 * and must be called by anything else which changes the user's address.
+	 */
+	void RefreshIPCache();
+
 	/** Get port number from sockaddr
 	 * @return The port number of this user.
 	 */
@@ -536,13 +569,16 @@ class CoreExport userrec : public connection
 	 */
 	int GetProtocolFamily();
 
-	/** Get IP string from sockaddr, using static internal buffer
+	/** Get IP string, as cached when the address was set
 	 * @return The IP string
 	 */
-	const char* GetIPString();
+	const char* GetIPString()
+	{
+		return ipstring;
+	}
 
-	/** Get IP string from sockaddr, using caller-specified buffer
-	 * @param buf A buffer to use
+	/** Get IP string, copied into a caller-specified buffer
+	 * @param buf A buffer of at least 48 bytes
 	 * @return The IP string
 	 */
 	const char* GetIPString(char* buf);
@@ -561,6 +597,11 @@ class CoreExport userrec : public connection
 	 */
 	long recvqmax;
 
+	/** Progress of this user's /LIST, or NULL if the user is not listing.
+	 * Owned by ChannelDirectory.
+	 */
+	ListCursor* listing;
+
 	/** This is true if the user matched an exception when they connected to the ircd.
 	 * It isnt valid after this point, and you should not attempt to do anything with it
 	 * after this point, because the eline might be removed at a later time, and/or no
@@ -574,6 +615,14 @@ class CoreExport userrec : public connection
 	 */
 	userrec(InspIRCd* Instance);
 
+	/** Allocate a userrec from the user pool. See SlabPool.
+	 */
+	static void* operator new(size_t size);
+
+	/** Return a userrec to the user pool
+	 */
+	static void operator delete(void* p, size_t size);
+
 	/** Returns the full displayed host of the user
 	 * This member function returns the hostname of the user as seen by other users
 	 * on the server, in nick!ident&at;host form.
@@ -591,6 +640,7 @@ class CoreExport userrec : public connection
 
 	/** This clears any cached results that are used for GetFullRealHost() etc.
 	 * The results of these calls are cached as generating them can be generally expensive.
+	 * The cached NAMES replies of the user's channels are discarded too.
 	 */
 	void InvalidateCache();
 
@@ -806,6 +856,8 @@ class CoreExport userrec : public connection
 	/** Add a client to the system.
 	 * This will create a new userrec, insert it into the user_hash,
 	 * initialize it as not yet registered, and add it to the socket engine.
+	 * The connection must already have been let in by the AdmissionManager,
+	 * which is the only place a new connection is checked against Z-lines.
 	 * @param Instance a pointer to the server instance
 	 * @param socket The socket id (file descriptor) this user is on
 	 * @param port The port number this user connected on
@@ -942,6 +994,26 @@ class CoreExport userrec : public connection
 	 */
 	bool ChangeDisplayedHost(const char* host);
 
+	/** Set the real host of a user, without any notification.
+	 * Used while a user is connecting, or being introduced by another server.
+	 * A registered user is re-indexed for WHO.
+	 *  newhost The new host, truncated to 64 characters
+	 */
+	void SetHost(const char* newhost);
+
+	/** Set the displayed host of a user, without any notification.
+	 * Use ChangeDisplayedHost() to change the host of a connected user.
+	 * A registered user is re-indexed for WHO.
+	 *  newhost The new host, truncated to 64 characters
+	 */
+	void SetDisplayedHost(const char* newhost);
+
+	/** Set the oper type of a user, without opering them up.
+	 * Use Oper() to oper up a local user.
+	 *  opertype The oper type, or an empty string for none
+	 */
+	void SetOperType(const char* opertype);
+
 	/** Change the ident (username) of a user.
 	 * ALWAYS use this function, rather than writing userrec::ident directly,
 	 * as this correctly causes the user to seem to quit (where configured)
@@ -1024,6 +1096,80 @@ class CoreExport userrec : public connection
 	virtual ~userrec();
 };
 
+/** Secondary indexes over registered users, used by WHO to find the users
+ * a mask could possibly match without testing every user on the network.
+ *
+ * Nicknames and displayed hosts are kept in sorted maps both as written
+ * and reversed, folded to lower case, so that a mask with a literal prefix
+ * ("nick*", "127.0.*") or a literal suffix ("*.isp.net") maps onto a single
+ * range of each. Real hosts are only indexed for users whose displayed host
+ * differs from their real one. Users are also grouped by server.
+ *
+ * The indexes only narrow a search; callers must still match each user
+ * they are given against the mask.
+ */
+class CoreExport UserIndex : public classbase
+{
+ private:
+	typedef std::multimap<std::string, userrec*> NameIndex;
+
+	/** Where a user sits in each index, so that it can be removed again
+	 * even if its names have changed since it was added
+	 */
+	struct Entry
+	{
+		NameIndex::iterator nick, rnick, dhost, rdhost, host, rhost;
+		bool realhost;
+	};
+
+	typedef std::map<userrec*, Entry> EntryMap;
+	typedef std::map<const char*, std::set<userrec*> > ServerIndex;
+
+	InspIRCd* ServerInstance;
+
+	EntryMap entries;
+	NameIndex nicks, rnicks, dhosts, rdhosts, hosts, rhosts;
+	ServerIndex servers;
+
+	/** Fold a name to lower case, optionally reversing it
+	 */
+	static std::string Fold(const char* name, size_t len, bool reverse);
+
+	/** Add every user in an index whose key begins with a prefix
+	 * @return False if this would make out longer than limit
+	 */
+	static bool Range(NameIndex& index, const std::string& prefix, std::vector<userrec*>& out, size_t limit);
+
+ public:
+	/** Create an empty index
+	 */
+	UserIndex(InspIRCd* Instance);
+
+	/** Index a user. Called when a local user finishes registering, or a
+	 * remote user is introduced.
+	 */
+	void Add(userrec* user);
+
+	/** Remove a user from the indexes, if it is in them
+	 */
+	void Del(userrec* user);
+
+	/** Re-index a user whose nickname or host has changed
+	 */
+	void Update(userrec* user);
+
+	/** Find the users which a WHO mask could match by nickname, displayed
+	 * host, server name, and optionally real host.
+	 * @param mask The wildcard mask
+	 * @param realhost True to also consider real hosts
+	 * @param out Receives each candidate once, in no particular order
+	 * @return False if the mask has no literal prefix or suffix to search
+	 * on, or would match too much of the network for the indexes to help;
+	 * every user must then be treated as a candidate. out is untouched.
+	 */
+	bool Candidates(const char* mask, bool realhost, std::vector<userrec*>& out);
+};
+
 /* Configuration callbacks */
 class ServerConfig;
 
@@ -19,6 +19,7 @@
 #include <string>
 #include <deque>
 #include <vector>
+#include <map>
 #include "users.h"
 #include "channels.h"
 
@@ -277,6 +278,14 @@ bool DoELine(ServerConfig* conf, const char* tag, char** entries, ValueList &val
  */
 typedef std::pair<std::string, std::string> IdentHostPair;
 
+/** Z-lines of one prefix length, keyed by masked address
+ */
+typedef nspace::hash_map<irc::sockets::ipaddr_key, ZLine*, irc::sockets::ipaddr_hash> ZLineKeyMap;
+
+/** Z-line index, by prefix length (counted over the 128 bit address key)
+ */
+typedef std::map<unsigned int, ZLineKeyMap> ZLineIndex;
+
 /** XLineManager is a class used to manage glines, klines, elines, zlines and qlines.
  */
 class CoreExport XLineManager
@@ -305,6 +314,24 @@ class CoreExport XLineManager
 	/** This functor is used by the std::sort() function to keep qlines in order
 	 */
 	static bool QSortComparison ( const QLine* one, const QLine* two );
+
+	/** Z-lines which are plain addresses or CIDR masks, indexed by prefix
+	 * length so that an address can be checked with one lookup per distinct
+	 * prefix length in use.
+	 */
+	ZLineIndex zline_index;
+
+	/** Z-lines which contain wildcards and must still be matched one by one
+	 */
+	std::vector<ZLine*> zline_wild;
+
+	/** True if zlines or pzlines have changed since the index was built
+	 */
+	bool zline_index_dirty;
+
+	/** Rebuild zline_index and zline_wild from zlines and pzlines
+	 */
+	void RebuildZLineIndex();
  public:
 	/* Lists for temporary lines with an expiry time */
 
@@ -448,6 +475,14 @@ class CoreExport XLineManager
 	 */
 	ZLine* matches_zline(const char* ipaddr, bool permonly = false);
 
+	/** Check if an address matches a ZLine, using the Z-line index.
+	 * This is the check used when admitting new connections.
+	 * @param key The binary form of the address
+	 * @param ipaddr The same address in human readable form, for wildcard masks
+	 * @return The matching line, or NULL if there is no match
+	 */
+	ZLine* matches_zline(const irc::sockets::ipaddr_key &key, const char* ipaddr);
+
 	/** Check if a hostname matches a KLine
 	 * @param user The user to check against
 	 * @return The reason for the line if there is a match, or NULL if there is no match
@@ -460,6 +495,14 @@ class CoreExport XLineManager
 	 */
 	ELine* matches_exception(userrec* user, bool permonly = false);
 
+	/** Check if an ident, host and IP match an ELine
+	 * @param ident The ident to check
+	 * @param host The host to check
+	 * @param ip The IP address to check
+	 * @return The matching line, or NULL if there is no match
+	 */
+	ELine* matches_exception(const char* ident, const char* host, const char* ip, bool permonly = false);
+
 	/** Expire any pending non-permenant lines
 	 */
 	void expire_lines();
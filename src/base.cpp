@@ -14,7 +14,10 @@
 #include "inspircd_config.h"
 #include "base.h"
 #include <time.h>
+#include <sys/mman.h>
+#include <new>
 #include "inspircd.h"
+#include "slabpool.h"
 
 const int bitfields[]           =       {1,2,4,8,16,32,64,128};
 const int inverted_bitfields[]  =       {~1,~2,~4,~8,~16,~32,~64,~128};
@@ -24,20 +27,86 @@ classbase::classbase()
 	this->age = time(NULL);
 }
 
+/** Names and destructors of registered extension slots.
+ * Held in a function so that modules registering keys from their static
+ * initialisers always find it constructed.
+ */
+class ExtensionRegistry
+{
+ public:
+	std::map<std::string, ExtensionSlot> slots;
+	std::vector<std::string> names;
+	std::vector<ExtensionDestructor> destructors;
+
+	static ExtensionRegistry& Get()
+	{
+		static ExtensionRegistry registry;
+		return registry;
+	}
+};
+
+ExtensionSlot Extensible::RegisterExt(const std::string &key)
+{
+	ExtensionRegistry& r = ExtensionRegistry::Get();
+	std::map<std::string, ExtensionSlot>::iterator i = r.slots.find(key);
+	if (i != r.slots.end())
+		return i->second;
+
+	ExtensionSlot slot = r.names.size();
+	r.slots[key] = slot;
+	r.names.push_back(key);
+	r.destructors.push_back(NULL);
+	return slot;
+}
+
+bool Extensible::FindExt(const std::string &key, ExtensionSlot &slot)
+{
+	ExtensionRegistry& r = ExtensionRegistry::Get();
+	std::map<std::string, ExtensionSlot>::iterator i = r.slots.find(key);
+	if (i == r.slots.end())
+		return false;
+	slot = i->second;
+	return true;
+}
+
+void Extensible::SetExtDestructor(ExtensionSlot slot, ExtensionDestructor destroy)
+{
+	ExtensionRegistry& r = ExtensionRegistry::Get();
+	if (slot < r.destructors.size())
+		r.destructors[slot] = destroy;
+}
+
+bool Extensible::Shrink(ExtensionSlot slot)
+{
+	ExtensibleStore::iterator i = Position(slot);
+	if ((i == Extension_Items.end()) || (i->first != slot))
+		return false;
+	this->Extension_Items.erase(i);
+	return true;
+}
+
 bool Extensible::Shrink(const std::string &key)
 {
-	/* map::size_type map::erase( const key_type& key );
-	 * returns the number of elements removed, std::map
-	 * is single-associative so this should only be 0 or 1
-	 */
-	return this->Extension_Items.erase(key);
+	ExtensionSlot slot;
+	return FindExt(key, slot) && this->Shrink(slot);
 }
 
 void Extensible::GetExtList(std::deque<std::string> &list)
 {
+	ExtensionRegistry& r = ExtensionRegistry::Get();
+	for (ExtensibleStore::iterator u = Extension_Items.begin(); u != Extension_Items.end(); u++)
+	{
+		list.push_back(r.names[u->first]);
+	}
+}
+
+Extensible::~Extensible()
+{
+	ExtensionRegistry& r = ExtensionRegistry::Get();
 	for (ExtensibleStore::iterator u = Extension_Items.begin(); u != Extension_Items.end(); u++)
 	{
-		list.push_back(u->first);
+		if ((u->second) && (r.destructors[u->first]))
+			r.destructors[u->first](u->second);
 	}
 }
 
@@ -93,3 +162,156 @@ bool BoolSet::operator=(BoolSet other)
 	this->bits = other.bits;
 	return true;
 }
+
+/** All pools, newest first. Being a plain pointer it is zero before any
+ * static initialiser runs, so pools may be defined in any file.
+ */
+static SlabPool* pools = NULL;
+
+SlabPool::SlabPool(const char* poolname, size_t size) : name(poolname), head(NULL), tail(NULL), slabs(0), empty(0), live(0), highwater(0)
+{
+	/* Round up to keep every object suitably aligned */
+	objsize = (size + 15) & ~(size_t)15;
+	perslab = (SlabBytes - HeaderBytes) / objsize;
+	nextpool = pools;
+	pools = this;
+}
+
+void SlabPool::LinkHead(Slab* s)
+{
+	s->prev = NULL;
+	s->next = head;
+	if (head)
+		head->prev = s;
+	else
+		tail = s;
+	head = s;
+}
+
+void SlabPool::LinkTail(Slab* s)
+{
+	s->next = NULL;
+	s->prev = tail;
+	if (tail)
+		tail->next = s;
+	else
+		head = s;
+	tail = s;
+}
+
+void SlabPool::Unlink(Slab* s)
+{
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		head = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+	else
+		tail = s->prev;
+}
+
+SlabPool::Slab* SlabPool::NewSlab()
+{
+	/* Map twice the size and trim it down to one aligned slab */
+	char* map = (char*)mmap(NULL, SlabBytes * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		throw std::bad_alloc();
+
+	char* base = (char*)(((unsigned long)map + SlabBytes - 1) & ~(unsigned long)(SlabBytes - 1));
+	if (base != map)
+		munmap(map, base - map);
+	munmap(base + SlabBytes, map + SlabBytes - base);
+
+	Slab* s = (Slab*)base;
+	s->freelist = NULL;
+	s->carved = s->used = 0;
+	slabs++;
+	empty++;
+	return s;
+}
+
+void* SlabPool::Allocate(size_t size)
+{
+	if ((size > objsize) || (!perslab))
+		return ::operator new(size);
+
+	Slab* s = head;
+	if (!s)
+	{
+		s = NewSlab();
+		LinkHead(s);
+	}
+
+	void* p;
+	if (s->freelist)
+	{
+		p = s->freelist;
+		s->freelist = *(void**)p;
+	}
+	else
+		p = Object(s, s->carved++);
+
+	if (!s->used++)
+		empty--;
+	if (s->used == perslab)
+		Unlink(s);
+
+	if (++live > highwater)
+		highwater = live;
+	return p;
+}
+
+void SlabPool::Free(void* p, size_t size)
+{
+	if (!p)
+		return;
+	if ((size > objsize) || (!perslab))
+	{
+		::operator delete(p);
+		return;
+	}
+
+	Slab* s = (Slab*)((unsigned long)p & ~(unsigned long)(SlabBytes - 1));
+	*(void**)p = s->freelist;
+	s->freelist = p;
+	live--;
+
+	if (s->used-- == perslab)
+		LinkHead(s);
+	if (!s->used)
+	{
+		/* Move it out of the way of allocations, ready for Release() */
+		empty++;
+		Unlink(s);
+		LinkTail(s);
+	}
+}
+
+size_t SlabPool::Release()
+{
+	size_t released = 0;
+	while ((tail) && (!tail->used))
+	{
+		Slab* s = tail;
+		Unlink(s);
+		munmap((char*)s, SlabBytes);
+		slabs--;
+		empty--;
+		released += SlabBytes;
+	}
+	return released;
+}
+
+size_t SlabPool::ReleaseAll()
+{
+	size_t released = 0;
+	for (SlabPool* p = pools; p; p = p->nextpool)
+		released += p->Release();
+	return released;
+}
+
+SlabPool* SlabPool::GetFirst()
+{
+	return pools;
+}
@@ -18,12 +18,41 @@
 #include "modules.h"
 #include "wildcard.h"
 #include "mode.h"
+#include "slabpool.h"
+
+/** Channels and their membership records come and go with every join and
+ * part, so each lives in a pool of its own rather than on the general heap
+ */
+static SlabPool ChannelPool("chanrec", sizeof(chanrec));
+static SlabPool MemberPool("Membership", sizeof(Membership));
+
+void* chanrec::operator new(size_t size)
+{
+	return ChannelPool.Allocate(size);
+}
+
+void chanrec::operator delete(void* p, size_t size)
+{
+	ChannelPool.Free(p, size);
+}
+
+void* Membership::operator new(size_t size)
+{
+	return MemberPool.Allocate(size);
+}
+
+void Membership::operator delete(void* p, size_t size)
+{
+	MemberPool.Free(p, size);
+}
 
 chanrec::chanrec(InspIRCd* Instance) : ServerInstance(Instance)
 {
 	*name = *topic = *setby = *key = 0;
 	maxbans = created = topicset = limit = 0;
 	memset(&modes,0,64);
+	paramserial = paramsnap = 0;
+	modesvalid = false;
 	age = ServerInstance->Time(true);
 }
 
@@ -39,6 +68,8 @@ void chanrec::SetModeParam(char mode,const char* parameter,bool mode_on)
 {
 	CustomModeList::iterator n = custom_mode_params.find(mode);	
 
+	paramserial++;
+
 	if (mode_on)
 	{
 		if (n == custom_mode_params.end())
@@ -76,100 +107,165 @@ std::string chanrec::GetModeParameter(char mode)
 	}
 }
 
-long chanrec::GetUserCounter()
+Membership* MemberList::insert(userrec* user, chanrec* chan)
 {
-	return (this->internal_userlist.size());
-}
+	Membership* m = this->find(user);
+	if (m)
+		return m;
 
-void chanrec::AddUser(userrec* user)
-{
-	internal_userlist[user] = user->nick;
+	/* Keep the index at most half full */
+	if ((members.size() + 1) * 2 > table.size())
+		this->Resize(table.empty() ? 8 : table.size() * 2);
+
+	m = new Membership(user, chan);
+	m->slot = members.size();
+	members.push_back(m);
+
+	size_t mask = table.size() - 1;
+	size_t b = Hash(user) & mask;
+	while (table[b])
+		b = (b + 1) & mask;
+	table[b] = m;
+
+	return m;
 }
 
-unsigned long chanrec::DelUser(userrec* user)
+Membership* MemberList::erase(userrec* user)
 {
-	CUListIter a = internal_userlist.find(user);
-	
-	if (a != internal_userlist.end())
+	if (table.empty())
+		return NULL;
+
+	size_t mask = table.size() - 1;
+	size_t b = Hash(user) & mask;
+	while (table[b] && table[b]->user != user)
+		b = (b + 1) & mask;
+
+	Membership* m = table[b];
+	if (!m)
+		return NULL;
+
+	/* Backward shift deletion: pull later entries of the probe run
+	 * into the hole unless they already sit at or after their home.
+	 */
+	table[b] = NULL;
+	for (size_t j = (b + 1) & mask; table[j]; j = (j + 1) & mask)
 	{
-		internal_userlist.erase(a);
-		/* And tidy any others... */
-		DelOppedUser(user);
-		DelHalfoppedUser(user);
-		DelVoicedUser(user);
+		size_t home = Hash(table[j]->user) & mask;
+		bool stays = (b <= j) ? ((b < home) && (home <= j)) : ((b < home) || (home <= j));
+		if (!stays)
+		{
+			table[b] = table[j];
+			table[j] = NULL;
+			b = j;
+		}
 	}
-	
-	return internal_userlist.size();
-}
 
-bool chanrec::HasUser(userrec* user)
-{
-	return (internal_userlist.find(user) != internal_userlist.end());
-}
+	/* Swap the last member into the vacated slot */
+	Membership* last = members.back();
+	members[m->slot] = last;
+	last->slot = m->slot;
+	members.pop_back();
 
-void chanrec::AddOppedUser(userrec* user)
-{
-	internal_op_userlist[user] = user->nick;
+	if (members.empty())
+		table.clear();
+	else if ((table.size() > 8) && (members.size() * 8 < table.size()))
+		this->Resize(table.size() / 2);
+
+	return m;
 }
 
-void chanrec::DelOppedUser(userrec* user)
+void MemberList::Resize(size_t buckets)
 {
-	CUListIter a = internal_op_userlist.find(user);
-	if (a != internal_op_userlist.end())
+	table.assign(buckets, NULL);
+	size_t mask = buckets - 1;
+	for (iterator i = members.begin(); i != members.end(); i++)
 	{
-		internal_op_userlist.erase(a);
-		return;
+		size_t b = Hash((*i)->user) & mask;
+		while (table[b])
+			b = (b + 1) & mask;
+		table[b] = *i;
 	}
 }
 
-void chanrec::AddHalfoppedUser(userrec* user)
+size_t MemberList::count(char mask) const
 {
-	internal_halfop_userlist[user] = user->nick;
+	size_t n = 0;
+	for (const_iterator i = members.begin(); i != members.end(); i++)
+		if ((*i)->status & mask)
+			n++;
+	return n;
 }
 
-void chanrec::DelHalfoppedUser(userrec* user)
+long chanrec::GetUserCounter()
 {
-	CUListIter a = internal_halfop_userlist.find(user);
-
-	if (a != internal_halfop_userlist.end())
-	{   
-		internal_halfop_userlist.erase(a);
-	}
+	return (this->members.size());
 }
 
-void chanrec::AddVoicedUser(userrec* user)
+Membership* chanrec::AddUser(userrec* user)
 {
-	internal_voice_userlist[user] = user->nick;
+	size_t before = members.size();
+	Membership* m = members.insert(user, this);
+	if (members.size() != before)
+	{
+		user->chans.push_front(m);
+		ServerInstance->Directory->Update(this);
+
+		/* A new member goes on the end of each NAMES reply which is built */
+		for (int f = 0; f < 4; f++)
+		{
+			if ((!names[f].valid) || (!names[f].shared))
+				continue;
+			if (user->Visibility)
+				names[f].shared = false;
+			else
+				this->AppendName(names[f], this->NamesEntry(user, m, user->nick, f));
+		}
+	}
+	return m;
 }
 
-void chanrec::DelVoicedUser(userrec* user)
+unsigned long chanrec::DelUser(userrec* user)
 {
-	CUListIter a = internal_voice_userlist.find(user);
+	Membership* m = members.erase(user);
 	
-	if (a != internal_voice_userlist.end())
+	if (m)
 	{
-		internal_voice_userlist.erase(a);
+		user->chans.unlink(m);
+		delete m;
+		ServerInstance->Directory->Update(this);
+		this->InvalidateNames();
 	}
+	
+	return members.size();
 }
 
-CUList* chanrec::GetUsers()
+bool chanrec::HasUser(userrec* user)
 {
-	return &internal_userlist;
+	return (members.find(user) != NULL);
 }
 
-CUList* chanrec::GetOppedUsers()
+Membership* chanrec::GetMembership(userrec* user)
 {
-	return &internal_op_userlist;
+	return members.find(user);
 }
 
-CUList* chanrec::GetHalfoppedUsers()
+MemberList* chanrec::GetUsers()
 {
-	return &internal_halfop_userlist;
+	return &members;
 }
 
-CUList* chanrec::GetVoicedUsers()
+char chanrec::StatusToMask(char status)
 {
-	return &internal_voice_userlist;
+	switch (status)
+	{
+		case '@':
+			return UCMODE_OP;
+		case '%':
+			return UCMODE_HOP;
+		case '+':
+			return UCMODE_VOICE;
+	}
+	return 0;
 }
 
 void chanrec::SetDefaultModes()
@@ -379,10 +475,7 @@ chanrec* chanrec::ForceChan(InspIRCd* Instance, chanrec* Ptr, userrec* user, con
 	bool silent = false;
 
 	dummyuser->SetFd(FD_MAGIC_NUMBER);
-	Ptr->AddUser(user);
-
-	/* Just in case they have no permissions */
-	user->chans[Ptr] = 0;
+	Membership* memb = Ptr->AddUser(user);
 
 	for (std::string::const_iterator x = privs.begin(); x != privs.end(); x++)
 	{
@@ -394,26 +487,7 @@ chanrec* chanrec::ForceChan(InspIRCd* Instance, chanrec* Ptr, userrec* user, con
 			/* Make sure that the mode handler knows this mode was now set */
 			mh->OnModeChange(dummyuser, dummyuser, Ptr, nick, true);
 
-			switch (mh->GetPrefix())
-			{
-				/* These logic ops are SAFE IN THIS CASE
-				 * because if the entry doesnt exist,
-				 * addressing operator[] creates it.
-				 * If they do exist, it points to it.
-				 * At all other times where we dont want
-				 * to create an item if it doesnt exist, we
-				 * must stick to ::find().
-				 */
-				case '@':
-					user->chans[Ptr] |= UCMODE_OP;
-				break;
-				case '%':
-					user->chans[Ptr] |= UCMODE_HOP;
-				break;
-				case '+':
-					user->chans[Ptr] |= UCMODE_VOICE;
-				break;
-			}
+			memb->status |= StatusToMask(mh->GetPrefix());
 		}
 	}
 
@@ -477,15 +551,13 @@ long chanrec::PartUser(userrec *user, const char* reason)
 	if (!user)
 		return this->GetUserCounter();
 
-	UCListIter i = user->chans.find(this);
-	if (i != user->chans.end())
+	if (this->HasUser(user))
 	{
 		FOREACH_MOD(I_OnUserPart,OnUserPart(user, this, reason ? reason : "", silent));
 
 		if (!silent)
 			this->WriteChannel(user, "PART %s%s%s", this->name, reason ? " :" : "", reason ? reason : "");
 
-		user->chans.erase(i);
 		this->RemoveAllPrefixes(user);
 	}
 
@@ -495,8 +567,8 @@ long chanrec::PartUser(userrec *user, const char* reason)
 		/* kill the record */
 		if (iter != ServerInstance->chanlist->end())
 		{
-			FOREACH_MOD(I_OnChannelDelete,OnChannelDelete(this));
 			ServerInstance->chanlist->erase(iter);
+			FOREACH_MOD(I_OnChannelDelete,OnChannelDelete(this));
 		}
 		return 0;
 	}
@@ -525,13 +597,11 @@ long chanrec::ServerKickUser(userrec* user, const char* reason, bool triggereven
 		FOREACH_MOD(I_OnUserKick,OnUserKick(NULL, user, this, reason, silent));
 	}
 
-	UCListIter i = user->chans.find(this);
-	if (i != user->chans.end())
+	if (this->HasUser(user))
 	{
 		if (!silent)
 			this->WriteChannelWithServ(ServerInstance->Config->ServerName, "KICK %s %s :%s", this->name, user->nick, reason);
 
-		user->chans.erase(i);
 		this->RemoveAllPrefixes(user);
 	}
 
@@ -541,8 +611,8 @@ long chanrec::ServerKickUser(userrec* user, const char* reason, bool triggereven
 		/* kill the record */
 		if (iter != ServerInstance->chanlist->end())
 		{
-			FOREACH_MOD(I_OnChannelDelete,OnChannelDelete(this));
 			ServerInstance->chanlist->erase(iter);
+			FOREACH_MOD(I_OnChannelDelete,OnChannelDelete(this));
 		}
 		return 0;
 	}
@@ -600,14 +670,11 @@ long chanrec::KickUser(userrec *src, userrec *user, const char* reason)
 
 	FOREACH_MOD(I_OnUserKick,OnUserKick(src, user, this, reason, silent));
 
-	UCListIter i = user->chans.find(this);
-	if (i != user->chans.end())
+	if (this->HasUser(user))
 	{
-		/* zap it from the channel list of the user */
 		if (!silent)
 			this->WriteChannel(src, "KICK %s %s :%s", this->name, user->nick, reason);
 
-		user->chans.erase(i);
 		this->RemoveAllPrefixes(user);
 	}
 
@@ -619,8 +686,8 @@ long chanrec::KickUser(userrec *src, userrec *user, const char* reason)
 		/* kill the record */
 		if (iter != ServerInstance->chanlist->end())
 		{
-			FOREACH_MOD(I_OnChannelDelete,OnChannelDelete(this));
 			ServerInstance->chanlist->erase(iter);
+			FOREACH_MOD(I_OnChannelDelete,OnChannelDelete(this));
 		}
 		return 0;
 	}
@@ -645,7 +712,6 @@ void chanrec::WriteChannel(userrec* user, char* text, ...)
 
 void chanrec::WriteChannel(userrec* user, const std::string &text)
 {
-	CUList *ulist = this->GetUsers();
 	char tb[MAXBUF];
 
 	if (!user)
@@ -654,10 +720,10 @@ void chanrec::WriteChannel(userrec* user, const std::string &text)
 	snprintf(tb,MAXBUF,":%s %s",user->GetFullHost(),text.c_str());
 	std::string out = tb;
 
-	for (CUList::iterator i = ulist->begin(); i != ulist->end(); i++)
+	for (MemberList::iterator i = members.begin(); i != members.end(); i++)
 	{
-		if (IS_LOCAL(i->first))
-			i->first->Write(out);
+		if (IS_LOCAL((*i)->user))
+			(*i)->user->Write(out);
 	}
 }
 
@@ -678,16 +744,15 @@ void chanrec::WriteChannelWithServ(const char* ServName, const char* text, ...)
 
 void chanrec::WriteChannelWithServ(const char* ServName, const std::string &text)
 {
-	CUList *ulist = this->GetUsers();
 	char tb[MAXBUF];
 
 	snprintf(tb,MAXBUF,":%s %s",ServName ? ServName : ServerInstance->Config->ServerName, text.c_str());
 	std::string out = tb;
 
-	for (CUList::iterator i = ulist->begin(); i != ulist->end(); i++)
+	for (MemberList::iterator i = members.begin(); i != members.end(); i++)
 	{
-		if (IS_LOCAL(i->first))
-			i->first->Write(out);
+		if (IS_LOCAL((*i)->user))
+			(*i)->user->Write(out);
 	}
 }
 
@@ -725,36 +790,23 @@ void chanrec::WriteAllExcept(userrec* user, bool serversource, char status, CULi
 
 void chanrec::WriteAllExcept(userrec* user, bool serversource, char status, CUList &except_list, const std::string &text)
 {
-	CUList *ulist;
 	char tb[MAXBUF];
-
-	switch (status)
-	{
-		case '@':
-			ulist = this->GetOppedUsers();
-			break;
-		case '%':
-			ulist = this->GetHalfoppedUsers();
-			break;
-		case '+':
-			ulist = this->GetVoicedUsers();
-			break;
-		default:
-			ulist = this->GetUsers();
-			break;
-	}
+	char mask = StatusToMask(status);
 
 	snprintf(tb,MAXBUF,":%s %s",user->GetFullHost(),text.c_str());
 	std::string out = tb;
 
-	for (CUList::iterator i = ulist->begin(); i != ulist->end(); i++)
+	for (MemberList::iterator i = members.begin(); i != members.end(); i++)
 	{
-		if ((IS_LOCAL(i->first)) && (except_list.find(i->first) == except_list.end()))
+		userrec* u = (*i)->user;
+		if ((mask) && (!((*i)->status & mask)))
+			continue;
+		if ((IS_LOCAL(u)) && (except_list.find(u) == except_list.end()))
 		{
 			if (serversource)
-				i->first->WriteServ(text);
+				u->WriteServ(text);
 			else
-				i->first->Write(out);
+				u->Write(out);
 		}
 	}
 }
@@ -773,10 +825,9 @@ void chanrec::WriteAllExceptSender(userrec* user, bool serversource, char status
 int chanrec::CountInvisible()
 {
 	int count = 0;
-	CUList *ulist= this->GetUsers();
-	for (CUList::iterator i = ulist->begin(); i != ulist->end(); i++)
+	for (MemberList::iterator i = members.begin(); i != members.end(); i++)
 	{
-		if (!(i->first->IsModeSet('i')))
+		if (!((*i)->user->IsModeSet('i')))
 			count++;
 	}
 
@@ -785,20 +836,32 @@ int chanrec::CountInvisible()
 
 char* chanrec::ChanModes(bool showkey)
 {
-	static char scratch[MAXBUF];
-	static char sparam[MAXBUF];
-	char* offset = scratch;
-	std::string extparam;
+	if ((!modesvalid) || (paramsnap != paramserial) || (limitsnap != limit) || (memcmp(modesnap, modes, 64)) || (strcmp(keysnap, key)))
+	{
+		modestring[0] = this->BuildModes(false);
+		modestring[1] = this->BuildModes(true);
+		memcpy(modesnap, modes, 64);
+		limitsnap = limit;
+		strlcpy(keysnap, key, sizeof(keysnap));
+		paramsnap = paramserial;
+		modesvalid = true;
+	}
 
-	*scratch = '\0';
-	*sparam = '\0';
+	return (char*)modestring[showkey ? 1 : 0].c_str();
+}
+
+std::string chanrec::BuildModes(bool showkey)
+{
+	std::string letters;
+	std::string params;
+	std::string extparam;
 
 	/* This was still iterating up to 190, chanrec::modes is only 64 elements -- Om */
 	for(int n = 0; n < 64; n++)
 	{
 		if(this->modes[n])
 		{
-			*offset++ = n + 65;
+			letters.push_back(n + 65);
 			extparam.clear();
 			switch (n)
 			{
@@ -821,26 +884,70 @@ char* chanrec::ChanModes(bool showkey)
 				break;
 			}
 			if (!extparam.empty())
-			{
-				charlcat(sparam,' ',MAXBUF);
-				strlcat(sparam,extparam.c_str(),MAXBUF);
-			}
+				params.append(" ").append(extparam);
 		}
 	}
 
-	/* Null terminate scratch */
-	*offset = '\0';
-	strlcat(scratch,sparam,MAXBUF);
-	return scratch;
+	return letters.append(params).substr(0, MAXBUF - 1);
 }
 
+/** Builds the 353 numerics of a NAMES reply, starting a new numeric
+ * whenever the current one is close to the line length limit.
+ */
+class NamesReply
+{
+	userrec* user;
+	chanrec* chan;
+	char list[MAXBUF];
+	char* ptr;
+	size_t curlen;
+	int numusers;
+
+	void Reset()
+	{
+		curlen = snprintf(list,MAXBUF,"353 %s = %s :", user->nick, chan->name);
+		ptr = list + curlen;
+		numusers = 0;
+	}
+
+ public:
+	NamesReply(userrec* u, chanrec* c) : user(u), chan(c)
+	{
+		Reset();
+	}
+
+	void Add(const std::string &entry)
+	{
+		size_t ptrlen = snprintf(ptr, MAXBUF - curlen, "%s", entry.c_str());
+
+		curlen += ptrlen;
+		ptr += ptrlen;
+
+		numusers++;
+
+		if (curlen > (480-NICKMAX))
+		{
+			/* list overflowed into multiple numerics */
+			user->WriteServ(std::string(list));
+			Reset();
+		}
+	}
+
+	void Finish()
+	{
+		/* if whats left in the list isnt empty, send it */
+		if (numusers)
+			user->WriteServ(std::string(list));
+
+		user->WriteServ("366 %s %s :End of /NAMES list.", user->nick, chan->name);
+	}
+};
+
 /* compile a userlist of a channel into a string, each nick seperated by
  * spaces and op, voice etc status shown as @ and +, and send it to 'user'
  */
 void chanrec::UserList(userrec *user, CUList *ulist)
 {
-	char list[MAXBUF];
-	size_t dlen, curlen;
 	int MOD_RESULT = 0;
 
 	if (!IS_LOCAL(user))
@@ -850,63 +957,117 @@ void chanrec::UserList(userrec *user, CUList *ulist)
 	if (MOD_RESULT == 1)
 		return;
 
-	dlen = curlen = snprintf(list,MAXBUF,"353 %s = %s :", user->nick, this->name);
-
-	int numusers = 0;
-	char* ptr = list + dlen;
-
-	if (!ulist)
-		ulist = this->GetUsers();
-
 	/* Improvement by Brain - this doesnt change in value, so why was it inside
 	 * the loop?
 	 */
 	bool has_user = this->HasUser(user);
+	int format = user->NamesFormat & (NAMES_ALLPREFIXES | NAMES_FULLHOST);
 
-	for (CUList::iterator i = ulist->begin(); i != ulist->end(); i++)
+	if ((!ulist) && (has_user))
 	{
-		if ((!has_user) && (i->first->IsModeSet('i')))
+		/* Every member sees the same list, unless someone on it has a visibility handler */
+		NamesCache& cache = this->GetNames(format);
+		if (cache.shared)
 		{
-			/*
-			 * user is +i, and source not on the channel, does not show
-			 * nick in NAMES list
-			 */
-			continue;
+			for (std::vector<std::string>::iterator i = cache.chunks.begin(); i != cache.chunks.end(); i++)
+				user->WriteServ("353 %s = %s :%s", user->nick, this->name, i->c_str());
+			user->WriteServ("366 %s %s :End of /NAMES list.", user->nick, this->name);
+			return;
 		}
+	}
 
-		if (i->first->Visibility && !i->first->Visibility->VisibleTo(user))
-			continue;
+	NamesReply reply(user, this);
 
-		size_t ptrlen = snprintf(ptr, MAXBUF, "%s%s ", this->GetPrefixChar(i->first), i->second.c_str());
-		/* OnUserList can change this - reset it back to normal */
-		i->second = i->first->nick;
+	if (ulist)
+	{
+		/* A module gave us its own list, the nicks to show are in the map */
+		for (CUList::iterator i = ulist->begin(); i != ulist->end(); i++)
+		{
+			if (!this->ShowInNames(user, i->first, has_user))
+				continue;
 
-		curlen += ptrlen;
-		ptr += ptrlen;
+			reply.Add(this->NamesEntry(i->first, members.find(i->first), i->second.c_str(), format));
+		}
+	}
+	else
+	{
+		for (MemberList::iterator i = members.begin(); i != members.end(); i++)
+		{
+			if (!this->ShowInNames(user, (*i)->user, has_user))
+				continue;
 
-		numusers++;
+			reply.Add(this->NamesEntry((*i)->user, *i, (*i)->user->nick, format));
+		}
+	}
 
-		if (curlen > (480-NICKMAX))
-		{
-			/* list overflowed into multiple numerics */
-			user->WriteServ(std::string(list));
+	reply.Finish();
+}
+
+std::string chanrec::NamesEntry(userrec* member, Membership* memb, const char* shown, int format)
+{
+	std::string entry = (format & NAMES_ALLPREFIXES) ? this->GetAllPrefixChars(memb) : this->GetPrefixChar(memb);
+	entry.append((format & NAMES_FULLHOST) ? member->GetFullHost() : shown);
+	return entry.append(" ");
+}
+
+void chanrec::AppendName(NamesCache &cache, const std::string &entry)
+{
+	/* Each chunk must fit in a 353 after the longest nick and this channel's name */
+	size_t room = (480 - NICKMAX) - (NICKMAX + strlen(this->name) + 9);
+
+	if ((cache.chunks.empty()) || (cache.chunks.back().length() + entry.length() > room))
+		cache.chunks.push_back(entry);
+	else
+		cache.chunks.back().append(entry);
+}
 
-			/* reset our lengths */
-			dlen = curlen = snprintf(list,MAXBUF,"353 %s = %s :", user->nick, this->name);
-			ptr = list + dlen;
+NamesCache& chanrec::GetNames(int format)
+{
+	NamesCache& cache = names[format];
+
+	if (!cache.valid)
+	{
+		cache.chunks.clear();
+		cache.shared = true;
+		cache.valid = true;
 
-			ptrlen = 0;
-			numusers = 0;
+		for (MemberList::iterator i = members.begin(); i != members.end(); i++)
+		{
+			if ((*i)->user->Visibility)
+			{
+				cache.shared = false;
+				cache.chunks.clear();
+				break;
+			}
+			this->AppendName(cache, this->NamesEntry((*i)->user, *i, (*i)->user->nick, format));
 		}
 	}
 
-	/* if whats left in the list isnt empty, send it */
-	if (numusers)
+	return cache;
+}
+
+void chanrec::InvalidateNames()
+{
+	for (int f = 0; f < 4; f++)
 	{
-		user->WriteServ(std::string(list));
+		names[f].valid = false;
+		names[f].chunks.clear();
 	}
+}
+
+bool chanrec::ShowInNames(userrec* user, userrec* member, bool has_user)
+{
+	/*
+	 * member is +i, and source not on the channel, does not show
+	 * nick in NAMES list
+	 */
+	if ((!has_user) && (member->IsModeSet('i')))
+		return false;
+
+	if (member->Visibility && !member->Visibility->VisibleTo(user))
+		return false;
 
-	user->WriteServ("366 %s %s :End of /NAMES list.", user->nick, this->name);
+	return true;
 }
 
 long chanrec::GetMaxBans()
@@ -940,65 +1101,47 @@ void chanrec::ResetMaxBans()
  * the user has must be returned.
  */
 const char* chanrec::GetPrefixChar(userrec *user)
+{
+	return this->GetPrefixChar(members.find(user));
+}
+
+const char* chanrec::GetPrefixChar(Membership* memb)
 {
 	static char pf[2] = {0, 0};
-	
-	prefixlist::iterator n = prefixes.find(user);
-	if (n != prefixes.end())
-	{
-		if (n->second.size())
-		{
-			/* If the user has any prefixes, their highest prefix
-			 * will always be at the head of the list, as the list is
-			 * sorted in rank order highest first (see SetPrefix()
-			 * for reasons why)
-			 */
-			*pf = n->second.begin()->first;
-			return pf;
-		}
-	}
 
-	*pf = 0;
+	*pf = memb ? ServerInstance->Modes->GetPrefixChar(memb->prefixes) : 0;
 	return pf;
 }
 
 const char* chanrec::GetAllPrefixChars(userrec* user)
 {
-	static char prefix[MAXBUF];
-	int ctr = 0;
-	*prefix = 0;
+	return this->GetAllPrefixChars(members.find(user));
+}
 
-	prefixlist::iterator n = prefixes.find(user);
-	if (n != prefixes.end())
-	{
-		for (std::vector<prefixtype>::iterator x = n->second.begin(); x != n->second.end(); x++)
-		{
-			prefix[ctr++] = x->first;
-		}
-	}
+const char* chanrec::GetAllPrefixChars(Membership* memb)
+{
+	static char prefix[MAXBUF];
 
-	prefix[ctr] = 0;
+	if (memb)
+		ServerInstance->Modes->GetPrefixChars(memb->prefixes, prefix);
+	else
+		*prefix = 0;
 
 	return prefix;
 }
 
 unsigned int chanrec::GetPrefixValue(userrec* user)
 {
-	prefixlist::iterator n = prefixes.find(user);
-	if (n != prefixes.end())
-	{
-		if (n->second.size())
-			return n->second.begin()->second;
-	}
-	return 0;
+	Membership* m = members.find(user);
+	return m ? ServerInstance->Modes->GetPrefixRank(m->prefixes) : 0;
 }
 
 int chanrec::GetStatusFlags(userrec *user)
 {
-	UCListIter i = user->chans.find(this);
-	if (i != user->chans.end())
+	Membership* m = members.find(user);
+	if (m)
 	{
-		return i->second;
+		return m->status;
 	}
 	return 0;
 }
@@ -1008,18 +1151,18 @@ int chanrec::GetStatus(userrec *user)
 	if (ServerInstance->ULine(user->server))
 		return STATUS_OP;
 
-	UCListIter i = user->chans.find(this);
-	if (i != user->chans.end())
+	Membership* m = members.find(user);
+	if (m)
 	{
-		if ((i->second & UCMODE_OP) > 0)
+		if ((m->status & UCMODE_OP) > 0)
 		{
 			return STATUS_OP;
 		}
-		if ((i->second & UCMODE_HOP) > 0)
+		if ((m->status & UCMODE_HOP) > 0)
 		{
 			return STATUS_HOP;
 		}
-		if ((i->second & UCMODE_VOICE) > 0)
+		if ((m->status & UCMODE_VOICE) > 0)
 		{
 			return STATUS_VOICE;
 		}
@@ -1030,47 +1173,238 @@ int chanrec::GetStatus(userrec *user)
 
 void chanrec::SetPrefix(userrec* user, char prefix, unsigned int prefix_value, bool adding)
 {
-	prefixlist::iterator n = prefixes.find(user);
-	prefixtype pfx = std::make_pair(prefix,prefix_value);
-	if (adding)
+	Membership* m = members.find(user);
+	unsigned int bit = ServerInstance->Modes->GetPrefixBit(prefix);
+
+	if ((!m) || (!bit))
+		return;
+
+	unsigned int changed = adding ? (m->prefixes | bit) : (m->prefixes & ~bit);
+	if (changed != m->prefixes)
 	{
-		if (n != prefixes.end())
-		{
-			if (std::find(n->second.begin(), n->second.end(), pfx) == n->second.end())
-			{
-				n->second.push_back(pfx);
-				/* We must keep prefixes in rank order, largest first.
-				 * This is for two reasons, firstly because x-chat *ass-u-me's* this
-				 * state, and secondly it turns out to be a benefit to us later.
-				 * See above in GetPrefix().
-				 */
-				std::sort(n->second.begin(), n->second.end(), ModeParser::PrefixComparison);
-			}
-		}
+		m->prefixes = changed;
+		this->InvalidateNames();
+	}
+}
+
+void chanrec::RemoveAllPrefixes(userrec* user)
+{
+	Membership* m = members.find(user);
+	if ((m) && (m->prefixes))
+	{
+		m->prefixes = 0;
+		this->InvalidateNames();
+	}
+}
+
+
+chanrec::~chanrec()
+{
+	ServerInstance->Directory->Del(this);
+}
+
+ListCursor::ListCursor(const std::string &mask, long mi, long ma)
+	: minusers(mi), maxusers(ma), glob(mask), topics(false), started(false)
+{
+	prefix = mask.substr(0, mask.find_first_of("*?")).c_str();
+}
+
+ChannelDirectory::ChannelDirectory(InspIRCd* Instance) : ServerInstance(Instance), listers(0)
+{
+}
+
+void ChannelDirectory::Update(chanrec* chan)
+{
+	long users = chan->GetUserCounter();
+	std::map<chanrec*, Entry>::iterator i = entries.find(chan);
+
+	if (i == entries.end())
+	{
+		if (!users)
+			return;
+
+		irc::string name = chan->name;
+		Entry& e = entries[chan];
+		e.size = bysize.insert(std::make_pair(SizeKey(-users, name), chan)).first;
+		e.name = byname.insert(std::make_pair(name, chan)).first;
+		e.topic = bytopic.insert(std::make_pair(TopicKey(chan->topic, name), chan)).first;
+	}
+	else if (!users)
+	{
+		Del(chan);
+	}
+	else if (i->second.size->first.first != -users)
+	{
+		SizeKey key(-users, i->second.size->first.second);
+		bysize.erase(i->second.size);
+		i->second.size = bysize.insert(std::make_pair(key, chan)).first;
+	}
+}
+
+void ChannelDirectory::Retopic(chanrec* chan)
+{
+	std::map<chanrec*, Entry>::iterator i = entries.find(chan);
+	if (i == entries.end())
+		return;
+
+	TopicKey key(chan->topic, i->second.topic->first.second);
+	if (key == i->second.topic->first)
+		return;
+
+	bytopic.erase(i->second.topic);
+	i->second.topic = bytopic.insert(std::make_pair(key, chan)).first;
+}
+
+void ChannelDirectory::Del(chanrec* chan)
+{
+	std::map<chanrec*, Entry>::iterator i = entries.find(chan);
+	if (i == entries.end())
+		return;
+
+	bysize.erase(i->second.size);
+	byname.erase(i->second.name);
+	bytopic.erase(i->second.topic);
+	entries.erase(i);
+}
+
+size_t ChannelDirectory::SendChannel(userrec* user, ListCursor* cursor, chanrec* chan)
+{
+	char buffer[MAXBUF];
+	long users = chan->GetUserCounter();
+
+	if ((!users) || ((cursor->minusers) && (users <= cursor->minusers)) || ((cursor->maxusers) && (users >= cursor->maxusers)))
+		return 0;
+
+	if ((!cursor->glob.empty()) && (!match(chan->name, cursor->glob.c_str())) && ((!*chan->topic) || (!match(chan->topic, cursor->glob.c_str()))))
+		return 0;
+
+	/* Private channels are listed without their name, secret channels not
+	 * at all, unless the user is on them
+	 */
+	bool has_user = chan->HasUser(user);
+	int counter = 0;
+	if ((chan->IsModeSet('p')) && (!has_user))
+		counter = snprintf(buffer, MAXBUF, "322 %s *", user->nick);
+	else if ((!chan->IsModeSet('s')) || (has_user))
+		counter = snprintf(buffer, MAXBUF, "322 %s %s %ld :[+%s] %s", user->nick, chan->name, users, chan->ChanModes(has_user), chan->topic);
+	else
+		return 0;
+
+	user->WriteServ(std::string(buffer));
+	return counter + strlen(ServerInstance->Config->ServerName) + 4;
+}
+
+void ChannelDirectory::StartList(userrec* user, const std::string &mask, long minusers, long maxusers)
+{
+	if (user->listing)
+		return;
+
+	user->WriteServ("321 %s Channel :Users Name",user->nick);
+	user->listing = new ListCursor(mask, minusers, maxusers);
+	listers++;
+	ContinueList(user);
+}
+
+void ChannelDirectory::ContinueList(userrec* user)
+{
+	ListCursor* cursor = user->listing;
+	if (!cursor)
+		return;
+
+	/* Queue about a quarter of the user's sendq per batch, but always
+	 * at least one line so that the list moves on
+	 */
+	size_t budget = user->sendqmax / 4;
+	size_t sent = 0;
+
+	/* A module hooking the socket (such as TLS) does its own buffering, so
+	 * the sendq is always empty. Count what the module holds instead, and
+	 * wait for the next write event while it holds a batch or more.
+	 */
+	Module* hook = ServerInstance->Config->GetIOHook(user->GetPort());
+	if (hook)
+	{
+		size_t queued = hook->OnRawSocketQueued(user->GetFd());
+		if ((queued) && (queued >= budget))
+			return;
+		budget -= queued;
+	}
+
+	if (cursor->prefix.empty())
+	{
+		/* Largest channels first. A '<n' filter skips the start of the
+		 * size index, and a '>n' filter stops before its end.
+		 */
+		SizeIndex::iterator i;
+		if (cursor->started)
+			i = bysize.upper_bound(cursor->lastsize);
+		else if (cursor->maxusers)
+			i = bysize.lower_bound(SizeKey(1 - cursor->maxusers, ""));
 		else
+			i = bysize.begin();
+
+		for (; (i != bysize.end()) && ((!cursor->minusers) || (i->first.first < -cursor->minusers)); i++)
 		{
-			pfxcontainer one;
-			one.push_back(pfx);
-			prefixes.insert(std::make_pair<userrec*,pfxcontainer>(user, one));
+			if ((sent) && (sent >= budget))
+				return;
+			cursor->lastsize = i->first;
+			cursor->started = true;
+			sent += SendChannel(user, cursor, i->second);
 		}
 	}
 	else
 	{
-		if (n != prefixes.end())
+		/* Channels whose name starts with the literal part of the mask,
+		 * then those whose topic does, skipping any already sent by name
+		 */
+		size_t len = cursor->prefix.length();
+		if (!cursor->topics)
 		{
-			pfxcontainer::iterator x = std::find(n->second.begin(), n->second.end(), pfx);
-			if (x != n->second.end())
-				n->second.erase(x);
+			NameIndex::iterator i = cursor->started ? byname.upper_bound(cursor->lastname) : byname.lower_bound(cursor->prefix);
+			for (; (i != byname.end()) && (!i->first.compare(0, len, cursor->prefix)); i++)
+			{
+				if ((sent) && (sent >= budget))
+					return;
+				cursor->lastname = i->first;
+				cursor->started = true;
+				sent += SendChannel(user, cursor, i->second);
+			}
+			cursor->topics = true;
+			cursor->started = false;
+		}
+
+		TopicIndex::iterator i = cursor->started ? bytopic.upper_bound(cursor->lasttopic) : bytopic.lower_bound(TopicKey(cursor->prefix, ""));
+		for (; (i != bytopic.end()) && (!i->first.first.compare(0, len, cursor->prefix)); i++)
+		{
+			if ((sent) && (sent >= budget))
+				return;
+			cursor->lasttopic = i->first;
+			cursor->started = true;
+			if (i->first.second.compare(0, len, cursor->prefix))
+				sent += SendChannel(user, cursor, i->second);
 		}
 	}
+
+	user->WriteServ("323 %s :End of channel list.",user->nick);
+	EndList(user);
 }
 
-void chanrec::RemoveAllPrefixes(userrec* user)
+void ChannelDirectory::EndList(userrec* user)
 {
-	prefixlist::iterator n = prefixes.find(user);
-	if (n != prefixes.end())
+	if (user->listing)
 	{
-		prefixes.erase(n);
+		delete user->listing;
+		user->listing = NULL;
+		listers--;
 	}
 }
 
+int ChannelDirectory::GetListers()
+{
+	return listers;
+}
+
+size_t ChannelDirectory::size()
+{
+	return entries.size();
+}
@@ -28,8 +28,6 @@ CmdResult cmd_list::Handle (const char** parameters, int pcnt, userrec *user)
 {
 	int minusers = 0, maxusers = 0;
 
-	user->WriteServ("321 %s Channel :Users Name",user->nick);
-
 	/* Work around mIRC suckyness. YOU SUCK, KHALED! */
 	if (pcnt == 1)
 	{
@@ -45,41 +43,8 @@ CmdResult cmd_list::Handle (const char** parameters, int pcnt, userrec *user)
 		}
 	}
 
-	for (chan_hash::const_iterator i = ServerInstance->chanlist->begin(); i != ServerInstance->chanlist->end(); i++)
-	{
-		// attempt to match a glob pattern
-		long users = i->second->GetUserCounter();
-
-		bool too_few = (minusers && (users <= minusers));
-		bool too_many = (maxusers && (users >= maxusers));
-
-		if (too_many || too_few)
-			continue;
-
-		if (pcnt)
-		{
-			if (!match(i->second->name, parameters[0]) && !match(i->second->topic, parameters[0]))
-				continue;
-		}
-
-		// if the channel is not private/secret, OR the user is on the channel anyway
-		bool n = i->second->HasUser(user);
-		if ((i->second->IsModeSet('p')) && (!n))
-		{
-			if (users)
-				user->WriteServ("322 %s *",user->nick,i->second->name);
-		}
-		else
-		{
-			if (((!(i->second->IsModeSet('p'))) && (!(i->second->IsModeSet('p')))) || (n))
-			{
-				long users = i->second->GetUserCounter();
-				if (users)
-					user->WriteServ("322 %s %s %d :[+%s] %s",user->nick,i->second->name,users,i->second->ChanModes(n),i->second->topic);
-			}
-		}
-	}
-	user->WriteServ("323 %s :End of channel list.",user->nick);
+	/* The directory sends the list a batch at a time as the user's sendq drains */
+	ServerInstance->Directory->StartList(user, pcnt ? parameters[0] : "", minusers, maxusers);
 
 	return CMD_SUCCESS;
 }
@@ -136,38 +136,22 @@ CmdResult cmd_nick::Handle (const char** parameters, int pcnt, userrec *user)
 	strlcpy(user->nick, parameters[0], NICKMAX - 1);
 
 	user->InvalidateCache();
-
-	/* Update display nicks */
-	for (UCListIter v = user->chans.begin(); v != user->chans.end(); v++)
-	{
-		CUList* ulist = v->first->GetUsers();
-		CUList::iterator i = ulist->find(user);
-		if (i != ulist->end())
-			i->second = user->nick;
-	}
+	ServerInstance->Indexes->Update(user);
 
 	if (user->registered < REG_NICKUSER)
 	{
 		user->registered = (user->registered | REG_NICK);
 
-		if (ServerInstance->Config->NoUserDns)
+		/* The hostname lookup started when the user connected */
+		if (user->dns_done)
 		{
-			user->dns_done = true;
-			ServerInstance->next_call = ServerInstance->Time();
+			/* Cached result, instant failure or lookups off - fall right through if possible */
+			ServerInstance->ConnectWhenReady(user);
 		}
 		else
 		{
-			user->StartDNSLookup();
-			if (user->dns_done)
-			{
-				/* Cached result or instant failure - fall right through if possible */
-				ServerInstance->next_call = ServerInstance->Time();
-			}
-			else
-			{
-				if (ServerInstance->next_call > ServerInstance->Time() + ServerInstance->Config->dns_timeout)
-					ServerInstance->next_call = ServerInstance->Time() + ServerInstance->Config->dns_timeout;
-			}
+			if (ServerInstance->next_call > user->signon)
+				ServerInstance->next_call = user->signon;
 		}
 	}
 	if (user->registered == REG_NICKUSER)
@@ -38,8 +38,7 @@ CmdResult cmd_rehash::Handle (const char** parameters, int pcnt, userrec *user)
 		ServerInstance->WriteOpers("*** %s is rehashing config file %s",user->nick,ServerConfig::CleanFilename(ServerInstance->ConfigFileName));
 		ServerInstance->CloseLog();
 		ServerInstance->OpenLog(ServerInstance->Config->argv, ServerInstance->Config->argc);
-		ServerInstance->RehashUsersAndChans();
-		FOREACH_MOD(I_OnGarbageCollect, OnGarbageCollect());
+		ServerInstance->GarbageCollect();
 		ServerInstance->Config->Read(false,user);
 		ServerInstance->Res->Rehash();
 		ServerInstance->ResetMaxBans();
@@ -25,6 +25,7 @@
 #include "users.h"
 #include "modules.h"
 #include "xline.h"
+#include "slabpool.h"
 #include "commands/cmd_stats.h"
 #include "commands/cmd_whowas.h"
 
@@ -47,6 +48,21 @@ CmdResult cmd_stats::Handle (const char** parameters, int pcnt, userrec *user)
 	return CMD_SUCCESS;
 }
 
+/** Describe a latency histogram as its sample count and percentiles */
+static std::string LatencySummary(const LatencyHistogram &h)
+{
+	std::string summary = ConvToStr(h.samples);
+	if (!h.samples)
+		return summary;
+	const int percents[] = { 50, 90, 99 };
+	for (int i = 0; i < 3; i++)
+	{
+		unsigned long bound = h.Percentile(percents[i]);
+		summary.append(" p" + ConvToStr(percents[i]) + (bound ? " <" + ConvToStr(bound) : " >=" + ConvToStr(1UL << (LatencyHistogram::BUCKETS - 2))) + "ms");
+	}
+	return summary;
+}
+
 DllExport void DoStats(InspIRCd* ServerInstance, char statschar, userrec* user, string_list &results)
 {
 	std::string sn = ServerInstance->Config->ServerName;
@@ -176,6 +192,10 @@ DllExport void DoStats(InspIRCd* ServerInstance, char statschar, userrec* user,
 			results.push_back(sn+" 249 "+user->nick+" :Channels(HASH_MAP) "+ConvToStr(ServerInstance->chanlist->size())+" ("+ConvToStr(ServerInstance->chanlist->size()*sizeof(chanrec))+" bytes)");
 			results.push_back(sn+" 249 "+user->nick+" :Commands(VECTOR) "+ConvToStr(ServerInstance->Parser->cmdlist.size())+" ("+ConvToStr(ServerInstance->Parser->cmdlist.size()*sizeof(command_t))+" bytes)");
 
+			for (SlabPool* pool = SlabPool::GetFirst(); pool; pool = pool->GetNext())
+				results.push_back(sn+" 249 "+user->nick+" :Pool("+pool->GetName()+") "+ConvToStr(pool->GetLive())+" live, "+ConvToStr(pool->GetFree())+" free, "+ConvToStr(pool->GetHighWater())+" peak ("+ConvToStr(pool->GetBytes())+" bytes)");
+			results.push_back(sn+" 249 "+user->nick+" :Strings(SET) "+ConvToStr(ServerInstance->Strings->size())+" ("+ConvToStr(ServerInstance->Strings->GetBytes())+" bytes)");
+
 			if (!ServerInstance->Config->WhoWasGroupSize == 0 && !ServerInstance->Config->WhoWasMaxGroups == 0)
 			{
 				command_t* whowas_command = ServerInstance->Parser->GetHandler("WHOWAS");
@@ -235,7 +255,27 @@ DllExport void DoStats(InspIRCd* ServerInstance, char statschar, userrec* user,
 			results.push_back(sn+" 249 "+user->nick+" :unknown commands "+ConvToStr(ServerInstance->stats->statsUnknown));
 			results.push_back(sn+" 249 "+user->nick+" :nick collisions "+ConvToStr(ServerInstance->stats->statsCollisions));
 			results.push_back(sn+" 249 "+user->nick+" :dns requests "+ConvToStr(ServerInstance->stats->statsDnsGood+ServerInstance->stats->statsDnsBad)+" succeeded "+ConvToStr(ServerInstance->stats->statsDnsGood)+" failed "+ConvToStr(ServerInstance->stats->statsDnsBad));
+			results.push_back(sn+" 249 "+user->nick+" :dns in flight "+ConvToStr(ServerInstance->Res->GetInFlight())+" coalesced "+ConvToStr(ServerInstance->Res->GetCoalesced())+
+					" retransmitted "+ConvToStr(ServerInstance->Res->GetRetransmits())+" tcp "+ConvToStr(ServerInstance->Res->GetTCPQueries()));
+			const DNSCache* dc = ServerInstance->Res->GetCacheStats();
+			results.push_back(sn+" 249 "+user->nick+" :dns cache "+ConvToStr(dc->size())+"/"+ConvToStr(dc->GetMaxSize())+" hits "+ConvToStr(dc->GetHits())+" negative "+ConvToStr(dc->GetNegativeHits())+
+					" misses "+ConvToStr(dc->GetMisses())+" evicted "+ConvToStr(dc->GetEvictions()));
+			dc = ServerInstance->Res->GetConfirmedStats();
+			results.push_back(sn+" 249 "+user->nick+" :dns confirmed hosts "+ConvToStr(dc->size())+"/"+ConvToStr(dc->GetMaxSize())+" hits "+ConvToStr(dc->GetHits())+" mismatched "+ConvToStr(dc->GetNegativeHits())+
+					" misses "+ConvToStr(dc->GetMisses()));
+			results.push_back(sn+" 249 "+user->nick+" :dns latency reverse "+LatencySummary(ServerInstance->stats->statsDnsReverse));
+			results.push_back(sn+" 249 "+user->nick+" :dns latency forward "+LatencySummary(ServerInstance->stats->statsDnsForward));
+			results.push_back(sn+" 249 "+user->nick+" :dns latency connect "+LatencySummary(ServerInstance->stats->statsDnsConnect));
+			for (std::vector<NameServer>::iterator ns = ServerInstance->Res->servers.begin(); ns != ServerInstance->Res->servers.end(); ns++)
+			{
+				snprintf(buffer,MAXBUF," 249 %s :dns server %s rtt %lu.%03lums sent %lu answered %lu%s",user->nick,ns->address.c_str(),ns->srtt / 1000,ns->srtt % 1000,
+						ns->sent,ns->answered,ns->IsAnswering(ServerInstance->Time()) ? "" : " not answering");
+				results.push_back(sn+buffer);
+			}
 			results.push_back(sn+" 249 "+user->nick+" :connection count "+ConvToStr(ServerInstance->stats->statsConnects));
+			results.push_back(sn+" 249 "+user->nick+" :admission accepted "+ConvToStr(ServerInstance->Admission->GetCount(ADMIT_OK))+" zlined "+ConvToStr(ServerInstance->Admission->GetCount(ADMIT_ZLINED))+" denied "+ConvToStr(ServerInstance->Admission->GetCount(ADMIT_DENIED))+
+					" localmax "+ConvToStr(ServerInstance->Admission->GetCount(ADMIT_LOCALCLONES))+" globalmax "+ConvToStr(ServerInstance->Admission->GetCount(ADMIT_GLOBALCLONES))+
+					" throttled ip "+ConvToStr(ServerInstance->Admission->GetCount(ADMIT_THROTTLE_IP))+" cidr "+ConvToStr(ServerInstance->Admission->GetCount(ADMIT_THROTTLE_CIDR)));
 			snprintf(buffer,MAXBUF," 249 %s :bytes sent %5.2fK recv %5.2fK",user->nick,ServerInstance->stats->statsSent / 1024,ServerInstance->stats->statsRecv / 1024);
 			results.push_back(sn+buffer);
 		}
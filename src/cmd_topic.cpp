@@ -101,6 +101,7 @@ CmdResult cmd_topic::Handle (const char** parameters, int pcnt, userrec *user)
 				strlcpy(Ptr->setby,user->nick,127);
 
 			Ptr->topicset = ServerInstance->Time();
+			ServerInstance->Directory->Retopic(Ptr);
 			Ptr->WriteChannel(user, "TOPIC %s :%s", Ptr->name, Ptr->topic);
 
 			if (IS_LOCAL(user))
@@ -58,8 +58,10 @@ CmdResult cmd_user::Handle (const char** parameters, int pcnt, userrec *user)
 	{
 		int MOD_RESULT = 0;
 		/* user is registered now, bit 0 = USER command, bit 1 = sent a NICK command */
-		if (ServerInstance->next_call > ServerInstance->Time() + ServerInstance->Config->dns_timeout)
-			ServerInstance->next_call = ServerInstance->Time() + ServerInstance->Config->dns_timeout;
+		if (user->dns_done)
+			ServerInstance->ConnectWhenReady(user);
+		else if (ServerInstance->next_call > user->signon)
+			ServerInstance->next_call = user->signon;
 		FOREACH_RESULT(I_OnUserRegister,OnUserRegister(user));
 		if (MOD_RESULT > 0)
 			return CMD_FAILURE;
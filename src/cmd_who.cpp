@@ -24,8 +24,8 @@ static char *getlastchanname(userrec *u)
 	UCListIter i = u->chans.begin();
 	if (i != u->chans.end())
 	{
-		if (!i->first->IsModeSet('s'))
-			return i->first->name;
+		if (!(*i)->chan->IsModeSet('s'))
+			return (*i)->chan->name;
 	}
 
 	return "*";
@@ -261,19 +261,21 @@ CmdResult cmd_who::Handle (const char** parameters, int pcnt, userrec *user)
 			bool inside = ch->HasUser(user);
 	
 			/* who on a channel. */
-			CUList *cu = ch->GetUsers();
+			MemberList *cu = ch->GetUsers();
 	
-			for (CUList::iterator i = cu->begin(); i != cu->end(); i++)
+			for (MemberList::iterator i = cu->begin(); i != cu->end(); i++)
 			{
+				userrec* u = (*i)->user;
+
 				/* opers only, please */
-				if (opt_viewopersonly && !IS_OPER(i->first))
+				if (opt_viewopersonly && !IS_OPER(u))
 					continue;
 	
 				/* If we're not inside the channel, hide +i users */
-				if (i->first->IsModeSet('i') && !inside)
+				if (u->IsModeSet('i') && !inside)
 					continue;
 	
-				SendWhoLine(user, initial, ch, i->first, whoresults);
+				SendWhoLine(user, initial, ch, u, whoresults);
 			}
 		}
 	}
@@ -299,14 +301,43 @@ CmdResult cmd_who::Handle (const char** parameters, int pcnt, userrec *user)
 		}
 		else
 		{
-			for (user_hash::iterator i = ServerInstance->clientlist->begin(); i != ServerInstance->clientlist->end(); i++)
+			/* When only nicks, hosts and servers are being matched, the user
+			 * indexes can narrow the search down to the users which might match.
+			 * Otherwise search local users for 'l', or everyone.
+			 */
+			std::vector<userrec*> candidates;
+			std::vector<userrec*>* search = NULL;
+
+			if ((!opt_realname) && (!opt_mode) && (!opt_metadata) && (!opt_ident) && (!opt_port) && (!opt_away) &&
+					(ServerInstance->Indexes->Candidates(matchtext, opt_showrealhost, candidates)))
+				search = &candidates;
+			else if (opt_local)
+				search = &ServerInstance->local_users;
+
+			if (search)
 			{
-				if (whomatch(i->second, matchtext))
+				for (std::vector<userrec*>::iterator i = search->begin(); i != search->end(); i++)
 				{
-					if ((i->second->IsModeSet('i')) && (!IS_OPER(user)))
-						continue;
+					if (whomatch(*i, matchtext))
+					{
+						if (((*i)->IsModeSet('i')) && (!IS_OPER(user)))
+							continue;
+
+						SendWhoLine(user, initial, NULL, *i, whoresults);
+					}
+				}
+			}
+			else
+			{
+				for (user_hash::iterator i = ServerInstance->clientlist->begin(); i != ServerInstance->clientlist->end(); i++)
+				{
+					if (whomatch(i->second, matchtext))
+					{
+						if ((i->second->IsModeSet('i')) && (!IS_OPER(user)))
+							continue;
 
-					SendWhoLine(user, initial, NULL, i->second, whoresults);
+						SendWhoLine(user, initial, NULL, i->second, whoresults);
+					}
 				}
 			}
 		}
@@ -24,8 +24,9 @@ extern "C" DllExport command_t* init_command(InspIRCd* Instance)
 }
 
 cmd_whowas::cmd_whowas(InspIRCd* Instance)
-: command_t(Instance, "WHOWAS", 0, 1)
+: command_t(Instance, "WHOWAS", 0, 1), oldest(NULL), newest(NULL), freelist(NULL), allocated(0), used(0)
 {
+	capacity = Instance->Config->WhoWasMaxMemory / sizeof(WhoWasGroup);
 	syntax = "<nick>{,<nick>}";
 	timer = new WhoWasMaintainTimer(Instance, 3600);
 	Instance->Timers->AddTimer(timer);
@@ -50,38 +51,27 @@ CmdResult cmd_whowas::Handle (const char** parameters, int pcnt, userrec* user)
 	}
 	else
 	{
-		whowas_set* grp = i->second;
-		if (grp->size())
+		for (WhoWasGroup* u = i->second.oldest; u; u = u->newer)
 		{
-			for (whowas_set::iterator ux = grp->begin(); ux != grp->end(); ux++)
-			{
-				WhoWasGroup* u = *ux;
-				time_t rawtime = u->signon;
-				tm *timeinfo;
-				char b[MAXBUF];
-	
-				timeinfo = localtime(&rawtime);
-				
-				/* XXX - 'b' could be only 25 chars long and then strlcpy() would terminate it for us too? */
-				strlcpy(b,asctime(timeinfo),MAXBUF);
-				b[24] = 0;
-
-				user->WriteServ("314 %s %s %s %s * :%s",user->nick,parameters[0],u->ident,u->dhost,u->gecos);
-				
-				if (IS_OPER(user))
-					user->WriteServ("379 %s %s :was connecting from *@%s", user->nick, parameters[0], u->host);
-				
-				if (*ServerInstance->Config->HideWhoisServer && !IS_OPER(user))
-					user->WriteServ("312 %s %s %s :%s",user->nick,parameters[0], ServerInstance->Config->HideWhoisServer, b);
-				else
-					user->WriteServ("312 %s %s %s :%s",user->nick,parameters[0], u->server, b);
-			}
-		}
-		else
-		{
-			user->WriteServ("406 %s %s :There was no such nickname",user->nick,parameters[0]);
-			user->WriteServ("369 %s %s :End of WHOWAS",user->nick,parameters[0]);
-			return CMD_FAILURE;
+			time_t rawtime = u->signon;
+			tm *timeinfo;
+			char b[MAXBUF];
+
+			timeinfo = localtime(&rawtime);
+			
+			/* XXX - 'b' could be only 25 chars long and then strlcpy() would terminate it for us too? */
+			strlcpy(b,asctime(timeinfo),MAXBUF);
+			b[24] = 0;
+
+			user->WriteServ("314 %s %s %s %s * :%s",user->nick,parameters[0],u->ident,u->dhost,u->gecos);
+			
+			if (IS_OPER(user))
+				user->WriteServ("379 %s %s :was connecting from *@%s", user->nick, parameters[0], u->host);
+			
+			if (*ServerInstance->Config->HideWhoisServer && !IS_OPER(user))
+				user->WriteServ("312 %s %s %s :%s",user->nick,parameters[0], ServerInstance->Config->HideWhoisServer, b);
+			else
+				user->WriteServ("312 %s %s %s :%s",user->nick,parameters[0], u->server, b);
 		}
 	}
 
@@ -109,6 +99,10 @@ CmdResult cmd_whowas::HandleInternal(const unsigned int id, const std::deque<cla
 			MaintainWhoWas(ServerInstance->Time());
 		break;
 
+		case WHOWAS_RESIZE:
+			Resize(ServerInstance->Time());
+		break;
+
 		default:
 		break;
 	}
@@ -117,160 +111,191 @@ CmdResult cmd_whowas::HandleInternal(const unsigned int id, const std::deque<cla
 
 void cmd_whowas::GetStats(Extensible* ext)
 {
-	int whowas_size = 0;
-	int whowas_bytes = 0;
-	whowas_users_fifo::iterator iter;
-	for (iter = whowas_fifo.begin(); iter != whowas_fifo.end(); iter++)
-	{
-		whowas_set* n = (whowas_set*)whowas.find(iter->second)->second;
-		if (n->size())
-		{
-			whowas_size += n->size();
-			whowas_bytes += (sizeof(whowas_set) + ( sizeof(WhoWasGroup) * n->size() ) );
-		}
-	}
-	stats.assign("Whowas(MAPSETS) " +ConvToStr(whowas_size)+" ("+ConvToStr(whowas_bytes)+" bytes)");
+	stats.assign("Whowas(SLAB) " + ConvToStr(used) + "/" + ConvToStr(capacity) + " (" + ConvToStr(allocated * sizeof(WhoWasGroup)) + " bytes)");
 	ext->Extend("stats", stats.c_str());
 }
 
-void cmd_whowas::AddToWhoWas(userrec* user)
+WhoWasGroup* cmd_whowas::Alloc()
 {
-	/* if whowas disabled */
-	if (ServerInstance->Config->WhoWasGroupSize == 0 || ServerInstance->Config->WhoWasMaxGroups == 0)
+	if ((!freelist) && (allocated < capacity))
 	{
-		return;
+		size_t n = std::min(SlabSize, capacity - allocated);
+		WhoWasGroup* slab = new WhoWasGroup[n];
+		slabs.push_back(slab);
+		allocated += n;
+		for (size_t i = 0; i < n; i++)
+		{
+			slab[i].next = freelist;
+			freelist = &slab[i];
+		}
 	}
 
-	whowas_users::iterator iter = whowas.find(user->nick);
-
-	if (iter == whowas.end())
+	if (!freelist)
 	{
-		whowas_set* n = new whowas_set;
-		WhoWasGroup *a = new WhoWasGroup(user);
-		n->push_back(a);
-		whowas[user->nick] = n;
-		whowas_fifo.push_back(std::make_pair(ServerInstance->Time(),user->nick));
-
-		if ((int)(whowas.size()) > ServerInstance->Config->WhoWasMaxGroups)
-		{
-			whowas_users::iterator iter = whowas.find(whowas_fifo[0].second);
-			if (iter != whowas.end())
-			{
-				whowas_set* n = (whowas_set*)iter->second;
-				if (n->size())
-				{
-					while (n->begin() != n->end())
-					{
-						WhoWasGroup *a = *(n->begin());
-						DELETE(a);
-						n->pop_front();
-					}
-				}
-				DELETE(n);
-				whowas.erase(iter);
-			}
-			whowas_fifo.pop_front();
-		}
+		/* At capacity, so the oldest entry makes way */
+		if (!oldest)
+			return NULL;
+		Release(oldest);
 	}
+
+	WhoWasGroup* a = freelist;
+	freelist = a->next;
+	return a;
+}
+
+void cmd_whowas::Release(WhoWasGroup* a)
+{
+	if (a->prev)
+		a->prev->next = a->next;
+	else
+		oldest = a->next;
+	if (a->next)
+		a->next->prev = a->prev;
 	else
+		newest = a->prev;
+
+	whowas_users::iterator i = whowas.find(a->nick);
+	if (i != whowas.end())
 	{
-		whowas_set* group = (whowas_set*)iter->second;
-		WhoWasGroup *a = new WhoWasGroup(user);
-		group->push_back(a);
+		whowas_set& n = i->second;
+		if (a->older)
+			a->older->newer = a->newer;
+		else
+			n.oldest = a->newer;
+		if (a->newer)
+			a->newer->older = a->older;
+		else
+			n.newest = a->older;
+		if (!--n.count)
+			whowas.erase(i);
+	}
 
-		if ((int)(group->size()) > ServerInstance->Config->WhoWasGroupSize)
-		{
-			WhoWasGroup *a = (WhoWasGroup*)*(group->begin());
-			DELETE(a);
-			group->pop_front();
-		}
+	a->next = freelist;
+	freelist = a;
+	used--;
+}
+
+void cmd_whowas::ReleaseNick(const char* nick)
+{
+	whowas_users::iterator i = whowas.find(nick);
+	while (i != whowas.end())
+	{
+		/* Releasing the last entry removes the nickname */
+		Release(i->second.oldest);
+		i = whowas.find(nick);
 	}
 }
 
-/* on rehash, refactor maps according to new conf values */
-void cmd_whowas::PruneWhoWas(time_t t)
+void cmd_whowas::Insert(const WhoWasGroup& entry)
 {
-	/* config values */
 	int groupsize = ServerInstance->Config->WhoWasGroupSize;
 	int maxgroups = ServerInstance->Config->WhoWasMaxGroups;
-	int maxkeep =   ServerInstance->Config->WhoWasMaxKeep;
 
-	/* first cut the list to new size (maxgroups) and also prune entries that are timed out. */
-	whowas_users::iterator iter;
-	int fifosize;
-	while ((fifosize = (int)whowas_fifo.size()) > 0)
+	whowas_users::iterator i = whowas.find(entry.nick);
+	if ((i != whowas.end()) && (i->second.count >= groupsize))
 	{
-		if (fifosize > maxgroups || whowas_fifo[0].first < t - maxkeep)
-		{
-			iter = whowas.find(whowas_fifo[0].second);
-			/* hopefully redundant integrity check, but added while debugging r6216 */
-			if (iter == whowas.end())
-			{
-				/* this should never happen, if it does maps are corrupt */
-				ServerInstance->Log(DEFAULT, "BUG: Whowas maps got corrupted! (1)");
-				return;
-			}
-			whowas_set* n = (whowas_set*)iter->second;
-			if (n->size())
-			{
-				while (n->begin() != n->end())
-				{
-					WhoWasGroup *a = *(n->begin());
-					DELETE(a);
-					n->pop_front();
-				}
-			}
-			DELETE(n);
-			whowas.erase(iter);
-			whowas_fifo.pop_front();
-		}
-		else
-			break;
+		Release(i->second.oldest);
+		i = whowas.find(entry.nick);
 	}
 
-	/* Then cut the whowas sets to new size (groupsize) */
-	fifosize = (int)whowas_fifo.size();
-	for (int i = 0; i < fifosize; i++)
+	/* A new nickname pushes out the nickname of the oldest entry */
+	if ((i == whowas.end()) && (oldest) && ((int)whowas.size() >= maxgroups))
 	{
-		iter = whowas.find(whowas_fifo[0].second);
-		/* hopefully redundant integrity check, but added while debugging r6216 */
-		if (iter == whowas.end())
-		{
-			/* this should never happen, if it does maps are corrupt */
-			ServerInstance->Log(DEFAULT, "BUG: Whowas maps got corrupted! (2)");
-			return;
-		}
-		whowas_set* n = (whowas_set*)iter->second;
-		if (n->size())
-		{
-			int nickcount = n->size();
-			while (n->begin() != n->end() && nickcount > groupsize)
-			{
-				WhoWasGroup *a = *(n->begin());
-				DELETE(a);
-				n->pop_front();
-				nickcount--;
-			}
-		}
+		char nick[NICKMAX];
+		strlcpy(nick, oldest->nick, NICKMAX);
+		ReleaseNick(nick);
 	}
+
+	WhoWasGroup* a = Alloc();
+	if (!a)
+		return;
+
+	*a = entry;
+	a->prev = newest;
+	a->next = NULL;
+	if (newest)
+		newest->next = a;
+	else
+		oldest = a;
+	newest = a;
+
+	whowas_set& n = whowas[a->nick];
+	a->older = n.newest;
+	a->newer = NULL;
+	if (n.newest)
+		n.newest->newer = a;
+	else
+		n.oldest = a;
+	n.newest = a;
+	n.count++;
+	used++;
 }
 
-/* call maintain once an hour to remove expired nicks */
-void cmd_whowas::MaintainWhoWas(time_t t)
+void cmd_whowas::AddToWhoWas(userrec* user)
 {
-	for (whowas_users::iterator iter = whowas.begin(); iter != whowas.end(); iter++)
+	/* if whowas disabled */
+	if (ServerInstance->Config->WhoWasGroupSize == 0 || ServerInstance->Config->WhoWasMaxGroups == 0)
 	{
-		whowas_set* n = (whowas_set*)iter->second;
-		if (n->size())
-		{
-			while ((n->begin() != n->end()) && ((*n->begin())->signon < t - ServerInstance->Config->WhoWasMaxKeep))
-			{
-				WhoWasGroup *a = *(n->begin());
-				DELETE(a);
-				n->erase(n->begin());
-			}
-		}
+		return;
 	}
+
+	WhoWasGroup entry;
+	entry.Set(user, ServerInstance->Time());
+	Insert(entry);
+}
+
+void cmd_whowas::Clear()
+{
+	for (WhoWasGroup* a = oldest; a; a = a->next)
+		whowas.erase(a->nick);
+	for (std::vector<WhoWasGroup*>::iterator i = slabs.begin(); i != slabs.end(); i++)
+		delete[] *i;
+	slabs.clear();
+	oldest = newest = freelist = NULL;
+	allocated = used = 0;
+}
+
+/* on rehash, refactor the list according to new conf values */
+void cmd_whowas::PruneWhoWas(time_t t)
+{
+	/* Take a copy of everything, then add it all back under the new limits.
+	 * This only happens on rehash, and lets a smaller maxmemory hand back
+	 * the slabs it no longer needs.
+	 */
+	std::vector<WhoWasGroup> entries;
+	entries.reserve(used);
+	for (WhoWasGroup* a = oldest; a; a = a->next)
+		entries.push_back(*a);
+
+	Clear();
+	capacity = ServerInstance->Config->WhoWasMaxMemory / sizeof(WhoWasGroup);
+
+	if (ServerInstance->Config->WhoWasGroupSize == 0 || ServerInstance->Config->WhoWasMaxGroups == 0)
+		return;
+
+	for (std::vector<WhoWasGroup>::iterator i = entries.begin(); i != entries.end(); i++)
+		Insert(*i);
+
+	MaintainWhoWas(t);
+}
+
+/* on rehash (and the first read of the config, after we were constructed
+ * with no limit), take up the new maxmemory. Slabs are only allocated as
+ * they are needed, so a larger limit needs nothing more.
+ */
+void cmd_whowas::Resize(time_t t)
+{
+	capacity = ServerInstance->Config->WhoWasMaxMemory / sizeof(WhoWasGroup);
+
+	if (allocated > capacity)
+		PruneWhoWas(t);
+}
+
+/* call maintain once an hour to remove expired nicks */
+void cmd_whowas::MaintainWhoWas(time_t t)
+{
+	while ((oldest) && (oldest->added < t - ServerInstance->Config->WhoWasMaxKeep))
+		Release(oldest);
 }
 
 cmd_whowas::~cmd_whowas()
@@ -280,53 +305,19 @@ cmd_whowas::~cmd_whowas()
 		ServerInstance->Timers->DelTimer(timer);
 	}
 
-	whowas_users::iterator iter;
-	int fifosize;
-	while ((fifosize = (int)whowas_fifo.size()) > 0)
-	{
-		iter = whowas.find(whowas_fifo[0].second);
-		/* hopefully redundant integrity check, but added while debugging r6216 */
-		if (iter == whowas.end())
-		{
-			/* this should never happen, if it does maps are corrupt */
-			ServerInstance->Log(DEFAULT, "BUG: Whowas maps got corrupted! (3)");
-			return;
-		}
-		whowas_set* n = (whowas_set*)iter->second;
-		if (n->size())
-		{
-			while (n->begin() != n->end())
-			{
-				WhoWasGroup *a = *(n->begin());
-				DELETE(a);
-				n->pop_front();
-			}
-		}
-		DELETE(n);
-		whowas.erase(iter);
-		whowas_fifo.pop_front();
-	}
-}
-
-WhoWasGroup::WhoWasGroup(userrec* user) : host(NULL), dhost(NULL), ident(NULL), server(NULL), gecos(NULL), signon(user->signon)
-{
-	this->host = strdup(user->host);
-	this->dhost = strdup(user->dhost);
-	this->ident = strdup(user->ident);
-	this->server = user->server;
-	this->gecos = strdup(user->fullname);
+	Clear();
 }
 
-WhoWasGroup::~WhoWasGroup()
+void WhoWasGroup::Set(userrec* user, time_t now)
 {
-	if (host)
-		free(host);
-	if (dhost)
-		free(dhost);
-	if (ident)
-		free(ident);
-	if (gecos)
-		free(gecos);
+	strlcpy(nick, user->nick, NICKMAX);
+	strlcpy(host, user->host, sizeof(host));
+	strlcpy(dhost, user->dhost, sizeof(dhost));
+	strlcpy(ident, user->ident, sizeof(ident));
+	server = user->server;
+	strlcpy(gecos, user->fullname, sizeof(gecos));
+	signon = user->signon;
+	added = now;
 }
 
 /* every hour, run this function which removes all entries older than Config->WhoWasMaxKeep */
@@ -29,13 +29,18 @@ ServerConfig::ServerConfig(InspIRCd* Instance) : ServerInstance(Instance)
 	*DefaultModes = *CustomVersion = *motd = *rules = *PrefixQuit = *DieValue = *DNSServer = '\0';
 	*UserStats = *ModPath = *MyExecutable = *DisabledCommands = *PID = *SuffixQuit = '\0';
 	WhoWasGroupSize = WhoWasMaxGroups = WhoWasMaxKeep = 0;
+	WhoWasMaxMemory = 0;
 	log_file = NULL;
 	NoUserDns = forcedebug = OperSpyWhois = nofork = HideBans = HideSplits = UndernetMsgPrefix = false;
-	CycleHosts = writelog = AllowHalfop = true;
+	CycleHosts = writelog = AllowHalfop = ReleaseSlabs = true;
 	dns_timeout = DieDelay = 5;
+	dns_cachesize = 10000;
 	MaxTargets = 20;
 	NetBufferSize = 10240;
 	SoftLimit = MAXCLIENTS;
+	ThrottleIPBurst = ThrottleIPRate = ThrottleCIDRBurst = ThrottleCIDRRate = 0;
+	ThrottleIPv4CIDR = 24;
+	ThrottleIPv6CIDR = 64;
 	MaxConn = SOMAXCONN;
 	MaxWhoResults = 0;
 	debugging = 0;
@@ -226,32 +231,37 @@ bool ValidateDnsServer(ServerConfig* conf, const char* tag, const char* value, V
 		conf->GetInstance()->Log(DEFAULT,"WARNING: <dns:server> not defined, attempting to find working server in the registry...");
 		nameserver = FindNameServerWin();
 		/* Windows stacks multiple nameservers in one registry key, seperated by commas.
-		 * Spotted by Cataclysm.
+		 * Spotted by Cataclysm. We want them all, seperated by spaces.
 		 */
-		if (nameserver.find(',') != std::string::npos)
-			nameserver = nameserver.substr(0, nameserver.find(','));
+		for (std::string::iterator i = nameserver.begin(); i != nameserver.end(); i++)
+			if (*i == ',')
+				*i = ' ';
 		data.Set(nameserver.c_str());
-		conf->GetInstance()->Log(DEFAULT,"<dns:server> set to '%s' as first active resolver in registry.", nameserver.c_str());
+		conf->GetInstance()->Log(DEFAULT,"<dns:server> set to '%s' as active resolvers in registry.", nameserver.c_str());
 #else
 		// attempt to look up their nameserver from /etc/resolv.conf
 		conf->GetInstance()->Log(DEFAULT,"WARNING: <dns:server> not defined, attempting to find working server in /etc/resolv.conf...");
 		ifstream resolv("/etc/resolv.conf");
-		bool found_server = false;
+		std::string servers;
 
 		if (resolv.is_open())
 		{
 			while (resolv >> nameserver)
 			{
-				if ((nameserver == "nameserver") && (!found_server))
+				if ((nameserver == "nameserver") && (resolv >> nameserver))
 				{
-					resolv >> nameserver;
-					data.Set(nameserver.c_str());
-					found_server = true;
-					conf->GetInstance()->Log(DEFAULT,"<dns:server> set to '%s' as first resolver in /etc/resolv.conf.",nameserver.c_str());
+					if (!servers.empty())
+						servers.append(" ");
+					servers.append(nameserver);
 				}
 			}
 
-			if (!found_server)
+			if (!servers.empty())
+			{
+				data.Set(servers.c_str());
+				conf->GetInstance()->Log(DEFAULT,"<dns:server> set to '%s' as resolvers in /etc/resolv.conf.",servers.c_str());
+			}
+			else
 			{
 				conf->GetInstance()->Log(DEFAULT,"/etc/resolv.conf contains no viable nameserver entries! Defaulting to nameserver '127.0.0.1'!");
 				data.Set("127.0.0.1");
@@ -305,6 +315,26 @@ bool ValidateMaxWho(ServerConfig* conf, const char* tag, const char* value, Valu
 	return true;
 }
 
+bool ValidateThrottleIPv4CIDR(ServerConfig* conf, const char* tag, const char* value, ValueItem &data)
+{
+	if ((data.GetInteger() > 32) || (data.GetInteger() < 1))
+	{
+		conf->GetInstance()->Log(DEFAULT,"<connthrottle:ipv4cidr> out of range, setting to default of 24.");
+		data.Set(24);
+	}
+	return true;
+}
+
+bool ValidateThrottleIPv6CIDR(ServerConfig* conf, const char* tag, const char* value, ValueItem &data)
+{
+	if ((data.GetInteger() > 128) || (data.GetInteger() < 1))
+	{
+		conf->GetInstance()->Log(DEFAULT,"<connthrottle:ipv6cidr> out of range, setting to default of 64.");
+		data.Set(64);
+	}
+	return true;
+}
+
 bool ValidateLogLevel(ServerConfig* conf, const char* tag, const char* value, ValueItem &data)
 {
 	std::string dbg = data.GetString();
@@ -387,6 +417,21 @@ bool ValidateWhoWas(ServerConfig* conf, const char* tag, const char* value, Valu
 	return true;
 }
 
+bool ValidateWhoWasMemory(ServerConfig* conf, const char* tag, const char* value, ValueItem &data)
+{
+	/* Validators run before the value is stored, so set it here for the whowas command to size itself from */
+	conf->WhoWasMaxMemory = data.GetInteger();
+
+	command_t* whowas_command = conf->GetInstance()->Parser->GetHandler("WHOWAS");
+	if (whowas_command)
+	{
+		std::deque<classbase*> params;
+		whowas_command->HandleInternal(WHOWAS_RESIZE, params);
+	}
+
+	return true;
+}
+
 /* Callback called before processing the first <connect> tag
  */
 bool InitConnect(ServerConfig* conf, const char* tag)
@@ -590,6 +635,8 @@ void ServerConfig::Read(bool bail, userrec* user)
 	static char exemptchanops[MAXBUF];	/* Exempt channel ops from these modes */
 	int rem = 0, add = 0;		/* Number of modules added, number of modules removed */
 	std::ostringstream errstr;	/* String stream containing the error output */
+	/* <connthrottle> as it was before this read */
+	unsigned int oldthrottle[] = { ThrottleIPBurst, ThrottleIPRate, ThrottleCIDRBurst, ThrottleCIDRRate, ThrottleIPv4CIDR, ThrottleIPv6CIDR };
 
 	/* These tags MUST occur and must ONLY occur once in the config file */
 	static char* Once[] = { "server", "admin", "files", "power", "options", NULL };
@@ -619,6 +666,7 @@ void ServerConfig::Read(bool bail, userrec* user)
 		{"options",	"allowhalfop",	"0",			new ValueContainerBool (&this->AllowHalfop),		DT_BOOLEAN, NoValidation},
 		{"dns",		"server",	"",			new ValueContainerChar (this->DNSServer),		DT_CHARPTR, ValidateDnsServer},
 		{"dns",		"timeout",	"5",			new ValueContainerInt  (&this->dns_timeout),		DT_INTEGER, NoValidation},
+		{"dns",		"cachesize",	"10000",		new ValueContainerInt  (&this->dns_cachesize),		DT_INTEGER, NoValidation},
 		{"options",	"moduledir",	MOD_PATH,		new ValueContainerChar (this->ModPath),			DT_CHARPTR, NoValidation},
 		{"disabled",	"commands",	"",			new ValueContainerChar (this->DisabledCommands),	DT_CHARPTR, NoValidation},
 		{"options",	"userstats",	"",			new ValueContainerChar (this->UserStats),		DT_CHARPTR, NoValidation},
@@ -634,16 +682,24 @@ void ServerConfig::Read(bool bail, userrec* user)
 		{"options",	"ircumsgprefix","0",			new ValueContainerBool (&this->UndernetMsgPrefix),	DT_BOOLEAN, NoValidation},
 		{"options",	"announceinvites", "1",			new ValueContainerBool (&this->AnnounceInvites),	DT_BOOLEAN, NoValidation},
 		{"options",	"hostintopic",	"1",			new ValueContainerBool (&this->FullHostInTopic),	DT_BOOLEAN, NoValidation},
+		{"options",	"releaseslabs",	"1",			new ValueContainerBool (&this->ReleaseSlabs),		DT_BOOLEAN, NoValidation},
 		{"options",	"hidemodes",	"",			new ValueContainerChar (hidemodes),			DT_CHARPTR, ValidateModeLists},
 		{"options",	"exemptchanops","",			new ValueContainerChar (exemptchanops),			DT_CHARPTR, ValidateExemptChanOps},
 		{"options",	"defaultmodes", "nt",			new ValueContainerChar (this->DefaultModes),		DT_CHARPTR, NoValidation},
 		{"pid",		"file",		"",			new ValueContainerChar (this->PID),			DT_CHARPTR, NoValidation},
 		{"whowas",	"groupsize",	"10",			new ValueContainerInt  (&this->WhoWasGroupSize),	DT_INTEGER, NoValidation},
 		{"whowas",	"maxgroups",	"10240",		new ValueContainerInt  (&this->WhoWasMaxGroups),	DT_INTEGER, NoValidation},
+		{"whowas",	"maxmemory",	"16777216",		new ValueContainerUInt (&this->WhoWasMaxMemory),	DT_INTEGER, ValidateWhoWasMemory},
 		{"whowas",	"maxkeep",	"3600",			new ValueContainerChar (maxkeep),			DT_CHARPTR, ValidateWhoWas},
 		{"die",		"value",	"",			new ValueContainerChar (this->DieValue),		DT_CHARPTR, NoValidation},
 		{"channels",	"users",	"20",			new ValueContainerUInt (&this->MaxChans),		DT_INTEGER, NoValidation},
 		{"channels",	"opers",	"60",			new ValueContainerUInt (&this->OperMaxChans),		DT_INTEGER, NoValidation},
+		{"connthrottle","ipburst",	"0",			new ValueContainerUInt (&this->ThrottleIPBurst),	DT_INTEGER, NoValidation},
+		{"connthrottle","iprate",	"0",			new ValueContainerUInt (&this->ThrottleIPRate),		DT_INTEGER, NoValidation},
+		{"connthrottle","cidrburst",	"0",			new ValueContainerUInt (&this->ThrottleCIDRBurst),	DT_INTEGER, NoValidation},
+		{"connthrottle","cidrrate",	"0",			new ValueContainerUInt (&this->ThrottleCIDRRate),	DT_INTEGER, NoValidation},
+		{"connthrottle","ipv4cidr",	"24",			new ValueContainerUInt (&this->ThrottleIPv4CIDR),	DT_INTEGER, ValidateThrottleIPv4CIDR},
+		{"connthrottle","ipv6cidr",	"64",			new ValueContainerUInt (&this->ThrottleIPv6CIDR),	DT_INTEGER, ValidateThrottleIPv6CIDR},
 		{NULL}
 	};
 
@@ -868,6 +924,14 @@ void ServerConfig::Read(bool bail, userrec* user)
 	 */
 	if (!bail)
 	{
+		unsigned int newthrottle[] = { ThrottleIPBurst, ThrottleIPRate, ThrottleCIDRBurst, ThrottleCIDRRate, ThrottleIPv4CIDR, ThrottleIPv6CIDR };
+		if (memcmp(oldthrottle, newthrottle, sizeof(oldthrottle)))
+		{
+			/* Buckets are keyed by the old CIDR widths and filled to the old bursts */
+			ServerInstance->Admission->ResetThrottles();
+			ServerInstance->Log(DEFAULT,"<connthrottle> changed, connection throttles reset.");
+		}
+
 		int found_ports = 0;
 		FailedPortList pl;
 		ServerInstance->BindPorts(false, found_ports, pl);
@@ -92,7 +92,7 @@ void CullList::AddItem(userrec* user, const char* reason, const char* o_reason)
 
 void CullList::MakeSilent(userrec* user)
 {
-	for (std::vector<CullItem>::iterator a = list.begin(); a != list.end(); ++a)
+	for (std::deque<CullItem>::iterator a = list.begin(); a != list.end(); ++a)
 	{
 		if (a->GetUser() == user)
 		{
@@ -108,9 +108,12 @@ int CullList::Apply()
 	int n = list.size();
 	while (list.size())
 	{
-		std::vector<CullItem>::iterator a = list.begin();
+		/* A pointer rather than an iterator: quit handlers may add more items,
+		 * which leaves references into a deque valid but not iterators.
+		 */
+		CullItem* a = &list.front();
 
-		user_hash::iterator iter = ServerInstance->clientlist->find(a->GetUser()->nick);
+		bool hashed = (ServerInstance->clientlist->find(a->GetUser()->nick) != ServerInstance->clientlist->end());
 		std::map<userrec*, userrec*>::iterator exemptiter = exempt.find(a->GetUser());
 		const char* preset_reason = a->GetUser()->GetOperQuit();
 		std::string reason = a->GetReason();
@@ -128,7 +131,8 @@ int CullList::Apply()
 		if (IS_LOCAL(a->GetUser()))
 		{
 			a->GetUser()->Write("ERROR :Closing link (%s@%s) [%s]", a->GetUser()->ident, a->GetUser()->host, oper_reason.c_str());
-			if ((!a->GetUser()->sendq.empty()) && (!(*a->GetUser()->GetWriteError())))
+			/* A module hooking the socket may hold the line instead of the sendq */
+			if (((!a->GetUser()->sendq.empty()) || (ServerInstance->Config->GetIOHook(a->GetUser()->GetPort()))) && (!(*a->GetUser()->GetWriteError())))
 				a->GetUser()->FlushWriteBuf();
 		}
 
@@ -182,19 +186,23 @@ int CullList::Apply()
 			a->GetUser()->AddToWhoWas();
 		}
 
-		if (iter != ServerInstance->clientlist->end())
+		if (hashed)
 		{
 			if (IS_LOCAL(a->GetUser()))
 			{
 				std::vector<userrec*>::iterator x = find(ServerInstance->local_users.begin(),ServerInstance->local_users.end(),a->GetUser());
 				if (x != ServerInstance->local_users.end())
 					ServerInstance->local_users.erase(x);
+				x = find(ServerInstance->ready_users.begin(),ServerInstance->ready_users.end(),a->GetUser());
+				if (x != ServerInstance->ready_users.end())
+					ServerInstance->ready_users.erase(x);
 			}
-			ServerInstance->clientlist->erase(iter);
+			/* Quit handlers may have changed the user list, so look again */
+			ServerInstance->clientlist->erase(a->GetUser()->nick);
 			DELETE(a->GetUser());
 		}
 
-		list.erase(list.begin());
+		list.pop_front();
 		exempt.erase(exemptiter);
 	}
 	return n;
@@ -42,6 +42,7 @@ using irc::sockets::insp_inaddr;
 using irc::sockets::insp_ntoa;
 using irc::sockets::insp_aton;
 using irc::sockets::OpenTCPSocket;
+using irc::sockets::NonBlocking;
 
 /** Masks to mask off the responses we get from the DNSRequest methods
  */
@@ -90,6 +91,8 @@ class DNSHeader
 	unsigned char	payload[512];	/* Packet payload */
 };
 
+class DNSTCPQuery;
+
 class DNSRequest
 {
  public:
@@ -100,11 +103,46 @@ class DNSRequest
 	DNS*            dnsobj;		/* DNS caller (where we get our FD from) */
 	unsigned long	ttl;		/* Time to live */
 	std::string     orig;		/* Original requested name/ip */
+	std::string     query;		/* Name sent, if other lookups may join this one */
+	unsigned char	packet[sizeof(DNSHeader)];	/* The query as sent, kept for retransmission */
+	int		packetlen;	/* Length of the query */
+	int		server;		/* Index of the server last sent to */
+	unsigned int	tried;		/* Servers sent to in this round, as a bitmask of indexes */
+	int		attempts;	/* Packets sent so far */
+	timeval		lastsent;	/* When the last packet went */
+	unsigned long	rto;		/* Microseconds to wait on it before retransmitting */
+	time_t		deadline;	/* When to give up altogether */
+	DNSTCPQuery*	tcp;		/* Set while the query is being asked again over TCP */
 
 	DNSRequest(InspIRCd* Instance, DNS* dns, int id, const std::string &original);
 	~DNSRequest();
 	DNSInfo ResultIsReady(DNSHeader &h, int length);
+	unsigned long NegativeTTL(DNSHeader &h, int length);
 	int SendRequests(const DNSHeader *header, const int length, QueryType qt);
+	int Transmit();
+};
+
+/** Asks a nameserver again over TCP, when its reply over UDP was truncated.
+ * The request keeps its id and timeout meanwhile. If the TCP query fails,
+ * the truncated reply is used after all.
+ */
+class DNSTCPQuery : public EventHandler
+{
+	InspIRCd* ServerInstance;
+	DNS* dns;
+	DNSRequest* req;
+	int server;
+	std::string sendq;	/* The query, with its length in front */
+	std::string recvq;	/* As much of the reply as has arrived, likewise */
+	std::string truncated;	/* The reply which came over UDP */
+
+	void Finish(const unsigned char* buffer, int length);
+	void Fail();
+ public:
+	DNSTCPQuery(InspIRCd* Instance, DNS* d, DNSRequest* r, int ns, const unsigned char* reply, int length);
+	bool Start();
+	void Close();
+	void HandleEvent(EventType et, int errornum = 0);
 };
 
 class CacheTimer : public InspTimer
@@ -114,7 +152,7 @@ class CacheTimer : public InspTimer
 	DNS* dns;
  public:
 	CacheTimer(InspIRCd* Instance, DNS* thisdns)
-		: InspTimer(3600, Instance->Time(), true), ServerInstance(Instance), dns(thisdns) { }
+		: InspTimer(60, Instance->Time(), true), ServerInstance(Instance), dns(thisdns) { }
 
 	virtual void Tick(time_t TIME)
 	{
@@ -122,31 +160,58 @@ class CacheTimer : public InspTimer
 	}
 };
 
+/** Checks on a request every second, retransmitting it when its
+ * server has not answered in time, and failing it at its deadline.
+ */
 class RequestTimeout : public InspTimer
 {
 	InspIRCd* ServerInstance;
 	DNSRequest* watch;
 	int watchid;
  public:
-	RequestTimeout(unsigned long n, InspIRCd* SI, DNSRequest* watching, int id) : InspTimer(n, time(NULL)), ServerInstance(SI), watch(watching), watchid(id)
+	RequestTimeout(InspIRCd* SI, DNSRequest* watching, int id) : InspTimer(1, SI->Time(), true), ServerInstance(SI), watch(watching), watchid(id)
 	{
 	}
 
 	void Tick(time_t TIME)
 	{
-		if (ServerInstance->Res->requests[watchid] == watch)
+		DNS* dns = ServerInstance->Res;
+
+		if (dns->requests[watchid] != watch)
 		{
-			/* Still exists, whack it */
-			if (ServerInstance->Res->Classes[watchid])
-			{
-				ServerInstance->Res->Classes[watchid]->OnError(RESOLVER_TIMEOUT, "Request timed out");
-				delete ServerInstance->Res->Classes[watchid];
-				ServerInstance->Res->Classes[watchid] = NULL;
-			}
-			ServerInstance->Res->requests[watchid] = NULL;
+			/* Answered already */
+			CancelRepeat();
+			return;
+		}
+
+		if (TIME >= watch->deadline)
+		{
+			/* Still exists, whack it. The request goes first, so that
+			 * lookups started from OnError() send a fresh query.
+			 */
+			CancelRepeat();
+			if (!watch->tcp)
+				dns->ServerFailed(watch->server, watch->rto);
+			dns->requests[watchid] = NULL;
 			DELETE(watch);
+			dns->FailResolvers(watchid, RESOLVER_TIMEOUT, "Request timed out");
 			return;
 		}
+
+		if (watch->tcp)
+			return;
+
+		timeval now;
+		gettimeofday(&now, NULL);
+		unsigned long waited = (now.tv_sec - watch->lastsent.tv_sec) * 1000000 + now.tv_usec - watch->lastsent.tv_usec;
+		if (waited >= watch->rto)
+		{
+			/* Lost, or the server is slow or gone. Ask the next one, and wait longer. */
+			dns->ServerFailed(watch->server, watch->rto);
+			dns->retransmits++;
+			watch->rto *= 2;
+			watch->Transmit();
+		}
 	}
 };
 
@@ -156,13 +221,30 @@ DNSRequest::DNSRequest(InspIRCd* Instance, DNS* dns, int id, const std::string &
 	res = new unsigned char[512];
 	*res = 0;
 	orig = original;
-	RequestTimeout* RT = new RequestTimeout(Instance->Config->dns_timeout ? Instance->Config->dns_timeout : 5, Instance, this, id);
+	ttl = 0;
+	packetlen = 0;
+	server = -1;
+	tried = 0;
+	attempts = 0;
+	rto = 0;
+	tcp = NULL;
+	deadline = Instance->Time() + (Instance->Config->dns_timeout ? Instance->Config->dns_timeout : 5);
+	RequestTimeout* RT = new RequestTimeout(Instance, this, id);
 	Instance->Timers->AddTimer(RT); /* The timer manager frees this */
 }
 
 /* Deallocate the processing buffer */
 DNSRequest::~DNSRequest()
 {
+	/* No more lookups may join this request */
+	if (!query.empty())
+	{
+		std::map<DNS::QueryKey, int>::iterator i = dnsobj->inflight.find(std::make_pair(type, query));
+		if ((i != dnsobj->inflight.end()) && (i->second == (id[0] << 8) + id[1]))
+			dnsobj->inflight.erase(i);
+	}
+	if (tcp)
+		tcp->Close();
 	delete[] res;
 }
 
@@ -207,48 +289,341 @@ inline void DNS::EmptyHeader(unsigned char *output, const DNSHeader *header, con
 	memcpy(&output[12],header->payload,length);
 }
 
+/** Skip over a name in a packet, returning the position after it */
+static int SkipName(const unsigned char* payload, int i, int length)
+{
+	while (i < length)
+	{
+		if (payload[i] > 63)
+			return i + 2;	/* Compression pointer, ends the name */
+		if (payload[i] == 0)
+			return i + 1;
+		i += payload[i] + 1;
+	}
+	return length;
+}
+
+/** How long a negative answer may be cached: the lesser of the TTL and
+ * MINIMUM fields of the SOA in its authority section (RFC 2308 section 5).
+ * Without an SOA it may not be cached at all.
+ */
+unsigned long DNSRequest::NegativeTTL(DNSHeader &header, int length)
+{
+	ResourceRecord rr;
+	int i = 0;
+
+	for (unsigned int q = 0; q < header.qdcount; q++)
+		i = SkipName(header.payload, i, length) + 4;
+
+	for (unsigned int a = 0; a < header.ancount + header.nscount; a++)
+	{
+		i = SkipName(header.payload, i, length);
+		if (length - i < 10)
+			return 0;
+
+		DNS::FillResourceRecord(&rr,&header.payload[i]);
+		i += 10;
+		if (i + (int)rr.rdlength > length)
+			return 0;
+
+		/* MINIMUM is the last field of the SOA data */
+		if ((a >= header.ancount) && (rr.type == 6) && (rr.rdlength >= 20))
+		{
+			const unsigned char* m = &header.payload[i + rr.rdlength - 4];
+			unsigned long minimum = (m[0] << 24) + (m[1] << 16) + (m[2] << 8) + m[3];
+			unsigned long ttl = rr.ttl < minimum ? rr.ttl : minimum;
+			if (ttl > DNS::MAX_NEGATIVE_TTL)
+				ttl = DNS::MAX_NEGATIVE_TTL;
+			return ttl;
+		}
+
+		i += rr.rdlength;
+	}
+
+	return 0;
+}
+
 /** Send requests we have previously built down the UDP socket */
 int DNSRequest::SendRequests(const DNSHeader *header, const int length, QueryType qt)
 {
-	unsigned char payload[sizeof(DNSHeader)];
-
 	this->rr_class = 1;
 	this->type = qt;
-		
-	DNS::EmptyHeader(payload,header,length);
 
-#ifdef IPV6
-	if (this->dnsobj->socketfamily == AF_INET6)
+	DNS::EmptyHeader(packet,header,length);
+	packetlen = length + 12;
+
+	return this->Transmit();
+}
+
+/** Send the query to the best server which has not had it yet */
+int DNSRequest::Transmit()
+{
+	sockaddr addr[2];
+	int ns;
+
+	/* Every server has had a go, start another round */
+	if (dnsobj->PickServer(tried) == -1)
+		tried = 0;
+
+	while ((ns = dnsobj->PickServer(tried)) != -1)
 	{
-		sockaddr_in6 addr;
-		memset(&addr,0,sizeof(addr));
-		memcpy(&addr.sin6_addr,&dnsobj->myserver6,sizeof(addr.sin6_addr));
-		addr.sin6_family = AF_INET6;
-		addr.sin6_port = htons(DNS::QUERY_PORT);
-		if (sendto(dnsobj->GetFd(), payload, length + 12, 0, (sockaddr *) &addr, sizeof(addr)) != length+12)
-			return -1;
+		tried |= 1 << ns;
+		socklen_t size = dnsobj->ServerAddress(ns, addr);
+		if (sendto(dnsobj->GetFd(), (const char*)packet, packetlen, 0, addr, size) != packetlen)
+			continue;
+
+		NameServer &s = dnsobj->servers[ns];
+		if (!attempts)
+		{
+			rto = 2 * s.srtt;
+			if (rto < DNS::MIN_RTO)
+				rto = DNS::MIN_RTO;
+			if (rto > DNS::MAX_RTO)
+				rto = DNS::MAX_RTO;
+		}
+		s.sent++;
+		attempts++;
+		server = ns;
+		gettimeofday(&lastsent, NULL);
+
+		/* The others drift back towards being worth another try,
+		 * so a server which was slow once is not passed over forever
+		 */
+		for (unsigned int i = 0; i < dnsobj->servers.size(); i++)
+			if (i != (unsigned int)ns)
+				dnsobj->servers[i].srtt -= dnsobj->servers[i].srtt >> 6;
+
+		return 0;
 	}
-	else
+
+	return -1;
+}
+
+DNSTCPQuery::DNSTCPQuery(InspIRCd* Instance, DNS* d, DNSRequest* r, int ns, const unsigned char* reply, int length)
+	: ServerInstance(Instance), dns(d), req(r), server(ns), truncated((const char*)reply, length)
+{
+	sendq.push_back((char)(r->packetlen >> 8));
+	sendq.push_back((char)(r->packetlen & 0xFF));
+	sendq.append((const char*)r->packet, r->packetlen);
+	this->SetFd(-1);
+}
+
+/** Connect to the server. The query is sent once connected. */
+bool DNSTCPQuery::Start()
+{
+	if ((server < 0) || ((unsigned int)server >= dns->servers.size()))
+		return false;
+
+	sockaddr addr[2];
+	socklen_t size = dns->ServerAddress(server, addr);
+
+	int fd = socket(dns->socketfamily, SOCK_STREAM, 0);
+	if (fd < 0)
+		return false;
+
+	irc::sockets::NonBlocking(fd);
+	if ((connect(fd, addr, size) == -1) && (errno != EINPROGRESS))
 	{
-		sockaddr_in addr;
-		memset(&addr,0,sizeof(addr));
-		memcpy(&addr.sin_addr.s_addr,&dnsobj->myserver4,sizeof(addr.sin_addr));
-		addr.sin_family = AF_INET;
-		addr.sin_port = htons(DNS::QUERY_PORT);
-		if (sendto(dnsobj->GetFd(), payload, length + 12, 0, (sockaddr *) &addr, sizeof(addr)) != length+12)
-			return -1;
+		close(fd);
+		return false;
+	}
+
+	this->SetFd(fd);
+	if (!ServerInstance->SE->AddFd(this))
+	{
+		close(fd);
+		this->SetFd(-1);
+		return false;
+	}
+
+	ServerInstance->SE->WantWrite(this);
+	return true;
+}
+
+/** Close the connection and free the query */
+void DNSTCPQuery::Close()
+{
+	if (this->GetFd() > -1)
+	{
+		ServerInstance->SE->DelFd(this);
+		close(this->GetFd());
+		this->SetFd(-1);
+	}
+	delete this;
+}
+
+/** Hand the reply to the request, then go away */
+void DNSTCPQuery::Finish(const unsigned char* buffer, int length)
+{
+	/* The request no longer owns this query, so that dealing with
+	 * the reply, which frees the request, does not free it too
+	 */
+	req->tcp = NULL;
+
+	/* Anything but a reply to this query is no use */
+	if ((length < 12) || (buffer[0] != req->id[0]) || (buffer[1] != req->id[1]))
+	{
+		buffer = (const unsigned char*)truncated.data();
+		length = truncated.length();
+	}
+
+	DNSResult res = dns->ParseResult(buffer, length, server, true);
+	dns->ProcessResult(res);
+	this->Close();
+}
+
+/** The TCP query failed, make do with the truncated reply */
+void DNSTCPQuery::Fail()
+{
+	this->Finish((const unsigned char*)truncated.data(), truncated.length());
+}
+
+void DNSTCPQuery::HandleEvent(EventType et, int errornum)
+{
+	switch (et)
+	{
+		case EVENT_WRITE:
+			/* Connected. The query is far smaller than the socket buffer. */
+			if (send(this->GetFd(), sendq.data(), sendq.length(), 0) != (int)sendq.length())
+				this->Fail();
+		break;
+
+		case EVENT_READ:
+		{
+			char buffer[MAXBUF];
+			int n = recv(this->GetFd(), buffer, sizeof(buffer), 0);
+
+			if ((n < 0) && (errno == EAGAIN))
+				return;
+
+			if (n <= 0)
+			{
+				this->Fail();
+				return;
+			}
+
+			recvq.append(buffer, n);
+			if (recvq.length() < 2)
+				return;
+
+			size_t length = ((unsigned char)recvq[0] << 8) + (unsigned char)recvq[1];
+			if (recvq.length() < length + 2)
+				return;
+
+			/* Only as much as a UDP reply can hold is parsed. The
+			 * records asked for come first, which is what matters.
+			 */
+			if (length > sizeof(DNSHeader))
+				length = sizeof(DNSHeader);
+			this->Finish((const unsigned char*)recvq.data() + 2, length);
+		}
+		break;
+
+		case EVENT_ERROR:
+			this->Fail();
+		break;
+	}
+}
+
+/** Fill in the socket address of a nameserver */
+socklen_t DNS::ServerAddress(int server, sockaddr* addr)
+{
+	NameServer &s = servers[server];
+
+#ifdef IPV6
+	if (this->socketfamily == AF_INET6)
+	{
+		sockaddr_in6* sin6 = (sockaddr_in6*)addr;
+		memset(sin6,0,sizeof(sockaddr_in6));
+		memcpy(&sin6->sin6_addr,&s.addr6,sizeof(sin6->sin6_addr));
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(DNS::QUERY_PORT);
+		return sizeof(sockaddr_in6);
 	}
-#else
-	sockaddr_in addr;
-	memset(&addr,0,sizeof(addr));
-	memcpy(&addr.sin_addr.s_addr, &dnsobj->myserver4, sizeof(addr.sin_addr));
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(DNS::QUERY_PORT);
-	if (sendto(dnsobj->GetFd(), (const char*)payload, length + 12, 0, (sockaddr *) &addr, sizeof(addr)) != length+12)
-		return -1;
 #endif
+	sockaddr_in* sin = (sockaddr_in*)addr;
+	memset(sin,0,sizeof(sockaddr_in));
+	memcpy(&sin->sin_addr.s_addr,&s.addr4,sizeof(sin->sin_addr));
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(DNS::QUERY_PORT);
+	return sizeof(sockaddr_in);
+}
 
-	return 0;
+/* Check wether a reply came from one of the DNS servers we
+ * send to, and from source-port 53. A user could in theory
+ * still spoof dns packets anyway but this is less trivial
+ * than just sending garbage to the client, which is possible
+ * without this check.
+ *
+ * -- Thanks jilles for pointing this one out.
+ */
+int DNS::FindServer(const sockaddr* from)
+{
+	for (unsigned int i = 0; i < servers.size(); i++)
+	{
+#ifdef IPV6
+		if (this->socketfamily == AF_INET6)
+		{
+			const sockaddr_in6* sin6 = (const sockaddr_in6*)from;
+			if ((ntohs(sin6->sin6_port) == DNS::QUERY_PORT) && (!memcmp(&sin6->sin6_addr, &servers[i].addr6, sizeof(in6_addr))))
+				return i;
+		}
+		else
+#endif
+		{
+			const sockaddr_in* sin = (const sockaddr_in*)from;
+			if ((ntohs(sin->sin_port) == DNS::QUERY_PORT) && (sin->sin_addr.s_addr == servers[i].addr4.s_addr))
+				return i;
+		}
+	}
+	return -1;
+}
+
+/** Choose where to send a request next */
+int DNS::PickServer(unsigned int tried)
+{
+	time_t now = ServerInstance->Time();
+	int best = -1;
+	bool bestup = false;
+
+	for (unsigned int i = 0; i < servers.size(); i++)
+	{
+		if (tried & (1 << i))
+			continue;
+
+		/* Servers which are answering come before those which are not,
+		 * then the fastest first. Unmeasured servers count as fastest,
+		 * so each gets tried.
+		 */
+		bool up = servers[i].IsAnswering(now);
+		if ((best == -1) || (up && !bestup) || ((up == bestup) && (servers[i].srtt < servers[best].srtt)))
+		{
+			best = i;
+			bestup = up;
+		}
+	}
+
+	return best;
+}
+
+/** A server did not answer a request in time, or could not */
+void DNS::ServerFailed(int server, unsigned long penalty)
+{
+	if ((server < 0) || ((unsigned int)server >= servers.size()))
+		return;
+
+	NameServer &s = servers[server];
+
+	/* However fast it was, it is at least this slow now */
+	s.srtt += penalty;
+	if (s.srtt > MAX_RTO)
+		s.srtt = MAX_RTO;
+
+	if (++s.failures == NameServer::MAX_FAILURES)
+		ServerInstance->Log(DEFAULT,"DNS: Nameserver %s has failed %d requests in a row, other nameservers will be used first for %d seconds", s.address.c_str(), s.failures, RETRY_DOWN);
+
+	if (s.failures >= NameServer::MAX_FAILURES)
+		s.retryat = ServerInstance->Time() + RETRY_DOWN;
 }
 
 /** Add a query with a predefined header, and allocate an ID for it. */
@@ -287,29 +662,118 @@ DNSRequest* DNS::AddQuery(DNSHeader *header, int &id, const char* original)
 
 int DNS::ClearCache()
 {
-	/* This ensures the buckets are reset to sane levels */
-	int rv = this->cache->size();
-	delete this->cache;
-	this->cache = new dnscache();
-	return rv;
+	this->confirmed->Clear();
+	return this->cache->Clear();
 }
 
 int DNS::PruneCache()
+{
+	this->confirmed->Prune(time(NULL));
+	return this->cache->Prune(time(NULL));
+}
+
+/** Unlink an entry from the index, the expiry order and the LRU list */
+void DNSCache::Erase(LRUList::iterator e)
+{
+	index.erase(e->key);
+	expiry.erase(e->expiry);
+	entries.erase(e);
+}
+
+CachedQuery* DNSCache::Find(const Key &key)
+{
+	std::map<Key, LRUList::iterator>::iterator i = index.find(key);
+	if (i == index.end())
+	{
+		misses++;
+		return NULL;
+	}
+
+	LRUList::iterator e = i->second;
+	if (!e->query.CalcTTLRemaining())
+	{
+		/* Expired, but not pruned yet */
+		Erase(e);
+		misses++;
+		return NULL;
+	}
+
+	/* Move it to the front, it is the most recently used now */
+	entries.splice(entries.begin(), entries, e);
+
+	if (e->query.negative)
+		neghits++;
+	else
+		hits++;
+
+	return &e->query;
+}
+
+void DNSCache::Add(const Key &key, const CachedQuery &query)
+{
+	if (!maxsize)
+		return;
+
+	std::map<Key, LRUList::iterator>::iterator i = index.find(key);
+	if (i != index.end())
+		Erase(i->second);
+
+	entries.push_front(Entry(key, query));
+	LRUList::iterator e = entries.begin();
+	e->expiry = expiry.insert(std::make_pair(query.expires, key));
+	index[key] = e;
+
+	/* Full, the least recently used entries make way */
+	while (index.size() > maxsize)
+	{
+		Erase(--entries.end());
+		evictions++;
+	}
+}
+
+bool DNSCache::Remove(const Key &key)
+{
+	std::map<Key, LRUList::iterator>::iterator i = index.find(key);
+	if (i == index.end())
+		return false;
+
+	Erase(i->second);
+	return true;
+}
+
+int DNSCache::Prune(time_t now)
 {
 	int n = 0;
-	dnscache* newcache = new dnscache();
-	for (dnscache::iterator i = this->cache->begin(); i != this->cache->end(); i++)
-		/* Dont include expired items (theres no point) */
-		if (i->second.CalcTTLRemaining())
-			newcache->insert(*i);
-		else
-			n++;
 
-	delete this->cache;
-	this->cache = newcache;
+	/* Entries are in order of expiry, so stop at the first still valid */
+	while (!expiry.empty() && (expiry.begin()->first <= now))
+	{
+		Erase(index[expiry.begin()->second]);
+		n++;
+	}
+
+	return n;
+}
+
+int DNSCache::Clear()
+{
+	int n = index.size();
+	index.clear();
+	expiry.clear();
+	entries.clear();
 	return n;
 }
 
+void DNSCache::SetMaxSize(size_t max)
+{
+	maxsize = max;
+	while (index.size() > maxsize)
+	{
+		Erase(--entries.end());
+		evictions++;
+	}
+}
+
 void DNS::Rehash()
 {
 	ip6munge = false;
@@ -323,16 +787,34 @@ void DNS::Rehash()
 		close(this->GetFd());
 		this->SetFd(-1);
 
+		/* Replies to anything sent from the old socket will never
+		 * arrive, so new lookups must not wait on those requests
+		 */
+		inflight.clear();
+	}
+
+	if (this->cache)
+	{
 		/* Rehash the cache */
 		this->PruneCache();
+		this->cache->SetMaxSize(ServerInstance->Config->dns_cachesize);
+		this->confirmed->SetMaxSize(ServerInstance->Config->dns_cachesize);
 	}
 	else
 	{
 		/* Create initial dns cache */
-		this->cache = new dnscache();
+		this->cache = new DNSCache(ServerInstance->Config->dns_cachesize);
+		this->confirmed = new DNSCache(ServerInstance->Config->dns_cachesize);
 	}
 
-	if ((strstr(ServerInstance->Config->DNSServer,"::ffff:") == (char*)&ServerInstance->Config->DNSServer) ||  (strstr(ServerInstance->Config->DNSServer,"::FFFF:") == (char*)&ServerInstance->Config->DNSServer))
+	/* The first server decides the address family, the rest must match it */
+	std::vector<NameServer> oldservers = servers;
+	irc::spacesepstream addresses(ServerInstance->Config->DNSServer);
+	std::string first = addresses.GetToken();
+	char firstaddr[MAXBUF];
+	strlcpy(firstaddr, first.c_str(), MAXBUF);
+
+	if ((strstr(firstaddr,"::ffff:") == (char*)&firstaddr) ||  (strstr(firstaddr,"::FFFF:") == (char*)&firstaddr))
 	{
 		ServerInstance->Log(DEFAULT,"WARNING: Using IPv4 addresses over IPv6 forces some DNS checks to be disabled.");
 		ServerInstance->Log(DEFAULT,"         This should not cause a problem, however it is recommended you migrate");
@@ -342,22 +824,46 @@ void DNS::Rehash()
 
 	this->socketfamily = AF_INET;
 #ifdef IPV6
-	if (strchr(ServerInstance->Config->DNSServer,':'))
-	{
+	if (strchr(firstaddr,':'))
 		this->socketfamily = AF_INET6;
-		inet_pton(AF_INET6, ServerInstance->Config->DNSServer, &this->myserver6);
-	}
 	else
-	{
-		inet_aton(ServerInstance->Config->DNSServer, &this->myserver4);
 		portpass = -1;
-	}
-#else
-	inet_aton(ServerInstance->Config->DNSServer, &this->myserver4);
 #endif
 
+	servers.clear();
+	for (std::string address = first; !address.empty(); address = addresses.GetToken())
+	{
+		if (servers.size() == MAX_NAMESERVERS)
+		{
+			ServerInstance->Log(DEFAULT,"WARNING: Only the first %d nameservers in <dns:server> are used.", MAX_NAMESERVERS);
+			break;
+		}
+
+		NameServer ns(address);
+		bool valid;
+#ifdef IPV6
+		if (this->socketfamily == AF_INET6)
+			valid = (inet_pton(AF_INET6, address.c_str(), &ns.addr6) > 0);
+		else
+#endif
+			valid = (inet_aton(address.c_str(), &ns.addr4) != 0);
+
+		if (!valid)
+		{
+			ServerInstance->Log(DEFAULT,"WARNING: Nameserver '%s' is not an address of the same type as '%s', ignoring it.", address.c_str(), firstaddr);
+			continue;
+		}
+
+		/* Keep what was learned about servers still in the list */
+		for (std::vector<NameServer>::iterator i = oldservers.begin(); i != oldservers.end(); i++)
+			if (i->address == address)
+				ns = *i;
+
+		servers.push_back(ns);
+	}
+
 	/* Initialize mastersocket */
-	int s = OpenTCPSocket(ServerInstance->Config->DNSServer, SOCK_DGRAM);
+	int s = OpenTCPSocket(firstaddr, SOCK_DGRAM);
 	this->SetFd(s);
 
 	/* Have we got a socket and is it nonblocking? */
@@ -374,6 +880,8 @@ void DNS::Rehash()
 
 		if (this->GetFd() >= 0)
 		{
+			NonBlocking(this->GetFd());
+
 			/* Hook the descriptor into the socket engine */
 			if (ServerInstance && ServerInstance->SE)
 			{
@@ -401,10 +909,14 @@ DNS::DNS(InspIRCd* Instance) : ServerInstance(Instance)
 	/* Set the id of the next request to 0
 	 */
 	currid = 0;
+	coalesced = 0;
+	retransmits = 0;
+	tcpqueries = 0;
 
 	/* DNS::Rehash() sets this to a valid ptr
 	 */
 	this->cache = NULL;
+	this->confirmed = NULL;
 	
 	/* Again, DNS::Rehash() sets this to a
 	 * valid value
@@ -457,67 +969,60 @@ int DNS::MakePayload(const char * const name, const QueryType rr, const unsigned
 	return payloadpos + 4;
 }
 
-/** Start lookup of an hostname to an IP address */
-int DNS::GetIP(const char *name)
+/** Send a query, unless the same query is already waiting for a reply */
+int DNS::StartQuery(const char* name, const QueryType qt, const char* original)
 {
 	DNSHeader h;
 	int id;
 	int length;
-	
-	if ((length = this->MakePayload(name, DNS_QUERY_A, 1, (unsigned char*)&h.payload)) == -1)
+
+	/* Reconnect storms bring many users from the same few hosts at once.
+	 * Rather than ask the same thing again, wait on the reply to the first.
+	 */
+	QueryKey key(qt, name);
+	std::map<QueryKey, int>::iterator i = inflight.find(key);
+	if (i != inflight.end())
+	{
+		coalesced++;
+		return i->second;
+	}
+
+	if ((length = this->MakePayload(name, qt, 1, (unsigned char*)&h.payload)) == -1)
 		return -1;
 
-	DNSRequest* req = this->AddQuery(&h, id, name);
+	DNSRequest* req = this->AddQuery(&h, id, original);
 
-	if ((!req) || (req->SendRequests(&h, length, DNS_QUERY_A) == -1))
+	if ((!req) || (req->SendRequests(&h, length, qt) == -1))
 		return -1;
 
+	req->query = name;
+	inflight[key] = id;
+
 	return id;
 }
 
+/** Start lookup of an hostname to an IP address */
+int DNS::GetIP(const char *name)
+{
+	return this->StartQuery(name, DNS_QUERY_A, name);
+}
+
 /** Start lookup of an hostname to an IPv6 address */
 int DNS::GetIP6(const char *name)
 {
-	DNSHeader h;
-	int id;
-	int length;
-
-	if ((length = this->MakePayload(name, DNS_QUERY_AAAA, 1, (unsigned char*)&h.payload)) == -1)
-		return -1;
-
-	DNSRequest* req = this->AddQuery(&h, id, name);
-
-	if ((!req) || (req->SendRequests(&h, length, DNS_QUERY_AAAA) == -1))
-		return -1;
-
-	return id;
+	return this->StartQuery(name, DNS_QUERY_AAAA, name);
 }
 
 /** Start lookup of a cname to another name */
 int DNS::GetCName(const char *alias)
 {
-	DNSHeader h;
-	int id;
-	int length;
-
-	if ((length = this->MakePayload(alias, DNS_QUERY_CNAME, 1, (unsigned char*)&h.payload)) == -1)
-		return -1;
-
-	DNSRequest* req = this->AddQuery(&h, id, alias);
-
-	if ((!req) || (req->SendRequests(&h, length, DNS_QUERY_CNAME) == -1))
-		return -1;
-
-	return id;
+	return this->StartQuery(alias, DNS_QUERY_CNAME, alias);
 }
 
 /** Start lookup of an IP address to a hostname */
 int DNS::GetName(const insp_inaddr *ip)
 {
 	char query[128];
-	DNSHeader h;
-	int id;
-	int length;
 
 #ifdef IPV6
 	unsigned char* c = (unsigned char*)&ip->s6_addr;
@@ -532,24 +1037,13 @@ int DNS::GetName(const insp_inaddr *ip)
 	sprintf(query,"%d.%d.%d.%d.in-addr.arpa",c[3],c[2],c[1],c[0]);
 #endif
 
-	if ((length = this->MakePayload(query, DNS_QUERY_PTR, 1, (unsigned char*)&h.payload)) == -1)
-		return -1;
-
-	DNSRequest* req = this->AddQuery(&h, id, insp_ntoa(*ip));
-
-	if ((!req) || (req->SendRequests(&h, length, DNS_QUERY_PTR) == -1))
-		return -1;
-
-	return id;
+	return this->StartQuery(query, DNS_QUERY_PTR, insp_ntoa(*ip));
 }
 
 /** Start lookup of an IP address to a hostname */
 int DNS::GetNameForce(const char *ip, ForceProtocol fp)
 {
 	char query[128];
-	DNSHeader h;
-	int id;
-	int length;
 #ifdef SUPPORT_IP6LINKS
 	if (fp == PROTOCOL_IPV6)
 	{
@@ -576,15 +1070,7 @@ int DNS::GetNameForce(const char *ip, ForceProtocol fp)
 			return -1;
 	}
 
-	if ((length = this->MakePayload(query, DNS_QUERY_PTR, 1, (unsigned char*)&h.payload)) == -1)
-		return -1;
-
-	DNSRequest* req = this->AddQuery(&h, id, ip);
-
-	if ((!req) || (req->SendRequests(&h, length, DNS_QUERY_PTR) == -1))
-		return -1;
-
-	return id;
+	return this->StartQuery(query, DNS_QUERY_PTR, ip);
 }
 
 /** Build an ipv6 reverse domain from an in6_addr
@@ -612,62 +1098,36 @@ void DNS::MakeIP6Int(char* query, const in6_addr *ip)
 /** Return the next id which is ready, and the result attached to it */
 DNSResult DNS::GetResult()
 {
-	/* Fetch dns query response and decide where it belongs */
-	DNSHeader header;
-	DNSRequest *req;
 	unsigned char buffer[sizeof(DNSHeader)];
-	sockaddr* from = new sockaddr[2];
+	sockaddr from[2];
 #ifdef IPV6
 	socklen_t x = this->socketfamily == AF_INET ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
 #else
 	socklen_t x = sizeof(sockaddr_in);
 #endif
-	const char* ipaddr_from;
-	unsigned short int port_from = 0;
 	int length = _recvfrom(this->GetFd(),(char*)buffer,sizeof(DNSHeader),0,from,&x);
 
-	/* Did we get the whole header? */
-	if (length < 12)
-	{
-		/* Nope - something screwed up. */
-		delete[] from;
+	/* We cant check where it came from if you're using 4in6.
+	 * Tough luck to you, choose one or't other!
+	 */
+	int ns = (length < 0) ? -1 : this->FindServer(from);
+	if ((ns == -1) && (!ip6munge))
 		return DNSResult(-1,"",0,"");
-	}
 
-	/* Check wether the reply came from a different DNS
-	 * server to the one we sent it to, or the source-port
-	 * is not 53.
-	 * A user could in theory still spoof dns packets anyway
-	 * but this is less trivial than just sending garbage
-	 * to the client, which is possible without this check.
-	 *
-	 * -- Thanks jilles for pointing this one out.
-	 */
-#ifdef IPV6
-	char nbuf[MAXBUF];
-	if (this->socketfamily == AF_INET6)
-	{
-		ipaddr_from = inet_ntop(AF_INET6, &((sockaddr_in6*)from)->sin6_addr, nbuf, sizeof(nbuf));
-		port_from = ntohs(((sockaddr_in6*)from)->sin6_port);
-	}
-	else
-#endif
-	{
-		ipaddr_from = inet_ntoa(((sockaddr_in*)from)->sin_addr);
-		port_from = ntohs(((sockaddr_in*)from)->sin_port);
-	}
+	return this->ParseResult(buffer, length, ns, false);
+}
 
-	delete[] from;
+/** Decode a reply packet and decide where it belongs */
+DNSResult DNS::ParseResult(const unsigned char* buffer, int length, int server, bool stream)
+{
+	DNSHeader header;
+	DNSRequest *req;
 
-	/* We cant perform this security check if you're using 4in6.
-	 * Tough luck to you, choose one or't other!
-	 */
-	if (!ip6munge)
+	/* Did we get the whole header? */
+	if (length < 12)
 	{
-		if ((port_from != DNS::QUERY_PORT) || (strcasecmp(ipaddr_from, ServerInstance->Config->DNSServer)))
-		{
-			return DNSResult(-1,"",0,"");
-		}
+		/* Nope - something screwed up. */
+		return DNSResult(-1,"",0,"");
 	}
 
 	/* Put the read header info into a header class */
@@ -682,16 +1142,73 @@ DNSResult DNS::GetResult()
 	/* Do we have a pending request matching this id? */
 	if (!requests[this_id])
 	{
-		/* Somehow we got a DNS response for a request we never made... */
+		/* Somehow we got a DNS response for a request we never made,
+		 * or a second reply to one which was retransmitted
+		 */
 		return DNSResult(-1,"",0,"");
 	}
-	else
+
+	req = requests[this_id];
+
+	/* The server could not get an answer (SERVFAIL) or will not
+	 * give us one (REFUSED). Another server may do better.
+	 */
+	unsigned int rcode = header.flags2 & FLAGS_MASK_RCODE;
+	bool failed = ((rcode == 2) || (rcode == 5));
+
+	if ((server >= 0) && ((unsigned int)server < servers.size()))
+	{
+		NameServer &s = servers[server];
+		s.answered++;
+		if (failed)
+			this->ServerFailed(server, MIN_RTO);
+		else if (s.failures)
+		{
+			if (s.failures >= NameServer::MAX_FAILURES)
+				ServerInstance->Log(DEFAULT,"DNS: Nameserver %s is answering again", s.address.c_str());
+			s.failures = 0;
+		}
+
+		/* A reply to a retransmitted query could be answering any
+		 * of the copies, so only time queries which were sent once
+		 */
+		if ((req->attempts == 1) && (!stream) && (!failed))
+		{
+			timeval now;
+			gettimeofday(&now, NULL);
+			unsigned long rtt = (now.tv_sec - req->lastsent.tv_sec) * 1000000 + now.tv_usec - req->lastsent.tv_usec;
+			s.srtt = s.srtt ? (s.srtt * 7 + rtt) / 8 : rtt;
+		}
+	}
+
+	if (failed && (!req->tcp) && (PickServer(req->tried) != -1))
+	{
+		req->Transmit();
+		return DNSResult(-1,"",0,"");
+	}
+
+	/* The answer did not fit in a UDP packet, ask again over TCP */
+	if ((header.flags1 & FLAGS_MASK_TC) && (!stream))
 	{
-		/* Remove the query from the list of pending queries */
-		req = requests[this_id];
-		requests[this_id] = NULL;
+		/* Already asking, this is a reply to a retransmitted copy */
+		if (req->tcp)
+			return DNSResult(-1,"",0,"");
+
+		DNSTCPQuery* tcp = new DNSTCPQuery(ServerInstance, this, req, server >= 0 ? server : req->server, buffer, length);
+		if (tcp->Start())
+		{
+			req->tcp = tcp;
+			tcpqueries++;
+			return DNSResult(-1,"",0,"");
+		}
+
+		/* Make do with whatever did fit */
+		delete tcp;
 	}
 
+	/* Remove the query from the list of pending queries */
+	requests[this_id] = NULL;
+
 	/* Inform the DNSRequest class that it has a result to be read.
 	 * When its finished it will return a DNSInfo which is a pair of
 	 * unsigned char* resource record data, and an error message.
@@ -709,8 +1226,10 @@ DNSResult DNS::GetResult()
 		 * Put the error message in the second field.
 		 */
 		std::string ro = req->orig;
+		unsigned long negttl = req->ttl;
+		QueryType qt = req->type;
 		delete req;
-		return DNSResult(this_id | ERROR_MASK, data.second, 0, ro);
+		return DNSResult(this_id | ERROR_MASK, data.second, negttl, ro, qt);
 	}
 	else
 	{
@@ -775,8 +1294,9 @@ DNSResult DNS::GetResult()
 
 		/* Build the reply with the id and hostname/ip in it */
 		std::string ro = req->orig;
+		QueryType qt = req->type;
 		delete req;
-		return DNSResult(this_id,resultstr,ttl,ro);
+		return DNSResult(this_id,resultstr,ttl,ro,qt);
 	}
 }
 
@@ -801,10 +1321,18 @@ DNSInfo DNSRequest::ResultIsReady(DNSHeader &header, int length)
 		return std::make_pair((unsigned char*)NULL,"Unexpected value in DNS reply packet");
 
 	if (header.flags2 & FLAGS_MASK_RCODE)
+	{
+		/* Only NXDOMAIN says anything lasting about the name */
+		if ((header.flags2 & FLAGS_MASK_RCODE) == 3)
+			this->ttl = this->NegativeTTL(header, length - 12);
 		return std::make_pair((unsigned char*)NULL,"Domain name not found");
+	}
 
 	if (header.ancount < 1)
+	{
+		this->ttl = this->NegativeTTL(header, length - 12);
 		return std::make_pair((unsigned char*)NULL,"No resource records returned");
+	}
 
 	/* Subtract the length of the header from the length of the packet */
 	length -= 12;
@@ -934,46 +1462,57 @@ DNS::~DNS()
 	close(this->GetFd());
 	ServerInstance->Timers->DelTimer(this->PruneTimer);
 	delete this->PruneTimer;
+	delete this->cache;
+	delete this->confirmed;
 }
 
-CachedQuery* DNS::GetCache(const std::string &source)
+CachedQuery* DNS::GetCache(QueryType qt, const std::string &source)
 {
-	dnscache::iterator x = cache->find(source.c_str());
-	if (x != cache->end())
-		return &(x->second);
-	else
-		return NULL;
+	return cache->Find(DNSCache::Key(qt, source.c_str()));
 }
 	        
-void DNS::DelCache(const std::string &source)
+void DNS::DelCache(QueryType qt, const std::string &source)
 {
-	cache->erase(source.c_str());
+	cache->Remove(DNSCache::Key(qt, source.c_str()));
+}
+
+CachedQuery* DNS::GetConfirmedHost(const std::string &ip)
+{
+	return confirmed->Find(DNSCache::Key(DNS_QUERY_PTR, ip.c_str()));
+}
+
+void DNS::AddConfirmedHost(const std::string &ip, const std::string &host, unsigned int ttl, bool matched)
+{
+	if (ttl)
+		confirmed->Add(DNSCache::Key(DNS_QUERY_PTR, ip.c_str()), CachedQuery(host, ttl, !matched));
 }
 
 void Resolver::TriggerCachedResult()
 {
 	if (CQ)
-		OnLookupComplete(CQ->data, time_left, true);
+	{
+		if (CQ->negative)
+			OnError(RESOLVER_NXDOMAIN, CQ->data);
+		else
+			OnLookupComplete(CQ->data, time_left, true);
+	}
 }
 
 /** High level abstraction of dns used by application at large */
-Resolver::Resolver(InspIRCd* Instance, const std::string &source, QueryType qt, bool &cached, Module* creator) : ServerInstance(Instance), Creator(creator), input(source), querytype(qt)
+Resolver::Resolver(InspIRCd* Instance, const std::string &source, QueryType qt, bool &cached, Module* creator) : ServerInstance(Instance), Creator(creator), input(source), querytype(qt), next(NULL)
 {
 	cached = false;
 
-	CQ = ServerInstance->Res->GetCache(source);
+	/* Forced reverse lookups are cached with the rest */
+	QueryType cachetype = ((qt == DNS_QUERY_PTR4) || (qt == DNS_QUERY_PTR6)) ? DNS_QUERY_PTR : qt;
+
+	/* The cache only returns entries which have not expired */
+	CQ = ServerInstance->Res->GetCache(cachetype, source);
 	if (CQ)
 	{
 		time_left = CQ->CalcTTLRemaining();
-		if (!time_left)
-		{
-			ServerInstance->Res->DelCache(source);
-		}
-		else
-		{
-			cached = true;
-			return;
-		}
+		cached = true;
+		return;
 	}
 
 	insp_inaddr binip;
@@ -1055,45 +1594,136 @@ Module* Resolver::GetCreator()
 /** Process a socket read event */
 void DNS::HandleEvent(EventType et, int errornum)
 {
-	/* Fetch the id and result of the next available packet */
-	DNSResult res = this->GetResult();
-	/* Is there a usable request id? */
-	if (res.id != -1)
+	/* Read every reply which is waiting, rather than one per
+	 * trip around the socket engine. The socket is nonblocking,
+	 * so reading stops as soon as it is empty.
+	 */
+#ifdef MSG_WAITFORONE
+	const int batch = 32;
+	unsigned char buffers[batch][sizeof(DNSHeader)];
+	sockaddr_storage from[batch];
+	iovec iov[batch];
+	mmsghdr msgs[batch];
+
+	for (int total = 0; total < MAX_REPLIES; )
 	{
-		/* Its an error reply */
-		if (res.id & ERROR_MASK)
+		memset(msgs, 0, sizeof(msgs));
+		for (int i = 0; i < batch; i++)
 		{
-			/* Mask off the error bit */
-			res.id -= ERROR_MASK;
-			/* Marshall the error to the correct class */
-			if (Classes[res.id])
-			{
-				if (ServerInstance && ServerInstance->stats)
-					ServerInstance->stats->statsDnsBad++;
-				Classes[res.id]->OnError(RESOLVER_NXDOMAIN, res.result);
-				delete Classes[res.id];
-				Classes[res.id] = NULL;
-			}
+			iov[i].iov_base = buffers[i];
+			iov[i].iov_len = sizeof(DNSHeader);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &from[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
 		}
-		else
+
+		int got = recvmmsg(this->GetFd(), msgs, batch, 0, NULL);
+		if (got <= 0)
+			break;
+
+		for (int i = 0; i < got; i++)
 		{
-			/* It is a non-error result, marshall the result to the correct class */
-			if (Classes[res.id])
-			{
-				if (ServerInstance && ServerInstance->stats)
-					ServerInstance->stats->statsDnsGood++;
+			int ns = this->FindServer((sockaddr*)&from[i]);
+			if ((ns == -1) && (!ip6munge))
+				continue;
+
+			DNSResult res = this->ParseResult(buffers[i], msgs[i].msg_len, ns, false);
+			this->ProcessResult(res);
+		}
 
-				if (!this->GetCache(res.original.c_str()))
-					this->cache->insert(std::make_pair(res.original.c_str(), CachedQuery(res.result, res.ttl)));
+		total += got;
+		if (got < batch)
+			break;
+	}
+#else
+	unsigned char buffer[sizeof(DNSHeader)];
+	sockaddr from[2];
 
-				Classes[res.id]->OnLookupComplete(res.result, res.ttl, false);
-				delete Classes[res.id];
-				Classes[res.id] = NULL;
+	for (int total = 0; total < MAX_REPLIES; total++)
+	{
+		socklen_t x = sizeof(from);
+		int length = _recvfrom(this->GetFd(),(char*)buffer,sizeof(DNSHeader),0,from,&x);
+		if (length < 0)
+			break;
+
+		int ns = this->FindServer(from);
+		if ((ns == -1) && (!ip6munge))
+			continue;
+
+		DNSResult res = this->ParseResult(buffer, length, ns, false);
+		this->ProcessResult(res);
+	}
+#endif
+}
+
+/** Hand a result to the Resolvers waiting for it */
+void DNS::ProcessResult(DNSResult &res)
+{
+	/* Is there a usable request id? */
+	if (res.id == -1)
+		return;
+
+	/* Its an error reply */
+	if (res.id & ERROR_MASK)
+	{
+		/* Mask off the error bit */
+		res.id -= ERROR_MASK;
+		/* Marshall the error to the correct classes */
+		if (Classes[res.id])
+		{
+			if (ServerInstance && ServerInstance->stats)
+				ServerInstance->stats->statsDnsBad++;
+
+			/* The name does not exist, or has no records of this type.
+			 * Remember that for as long as its zone says we may.
+			 */
+			if (res.ttl)
+				this->cache->Add(DNSCache::Key(res.type, res.original.c_str()), CachedQuery(res.result, res.ttl, true));
+
+			this->FailResolvers(res.id, RESOLVER_NXDOMAIN, res.result);
+		}
+	}
+	else
+	{
+		/* It is a non-error result, marshall the result to the correct classes */
+		if (Classes[res.id])
+		{
+			if (ServerInstance && ServerInstance->stats)
+				ServerInstance->stats->statsDnsGood++;
+
+			if (res.ttl)
+				this->cache->Add(DNSCache::Key(res.type, res.original.c_str()), CachedQuery(res.result, res.ttl));
+
+			/* Detach the waiting list first, lookups started from
+			 * inside OnLookupComplete() get a list of their own
+			 */
+			Resolver* r = Classes[res.id];
+			Classes[res.id] = NULL;
+			while (r)
+			{
+				Resolver* next = r->next;
+				r->OnLookupComplete(res.result, res.ttl, false);
+				delete r;
+				r = next;
 			}
 		}
+	}
+
+	if (ServerInstance && ServerInstance->stats)
+		ServerInstance->stats->statsDns++;
+}
 
-		if (ServerInstance && ServerInstance->stats)
-			ServerInstance->stats->statsDns++;
+void DNS::FailResolvers(int id, ResolverError e, const std::string &errormessage)
+{
+	Resolver* r = Classes[id];
+	Classes[id] = NULL;
+	while (r)
+	{
+		Resolver* next = r->next;
+		r->OnError(e, errormessage);
+		delete r;
+		r = next;
 	}
 }
 
@@ -1103,19 +1733,15 @@ bool DNS::AddResolverClass(Resolver* r)
 	/* Check the pointers validity and the id's validity */
 	if ((r) && (r->GetId() > -1))
 	{
-		/* Check the slot isnt already occupied -
-		 * This should NEVER happen unless we have
-		 * a severely broken DNS server somewhere
+		/* If another lookup of the same thing got there first,
+		 * wait behind it for the same reply
 		 */
-		if (!Classes[r->GetId()])
-		{
-			/* Set up the pointer to the class */
-			Classes[r->GetId()] = r;
-			return true;
-		}
-		else
-			/* Duplicate id */
-			return false;
+		Resolver** tail = &Classes[r->GetId()];
+		while (*tail)
+			tail = &(*tail)->next;
+		r->next = NULL;
+		*tail = r;
+		return true;
 	}
 	else
 	{
@@ -1133,14 +1759,18 @@ void DNS::CleanResolvers(Module* module)
 {
 	for (int i = 0; i < MAX_REQUEST_ID; i++)
 	{
-		if (Classes[i])
+		Resolver** r = &Classes[i];
+		while (*r)
 		{
-			if (Classes[i]->GetCreator() == module)
+			if ((*r)->GetCreator() == module)
 			{
-				Classes[i]->OnError(RESLOVER_FORCEUNLOAD, "Parent module is unloading");
-				delete Classes[i];
-				Classes[i] = NULL;
+				Resolver* gone = *r;
+				*r = gone->next;
+				gone->OnError(RESLOVER_FORCEUNLOAD, "Parent module is unloading");
+				delete gone;
 			}
+			else
+				r = &(*r)->next;
 		}
 	}
 }
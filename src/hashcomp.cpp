@@ -13,6 +13,7 @@
 
 #include "inspircd.h"
 #include "hashcomp.h"
+#include "stringtable.h"
 #ifndef WIN32
 #include <ext/hash_map>
 #define nspace __gnu_cxx
@@ -617,3 +618,47 @@ unsigned char irc::dynamicbitmask::GetSize()
 	return bits_size;
 }
 
+
+const char* StringTable::Acquire(const char* s, size_t maxlen)
+{
+	std::string truncated;
+	size_t len = strlen(s);
+	if ((maxlen) && (len > maxlen))
+	{
+		truncated.assign(s, maxlen);
+		s = truncated.c_str();
+		len = maxlen;
+	}
+
+	if (!len)
+		return "";
+
+	Table::iterator i = table.find(s);
+	if (i != table.end())
+	{
+		Header(*i)->refs++;
+		return *i;
+	}
+
+	size_t size = offsetof(Entry, text) + len + 1;
+	Entry* e = (Entry*)malloc(size);
+	e->refs = 1;
+	memcpy(e->text, s, len + 1);
+	table.insert(e->text);
+	bytes += size;
+	return e->text;
+}
+
+void StringTable::Release(const char* s)
+{
+	if (!*s)
+		return;
+
+	Entry* e = Header(s);
+	if (--e->refs)
+		return;
+
+	table.erase(e->text);
+	bytes -= offsetof(Entry, text) + strlen(e->text) + 1;
+	free(e);
+}
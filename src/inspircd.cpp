@@ -40,6 +40,7 @@
 #include "typedefs.h"
 #include "command_parse.h"
 #include "exitcodes.h"
+#include "slabpool.h"
 
 #ifdef WIN32
 
@@ -309,8 +310,7 @@ void InspIRCd::Rehash(int status)
 	SI->WriteOpers("*** Rehashing config file %s due to SIGHUP",ServerConfig::CleanFilename(SI->ConfigFileName));
 	SI->CloseLog();
 	SI->OpenLog(SI->Config->argv, SI->Config->argc);
-	SI->RehashUsersAndChans();
-	FOREACH_MOD_I(SI, I_OnGarbageCollect, OnGarbageCollect());
+	SI->GarbageCollect();
 	SI->Config->Read(false,NULL);
 	SI->ResetMaxBans();
 	SI->Res->Rehash();
@@ -325,32 +325,6 @@ void InspIRCd::ResetMaxBans()
 }
 
 
-/** Because hash_map doesnt free its buckets when we delete items (this is a 'feature')
- * we must occasionally rehash the hash (yes really).
- * We do this by copying the entries from the old hash to a new hash, causing all
- * empty buckets to be weeded out of the hash. We dont do this on a timer, as its
- * very expensive, so instead we do it when the user types /REHASH and expects a
- * short delay anyway.
- */
-void InspIRCd::RehashUsersAndChans()
-{
-	user_hash* old_users = this->clientlist;
-	chan_hash* old_chans = this->chanlist;
-
-	this->clientlist = new user_hash();
-	this->chanlist = new chan_hash();
-
-	for (user_hash::const_iterator n = old_users->begin(); n != old_users->end(); n++)
-		this->clientlist->insert(*n);
-
-	delete old_users;
-
-	for (chan_hash::const_iterator n = old_chans->begin(); n != old_chans->end(); n++)
-		this->chanlist->insert(*n);
-
-	delete old_chans;
-}
-
 void InspIRCd::CloseLog()
 {
 	this->Logger->Close();
@@ -569,6 +543,10 @@ InspIRCd::InspIRCd(int argc, char** argv)
 	this->Timers = new TimerManager(this);
 	this->Parser = new CommandParser(this);
 	this->XLines = new XLineManager(this);
+	this->Admission = new AdmissionManager(this);
+	this->Indexes = new UserIndex(this);
+	this->Directory = new ChannelDirectory(this);
+	this->Strings = new StringTable();
 	Config->ClearStack();
 	Config->Read(true, NULL);
 
@@ -831,7 +809,7 @@ void InspIRCd::BuildISupport()
 	std::stringstream v;
 	v << "WALLCHOPS WALLVOICES MODES=" << MAXMODES-1 << " CHANTYPES=# PREFIX=" << this->Modes->BuildPrefixes() << " MAP MAXCHANNELS=" << Config->MaxChans << " MAXBANS=60 VBANLIST NICKLEN=" << NICKMAX-1;
 	v << " CASEMAPPING=rfc1459 STATUSMSG=@%+ CHARSET=ascii TOPICLEN=" << MAXTOPIC << " KICKLEN=" << MAXKICK << " MAXTARGETS=" << Config->MaxTargets << " AWAYLEN=";
-	v << MAXAWAY << " CHANMODES=" << this->Modes->ChanModes() << " FNC NETWORK=" << Config->Network << " MAXPARA=32 ELIST=MU";
+	v << MAXAWAY << " CHANMODES=" << this->Modes->ChanModes() << " FNC NETWORK=" << Config->Network << " MAXPARA=32 ELIST=MU SAFELIST";
 	Config->data005 = v.str();
 	FOREACH_MOD_I(this,I_On005Numeric,On005Numeric(Config->data005));
 	Config->Update005();
@@ -1054,6 +1032,17 @@ bool InspIRCd::LoadModule(const char* filename)
 	return true;
 }
 
+void InspIRCd::GarbageCollect()
+{
+	FOREACH_MOD_I(this, I_OnGarbageCollect, OnGarbageCollect());
+	if (Config->ReleaseSlabs)
+	{
+		size_t released = SlabPool::ReleaseAll();
+		if (released)
+			this->Log(DEBUG, "Released %lu bytes of empty slabs", (unsigned long)released);
+	}
+}
+
 void InspIRCd::DoOneIteration(bool process_module_sockets)
 {
 #ifndef WIN32
@@ -1081,8 +1070,7 @@ void InspIRCd::DoOneIteration(bool process_module_sockets)
 			WriteOpers("*** \002EH?!\002 -- Time is flowing BACKWARDS in this dimension! Clock drifted backwards %d secs.",abs(OLDTIME-TIME));
 		if ((TIME % 3600) == 0)
 		{
-			this->RehashUsersAndChans();
-			FOREACH_MOD_I(this, I_OnGarbageCollect, OnGarbageCollect());
+			this->GarbageCollect();
 		}
 		Timers->TickTimers(TIME);
 		this->DoBackgroundUserStuff(TIME);
@@ -1123,6 +1111,12 @@ void InspIRCd::DoOneIteration(bool process_module_sockets)
 	 */
 	SE->DispatchEvents();
 
+	/* If someone became ready to connect part way through this second,
+	 * e.g. their hostname lookup came back, connect them now rather than
+	 * on the next tick
+	 */
+	this->ConnectReadyUsers();
+
 	/* if any users was quit, take them out */
 	GlobalCulls.Apply();
 
@@ -1208,20 +1202,20 @@ int InspIRCd::SetTimeDelta(int delta)
 
 void InspIRCd::AddLocalClone(userrec* user)
 {
-	clonemap::iterator x = local_clones.find(user->GetIPString());
+	clonemap::iterator x = local_clones.find(user->ipkey);
 	if (x != local_clones.end())
 		x->second++;
 	else
-		local_clones[user->GetIPString()] = 1;
+		local_clones[user->ipkey] = 1;
 }
 
 void InspIRCd::AddGlobalClone(userrec* user)
 {
-	clonemap::iterator y = global_clones.find(user->GetIPString());
+	clonemap::iterator y = global_clones.find(user->ipkey);
 	if (y != global_clones.end())
 		y->second++;
 	else
-		global_clones[user->GetIPString()] = 1;
+		global_clones[user->ipkey] = 1;
 }
 
 int InspIRCd::GetTimeDelta()
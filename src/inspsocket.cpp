@@ -748,6 +748,18 @@ void InspSocket::HandleEvent(EventType et, int errornum)
 						this->Instance->SocketCull[this] = this;
 					return;
 				}
+				/* Let a hooking module send what it has buffered */
+				if ((this->IsIOHooked) && (outbuffer.empty()))
+				{
+					try
+					{
+						Instance->Config->GetIOHook(this)->OnRawSocketWrite(this->fd, NULL, 0);
+					}
+					catch (CoreException& modexcept)
+					{
+						Instance->Log(DEBUG,"%s threw an exception: %s", modexcept.GetSource(), modexcept.GetReason());
+					}
+				}
 			}
 		break;
 	}
@@ -181,26 +181,14 @@ const char* ModeParser::Grant(userrec *d,chanrec *chan,int MASK)
 	if (!chan)
 		return "";
 
-	UCListIter n = d->chans.find(chan);
-	if (n != d->chans.end())
+	Membership* n = chan->GetMembership(d);
+	if (n)
 	{
-		if (n->second & MASK)
+		if (n->status & MASK)
 		{
 			return "";
 		}
-		n->second = n->second | MASK;
-		switch (MASK)
-		{
-			case UCMODE_OP:
-				n->first->AddOppedUser(d);
-			break;
-			case UCMODE_HOP:
-				n->first->AddHalfoppedUser(d);
-			break;
-			case UCMODE_VOICE:
-				n->first->AddVoicedUser(d);
-			break;
-		}
+		n->status |= MASK;
 		return d->nick;
 	}
 	return "";
@@ -211,26 +199,14 @@ const char* ModeParser::Revoke(userrec *d,chanrec *chan,int MASK)
 	if (!chan)
 		return "";
 
-	UCListIter n = d->chans.find(chan);
-	if (n != d->chans.end())
+	Membership* n = chan->GetMembership(d);
+	if (n)
 	{
-		if ((n->second & MASK) == 0)
+		if ((n->status & MASK) == 0)
 		{
 			return "";
 		}
-		n->second ^= MASK;
-		switch (MASK)
-		{
-			case UCMODE_OP:
-				n->first->DelOppedUser(d);
-			break;
-			case UCMODE_HOP:
-				n->first->DelHalfoppedUser(d);
-			break;
-			case UCMODE_VOICE:
-				n->first->DelVoicedUser(d);
-			break;
-		}
+		n->status ^= MASK;
 		return d->nick;
 	}
 	return "";
@@ -710,6 +686,27 @@ bool ModeParser::AddMode(ModeHandler* mh, unsigned const char modeletter)
 	if (modehandlers[pos])
 		return false;
 
+	if ((mh->GetPrefix()) && (mh->GetModeType() == MODETYPE_CHANNEL))
+	{
+		/* Give the prefix a bit of its own, and slot it in by rank */
+		if ((prefixbits[(unsigned char)mh->GetPrefix()]) || (usedprefixbits == ~0U))
+			return false;
+
+		PrefixSlot slot;
+		slot.handler = mh;
+		slot.prefix = mh->GetPrefix();
+		slot.rank = mh->GetPrefixRank();
+		for (slot.bit = 1; usedprefixbits & slot.bit; slot.bit <<= 1);
+
+		std::vector<PrefixSlot>::iterator i = prefixslots.begin();
+		while ((i != prefixslots.end()) && (i->rank >= slot.rank))
+			i++;
+		prefixslots.insert(i, slot);
+
+		usedprefixbits |= slot.bit;
+		prefixbits[(unsigned char)slot.prefix] = slot.bit;
+	}
+
 	modehandlers[pos] = mh;
 	return true;
 }
@@ -746,6 +743,28 @@ bool ModeParser::DelMode(ModeHandler* mh)
 
 	modehandlers[pos] = NULL;
 
+	for (std::vector<PrefixSlot>::iterator i = prefixslots.begin(); i != prefixslots.end(); i++)
+	{
+		if (i->handler == mh)
+		{
+			/* RemoveMode() will normally have taken the prefix off everyone
+			 * already, but the bit must be clear before another mode gets it.
+			 */
+			for (chan_hash::iterator c = ServerInstance->chanlist->begin(); c != ServerInstance->chanlist->end(); c++)
+			{
+				MemberList* members = c->second->GetUsers();
+				for (MemberList::iterator m = members->begin(); m != members->end(); m++)
+					(*m)->prefixes &= ~i->bit;
+				c->second->InvalidateNames();
+			}
+
+			usedprefixbits &= ~i->bit;
+			prefixbits[(unsigned char)i->prefix] = 0;
+			prefixslots.erase(i);
+			break;
+		}
+	}
+
 	return true;
 }
 
@@ -819,14 +838,10 @@ std::string ModeParser::ParaModeList()
 
 ModeHandler* ModeParser::FindPrefix(unsigned const char pfxletter)
 {
-	for (unsigned char mode = 'A'; mode <= 'z'; mode++)
+	for (std::vector<PrefixSlot>::const_iterator i = prefixslots.begin(); i != prefixslots.end(); i++)
 	{
-		unsigned char pos = (mode-65) | MASK_CHANNEL;
-
-		if ((modehandlers[pos]) && (modehandlers[pos]->GetPrefix() == pfxletter))
-		{
-			return modehandlers[pos];
-		}
+		if ((unsigned char)i->prefix == pfxletter)
+			return i->handler;
 	}
 	return NULL;
 }
@@ -1059,6 +1074,8 @@ ModeParser::ModeParser(InspIRCd* Instance) : ServerInstance(Instance)
 	/* Clear mode list */
 	memset(modehandlers, 0, sizeof(modehandlers));
 	memset(modewatchers, 0, sizeof(modewatchers));
+	memset(prefixbits, 0, sizeof(prefixbits));
+	usedprefixbits = 0;
 
 	/* Last parse string */
 	LastParse.clear();
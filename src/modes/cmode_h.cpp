@@ -47,16 +47,16 @@ ModePair ModeChannelHalfOp::ModeSet(userrec* source, userrec* dest, chanrec* cha
 
 void ModeChannelHalfOp::RemoveMode(chanrec* channel)
 {
-	CUList* list = channel->GetHalfoppedUsers();
+	MemberList* list = channel->GetUsers();
 	CUList copy;
 	char moderemove[MAXBUF];
 	userrec* n = new userrec(ServerInstance);
 	n->SetFd(FD_MAGIC_NUMBER);
 
-	for (CUList::iterator i = list->begin(); i != list->end(); i++)
+	for (MemberList::iterator i = list->begin(); i != list->end(); i++)
 	{
-		userrec* n = i->first;
-		copy.insert(std::make_pair(n,n->nick));
+		if ((*i)->status & UCMODE_HOP)
+			copy.insert(std::make_pair((*i)->user,(*i)->user->nick));
 	}
 	for (CUList::iterator i = copy.begin(); i != copy.end(); i++)
 	{
@@ -48,16 +48,16 @@ ModePair ModeChannelOp::ModeSet(userrec* source, userrec* dest, chanrec* channel
 
 void ModeChannelOp::RemoveMode(chanrec* channel)
 {
-	CUList* list = channel->GetOppedUsers();
+	MemberList* list = channel->GetUsers();
 	CUList copy;
 	char moderemove[MAXBUF];
 	userrec* n = new userrec(ServerInstance);
 	n->SetFd(FD_MAGIC_NUMBER);
 
-	for (CUList::iterator i = list->begin(); i != list->end(); i++)
+	for (MemberList::iterator i = list->begin(); i != list->end(); i++)
 	{
-		userrec* n = i->first;
-		copy.insert(std::make_pair(n,n->nick));
+		if ((*i)->status & UCMODE_OP)
+			copy.insert(std::make_pair((*i)->user,(*i)->user->nick));
 	}
 	for (CUList::iterator i = copy.begin(); i != copy.end(); i++)
 	{
@@ -152,6 +152,7 @@ int		Module::OnAddBan(userrec* source, chanrec* channel,const std::string &banma
 int		Module::OnDelBan(userrec* source, chanrec* channel,const std::string &banmask) { return 0; }
 void		Module::OnRawSocketAccept(int fd, const std::string &ip, int localport) { }
 int		Module::OnRawSocketWrite(int fd, const char* buffer, int count) { return 0; }
+size_t		Module::OnRawSocketQueued(int fd) { return 0; }
 void		Module::OnRawSocketClose(int fd) { }
 void		Module::OnRawSocketConnect(int fd) { }
 int		Module::OnRawSocketRead(int fd, char* buffer, unsigned int count, int &readresult) { return 0; }
@@ -347,7 +348,6 @@ const std::string& InspIRCd::GetModuleName(Module* m)
 void InspIRCd::RehashServer()
 {
 	this->WriteOpers("*** Rehashing config file");
-	this->RehashUsersAndChans();
 	this->Config->Read(false,NULL);
 	this->ResetMaxBans();
 	this->Res->Rehash();
@@ -0,0 +1,109 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2007 InspIRCd Development Team
+ * See: http://www.inspircd.org/wiki/index.php/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#include "inspircd.h"
+#include "users.h"
+#include "channels.h"
+#include "modules.h"
+
+/* $ModDesc: Times Extensible lookups by slot and by string key */
+
+/** Number of items attached to the object, about as many as a
+ * user carries on a server running the usual modules
+ */
+static const unsigned int BenchItems = 8;
+
+/** Number of lookups timed for each method
+ */
+static const unsigned int BenchLookups = 2000000;
+
+class ModuleExtBench : public Module
+{
+	static double PerLookup(const timeval &since)
+	{
+		timeval now;
+		gettimeofday(&now, NULL);
+		return ((now.tv_sec - since.tv_sec) * 1000000.0 + now.tv_usec - since.tv_usec) * 1000.0 / BenchLookups;
+	}
+
+ public:
+	ModuleExtBench(InspIRCd* Me)
+		: Module::Module(Me)
+	{
+		Extensible object;
+		ExtensionSlot slots[BenchItems];
+		std::string keys[BenchItems];
+		/* The per-object store Extensible used before slots */
+		std::map<std::string, char*> oldstore;
+
+		for (unsigned int n = 0; n < BenchItems; n++)
+		{
+			keys[n] = "extbench_" + ConvToStr(n);
+			slots[n] = Extensible::RegisterExt(keys[n]);
+			object.Extend(slots[n], (char*)(keys[n].c_str()));
+			oldstore[keys[n]] = (char*)(keys[n].c_str());
+		}
+
+		unsigned long found[4] = { 0, 0, 0, 0 };
+		double took[4];
+		char* p;
+		timeval start;
+
+		gettimeofday(&start, NULL);
+		for (unsigned int i = 0; i < BenchLookups; i++)
+			if (object.GetExt(slots[i % BenchItems], p))
+				found[0] += (p == keys[i % BenchItems].c_str());
+		took[0] = PerLookup(start);
+
+		gettimeofday(&start, NULL);
+		for (unsigned int i = 0; i < BenchLookups; i++)
+			if (object.GetExt(keys[i % BenchItems], p))
+				found[1] += (p == keys[i % BenchItems].c_str());
+		took[1] = PerLookup(start);
+
+		/* Most modules pass a string literal, which becomes a std::string on each call */
+		gettimeofday(&start, NULL);
+		for (unsigned int i = 0; i < BenchLookups; i++)
+			if (object.GetExt(keys[i % BenchItems].c_str(), p))
+				found[2] += (p == keys[i % BenchItems].c_str());
+		took[2] = PerLookup(start);
+
+		gettimeofday(&start, NULL);
+		for (unsigned int i = 0; i < BenchLookups; i++)
+		{
+			std::map<std::string, char*>::iterator it = oldstore.find(keys[i % BenchItems].c_str());
+			if (it != oldstore.end())
+				found[3] += (it->second == keys[i % BenchItems].c_str());
+		}
+		took[3] = PerLookup(start);
+
+		ServerInstance->Log(DEFAULT, "m_extbench: %u items, %u lookups each: slot %.1fns, std::string key %.1fns, char* key %.1fns, std::map<std::string> store %.1fns",
+				BenchItems, BenchLookups, took[0], took[1], took[2], took[3]);
+
+		const char* methods[] = { "slot", "std::string key", "char* key", "std::map<std::string> store" };
+		for (unsigned int n = 0; n < 4; n++)
+			if (found[n] != BenchLookups)
+				throw ModuleException(std::string("m_extbench: Lookups by ") + methods[n] + " returned the wrong item");
+	}
+
+	virtual ~ModuleExtBench()
+	{
+	}
+
+	virtual Version GetVersion()
+	{
+		return Version(1, 1, 0, 0, VF_VENDOR, API_VERSION);
+	}
+};
+
+MODULE_INIT(ModuleExtBench);
@@ -50,9 +50,14 @@ class ModuleFilterPCRE : public FilterBase
 	int erroffset;
 	PCREFilter fr;
 
+	/* Prefilter ids are indexes into filters, valid while !dirty */
+	FilterPrefilter prefilter;
+	std::vector<unsigned int> candidates;
+	bool dirty;
+
  public:
 	ModuleFilterPCRE(InspIRCd* Me)
-	: FilterBase(Me, "m_filter_pcre.so")
+	: FilterBase(Me, "m_filter_pcre.so"), dirty(true)
 	{
 		OnRehash(NULL,"");
 	}
@@ -61,23 +66,38 @@ class ModuleFilterPCRE : public FilterBase
 	{
 	}
 
+	void Compile()
+	{
+		prefilter.Clear();
+		for (std::vector<PCREFilter>::iterator i = filters.begin(); i != filters.end(); i++)
+			prefilter.Add(FilterPrefilter::RegexFragment(i->freeform));
+		prefilter.Compile();
+		dirty = false;
+	}
+
 	virtual FilterResult* FilterMatch(userrec* user, const std::string &text, int flags)
 	{
-		for (std::vector<PCREFilter>::iterator index = filters.begin(); index != filters.end(); index++)
+		if (dirty)
+			this->Compile();
+
+		prefilter.GetCandidates(text, candidates);
+
+		for (std::vector<unsigned int>::iterator i = candidates.begin(); i != candidates.end(); i++)
 		{
-			/* Skip ones that dont apply to us */
+			PCREFilter* index = &filters[*i];
 
-			if (!FilterBase::AppliesToMe(user, dynamic_cast<FilterResult*>(&(*index)), flags))
+			/* Skip ones that dont apply to us */
+			if (!FilterBase::AppliesToMe(user, dynamic_cast<FilterResult*>(index), flags))
 				continue;
 
-			if (pcre_exec(index->regexp, NULL, text.c_str(), text.length(), 0, 0, NULL, 0) > -1)
+			timeval start;
+			gettimeofday(&start, NULL);
+			bool matched = (pcre_exec(index->regexp, NULL, text.c_str(), text.length(), 0, 0, NULL, 0) > -1);
+			index->Account(start, matched);
+
+			if (matched)
 			{
 				fr = *index;
-				if (index != filters.begin())
-				{
-					filters.erase(index);
-					filters.insert(filters.begin(), fr);
-				}
 				return &fr;
 			}
 		}
@@ -92,6 +112,7 @@ class ModuleFilterPCRE : public FilterBase
 			{
 				pcre_free((*i).regexp);
 				filters.erase(i);
+				dirty = true;
 				return true;
 			}
 		}
@@ -127,6 +148,7 @@ class ModuleFilterPCRE : public FilterBase
 		else
 		{
 			filters.push_back(PCREFilter(re, reason, type, duration, freeform, flags));
+			dirty = true;
 			return std::make_pair(true, "");
 		}
 	}
@@ -162,6 +184,7 @@ class ModuleFilterPCRE : public FilterBase
 				ServerInstance->Log(DEFAULT,"Regular expression %s loaded.", pattern.c_str());
 			}
 		}
+		dirty = true;
 	}
 
 	virtual int OnStats(char symbol, userrec* user, string_list &results)
@@ -172,6 +195,7 @@ class ModuleFilterPCRE : public FilterBase
 			for (std::vector<PCREFilter>::iterator i = filters.begin(); i != filters.end(); i++)
 			{
 				results.push_back(sn+" 223 "+user->nick+" :REGEXP:"+i->freeform+" "+i->flags+" "+i->action+" "+ConvToStr(i->gline_time)+" :"+i->reason);
+				this->StatsCounters(user, &(*i), results);
 			}
 		}
 		return 0;
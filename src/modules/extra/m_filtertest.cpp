@@ -0,0 +1,107 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2007 InspIRCd Development Team
+ * See: http://www.inspircd.org/wiki/index.php/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#include "inspircd.h"
+#include "users.h"
+#include "channels.h"
+#include "modules.h"
+#include "m_filter.h"
+
+/* $ModDesc: Checks the literal fragments the filter prefilter takes from globs and regexps */
+/* $ModDep: m_filter.h */
+
+/** One pattern, the fragment expected from it, and a line it matches,
+ * which the prefilter must let through
+ */
+struct FragmentCase
+{
+	bool regexp;
+	const char* pattern;
+	const char* fragment;
+	const char* line;
+};
+
+static const FragmentCase cases[] = {
+	{ false, "*some*spam*", "some", "here is some spam" },
+	{ false, "*", "", "anything" },
+	{ true, "buy cheap", "buy cheap", "BUY CHEAP now" },
+	{ true, "a\\.b", "a.b", "a.b" },
+	{ true, "(foo)barbaz", "barbaz", "foobarbaz" },
+	{ true, "free|cheap", "", "cheap" },
+	{ true, "spam\\d+more", "spam", "spam42more" },
+	{ true, "colou?r", "colo", "color" },
+	{ true, "\\Qa.b\\E", "", "a.b" },
+	/* Hex escapes: the digits are not literal text */
+	{ true, "foo\\x41bar", "foo", "fooAbar" },
+	{ true, "ab\\x{41}cdef", "cdef", "abAcdef" },
+	{ true, "\\x4", "", "\x04" },
+	{ true, "[\\x41-\\x5a]+xyz", "xyz", "QQxyz" },
+	/* Octal escapes and backreferences */
+	{ true, "ab\\101cdef", "cdef", "abAcdef" },
+	{ true, "\\0123four", "four", "\nfour" },
+	{ true, "\\012xyzw", "xyzw", "\nxyzw" },
+	{ true, "(a)\\1bcde", "bcde", "aabcde" },
+	{ true, "x\\o{101}yyyy", "yyyy", "xAyyyy" },
+	/* Other escapes with an argument */
+	{ true, "\\cAhello", "hello", "\x01hello" },
+	{ true, "\\N{U+41}zzzz", "zzzz", "Azzzz" },
+	{ true, "\\p{Lu}word", "word", "Xword" },
+	{ true, "\\pLword", "word", "Xword" },
+	{ true, "(?<n>a)\\k<n>bcd", "", "aabcd" },
+	{ NULL, NULL, NULL, NULL }
+};
+
+class ModuleFilterTest : public Module
+{
+ public:
+	ModuleFilterTest(InspIRCd* Me)
+		: Module::Module(Me)
+	{
+		int failed = 0;
+		int total = 0;
+
+		for (const FragmentCase* c = cases; c->pattern; c++, total++)
+		{
+			std::string fragment = c->regexp ? FilterPrefilter::RegexFragment(c->pattern) : FilterPrefilter::GlobFragment(c->pattern);
+
+			FilterPrefilter prefilter;
+			prefilter.Add(fragment);
+			prefilter.Compile();
+			std::vector<unsigned int> candidates;
+			prefilter.GetCandidates(c->line, candidates);
+
+			if ((fragment != c->fragment) || (candidates.size() != 1))
+			{
+				ServerInstance->Log(DEFAULT, "m_filtertest: '%s' gave fragment '%s', expected '%s', %s its line", c->pattern, fragment.c_str(), c->fragment,
+						candidates.size() ? "matching" : "NOT matching");
+				failed++;
+			}
+		}
+
+		if (failed)
+			throw ModuleException("m_filtertest: " + ConvToStr(failed) + " of " + ConvToStr(total) + " cases failed, see the log");
+
+		ServerInstance->Log(DEFAULT, "m_filtertest: All %d cases passed", total);
+	}
+
+	virtual ~ModuleFilterTest()
+	{
+	}
+
+	virtual Version GetVersion()
+	{
+		return Version(1, 1, 0, 0, VF_VENDOR, API_VERSION);
+	}
+};
+
+MODULE_INIT(ModuleFilterTest);
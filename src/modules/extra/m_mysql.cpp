@@ -13,7 +13,10 @@
 
 #include "inspircd.h"
 #include <mysql.h>
+#include <errmsg.h>
+#include <mysqld_error.h>
 #include <pthread.h>
+#include <fcntl.h>
 #include "users.h"
 #include "channels.h"
 #include "modules.h"
@@ -32,21 +35,20 @@
  * that instead, you should thread your program. This is what i've done here to allow for
  * asyncronous SQL requests via mysql. The way this works is as follows:
  *
- * The module spawns a thread via pthreads, and performs its mysql queries in this thread,
- * using a queue with priorities. There is a mutex on either end which prevents two threads
- * adjusting the queue at the same time, and crashing the ircd. Every 50 milliseconds, the
- * worker thread wakes up, and checks if there is a request at the head of its queue.
- * If there is, it processes this request, blocking the worker thread but leaving the ircd
- * thread to go about its business as usual. During this period, the ircd thread is able
- * to insert futher pending requests into the queue.
+ * Each <database> gets a ConnectionPool, which opens poolsize connections to the database,
+ * each with a thread of its own. Requests go on the pool's queue, which has priorities, and
+ * whichever thread is free takes the next one off it, so one slow query only holds up one
+ * connection. Each pool has its own mutex, so the threads of one database never wait on
+ * those of another, and none of them poll: they sleep on a condition until there is work.
  *
- * Once the processing of a request is complete, it is removed from the incoming queue to
- * an outgoing queue, and initialized as a 'response'. The worker thread then signals the
- * ircd thread (via a loopback socket) of the fact a result is available, by sending the
- * connection ID through the connection.
+ * Once a query is complete, its result goes on the pool's queue of results, and the thread
+ * signals the ircd thread by writing a byte down a pipe, whose other end is in the socket
+ * engine. The ircd thread then takes every result off the queue, and sends each on its way
+ * to the original calling module.
  *
- * The ircd thread then mutexes the queue once more, reads the outbound response off the head
- * of the queue, and sends it on its way to the original calling module.
+ * Each connection keeps the statements it has prepared, by their text, so that queries which
+ * differ only in their '?' parameters are parsed by the server once, and just executed after
+ * that (see SQLparameters in m_sqlv2.h).
  *
  * XXX: You might be asking "why doesnt he just send the response from within the worker thread?"
  * The answer to this is simple. The majority of InspIRCd, and in fact most ircd's are not
@@ -56,34 +58,23 @@
  * if a module is ever put in a re-enterant state (stack corruption could occur, crashes, data
  * corruption, and worse, so DONT think about it until the day comes when InspIRCd is 100%
  * gauranteed threadsafe!)
- *
- * For a diagram of this system please see http://www.inspircd.org/wiki/Mysql2
  */
 
 
-class SQLConnection;
-class Notifier;
+class ConnectionPool;
 
 
-typedef std::map<std::string, SQLConnection*> ConnMap;
-bool giveup = false;
-static Module* SQLModule = NULL;
-static Notifier* MessagePipe = NULL;
-int QueueFD = -1;
+typedef std::map<std::string, ConnectionPool*> ConnMap;
 
 
 #if !defined(MYSQL_VERSION_ID) || MYSQL_VERSION_ID<32224
 #define mysql_field_count mysql_num_fields
 #endif
 
-typedef std::deque<SQLresult*> ResultQueue;
-
-/* A mutex to wrap around queue accesses */
-pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-pthread_mutex_t results_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-pthread_mutex_t logging_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* MySQL 8 uses bool where it used my_bool, and no longer defines it. MariaDB still does. */
+#if defined(MYSQL_VERSION_ID) && (MYSQL_VERSION_ID >= 80001) && !defined(MARIADB_BASE_VERSION) && !defined(MARIADB_PACKAGE_VERSION_ID)
+typedef bool my_bool;
+#endif
 
 /** Represents a mysql result set
  */
@@ -97,8 +88,13 @@ class MySQLresult : public SQLresult
 	SQLfieldList emptyfieldlist;
 	int rows;
  public:
+	/** When the query was started and finished, and whether it reused a prepared statement, for SQLstats
+	 */
+	unsigned long long started, finished;
+	bool reused;
 
-	MySQLresult(Module* self, Module* to, MYSQL_RES* res, int affected_rows, unsigned int id) : SQLresult(self, to, id), currentrow(0), fieldmap(NULL)
+	MySQLresult(Module* self, Module* to, MYSQL_RES* res, int affected_rows, unsigned int id) : SQLresult(self, to, id), currentrow(0), fieldmap(NULL),
+		started(0), finished(0), reused(false)
 	{
 		/* A number of affected rows from from mysql_affected_rows.
 		 */
@@ -144,12 +140,40 @@ class MySQLresult : public SQLresult
 		}
 	}
 
-	MySQLresult(Module* self, Module* to, SQLerror e, unsigned int id) : SQLresult(self, to, id), currentrow(0)
+	MySQLresult(Module* self, Module* to, SQLerror e, unsigned int id) : SQLresult(self, to, id), currentrow(0), fieldmap(NULL), started(0), finished(0), reused(false)
 	{
 		rows = 0;
 		error = e;
 	}
 
+	/** Make an empty result, to be filled in from a prepared statement
+	 */
+	MySQLresult(Module* self, Module* to, unsigned int id) : SQLresult(self, to, id), currentrow(0), fieldmap(NULL), rows(0),
+		started(0), finished(0), reused(false)
+	{
+	}
+
+	void SetColumns(MYSQL_FIELD* fields, unsigned int count)
+	{
+		colnames.clear();
+		for (unsigned int i = 0; i < count; i++)
+			colnames.push_back(fields[i].name ? fields[i].name : "");
+	}
+
+	void AddRow(const SQLfieldList &row)
+	{
+		fieldlists.push_back(row);
+		rows++;
+	}
+
+	/** Set the number of rows a statement with no result set changed
+	 */
+	void SetAffected(int affected_rows)
+	{
+		rows = (affected_rows >= 1) ? affected_rows : 0;
+		fieldlists.resize(rows);
+	}
+
 	~MySQLresult()
 	{
 	}
@@ -267,212 +291,723 @@ class MySQLresult : public SQLresult
 	}
 };
 
-class SQLConnection;
 
-void NotifyMainThread(SQLConnection* connection_with_new_result);
+typedef std::deque<MySQLresult*> ResultQueue;
 
-/** Represents a connection to a mysql database
+/** A prepared statement kept for reuse, see SQLConnection::statements
  */
-class SQLConnection : public classbase
+struct CachedStatement
+{
+	/** The statement, or NULL if the server can't prepare this text, so it is always sent as it is
+	 */
+	MYSQL_STMT* stmt;
+	unsigned long lastused;
+};
+
+/** Where one column of a prepared statement's rows is fetched to
+ */
+struct FetchColumn
+{
+	std::vector<char> buffer;
+	unsigned long length;
+	my_bool null;
+
+	FetchColumn() : buffer(64), length(0), null(0)
+	{
+	}
+};
+
+/** Represents a connection to a mysql database, and the thread which runs its
+ * queries. Apart from starting and joining the thread, all of this is only
+ * used on that thread.
+ */
+class SQLConnection : public classbase, public SQLparameters
 {
  protected:
 
 	MYSQL connection;
-	MYSQL_RES *res;
-	MYSQL_ROW row;
 	SQLhost host;
-	std::map<std::string,std::string> thisrow;
-	bool Enabled;
+	ConnectionPool* pool;
+	bool connected;
+	pthread_t thread;
+	bool running;
 
- public:
+	/** Why the last connection attempt failed
+	 */
+	std::string lasterror;
 
-	QueryQueue queue;
-	ResultQueue rq;
+	/** Prepared statements by the text they were prepared from
+	 */
+	std::map<std::string, CachedStatement> statements;
 
-	// This constructor creates an SQLConnection object with the given credentials, but does not connect yet.
-	SQLConnection(const SQLhost &hi) : host(hi), Enabled(false)
+	/** Counts statement uses, to find the one least recently used
+	 */
+	unsigned long statementclock;
+
+	static void* Entry(void* arg)
+	{
+		((SQLConnection*)arg)->Work();
+		return NULL;
+	}
+
+ public:
+
+	SQLConnection(const SQLhost &hi, ConnectionPool* p) : host(hi), pool(p), connected(false), running(false), statementclock(0)
 	{
 	}
 
 	~SQLConnection()
 	{
-		Close();
+		Join();
 	}
 
-	// This method connects to the database using the credentials supplied to the constructor, and returns
-	// true upon success.
-	bool Connect()
+	/** Start the thread, which connects and then waits for queries
+	 */
+	bool Start()
 	{
-		unsigned int timeout = 1;
-		mysql_init(&connection);
-		mysql_options(&connection,MYSQL_OPT_CONNECT_TIMEOUT,(char*)&timeout);
-		return mysql_real_connect(&connection, host.host.c_str(), host.user.c_str(), host.pass.c_str(), host.name.c_str(), host.port, NULL, 0);
+		running = !pthread_create(&thread, NULL, Entry, this);
+		return running;
 	}
 
-	void DoLeadingQuery()
+	/** Wait for the thread to finish, once the pool has told it to
+	 */
+	void Join()
 	{
-		if (!CheckConnection())
+		if (running)
+		{
+			pthread_join(thread, NULL);
+			running = false;
+		}
+	}
+
+	void Work();
+	bool Connect();
+	void Close();
+	MySQLresult* Execute(SQLrequest &req, bool reconnect);
+
+	/** Escape with the connection's character set. With no connection the handle
+	 * was never set up (or has been closed), so escape the characters
+	 * mysql_real_escape_string would. That is right for utf8 and latin1 text, though
+	 * not for multibyte sets such as GBK.
+	 */
+	virtual std::string Escape(const std::string &param)
+	{
+		if (!connected)
+		{
+			std::string ret;
+			ret.reserve(param.length() * 2);
+			for (std::string::const_iterator i = param.begin(); i != param.end(); i++)
+			{
+				switch (*i)
+				{
+					case '\0':	ret.append("\\0"); break;
+					case '\n':	ret.append("\\n"); break;
+					case '\r':	ret.append("\\r"); break;
+					case '\032':	ret.append("\\Z"); break;
+					case '\\':
+					case '\'':
+					case '"':
+						ret.push_back('\\');
+						/* fall through */
+					default:
+						ret.push_back(*i);
+				}
+			}
+			return ret;
+		}
+
+		std::vector<char> buffer(param.length() * 2 + 1);
+		unsigned long len = mysql_real_escape_string(&connection, &buffer[0], param.data(), param.length());
+		return std::string(&buffer[0], len);
+	}
+
+	virtual std::string Placeholder(unsigned int n)
+	{
+		return "?";
+	}
+
+ private:
+
+	MySQLresult* Run(SQLrequest &req, unsigned int &err);
+	MySQLresult* RunText(SQLrequest &req, const std::string &text, unsigned int &err);
+	MySQLresult* RunStatement(SQLrequest &req, MYSQL_STMT* stmt, ParamL &binds, unsigned int &err);
+	MYSQL_STMT* GetStatement(const std::string &sql, unsigned int params, bool &reused, unsigned int &err);
+
+	MySQLresult* Error(SQLrequest &req, unsigned int errnum, const std::string &errmsg);
+	MySQLresult* StatementError(SQLrequest &req, MYSQL_STMT* stmt, unsigned int &err);
+};
+
+/** A <database>, its connections, and the queue of queries waiting for them.
+ * What is shared with the threads is only touched with lock held. The read
+ * end of the pipe the threads wake the main thread with is our fd.
+ */
+class ConnectionPool : public EventHandler
+{
+ public:
+	InspIRCd* Instance;
+	Module* mod;
+	SQLhost host;
+
+	/** Guards everything down to notify
+	 */
+	pthread_mutex_t lock;
+
+	/** Signalled when a query is queued, or the threads should stop
+	 */
+	pthread_cond_t wake;
+
+	QueryQueue queue;
+	ResultQueue results;
+
+	/** Connections which are up, and how many are running a query
+	 */
+	unsigned int connected;
+	unsigned int busy;
+
+	/** Tells the threads to finish once everything queued has run
+	 */
+	bool stopping;
+
+	/** Set once the main thread has been woken, until it comes for the results
+	 */
+	bool signalled;
+
+	/** Why a connection last failed, for the main thread to log
+	 */
+	std::string connecterror;
+
+	/** The write end of the pipe
+	 */
+	int notify;
+
+	std::vector<SQLConnection*> connections;
+
+	/** The module each query in progress is for, and when it was sent, by query ID. When a
+	 * module unloads its queries are forgotten: any already running still finish, but their
+	 * results are dropped. This and stats are only used by the main thread.
+	 */
+	std::map<unsigned long, std::pair<Module*, unsigned long long> > inflight;
+	SQLstats stats;
+
+	ConnectionPool(InspIRCd* SI, Module* m, const SQLhost &hi)
+	: Instance(SI), mod(m), host(hi), connected(0), busy(0), stopping(false), signalled(false), notify(-1)
+	{
+		pthread_mutex_init(&lock, NULL);
+		pthread_cond_init(&wake, NULL);
+		this->fd = -1;
+
+		int fds[2];
+		if (pipe(fds))
+		{
+			Instance->Log(DEFAULT, "SQL: Could not create a pipe for database %s: %s", host.id.c_str(), strerror(errno));
 			return;
+		}
 
-		/* Parse the command string and dispatch it to mysql */
-		SQLrequest& req = queue.front();
+		fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+		fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL, 0) | O_NONBLOCK);
+		this->SetFd(fds[0]);
+		notify = fds[1];
 
-		/* Pointer to the buffer we screw around with substitution in */
-		char* query;
+		if (!Instance->SE->AddFd(this))
+		{
+			Instance->Log(DEFAULT, "SQL: Could not add database %s to the socket engine", host.id.c_str());
+			close(fds[0]);
+			close(fds[1]);
+			this->fd = notify = -1;
+			return;
+		}
 
-		/* Pointer to the current end of query, where we append new stuff */
-		char* queryend;
+		unsigned int size = host.poolsize ? host.poolsize : 1;
+		while (connections.size() < size)
+		{
+			SQLConnection* conn = new SQLConnection(host, this);
+			if (!conn->Start())
+			{
+				Instance->Log(DEFAULT, "SQL: Could not start a thread for database %s", host.id.c_str());
+				delete conn;
+				break;
+			}
+			connections.push_back(conn);
+		}
+	}
 
-		/* Total length of the unescaped parameters */
-		unsigned long paramlen;
+	~ConnectionPool()
+	{
+		Stop();
 
-		/* Total length of query, used for binary-safety in mysql_real_query */
-		unsigned long querylength = 0;
+		for (std::vector<SQLConnection*>::iterator i = connections.begin(); i != connections.end(); i++)
+			delete *i;
 
-		paramlen = 0;
+		for (ResultQueue::iterator i = results.begin(); i != results.end(); i++)
+			delete *i;
 
-		for(ParamL::iterator i = req.query.p.begin(); i != req.query.p.end(); i++)
+		if (this->fd > -1)
 		{
-			paramlen += i->size();
+			Instance->SE->DelFd(this);
+			close(this->fd);
+			close(notify);
 		}
 
-		/* To avoid a lot of allocations, allocate enough memory for the biggest the escaped query could possibly be.
-		 * sizeofquery + (totalparamlength*2) + 1
-		 *
-		 * The +1 is for null-terminating the string for mysql_real_escape_string
-		 */
+		pthread_cond_destroy(&wake);
+		pthread_mutex_destroy(&lock);
+	}
 
-		query = new char[req.query.q.length() + (paramlen*2) + 1];
-		queryend = query;
+	/** Queue a query for the threads
+	 */
+	SQLerror Query(SQLrequest &req)
+	{
+		if (connections.empty())
+			return SQLerror(BAD_CONN);
 
-		/* Okay, now we have a buffer large enough we need to start copying the query into it and escaping and substituting
-		 * the parameters into it...
-		 */
+		inflight[req.id] = std::make_pair(req.GetSource(), SQLstats::Now());
+
+		pthread_mutex_lock(&lock);
+		queue.push(req);
+		stats.Queued(queue.totalsize());
+		pthread_cond_signal(&wake);
+		pthread_mutex_unlock(&lock);
+
+		return SQLerror();
+	}
+
+	/** Let the threads run everything queued, and wait for them to finish
+	 */
+	void Stop()
+	{
+		pthread_mutex_lock(&lock);
+		stopping = true;
+		pthread_cond_broadcast(&wake);
+		pthread_mutex_unlock(&lock);
+
+		for (std::vector<SQLConnection*>::iterator i = connections.begin(); i != connections.end(); i++)
+			(*i)->Join();
+	}
+
+	/** Wake the main thread, from a thread with lock held
+	 */
+	void Notify()
+	{
+		if (signalled)
+			return;
 
-		for(unsigned long i = 0; i < req.query.q.length(); i++)
+		signalled = true;
+		char c = 0;
+		if (write(notify, &c, 1) < 0)
 		{
-			if(req.query.q[i] == '?')
-			{
-				/* We found a place to substitute..what fun.
-				 * use mysql calls to escape and write the
-				 * escaped string onto the end of our query buffer,
-				 * then we "just" need to make sure queryend is
-				 * pointing at the right place.
-				 */
-				if(req.query.p.size())
-				{
-					unsigned long len = mysql_real_escape_string(&connection, queryend, req.query.p.front().c_str(), req.query.p.front().length());
+			// The pipe is full, so the main thread will be round anyway.
+		}
+	}
 
-					queryend += len;
-					req.query.p.pop_front();
-				}
-				else
-					break;
-			}
+	/** Drop what is queued for a module which is unloading, and forget the rest
+	 */
+	void OnUnloadModule(Module* m)
+	{
+		pthread_mutex_lock(&lock);
+		queue.PurgeModule(m);
+		pthread_mutex_unlock(&lock);
+
+		std::map<unsigned long, std::pair<Module*, unsigned long long> >::iterator i = inflight.begin();
+		while (i != inflight.end())
+		{
+			if (i->second.first == m)
+				inflight.erase(i++);
 			else
+				i++;
+		}
+	}
+
+	/** The threads have results, or something to log
+	 */
+	virtual void HandleEvent(EventType et, int errornum = 0)
+	{
+		char buf[64];
+		while (read(this->fd, buf, sizeof(buf)) > 0);
+
+		ResultQueue ready;
+		std::string error;
+
+		pthread_mutex_lock(&lock);
+		ready.swap(results);
+		error.swap(connecterror);
+		signalled = false;
+		pthread_mutex_unlock(&lock);
+
+		if (!error.empty())
+			Instance->Log(DEFAULT, "SQL: Failed to connect database " + host.host + ": Error: " + error);
+
+		for (ResultQueue::iterator i = ready.begin(); i != ready.end(); i++)
+		{
+			MySQLresult* res = *i;
+			std::map<unsigned long, std::pair<Module*, unsigned long long> >::iterator q = inflight.find(res->id);
+			if (q != inflight.end())
 			{
-				*queryend = req.query.q[i];
-				queryend++;
+				stats.Answered(q->second.second, res->started, res->finished, res->error.Id() != NO_ERROR, res->reused);
+				inflight.erase(q);
+				res->Send();
 			}
-			querylength++;
+			delete res;
 		}
+	}
+
+	/** Return the statistics, with what the threads are doing now
+	 */
+	SQLstats GetStats()
+	{
+		SQLstats now = stats;
+		pthread_mutex_lock(&lock);
+		now.connections = connected;
+		now.busy = busy;
+		now.queued = queue.totalsize();
+		pthread_mutex_unlock(&lock);
+		return now;
+	}
+
+	const SQLhost& GetConfHost()
+	{
+		return host;
+	}
+};
+
+void SQLConnection::Work()
+{
+	mysql_thread_init();
+	Connect();
+
+	pthread_mutex_lock(&pool->lock);
+	while (true)
+	{
+		while (!pool->queue.totalsize() && !pool->stopping)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+
+		if (!pool->queue.totalsize())
+			break;
+
+		// The request is copied, so that the main thread is free to change the queue
+		SQLrequest req = pool->queue.front();
+		pool->queue.pop();
+		pool->busy++;
+		bool reconnect = !pool->stopping;
+		pthread_mutex_unlock(&pool->lock);
 
-		*queryend = 0;
+		MySQLresult* res = Execute(req, reconnect);
 
-		pthread_mutex_lock(&queue_mutex);
-		req.query.q = query;
-		pthread_mutex_unlock(&queue_mutex);
+		pthread_mutex_lock(&pool->lock);
+		pool->busy--;
+		pool->results.push_back(res);
+		pool->Notify();
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	Close();
+	mysql_thread_end();
+}
+
+bool SQLConnection::Connect()
+{
+	unsigned int timeout = 1;
+	mysql_init(&connection);
+	mysql_options(&connection,MYSQL_OPT_CONNECT_TIMEOUT,(char*)&timeout);
+	connected = mysql_real_connect(&connection, host.host.c_str(), host.user.c_str(), host.pass.c_str(), host.name.c_str(), host.port, NULL, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	if (connected)
+	{
+		pool->connected++;
+	}
+	else
+	{
+		lasterror = mysql_error(&connection);
+		pool->connecterror = lasterror;
+		pool->Notify();
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!connected)
+		mysql_close(&connection);
+
+	return connected;
+}
+
+void SQLConnection::Close()
+{
+	if (!connected)
+		return;
+
+	for (std::map<std::string, CachedStatement>::iterator i = statements.begin(); i != statements.end(); i++)
+		if (i->second.stmt)
+			mysql_stmt_close(i->second.stmt);
+
+	statements.clear();
+	mysql_close(&connection);
+	connected = false;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->connected--;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/** Run a query, connecting first if need be
+ * @param reconnect False if the pool is stopping, when a connection is not tried again
+ */
+MySQLresult* SQLConnection::Execute(SQLrequest &req, bool reconnect)
+{
+	unsigned long long started = SQLstats::Now();
+	MySQLresult* res = NULL;
 
-		if (!mysql_real_query(&connection, req.query.q.data(), req.query.q.length()))
+	for (int attempt = 0; !res; attempt++)
+	{
+		if (!connected && (!reconnect || !Connect()))
 		{
-			/* Successfull query */
-			res = mysql_use_result(&connection);
-			unsigned long rows = mysql_affected_rows(&connection);
-			MySQLresult* r = new MySQLresult(SQLModule, req.GetSource(), res, rows, req.id);
-			r->dbid = this->GetID();
-			r->query = req.query.q;
-			/* Put this new result onto the results queue.
-			 * XXX: Remember to mutex the queue!
-			 */
-			pthread_mutex_lock(&results_mutex);
-			rq.push_back(r);
-			pthread_mutex_unlock(&results_mutex);
+			res = new MySQLresult(pool->mod, req.GetSource(), SQLerror(BAD_CONN, lasterror), req.id);
+			res->query = req.query.q;
+			break;
 		}
-		else
+
+		unsigned int err = 0;
+		res = Run(req, err);
+
+		if ((err == CR_SERVER_GONE_ERROR) || (err == CR_SERVER_LOST))
 		{
-			/* XXX: See /usr/include/mysql/mysqld_error.h for a list of
-			 * possible error numbers and error messages */
-			SQLerror e(QREPLY_FAIL, ConvToStr(mysql_errno(&connection)) + std::string(": ") + mysql_error(&connection));
-			MySQLresult* r = new MySQLresult(SQLModule, req.GetSource(), e, req.id);
-			r->dbid = this->GetID();
-			r->query = req.query.q;
-
-			pthread_mutex_lock(&results_mutex);
-			rq.push_back(r);
-			pthread_mutex_unlock(&results_mutex);
+			Close();
+
+			/* The server closed the connection since the last query, after wait_timeout
+			 * or a restart, so this one was never sent: try it once on a new connection.
+			 * A connection lost partway through a query may have been lost after it ran.
+			 */
+			if ((err == CR_SERVER_GONE_ERROR) && !attempt)
+			{
+				delete res;
+				res = NULL;
+			}
 		}
+	}
 
-		/* Now signal the main thread that we've got a result to process.
-		 * Pass them this connection id as what to examine
-		 */
+	res->dbid = host.id;
+	res->started = started;
+	res->finished = SQLstats::Now();
+	return res;
+}
 
-		delete[] query;
+MySQLresult* SQLConnection::Run(SQLrequest &req, unsigned int &err)
+{
+	std::string sql, text;
+	ParamL binds;
+	Substitute(req.query, sql, binds, text);
+
+	bool reused = false;
+	MYSQL_STMT* stmt = GetStatement(sql, binds.size(), reused, err);
+
+	MySQLresult* res;
+	if (err)
+		res = Error(req, err, lasterror);
+	else if (stmt)
+		res = RunStatement(req, stmt, binds, err);
+	else
+		res = RunText(req, text, err);
+
+	res->query = text;
+	res->reused = reused;
+	return res;
+}
 
-		NotifyMainThread(this);
+MySQLresult* SQLConnection::RunText(SQLrequest &req, const std::string &text, unsigned int &err)
+{
+	if (mysql_real_query(&connection, text.data(), text.length()))
+	{
+		/* XXX: See /usr/include/mysql/mysqld_error.h for a list of
+		 * possible error numbers and error messages */
+		err = mysql_errno(&connection);
+		return Error(req, err, mysql_error(&connection));
 	}
 
-	bool ConnectionLost()
+	MYSQL_RES* res = mysql_use_result(&connection);
+	unsigned long rows = mysql_affected_rows(&connection);
+	return new MySQLresult(pool->mod, req.GetSource(), res, rows, req.id);
+}
+
+MySQLresult* SQLConnection::RunStatement(SQLrequest &req, MYSQL_STMT* stmt, ParamL &binds, unsigned int &err)
+{
+	if (!binds.empty())
 	{
-		if (&connection) {
-			return (mysql_ping(&connection) != 0);
+		std::vector<MYSQL_BIND> params(binds.size());
+		memset(&params[0], 0, sizeof(MYSQL_BIND) * params.size());
+		for (unsigned int i = 0; i < binds.size(); i++)
+		{
+			params[i].buffer_type = MYSQL_TYPE_STRING;
+			params[i].buffer = (void*)binds[i].data();
+			params[i].buffer_length = binds[i].length();
 		}
-		else return false;
+
+		if (mysql_stmt_bind_param(stmt, &params[0]))
+			return StatementError(req, stmt, err);
 	}
 
-	bool CheckConnection()
+	if (mysql_stmt_execute(stmt))
+		return StatementError(req, stmt, err);
+
+	MySQLresult* res = new MySQLresult(pool->mod, req.GetSource(), req.id);
+
+	MYSQL_RES* meta = mysql_stmt_result_metadata(stmt);
+	if (!meta)
 	{
-		if (ConnectionLost()) {
-			return Connect();
-		}
-		else return true;
+		res->SetAffected(mysql_stmt_affected_rows(stmt));
+		return res;
 	}
 
-	std::string GetError()
+	unsigned int cols = mysql_num_fields(meta);
+	res->SetColumns(mysql_fetch_fields(meta), cols);
+	mysql_free_result(meta);
+
+	/* Every column is fetched as a string, as a query sent as text would give it.
+	 * Each starts with a small buffer, which grows when a value doesn't fit.
+	 */
+	std::vector<FetchColumn> columns(cols);
+	std::vector<MYSQL_BIND> bind(cols);
+	if (cols)
 	{
-		return mysql_error(&connection);
+		memset(&bind[0], 0, sizeof(MYSQL_BIND) * cols);
+		for (unsigned int i = 0; i < cols; i++)
+		{
+			bind[i].buffer_type = MYSQL_TYPE_STRING;
+			bind[i].buffer = &columns[i].buffer[0];
+			bind[i].buffer_length = columns[i].buffer.size();
+			bind[i].length = &columns[i].length;
+			bind[i].is_null = &columns[i].null;
+		}
 	}
 
-	const std::string& GetID()
+	if ((mysql_stmt_store_result(stmt)) || (cols && mysql_stmt_bind_result(stmt, &bind[0])))
 	{
-		return host.id;
+		delete res;
+		res = StatementError(req, stmt, err);
+		mysql_stmt_free_result(stmt);
+		return res;
 	}
 
-	std::string GetHost()
+	int fetched;
+	while (((fetched = mysql_stmt_fetch(stmt)) == 0) || (fetched == MYSQL_DATA_TRUNCATED))
 	{
-		return host.host;
+		SQLfieldList row;
+		bool grown = false;
+
+		for (unsigned int i = 0; i < cols; i++)
+		{
+			FetchColumn &column = columns[i];
+			if (column.null)
+			{
+				row.push_back(SQLfield("", true));
+				continue;
+			}
+
+			if (column.length > column.buffer.size())
+			{
+				column.buffer.resize(column.length);
+				bind[i].buffer = &column.buffer[0];
+				bind[i].buffer_length = column.buffer.size();
+				mysql_stmt_fetch_column(stmt, &bind[i], i, 0);
+				grown = true;
+			}
+
+			row.push_back(SQLfield(std::string(&column.buffer[0], column.length), false));
+		}
+
+		res->AddRow(row);
+
+		// The library keeps its own copy of the bindings, which has to see the new buffers
+		if (grown)
+			mysql_stmt_bind_result(stmt, &bind[0]);
 	}
 
-	void SetEnable(bool Enable)
+	if (fetched == 1)
 	{
-		Enabled = Enable;
+		delete res;
+		res = StatementError(req, stmt, err);
 	}
 
-	bool IsEnabled()
+	mysql_stmt_free_result(stmt);
+	return res;
+}
+
+/** Find the prepared statement for some text, preparing and keeping it if it is new
+ * @param params How many parameters it should have
+ * @param reused Set to true if it was already prepared
+ * @param err Set if the connection was lost
+ * @return NULL if it should be sent as text: because no statements are kept, it can't be
+ * prepared, or it failed to prepare, in which case sending it gives the error
+ */
+MYSQL_STMT* SQLConnection::GetStatement(const std::string &sql, unsigned int params, bool &reused, unsigned int &err)
+{
+	std::map<std::string, CachedStatement>::iterator i = statements.find(sql);
+	if (i != statements.end())
 	{
-		return Enabled;
+		i->second.lastused = ++statementclock;
+		reused = (i->second.stmt != NULL);
+		return i->second.stmt;
 	}
 
-	void Close()
+	if (!host.statements)
+		return NULL;
+
+	MYSQL_STMT* stmt = mysql_stmt_init(&connection);
+	if (!stmt)
+		return NULL;
+
+	if (mysql_stmt_prepare(stmt, sql.data(), sql.length()))
 	{
-		mysql_close(&connection);
+		unsigned int e = mysql_stmt_errno(stmt);
+		lasterror = mysql_stmt_error(stmt);
+		mysql_stmt_close(stmt);
+
+		if ((e == CR_SERVER_GONE_ERROR) || (e == CR_SERVER_LOST))
+		{
+			err = e;
+			return NULL;
+		}
+
+		// Some statements can never be prepared, so don't try them again
+		if (e != ER_UNSUPPORTED_PS)
+			return NULL;
+
+		stmt = NULL;
+	}
+	else if (mysql_stmt_param_count(stmt) != params)
+	{
+		// An escaped parameter had a ? in it, which was taken as another placeholder
+		mysql_stmt_close(stmt);
+		return NULL;
 	}
 
-	const SQLhost& GetConfHost()
+	if (statements.size() >= host.statements)
 	{
-		return host;
+		std::map<std::string, CachedStatement>::iterator oldest = statements.begin();
+		for (i = statements.begin(); i != statements.end(); i++)
+			if (i->second.lastused < oldest->second.lastused)
+				oldest = i;
+
+		if (oldest->second.stmt)
+			mysql_stmt_close(oldest->second.stmt);
+		statements.erase(oldest);
 	}
 
-};
+	CachedStatement &entry = statements[sql];
+	entry.stmt = stmt;
+	entry.lastused = ++statementclock;
+	return stmt;
+}
+
+MySQLresult* SQLConnection::Error(SQLrequest &req, unsigned int errnum, const std::string &errmsg)
+{
+	SQLerror e(QREPLY_FAIL, ConvToStr(errnum) + std::string(": ") + errmsg);
+	return new MySQLresult(pool->mod, req.GetSource(), e, req.id);
+}
+
+MySQLresult* SQLConnection::StatementError(SQLrequest &req, MYSQL_STMT* stmt, unsigned int &err)
+{
+	err = mysql_stmt_errno(stmt);
+	MySQLresult* res = Error(req, err, mysql_stmt_error(stmt));
+	mysql_stmt_reset(stmt);
+	return res;
+}
 
 ConnMap Connections;
 
@@ -498,6 +1033,8 @@ bool HostInConf(ConfigReader* conf, const SQLhost &h)
 		host.user	= conf->ReadValue("database", "username", i);
 		host.pass	= conf->ReadValue("database", "password", i);
 		host.ssl	= conf->ReadFlag("database", "ssl", i);
+		host.poolsize	= conf->ReadInteger("database", "poolsize", "1", i, true);
+		host.statements	= conf->ReadInteger("database", "statements", "32", i, true);
 		if (h == host)
 			return true;
 	}
@@ -506,16 +1043,19 @@ bool HostInConf(ConfigReader* conf, const SQLhost &h)
 
 void ClearOldConnections(ConfigReader* conf)
 {
-	ConnMap::iterator i,safei;
-	for (i = Connections.begin(); i != Connections.end(); i++)
+	ConnMap::iterator i = Connections.begin();
+	while (i != Connections.end())
 	{
 		if (!HostInConf(conf, i->second->GetConfHost()))
 		{
+			// Let what was queued finish, and hand back its results
+			i->second->Stop();
+			i->second->HandleEvent(EVENT_READ);
 			DELETE(i->second);
-			safei = i;
-			--i;
-			Connections.erase(safei);
+			Connections.erase(i++);
 		}
+		else
+			i++;
 	}
 }
 
@@ -524,31 +1064,12 @@ void ClearAllConnections()
 	ConnMap::iterator i;
 	while ((i = Connections.begin()) != Connections.end())
 	{
-		Connections.erase(i);
 		DELETE(i->second);
+		Connections.erase(i);
 	}
 }
 
-void ConnectDatabases(InspIRCd* ServerInstance)
-{
-	for (ConnMap::iterator i = Connections.begin(); i != Connections.end(); i++)
-	{
-		if (i->second->IsEnabled())
-			continue;
-
-		i->second->SetEnable(true);
-		if (!i->second->Connect())
-		{
-			/* XXX: MUTEX */
-			pthread_mutex_lock(&logging_mutex);
-			ServerInstance->Log(DEFAULT,"SQL: Failed to connect database "+i->second->GetHost()+": Error: "+i->second->GetError());
-			i->second->SetEnable(false);
-			pthread_mutex_unlock(&logging_mutex);
-		}
-	}
-}
-
-void LoadDatabases(ConfigReader* conf, InspIRCd* ServerInstance)
+void LoadDatabases(ConfigReader* conf, InspIRCd* ServerInstance, Module* mod)
 {
 	ClearOldConnections(conf);
 	for (int j =0; j < conf->Enumerate("database"); j++)
@@ -561,143 +1082,20 @@ void LoadDatabases(ConfigReader* conf, InspIRCd* ServerInstance)
 		host.user	= conf->ReadValue("database", "username", j);
 		host.pass	= conf->ReadValue("database", "password", j);
 		host.ssl	= conf->ReadFlag("database", "ssl", j);
+		host.poolsize	= conf->ReadInteger("database", "poolsize", "1", j, true);
+		host.statements	= conf->ReadInteger("database", "statements", "32", j, true);
 
 		if (HasHost(host))
 			continue;
 
 		if (!host.id.empty() && !host.host.empty() && !host.name.empty() && !host.user.empty() && !host.pass.empty())
 		{
-			SQLConnection* ThisSQL = new SQLConnection(host);
+			ConnectionPool* ThisSQL = new ConnectionPool(ServerInstance, mod, host);
 			Connections[host.id] = ThisSQL;
 		}
 	}
-	ConnectDatabases(ServerInstance);
-}
-
-char FindCharId(const std::string &id)
-{
-	char i = 1;
-	for (ConnMap::iterator iter = Connections.begin(); iter != Connections.end(); ++iter, ++i)
-	{
-		if (iter->first == id)
-		{
-			return i;
-		}
-	}
-	return 0;
-}
-
-ConnMap::iterator GetCharId(char id)
-{
-	char i = 1;
-	for (ConnMap::iterator iter = Connections.begin(); iter != Connections.end(); ++iter, ++i)
-	{
-		if (i == id)
-			return iter;
-	}
-	return Connections.end();
-}
-
-void NotifyMainThread(SQLConnection* connection_with_new_result)
-{
-	/* Here we write() to the socket the main thread has open
-	 * and we connect()ed back to before our thread became active.
-	 * The main thread is using a nonblocking socket tied into
-	 * the socket engine, so they wont block and they'll receive
-	 * nearly instant notification. Because we're in a seperate
-	 * thread, we can just use standard connect(), and we can
-	 * block if we like. We just send the connection id of the
-	 * connection back.
-	 *
-	 * NOTE: We only send a single char down the connection, this
-	 * way we know it wont get a partial read at the other end if
-	 * the system is especially congested (see bug #263).
-	 * The function FindCharId translates a connection name into a
-	 * one character id, and GetCharId translates a character id
-	 * back into an iterator.
-	 */
-	char id = FindCharId(connection_with_new_result->GetID());
-	send(QueueFD, &id, 1, 0);
 }
 
-void* DispatcherThread(void* arg);
-
-/** Used by m_mysql to notify one thread when the other has a result
- */
-class Notifier : public InspSocket
-{
-	insp_sockaddr sock_us;
-	socklen_t uslen;
-	
-
- public:
-
-	/* Create a socket on a random port. Let the tcp stack allocate us an available port */
-#ifdef IPV6
-	Notifier(InspIRCd* SI) : InspSocket(SI, "::1", 0, true, 3000)
-#else
-	Notifier(InspIRCd* SI) : InspSocket(SI, "127.0.0.1", 0, true, 3000)
-#endif
-	{
-		uslen = sizeof(sock_us);
-		if (getsockname(this->fd,(sockaddr*)&sock_us,&uslen))
-		{
-			throw ModuleException("Could not create random listening port on localhost");
-		}
-	}
-
-	Notifier(InspIRCd* SI, int newfd, char* ip) : InspSocket(SI, newfd, ip)
-	{
-	}
-
-	/* Using getsockname and ntohs, we can determine which port number we were allocated */
-	int GetPort()
-	{
-#ifdef IPV6
-		return ntohs(sock_us.sin6_port);
-#else
-		return ntohs(sock_us.sin_port);
-#endif
-	}
-
-	virtual int OnIncomingConnection(int newsock, char* ip)
-	{
-		Notifier* n = new Notifier(this->Instance, newsock, ip);
-		n = n; /* Stop bitching at me, GCC */
-		return true;
-	}
-
-	virtual bool OnDataReady()
-	{
-		char data = 0;
-		/* NOTE: Only a single character is read so we know we
-		 * cant get a partial read. (We've been told that theres
-		 * data waiting, so we wont ever get EAGAIN)
-		 * The function GetCharId translates a single character
-		 * back into an iterator.
-		 */
-		if (read(this->GetFd(), &data, 1) > 0)
-		{
-			ConnMap::iterator iter = GetCharId(data);
-			if (iter != Connections.end())
-			{
-				/* Lock the mutex, send back the data */
-				pthread_mutex_lock(&results_mutex);
-				ResultQueue::iterator n = iter->second->rq.begin();
-				(*n)->Send();
-				iter->second->rq.pop_front();
-				pthread_mutex_unlock(&results_mutex);
-				return true;
-			}
-			/* No error, but unknown id */
-			return true;
-		}
-
-		/* Erk, error on descriptor! */
-		return false;
-	}
-};
-
 /** MySQL module
  */
 class ModuleSQL : public Module
@@ -705,44 +1103,30 @@ class ModuleSQL : public Module
  public:
 	
 	ConfigReader *Conf;
-	InspIRCd* PublicServerInstance;
-	pthread_t Dispatcher;
-	int currid;
-	bool rehashing;
+	unsigned long currid;
 
 	ModuleSQL(InspIRCd* Me)
-	: Module::Module(Me), rehashing(false)
+	: Module::Module(Me), currid(0)
 	{
 		ServerInstance->UseInterface("SQLutils");
 
-		Conf = new ConfigReader(ServerInstance);
-		PublicServerInstance = ServerInstance;
-		currid = 0;
-		SQLModule = this;
-
-		MessagePipe = new Notifier(ServerInstance);
-		
-		pthread_attr_t attribs;
-		pthread_attr_init(&attribs);
-		pthread_attr_setdetachstate(&attribs, PTHREAD_CREATE_DETACHED);
-		if (pthread_create(&this->Dispatcher, &attribs, DispatcherThread, (void *)this) != 0)
-		{
-			throw ModuleException("m_mysql: Failed to create dispatcher thread: " + std::string(strerror(errno)));
-		}
+		// This has to be done before more than one thread uses the library
+		if (mysql_library_init(0, NULL, NULL))
+			throw ModuleException("m_mysql: Could not initialise the MySQL client library");
 
 		if (!ServerInstance->PublishFeature("SQL", this))
 		{
-			/* Tell worker thread to exit NOW */
-			giveup = true;
 			throw ModuleException("m_mysql: Unable to publish feature 'SQL'");
 		}
 
+		Conf = new ConfigReader(ServerInstance);
+		LoadDatabases(Conf, ServerInstance, this);
+
 		ServerInstance->PublishInterface("SQL", this);
 	}
 
 	virtual ~ModuleSQL()
 	{
-		giveup = true;
 		ClearAllConnections();
 		DELETE(Conf);
 		ServerInstance->UnpublishInterface("SQL", this);
@@ -753,7 +1137,7 @@ class ModuleSQL : public Module
 
 	void Implements(char* List)
 	{
-		List[I_OnRehash] = List[I_OnRequest] = 1;
+		List[I_OnRehash] = List[I_OnRequest] = List[I_OnUnloadModule] = List[I_OnStats] = 1;
 	}
 
 	unsigned long NewID()
@@ -769,121 +1153,65 @@ class ModuleSQL : public Module
 		{
 			SQLrequest* req = (SQLrequest*)request;
 
-			/* XXX: Lock */
-			pthread_mutex_lock(&queue_mutex);
-
 			ConnMap::iterator iter;
 
-			char* returnval = NULL;
-
 			if((iter = Connections.find(req->dbid)) != Connections.end())
 			{
 				req->id = NewID();
-				iter->second->queue.push(*req);
-				returnval = SQLSUCCESS;
+				req->error = iter->second->Query(*req);
+				if (req->error.Id() != NO_ERROR)
+					return NULL;
+				return SQLSUCCESS;
 			}
 			else
 			{
 				req->error.Id(BAD_DBID);
+				return NULL;
 			}
+		}
+		else if (strcmp(SQLSTATSID, request->GetId()) == 0)
+		{
+			SQLstatsrequest* req = (SQLstatsrequest*)request;
+			ConnMap::iterator iter = Connections.find(req->dbid);
+			if (iter == Connections.end())
+				return NULL;
 
-			pthread_mutex_unlock(&queue_mutex);
-			/* XXX: Unlock */
-
-			return returnval;
+			req->stats = iter->second->GetStats();
+			return SQLSUCCESS;
 		}
 
 		return NULL;
 	}
 
-	virtual void OnRehash(userrec* user, const std::string &parameter)
-	{
-		rehashing = true;
-	}
-	
-	virtual Version GetVersion()
+	virtual void OnUnloadModule(Module* mod, const std::string& name)
 	{
-		return Version(1,1,0,0,VF_VENDOR|VF_SERVICEPROVIDER,API_VERSION);
+		for (ConnMap::iterator iter = Connections.begin(); iter != Connections.end(); iter++)
+			iter->second->OnUnloadModule(mod);
 	}
-	
-};
-
-void* DispatcherThread(void* arg)
-{
-	ModuleSQL* thismodule = (ModuleSQL*)arg;
-	LoadDatabases(thismodule->Conf, thismodule->PublicServerInstance);
 
-	/* Connect back to the Notifier */
-
-	if ((QueueFD = socket(AF_FAMILY, SOCK_STREAM, 0)) == -1)
+	virtual int OnStats(char symbol, userrec* user, string_list &results)
 	{
-		/* crap, we're out of sockets... */
-		return NULL;
+		if (symbol == 'S')
+		{
+			for (ConnMap::iterator iter = Connections.begin(); iter != Connections.end(); iter++)
+				results.push_back(std::string(ServerInstance->Config->ServerName) + " 304 " + user->nick + " :SQLSTATS mysql " + iter->first + " " +
+						iter->second->GetStats().Summary());
+		}
+		return 0;
 	}
 
-	insp_sockaddr addr;
-
-#ifdef IPV6
-	insp_aton("::1", &addr.sin6_addr);
-	addr.sin6_family = AF_FAMILY;
-	addr.sin6_port = htons(MessagePipe->GetPort());
-#else
-	insp_inaddr ia;
-	insp_aton("127.0.0.1", &ia);
-	addr.sin_family = AF_FAMILY;
-	addr.sin_addr = ia;
-	addr.sin_port = htons(MessagePipe->GetPort());
-#endif
-
-	if (connect(QueueFD, (sockaddr*)&addr,sizeof(addr)) == -1)
+	virtual void OnRehash(userrec* user, const std::string &parameter)
 	{
-		/* wtf, we cant connect to it, but we just created it! */
-		return NULL;
+		DELETE(Conf);
+		Conf = new ConfigReader(ServerInstance);
+		LoadDatabases(Conf, ServerInstance, this);
 	}
-
-	while (!giveup)
+	
+	virtual Version GetVersion()
 	{
-		if (thismodule->rehashing)
-		{
-		/* XXX: Lock */
-			pthread_mutex_lock(&queue_mutex);
-			thismodule->rehashing = false;
-			LoadDatabases(thismodule->Conf, thismodule->PublicServerInstance);
-			pthread_mutex_unlock(&queue_mutex);
-			/* XXX: Unlock */
-		}
-
-		SQLConnection* conn = NULL;
-		/* XXX: Lock here for safety */
-		pthread_mutex_lock(&queue_mutex);
-		for (ConnMap::iterator i = Connections.begin(); i != Connections.end(); i++)
-		{
-			if (i->second->queue.totalsize())
-			{
-				conn = i->second;
-				break;
-			}
-		}
-		pthread_mutex_unlock(&queue_mutex);
-		/* XXX: Unlock */
-
-		/* Theres an item! */
-		if (conn)
-		{
-			conn->DoLeadingQuery();
-
-			/* XXX: Lock */
-			pthread_mutex_lock(&queue_mutex);
-			conn->queue.pop();
-			pthread_mutex_unlock(&queue_mutex);
-			/* XXX: Unlock */
-		}
-
-		usleep(50);
+		return Version(1,1,0,0,VF_VENDOR|VF_SERVICEPROVIDER,API_VERSION);
 	}
-
-	return NULL;
-}
+	
+};
 
 MODULE_INIT(ModuleSQL);
-
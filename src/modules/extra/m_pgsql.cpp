@@ -14,6 +14,7 @@
 #include "inspircd.h"
 #include <cstdlib>
 #include <sstream>
+#include <algorithm>
 #include <libpq-fe.h>
 #include "users.h"
 #include "channels.h"
@@ -36,8 +37,9 @@
 
 /* Forward declare, so we can have the typedef neatly at the top */
 class SQLConn;
+class ConnectionPool;
 
-typedef std::map<std::string, SQLConn*> ConnMap;
+typedef std::map<std::string, ConnectionPool*> ConnMap;
 
 /* CREAD,	Connecting and wants read event
  * CWRITE,	Connecting and wants write event
@@ -151,6 +153,13 @@ public:
 		PQclear(res);
 	}
 
+	/** Return the result from libpq, which is NULL if the query got no answer
+	 */
+	PGresult* GetResult()
+	{
+		return res;
+	}
+
 	virtual int Rows()
 	{
 		if(!cols && !rows)
@@ -310,30 +319,61 @@ public:
 	}
 };
 
-/** SQLConn represents one SQL session.
+/** A statement prepared on a connection, see SQLConn::statements
+ */
+struct CachedStatement
+{
+	/** The name it was prepared under, or empty if it can't be prepared, so it is always sent as text
+	 */
+	std::string name;
+	unsigned long lastused;
+};
+
+/** What a connection is waiting on the server for
+ */
+enum SQLstep { STEP_NONE, STEP_DEALLOCATE, STEP_PREPARE, STEP_EXECUTE };
+
+/** SQLConn represents one SQL session, in a ConnectionPool. It takes one query at a
+ * time off its pool's queue.
  */
-class SQLConn : public EventHandler
+class SQLConn : public EventHandler, public SQLparameters
 {
   private:
   	InspIRCd*		Instance;
 	SQLhost			confhost;	/* The <database> entry */
-	Module*			us;			/* Pointer to the SQL provider itself */
+	ConnectionPool*	pool;		/* The pool this connection is in */
 	PGconn* 		sql;		/* PgSQL database connection handle */
 	SQLstatus		status;		/* PgSQL database connection status */
-	bool			qinprog;	/* If there is currently a query in progress */
-	QueryQueue		queue;		/* Queue of queries waiting to be executed on this connection */
 	time_t			idle;		/* Time we last heard from the database */
 
+	SQLrequest*		current;	/* The query in progress, or NULL */
+	SQLstep			step;		/* What we sent the server for it */
+	std::string		query;		/* Its text, with placeholders for the parameters in binds */
+	ParamL			binds;
+	std::string		text;		/* Its text with every parameter escaped into it */
+	std::string		statement;	/* The name of the statement being prepared */
+	PGresult*		pending;	/* The last result of the step */
+	unsigned long long	started;	/* When it was sent to the database */
+	bool			reused;		/* True if it used a statement already prepared */
+
+	/** Prepared statements by the text they were prepared from
+	 */
+	std::map<std::string, CachedStatement> statements;
+
+	/** Counts statement uses, to find the one least recently used
+	 */
+	unsigned long statementclock;
+
+	/** For naming statements
+	 */
+	unsigned long statementid;
+
   public:
-	SQLConn(InspIRCd* SI, Module* self, const SQLhost& hi)
-	: EventHandler(), Instance(SI), confhost(hi), us(self), sql(NULL), status(CWRITE), qinprog(false)
+	SQLConn(InspIRCd* SI, ConnectionPool* p, const SQLhost& hi)
+	: EventHandler(), Instance(SI), confhost(hi), pool(p), sql(NULL), status(CWRITE), current(NULL), step(STEP_NONE), pending(NULL), started(0),
+	reused(false), statementclock(0), statementid(0)
 	{
 		idle = this->Instance->Time();
-		if(!DoConnect())
-		{
-			Instance->Log(DEFAULT, "WARNING: Could not connect to database with id: " + ConvToStr(hi.id));
-			DelayReconnect();
-		}
 	}
 
 	~SQLConn()
@@ -346,11 +386,10 @@ class SQLConn : public EventHandler
 		switch (et)
 		{
 			case EVENT_READ:
-				OnDataReady();
-			break;
-
 			case EVENT_WRITE:
-				OnWriteReady();
+				/* If this fails, the connection is closed and this deleted */
+				if (!DoEvent())
+					DelayReconnect();
 			break;
 
 			case EVENT_ERROR:
@@ -414,12 +453,12 @@ class SQLConn : public EventHandler
 
 	bool DoConnectedPoll()
 	{
-		if(!qinprog && queue.totalsize())
-		{
-			/* There's no query currently in progress, and there's queries in the queue. */
-			SQLrequest& query = queue.front();
-			DoQuery(query);
-		}
+		/* Send whatever is still buffered from the last query */
+		if (PQflush(sql) == 1)
+			Instance->SE->WantWrite(this);
+
+		if (!current)
+			StartNext();
 
 		if(PQconsumeInput(sql))
 		{
@@ -428,67 +467,26 @@ class SQLConn : public EventHandler
 			 */
 			idle = this->Instance->Time();
 
-			if (PQisBusy(sql))
-			{
-				/* Nothing happens here */
-			}
-			else if (qinprog)
+			/* PgSQL would allow a query string to be sent which has multiple
+			 * queries in it, this isn't portable across database backends and
+			 * we don't want modules doing it. But just in case we make sure we
+			 * drain any results there are and just use the last one.
+			 * If the module devs are behaving there will only be one result.
+			 * Once there are no more, the step is complete.
+			 */
+			while (current && !PQisBusy(sql))
 			{
-				/* Grab the request we're processing */
-				SQLrequest& query = queue.front();
-
-				/* Get a pointer to the module we're about to return the result to */
-				Module* to = query.GetSource();
-
-				/* Fetch the result.. */
 				PGresult* result = PQgetResult(sql);
-
-				/* PgSQL would allow a query string to be sent which has multiple
-				 * queries in it, this isn't portable across database backends and
-				 * we don't want modules doing it. But just in case we make sure we
-				 * drain any results there are and just use the last one.
-				 * If the module devs are behaving there will only be one result.
-				 */
-				while (PGresult* temp = PQgetResult(sql))
-				{
-					PQclear(result);
-					result = temp;
-				}
-
-				if(to)
+				if (result)
 				{
-					/* ..and the result */
-					PgSQLresult reply(us, to, query.id, result);
-
-					/* Fix by brain, make sure the original query gets sent back in the reply */
-					reply.query = query.query.q;
-
-					switch(PQresultStatus(result))
-					{
-						case PGRES_EMPTY_QUERY:
-						case PGRES_BAD_RESPONSE:
-						case PGRES_FATAL_ERROR:
-							reply.error.Id(QREPLY_FAIL);
-							reply.error.Str(PQresultErrorMessage(result));
-						default:;
-							/* No action, other values are not errors */
-					}
-
-					reply.Send();
-
-					/* PgSQLresult's destructor will free the PGresult */
+					if (pending)
+						PQclear(pending);
+					pending = result;
 				}
 				else
 				{
-					/* If the client module is unloaded partway through a query then the provider will set
-					 * the pointer to NULL. We cannot just cancel the query as the result will still come
-					 * through at some point...and it could get messy if we play with invalid pointers...
-					 */
-					PQclear(result);
+					Finish();
 				}
-				qinprog = false;
-				queue.pop();
-				DoConnectedPoll();
 			}
 			return true;
 		}
@@ -497,10 +495,8 @@ class SQLConn : public EventHandler
 			/* I think we'll assume this means the server died...it might not,
 			 * but I think that any error serious enough we actually get here
 			 * deserves to reconnect [/excuse]
-			 * Returning true so the core doesn't try and close the connection.
 			 */
-			DelayReconnect();
-			return true;
+			return false;
 		}
 	}
 
@@ -525,23 +521,6 @@ class SQLConn : public EventHandler
 		}
 	}
 
-	bool OnDataReady()
-	{
-		/* Always return true here, false would close the socket - we need to do that ourselves with the pgsql API */
-		return DoEvent();
-	}
-
-	bool OnWriteReady()
-	{
-		/* Always return true here, false would close the socket - we need to do that ourselves with the pgsql API */
-		return DoEvent();
-	}
-
-	bool OnConnected()
-	{
-		return DoEvent();
-	}
-
 	void DelayReconnect();
 
 	bool DoEvent()
@@ -563,154 +542,420 @@ class SQLConn : public EventHandler
 		return ret;
 	}
 
-	SQLerror DoQuery(SQLrequest &req)
+	bool Connected()
+	{
+		return ((status == WREAD) || (status == WWRITE));
+	}
+
+	bool Busy()
+	{
+		return current;
+	}
+
+	/** Take the next query off the pool's queue, if we are free to run one
+	 */
+	void StartNext();
+
+	/** Fail the query in progress, as the connection is going
+	 */
+	void Abandon(const std::string &why)
+	{
+		if (current)
+			Deliver(BAD_CONN, why);
+	}
+
+	virtual std::string Escape(const std::string &param)
+	{
+		std::vector<char> buffer(param.length() * 2 + 1);
+		int error = 0;
+		size_t len = 0;
+
+#ifdef PGSQL_HAS_ESCAPECONN
+		len = PQescapeStringConn(sql, &buffer[0], param.c_str(), param.length(), &error);
+#else
+		len = PQescapeString         (&buffer[0], param.c_str(), param.length());
+#endif
+		if(error)
+		{
+			Instance->Log(DEBUG, "BUG: Apparently PQescapeStringConn() failed somehow...don't know how or what to do...");
+		}
+
+		return std::string(&buffer[0], len);
+	}
+
+	virtual std::string Placeholder(unsigned int n)
 	{
-		if((status == WREAD) || (status == WWRITE))
+		return "$" + ConvToStr(n);
+	}
+
+	const SQLhost GetConfHost()
+	{
+		return confhost;
+	}
+
+	void Close() {
+		if (!this->Instance->SE->DelFd(this))
 		{
-			if(!qinprog)
+			if (sql && PQstatus(sql) == CONNECTION_BAD)
 			{
-				/* Parse the command string and dispatch it */
+				this->Instance->SE->DelFd(this, true);
+			}
+			else
+			{
+				Instance->Log(DEBUG, "BUG: PQsocket cant be removed from socket engine!");
+			}
+		}
+
+		if (pending)
+		{
+			PQclear(pending);
+			pending = NULL;
+		}
+
+		if(sql)
+		{
+			PQfinish(sql);
+			sql = NULL;
+		}
+	}
 
-				/* Pointer to the buffer we screw around with substitution in */
-				char* query;
-				/* Pointer to the current end of query, where we append new stuff */
-				char* queryend;
-				/* Total length of the unescaped parameters */
-				unsigned int paramlen;
+  private:
+	/** Send the current query, or the step it needs first: making room for its
+	 * statement, or preparing it.
+	 * @param astext Send it as text, because it failed to prepare
+	 */
+	void Send(bool astext = false)
+	{
+		std::vector<const char*> values;
+		for (ParamL::iterator i = binds.begin(); i != binds.end(); i++)
+			values.push_back(i->c_str());
+		const char* const* params = values.empty() ? NULL : &values[0];
 
-				paramlen = 0;
+		int sent;
+		step = STEP_EXECUTE;
 
-				for(ParamL::iterator i = req.query.p.begin(); i != req.query.p.end(); i++)
+		if (astext)
+		{
+			sent = PQsendQuery(sql, text.c_str());
+		}
+		else if (!confhost.statements)
+		{
+			if (binds.empty())
+				sent = PQsendQuery(sql, text.c_str());
+			else
+				sent = PQsendQueryParams(sql, query.c_str(), binds.size(), NULL, params, NULL, NULL, 0);
+		}
+		else
+		{
+			std::map<std::string, CachedStatement>::iterator i = statements.find(query);
+			if (i != statements.end())
+			{
+				i->second.lastused = ++statementclock;
+				if (i->second.name.empty())
 				{
-					paramlen += i->size();
+					sent = PQsendQuery(sql, text.c_str());
 				}
+				else
+				{
+					reused = true;
+					sent = PQsendQueryPrepared(sql, i->second.name.c_str(), binds.size(), params, NULL, NULL, 0);
+				}
+			}
+			else if (statements.size() >= confhost.statements)
+			{
+				std::map<std::string, CachedStatement>::iterator oldest = statements.begin();
+				for (i = statements.begin(); i != statements.end(); i++)
+					if (i->second.lastused < oldest->second.lastused)
+						oldest = i;
 
-				/* To avoid a lot of allocations, allocate enough memory for the biggest the escaped query could possibly be.
-				 * sizeofquery + (totalparamlength*2) + 1
-				 *
-				 * The +1 is for null-terminating the string for PQsendQuery()
-				 */
+				std::string name = oldest->second.name;
+				statements.erase(oldest);
 
-				query = new char[req.query.q.length() + (paramlen*2) + 1];
-				queryend = query;
+				if (name.empty())
+				{
+					Send();
+					return;
+				}
 
-				/* Okay, now we have a buffer large enough we need to start copying the query into it and escaping and substituting
-				 * the parameters into it...
-				 */
+				step = STEP_DEALLOCATE;
+				sent = PQsendQuery(sql, ("DEALLOCATE " + name).c_str());
+			}
+			else
+			{
+				step = STEP_PREPARE;
+				statement = "insp_" + ConvToStr(++statementid);
+				sent = PQsendPrepare(sql, statement.c_str(), query.c_str(), binds.size(), NULL);
+			}
+		}
 
-				for(unsigned int i = 0; i < req.query.q.length(); i++)
-				{
-					if(req.query.q[i] == '?')
-					{
-						/* We found a place to substitute..what fun.
-						 * Use the PgSQL calls to escape and write the
-						 * escaped string onto the end of our query buffer,
-						 * then we "just" need to make sure queryend is
-						 * pointing at the right place.
-						 */
-
-						if(req.query.p.size())
-						{
-							int error = 0;
-							size_t len = 0;
+		if (!sent)
+		{
+			Deliver(QSEND_FAIL, PQerrorMessage(sql));
+			return;
+		}
 
-#ifdef PGSQL_HAS_ESCAPECONN
-							len = PQescapeStringConn(sql, queryend, req.query.p.front().c_str(), req.query.p.front().length(), &error);
-#else
-							len = PQescapeString         (queryend, req.query.p.front().c_str(), req.query.p.front().length());
-#endif
-							if(error)
-							{
-								Instance->Log(DEBUG, "BUG: Apparently PQescapeStringConn() failed somehow...don't know how or what to do...");
-							}
-
-							/* Incremenet queryend to the end of the newly escaped parameter */
-							queryend += len;
-
-							/* Remove the parameter we just substituted in */
-							req.query.p.pop_front();
-						}
-						else
-						{
-							Instance->Log(DEBUG, "BUG: Found a substitution location but no parameter to substitute :|");
-							break;
-						}
-					}
-					else
-					{
-						*queryend = req.query.q[i];
-						queryend++;
-					}
-				}
+		if (PQflush(sql) == 1)
+			Instance->SE->WantWrite(this);
+	}
 
-				/* Null-terminate the query */
-				*queryend = 0;
-				req.query.q = query;
+	/** The server has answered the step we sent, so go on to the next one
+	 */
+	void Finish()
+	{
+		switch (step)
+		{
+			case STEP_DEALLOCATE:
+				Send();
+			break;
 
-				if(PQsendQuery(sql, query))
+			case STEP_PREPARE:
+				if (pending && (PQresultStatus(pending) == PGRES_COMMAND_OK))
 				{
-					qinprog = true;
-					delete[] query;
-					return SQLerror();
+					CachedStatement &entry = statements[query];
+					entry.name = statement;
+					entry.lastused = ++statementclock;
+					Send();
 				}
 				else
 				{
-					delete[] query;
-					return SQLerror(QSEND_FAIL, PQerrorMessage(sql));
+					/* Several queries in one, or a parameter whose type can't be worked out,
+					 * can't be prepared but can still be sent as text, so always send those
+					 * as text. Anything else which fails is sent as text once, to give the
+					 * error it always would have.
+					 */
+					const char* state = pending ? PQresultErrorField(pending, PG_DIAG_SQLSTATE) : NULL;
+					if (state && (!strcmp(state, "42601") || !strcmp(state, "42P18")))
+					{
+						CachedStatement &entry = statements[query];
+						entry.lastused = ++statementclock;
+					}
+					Send(true);
 				}
-			}
+			break;
+
+			default:
+				Deliver(NO_ERROR, "");
+				StartNext();
+			break;
 		}
-		return SQLerror(BAD_CONN, "Can't query until connection is complete");
 	}
 
-	SQLerror Query(const SQLrequest &req)
+	/** Send the result of the current query back, and finish with it
+	 * @param err An error in sending it, or NO_ERROR to use the result from the server
+	 */
+	void Deliver(SQLerrorNum err, const std::string &why);
+};
+
+/** A <database>, and the connections to it, which share its queue of queries
+ */
+class ConnectionPool : public classbase
+{
+  public:
+	InspIRCd*		Instance;
+	Module*			us;			/* Pointer to the SQL provider itself */
+	SQLhost			confhost;	/* The <database> entry, with the ip the hostname resolved to */
+	QueryQueue		queue;		/* Queries waiting for a connection */
+	std::vector<SQLConn*>	conns;
+
+	/** The module each query in progress is for, and when it was sent, by query ID. When a
+	 * module unloads its queries are forgotten: any already running still finish, but their
+	 * results are dropped.
+	 */
+	std::map<unsigned long, std::pair<Module*, unsigned long long> > inflight;
+	SQLstats		stats;
+
+	ConnectionPool(InspIRCd* SI, Module* self, const SQLhost& hi)
+	: Instance(SI), us(self), confhost(hi)
 	{
-		queue.push(req);
+	}
+
+	~ConnectionPool()
+	{
+		for (std::vector<SQLConn*>::iterator i = conns.begin(); i != conns.end(); i++)
+			delete *i;
+	}
 
-		if(!qinprog && queue.totalsize())
+	/** Open connections until there are poolsize of them
+	 * @return False if one failed, when the module should try again later
+	 */
+	bool Fill()
+	{
+		unsigned int size = confhost.poolsize ? confhost.poolsize : 1;
+		while (conns.size() < size)
 		{
-			/* There's no query currently in progress, and there's queries in the queue. */
-			SQLrequest& query = queue.front();
-			return DoQuery(query);
+			SQLConn* conn = new SQLConn(Instance, this, confhost);
+			conns.push_back(conn);
+			if (!conn->DoConnect())
+			{
+				Instance->Log(DEFAULT, "WARNING: Could not connect to database with id: " + ConvToStr(confhost.id));
+				conns.pop_back();
+				delete conn;
+				return false;
+			}
 		}
-		else
+		return true;
+	}
+
+	/** Close a connection which failed. What it was running fails. A connection which was
+	 * working has most likely been closed by the server, after an idle timeout or a restart,
+	 * so another is opened at once for the queue to wait on. Once there are no connections
+	 * left, everything queued fails.
+	 * @return False if the connection was not in this pool, or one could not be reopened
+	 * and the module should try again later
+	 */
+	bool Remove(SQLConn* conn)
+	{
+		std::vector<SQLConn*>::iterator i = std::find(conns.begin(), conns.end(), conn);
+		if (i == conns.end())
+			return false;
+
+		bool reopen = conn->Connected();
+		conns.erase(i);
+		conn->Abandon("Lost the connection to the database");
+		delete conn;
+
+		if (reopen)
+			reopen = Fill();
+
+		while (conns.empty() && queue.totalsize())
 		{
-			return SQLerror();
+			SQLrequest req = queue.front();
+			queue.pop();
+
+			PgSQLresult reply(us, req.GetSource(), req.id, NULL);
+			reply.query = req.query.q;
+			reply.dbid = confhost.id;
+			reply.error = SQLerror(BAD_CONN, "Not connected to the database");
+			if (Answered(req.id, SQLstats::Now(), SQLstats::Now(), true, false))
+				reply.Send();
 		}
+		return reopen;
 	}
 
-	void OnUnloadModule(Module* mod)
+	SQLerror Query(SQLrequest &req)
 	{
-		queue.PurgeModule(mod);
+		if (conns.empty())
+			return SQLerror(BAD_CONN, "Not connected to the database");
+
+		inflight[req.id] = std::make_pair(req.GetSource(), SQLstats::Now());
+		queue.push(req);
+		stats.Queued(queue.totalsize());
+
+		/* Any connection which is free takes it, and the others wait */
+		for (std::vector<SQLConn*>::iterator i = conns.begin(); (i != conns.end()) && queue.totalsize(); i++)
+			if ((*i)->Connected() && !(*i)->Busy())
+				(*i)->StartNext();
+
+		return SQLerror();
 	}
 
-	const SQLhost GetConfHost()
+	/** Count a query which has been answered
+	 * @return True if its result should be sent, false if the module it was for has gone
+	 */
+	bool Answered(unsigned long id, unsigned long long started, unsigned long long finished, bool error, bool prepared)
 	{
-		return confhost;
+		std::map<unsigned long, std::pair<Module*, unsigned long long> >::iterator i = inflight.find(id);
+		if (i == inflight.end())
+			return false;
+
+		stats.Answered(i->second.second, started, finished, error, prepared);
+		inflight.erase(i);
+		return true;
 	}
 
-	void Close() {
-		if (!this->Instance->SE->DelFd(this))
+	void OnUnloadModule(Module* mod)
+	{
+		queue.PurgeModule(mod);
+
+		std::map<unsigned long, std::pair<Module*, unsigned long long> >::iterator i = inflight.begin();
+		while (i != inflight.end())
 		{
-			if (sql && PQstatus(sql) == CONNECTION_BAD)
-			{
-				this->Instance->SE->DelFd(this, true);
-			}
+			if (i->second.first == mod)
+				inflight.erase(i++);
 			else
-			{
-				Instance->Log(DEBUG, "BUG: PQsocket cant be removed from socket engine!");
-			}
+				i++;
 		}
+	}
 
-		if(sql)
+	SQLstats GetStats()
+	{
+		SQLstats now = stats;
+		for (std::vector<SQLConn*>::iterator i = conns.begin(); i != conns.end(); i++)
 		{
-			PQfinish(sql);
-			sql = NULL;
+			now.connections += (*i)->Connected();
+			now.busy += (*i)->Busy();
 		}
+		now.queued = queue.totalsize();
+		return now;
 	}
 
+	const SQLhost GetConfHost()
+	{
+		return confhost;
+	}
 };
 
+void SQLConn::StartNext()
+{
+	if (current || !Connected() || !pool->queue.totalsize())
+		return;
+
+	current = new SQLrequest(pool->queue.front());
+	pool->queue.pop();
+
+	started = SQLstats::Now();
+	reused = false;
+	query.clear();
+	text.clear();
+	binds.clear();
+	Substitute(current->query, query, binds, text);
+	Send();
+}
+
+void SQLConn::Deliver(SQLerrorNum err, const std::string &why)
+{
+	/* PgSQLresult's destructor will free the PGresult */
+	PgSQLresult reply(pool->us, current->GetSource(), current->id, pending);
+	pending = NULL;
+
+	/* Fix by brain, make sure the original query gets sent back in the reply */
+	reply.query = text.empty() ? current->query.q : text;
+	reply.dbid = confhost.id;
+
+	if (err != NO_ERROR)
+	{
+		reply.error = SQLerror(err, why);
+	}
+	else if (!reply.GetResult())
+	{
+		reply.error = SQLerror(QREPLY_FAIL, PQerrorMessage(sql));
+	}
+	else
+	{
+		switch(PQresultStatus(reply.GetResult()))
+		{
+			case PGRES_EMPTY_QUERY:
+			case PGRES_BAD_RESPONSE:
+			case PGRES_FATAL_ERROR:
+				reply.error.Id(QREPLY_FAIL);
+				reply.error.Str(PQresultErrorMessage(reply.GetResult()));
+			default:;
+				/* No action, other values are not errors */
+		}
+	}
+
+	/* If the client module is unloaded partway through a query then the pool forgets
+	 * it. We cannot just cancel the query as the result will still come through at
+	 * some point, so it is dropped here.
+	 */
+	if (pool->Answered(current->id, started, SQLstats::Now(), reply.error.Id() != NO_ERROR, reused))
+		reply.Send();
+
+	delete current;
+	current = NULL;
+	step = STEP_NONE;
+}
+
 class ModulePgSQL : public Module
 {
   private:
@@ -721,7 +966,7 @@ class ModulePgSQL : public Module
 
   public:
 	ModulePgSQL(InspIRCd* Me)
-	: Module::Module(Me), currid(0)
+	: Module::Module(Me), currid(0), retimer(NULL)
 	{
 		ServerInstance->UseInterface("SQLutils");
 
@@ -752,7 +997,7 @@ class ModulePgSQL : public Module
 
 	void Implements(char* List)
 	{
-		List[I_OnUnloadModule] = List[I_OnRequest] = List[I_OnRehash] = List[I_OnUserRegister] = List[I_OnCheckReady] = List[I_OnUserDisconnect] = 1;
+		List[I_OnUnloadModule] = List[I_OnRequest] = List[I_OnRehash] = List[I_OnUserRegister] = List[I_OnCheckReady] = List[I_OnUserDisconnect] = List[I_OnStats] = 1;
 	}
 
 	virtual void OnRehash(userrec* user, const std::string &parameter)
@@ -760,14 +1005,32 @@ class ModulePgSQL : public Module
 		ReadConf();
 	}
 
-	bool HasHost(const SQLhost &host)
+	ConnectionPool* FindHost(const SQLhost &host)
 	{
 		for (ConnMap::iterator iter = connections.begin(); iter != connections.end(); iter++)
 		{
 			if (host == iter->second->GetConfHost())
-				return true;
+				return iter->second;
 		}
-		return false;
+		return NULL;
+	}
+
+	bool HasHost(const SQLhost &host)
+	{
+		return FindHost(host);
+	}
+
+	void ReadHost(ConfigReader &conf, int i, SQLhost &host)
+	{
+		host.id		= conf.ReadValue("database", "id", i);
+		host.host	= conf.ReadValue("database", "hostname", i);
+		host.port	= conf.ReadInteger("database", "port", i, true);
+		host.name	= conf.ReadValue("database", "name", i);
+		host.user	= conf.ReadValue("database", "username", i);
+		host.pass	= conf.ReadValue("database", "password", i);
+		host.ssl	= conf.ReadFlag("database", "ssl", "0", i);
+		host.poolsize	= conf.ReadInteger("database", "poolsize", "1", i, true);
+		host.statements	= conf.ReadInteger("database", "statements", "32", i, true);
 	}
 
 	bool HostInConf(const SQLhost &h)
@@ -776,13 +1039,7 @@ class ModulePgSQL : public Module
 		for(int i = 0; i < conf.Enumerate("database"); i++)
 		{
 			SQLhost host;
-			host.id		= conf.ReadValue("database", "id", i);
-			host.host	= conf.ReadValue("database", "hostname", i);
-			host.port	= conf.ReadInteger("database", "port", i, true);
-			host.name	= conf.ReadValue("database", "name", i);
-			host.user	= conf.ReadValue("database", "username", i);
-			host.pass	= conf.ReadValue("database", "password", i);
-			host.ssl	= conf.ReadFlag("database", "ssl", "0", i);
+			ReadHost(conf, i, host);
 			if (h == host)
 				return true;
 		}
@@ -799,16 +1056,16 @@ class ModulePgSQL : public Module
 			SQLhost host;
 			int ipvalid;
 
-			host.id		= conf.ReadValue("database", "id", i);
-			host.host	= conf.ReadValue("database", "hostname", i);
-			host.port	= conf.ReadInteger("database", "port", i, true);
-			host.name	= conf.ReadValue("database", "name", i);
-			host.user	= conf.ReadValue("database", "username", i);
-			host.pass	= conf.ReadValue("database", "password", i);
-			host.ssl	= conf.ReadFlag("database", "ssl", "0", i);
+			ReadHost(conf, i, host);
 
-			if (HasHost(host))
+			/* Reopen any of its connections which have failed */
+			ConnectionPool* pool = FindHost(host);
+			if (pool)
+			{
+				if (!pool->Fill())
+					DelayReconnect();
 				continue;
+			}
 
 #ifdef IPV6
 			if (strchr(host.host.c_str(),':'))
@@ -855,16 +1112,16 @@ class ModulePgSQL : public Module
 
 	void ClearOldConnections()
 	{
-		ConnMap::iterator iter,safei;
-		for (iter = connections.begin(); iter != connections.end(); iter++)
+		ConnMap::iterator iter = connections.begin();
+		while (iter != connections.end())
 		{
 			if (!HostInConf(iter->second->GetConfHost()))
 			{
 				DELETE(iter->second);
-				safei = iter;
-				--iter;
-				connections.erase(safei);
+				connections.erase(iter++);
 			}
+			else
+				iter++;
 		}
 	}
 
@@ -873,8 +1130,8 @@ class ModulePgSQL : public Module
 		ConnMap::iterator i;
 		while ((i = connections.begin()) != connections.end())
 		{
-			connections.erase(i);
 			DELETE(i->second);
+			connections.erase(i);
 		}
 	}
 
@@ -886,27 +1143,38 @@ class ModulePgSQL : public Module
 			return;
 		}
 
-		SQLConn* newconn;
+		ConnectionPool* pool = new ConnectionPool(ServerInstance, this, hi);
+		connections.insert(std::make_pair(hi.id, pool));
+
+		if (!pool->Fill())
+			DelayReconnect();
+	}
 
-		/* The conversion succeeded, we were given an IP and we can give it straight to SQLConn */
-		newconn = new SQLConn(ServerInstance, this, hi);
+	/** Try to open the connections which failed again in a while
+	 */
+	void DelayReconnect()
+	{
+		if (retimer)
+			return;
 
-		connections.insert(std::make_pair(hi.id, newconn));
+		retimer = new ReconnectTimer(ServerInstance, this);
+		ServerInstance->Timers->AddTimer(retimer);
 	}
 
 	void ReconnectConn(SQLConn* conn)
 	{
 		for (ConnMap::iterator iter = connections.begin(); iter != connections.end(); iter++)
-		{
-			if (conn == iter->second)
-			{
-				DELETE(iter->second);
-				connections.erase(iter);
-				break;
-			}
-		}
-		retimer = new ReconnectTimer(ServerInstance, this);
-		ServerInstance->Timers->AddTimer(retimer);
+			if (iter->second->Remove(conn))
+				return;
+
+		DelayReconnect();
+	}
+
+	void OnReconnectTimer()
+	{
+		/* The timer deletes itself once it has ticked */
+		retimer = NULL;
+		ReadConf();
 	}
 
 	virtual char* OnRequest(Request* request)
@@ -929,14 +1197,24 @@ class ModulePgSQL : public Module
 				return NULL;
 			}
 		}
+		else if (strcmp(SQLSTATSID, request->GetId()) == 0)
+		{
+			SQLstatsrequest* req = (SQLstatsrequest*)request;
+			ConnMap::iterator iter = connections.find(req->dbid);
+			if (iter == connections.end())
+				return NULL;
+
+			req->stats = iter->second->GetStats();
+			return sqlsuccess;
+		}
 		return NULL;
 	}
 
 	virtual void OnUnloadModule(Module* mod, const std::string&	name)
 	{
 		/* When a module unloads we have to check all the pending queries for all our connections
-		 * and set the Module* specifying where the query came from to NULL. If the query has already
-		 * been dispatched then when it is processed it will be dropped if the pointer is NULL.
+		 * and forget the ones from that module. If a query has already been dispatched then when
+		 * it is processed its result will be dropped.
 		 *
 		 * If the queries we find are not already being executed then we can simply remove them immediately.
 		 */
@@ -946,6 +1224,17 @@ class ModulePgSQL : public Module
 		}
 	}
 
+	virtual int OnStats(char symbol, userrec* user, string_list &results)
+	{
+		if (symbol == 'S')
+		{
+			for (ConnMap::iterator iter = connections.begin(); iter != connections.end(); iter++)
+				results.push_back(std::string(ServerInstance->Config->ServerName) + " 304 " + user->nick + " :SQLSTATS pgsql " + iter->first + " " +
+						iter->second->GetStats().Summary());
+		}
+		return 0;
+	}
+
 	unsigned long NewID()
 	{
 		if (currid+1 == 0)
@@ -972,13 +1261,12 @@ void SQLresolver::OnLookupComplete(const std::string &result, unsigned int ttl,
 
 void ReconnectTimer::Tick(time_t time)
 {
-	((ModulePgSQL*)mod)->ReadConf();
+	((ModulePgSQL*)mod)->OnReconnectTimer();
 }
 
 void SQLConn::DelayReconnect()
 {
-	((ModulePgSQL*)us)->ReconnectConn(this);
+	((ModulePgSQL*)pool->us)->ReconnectConn(this);
 }
 
 MODULE_INIT(ModulePgSQL);
-
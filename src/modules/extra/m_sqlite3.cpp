@@ -13,6 +13,8 @@
 
 #include "inspircd.h"
 #include <sqlite3.h>
+#include <pthread.h>
+#include <fcntl.h>
 #include "users.h"
 #include "channels.h"
 #include "modules.h"
@@ -20,64 +22,115 @@
 #include "m_sqlv2.h"
 
 /* $ModDesc: sqlite3 provider */
-/* $CompileFlags: pkgconfversion("sqlite3","3.3") pkgconfincludes("sqlite3","/sqlite3.h","") */
+/* $CompileFlags: pkgconfversion("sqlite3","3.5") pkgconfincludes("sqlite3","/sqlite3.h","") */
 /* $LinkerFlags: pkgconflibs("sqlite3","/libsqlite3.so","-lsqlite3") */
 /* $ModDep: m_sqlv2.h */
 
 
 class SQLConn;
 class SQLite3Result;
-class ResultNotifier;
 
 typedef std::map<std::string, SQLConn*> ConnMap;
-typedef std::deque<classbase*> paramlist;
-typedef std::deque<SQLite3Result*> ResultQueue;
 
-ResultNotifier* resultnotify = NULL;
+/** A queue which one thread puts items on and one other thread takes them
+ * off, without a lock. Each end only moves its own pointer: items are linked
+ * on after the tail, and taken by moving the head along, which always points
+ * at a node whose item has been taken (at first, a dummy), so the two ends
+ * never touch the same node except through its next pointer.
+ */
+template<typename T> class LockFreeQueue : public classbase
+{
+	struct Node
+	{
+		T* item;
+		Node* volatile next;
+	};
 
+	/** The consumer's end
+	 */
+	Node* head;
 
-class ResultNotifier : public InspSocket
-{
-	Module* mod;
-	insp_sockaddr sock_us;
-	socklen_t uslen;
+	/** The producer's end
+	 */
+	Node* tail;
 
  public:
-	/* Create a socket on a random port. Let the tcp stack allocate us an available port */
-#ifdef IPV6
-	ResultNotifier(InspIRCd* SI, Module* m) : InspSocket(SI, "::1", 0, true, 3000), mod(m)
-#else
-	ResultNotifier(InspIRCd* SI, Module* m) : InspSocket(SI, "127.0.0.1", 0, true, 3000), mod(m)
-#endif
+	LockFreeQueue()
+	{
+		head = tail = new Node;
+		head->item = NULL;
+		head->next = NULL;
+	}
+
+	/** Anything still queued is not deleted
+	 */
+	~LockFreeQueue()
 	{
-		uslen = sizeof(sock_us);
-		if (getsockname(this->fd,(sockaddr*)&sock_us,&uslen))
+		while (head)
 		{
-			throw ModuleException("Could not create random listening port on localhost");
+			Node* n = head->next;
+			delete head;
+			head = n;
 		}
 	}
 
-	ResultNotifier(InspIRCd* SI, Module* m, int newfd, char* ip) : InspSocket(SI, newfd, ip), mod(m)
+	/** Queue an item, from the producing thread
+	 */
+	void push(T* item)
 	{
+		Node* n = new Node;
+		n->item = item;
+		n->next = NULL;
+		// The node must be complete before the consumer can see it
+		__sync_synchronize();
+		tail->next = n;
+		tail = n;
 	}
 
-	/* Using getsockname and ntohs, we can determine which port number we were allocated */
-	int GetPort()
+	/** Take the first item, from the consuming thread
+	 * @return The item, or NULL if there are none
+	 */
+	T* pop()
 	{
-#ifdef IPV6
-		return ntohs(sock_us.sin6_port);
-#else
-		return ntohs(sock_us.sin_port);
-#endif
+		Node* n = head->next;
+		if (!n)
+			return NULL;
+		__sync_synchronize();
+		T* item = n->item;
+		delete head;
+		head = n;
+		return item;
 	}
 
-	virtual int OnIncomingConnection(int newsock, char* ip)
+	/** @return True if there is nothing to take, from the consuming thread
+	 */
+	bool empty()
+	{
+		return !head->next;
+	}
+};
+
+/** A request as handed to a connection's thread. Only the ID and query are
+ * used there, the source is just carried along for the result.
+ */
+struct SQLite3Query
+{
+	unsigned long id;
+	Module* source;
+	SQLquery query;
+	unsigned long long sent;
+
+	SQLite3Query(SQLrequest &req) : id(req.id), source(req.GetSource()), query(req.query), sent(SQLstats::Now())
 	{
-		Dispatch();
-		return false;
 	}
+};
 
-	void Dispatch();
+/** A prepared statement kept for reuse, see SQLConn::statements
+ */
+struct CachedStatement
+{
+	sqlite3_stmt* stmt;
+	unsigned long lastused;
 };
 
 
@@ -96,8 +149,14 @@ class SQLite3Result : public SQLresult
 	SQLfieldMap* fieldmap;
 
   public:
+	/** When the query was sent, started and finished, and whether it reused a
+	 * prepared statement, for SQLstats
+	 */
+	unsigned long long sent, started, finished;
+	bool reused;
+
 	SQLite3Result(Module* self, Module* to, unsigned int id)
-	: SQLresult(self, to, id), currentrow(0), rows(0), cols(0), fieldlist(NULL), fieldmap(NULL)
+	: SQLresult(self, to, id), currentrow(0), rows(0), cols(0), fieldlist(NULL), fieldmap(NULL), sent(0), started(0), finished(0), reused(false)
 	{
 	}
 
@@ -105,25 +164,39 @@ class SQLite3Result : public SQLresult
 	{
 	}
 
-	void AddRow(int colsnum, char **data, char **colname)
+	/** Take the column names from a statement about to be stepped through
+	 */
+	void SetColumns(sqlite3_stmt* stmt)
 	{
 		colnames.clear();
-		cols = colsnum;
-		for (int i = 0; i < colsnum; i++)
+		cols = sqlite3_column_count(stmt);
+		for (int i = 0; i < cols; i++)
 		{
-			fieldlists.resize(fieldlists.size()+1);
-			colnames.push_back(colname[i]);
-			SQLfield sf(data[i] ? data[i] : "", data[i] ? false : true);
-			fieldlists[rows].push_back(sf);
+			const char* name = sqlite3_column_name(stmt, i);
+			colnames.push_back(name ? name : "");
 		}
-		rows++;
 	}
 
-	void UpdateAffectedCount()
+	/** Copy the row a statement is on
+	 */
+	void AddRow(sqlite3_stmt* stmt)
 	{
+		fieldlists.resize(rows + 1);
+		for (int i = 0; i < cols; i++)
+		{
+			const char* data = (const char*)sqlite3_column_text(stmt, i);
+			fieldlists[rows].push_back(SQLfield(data ? data : "", data ? false : true));
+		}
 		rows++;
 	}
 
+	/** Count rows changed by an INSERT, UPDATE or DELETE
+	 */
+	void AddAffected(int count)
+	{
+		rows += count;
+	}
+
 	virtual int Rows()
 	{
 		return rows;
@@ -249,212 +322,587 @@ class SQLite3Result : public SQLresult
 
 };
 
-class SQLConn : public classbase
+/** One database, and the thread every query on it is run on. Requests are
+ * handed to the thread and results back through LockFreeQueues. Each side
+ * wakes the other with a byte down a pipe, but only once the other has
+ * said it is waiting, so a busy connection passes queries back and forth
+ * without any system calls. The read end of the pipe back is our fd.
+ */
+class SQLConn : public EventHandler, public SQLparameters
 {
   private:
-	ResultQueue results;
-  	InspIRCd* Instance;
+	InspIRCd* Instance;
 	Module* mod;
 	SQLhost host;
 	sqlite3* conn;
 
+	/** Queries waiting for the thread
+	 */
+	LockFreeQueue<SQLite3Query> requests;
+
+	/** Results waiting for the main thread
+	 */
+	LockFreeQueue<SQLite3Result> results;
+
+	/** The pipe the thread waits on
+	 */
+	int wakefd[2];
+
+	/** The write end of the pipe back to the main thread
+	 */
+	int notifyfd;
+
+	/** Set by the thread when it is about to wait for requests
+	 */
+	volatile int sleeping;
+
+	/** Set by the thread when it has woken the main thread, until that comes for the results
+	 */
+	volatile int signalled;
+
+	/** Tells the thread to finish once it has run everything queued
+	 */
+	volatile int stopping;
+
+	pthread_t thread;
+	bool running;
+
+	/** Whether the database is used in WAL mode
+	 */
+	bool wal;
+
+	/** Most queries to run in one transaction
+	 */
+	unsigned int batchsize;
+
+	/** Most prepared statements to keep
+	 */
+	unsigned int maxstatements;
+
+	/** Prepared statements by the text they were prepared from. Only the thread uses these.
+	 */
+	std::map<std::string, CachedStatement> statements;
+
+	/** Counts statement uses, to find the one least recently used
+	 */
+	unsigned long statementclock;
+
+	/** The module each query in progress is for, by query ID, or NULL if that module
+	 * has since unloaded. Only the main thread uses this.
+	 */
+	std::map<unsigned long, Module*> inflight;
+
+	/** Only the main thread uses these
+	 */
+	SQLstats stats;
+
+	static bool MakePipe(int fds[2])
+	{
+		if (pipe(fds))
+			return false;
+
+		// The thread blocks reading its pipe, nothing else may block
+		fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL, 0) | O_NONBLOCK);
+		return true;
+	}
+
+	static void* Entry(void* arg)
+	{
+		((SQLConn*)arg)->Run();
+		return NULL;
+	}
+
   public:
-	SQLConn(InspIRCd* SI, Module* m, const SQLhost& hi)
-	: Instance(SI), mod(m), host(hi)
+	SQLConn(InspIRCd* SI, Module* m, const SQLhost& hi, bool walmode, unsigned int batch)
+	: Instance(SI), mod(m), host(hi), conn(NULL), notifyfd(-1), sleeping(0), signalled(0), stopping(0), running(false),
+	  wal(walmode), batchsize(batch ? batch : 1), maxstatements(hi.statements), statementclock(0)
 	{
+		wakefd[0] = wakefd[1] = -1;
+		this->fd = -1;
+
 		if (OpenDB() != SQLITE_OK)
 		{
 			Instance->Log(DEFAULT, "WARNING: Could not open DB with id: " + host.id);
 			CloseDB();
+			return;
+		}
+
+		/* Readers no longer wait for writers, and each commit is an append to the
+		 * log rather than a sync of the database and its journal.
+		 */
+		if (wal)
+			sqlite3_exec(conn, "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL", NULL, NULL, NULL);
+		else
+			sqlite3_exec(conn, "PRAGMA journal_mode=DELETE", NULL, NULL, NULL);
+
+		int fds[2];
+		if (!MakePipe(wakefd) || !MakePipe(fds))
+		{
+			Instance->Log(DEFAULT, "WARNING: Could not create pipes for DB with id: %s: %s", host.id.c_str(), strerror(errno));
+			return;
+		}
+
+		fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+		this->SetFd(fds[0]);
+		notifyfd = fds[1];
+
+		if (!Instance->SE->AddFd(this))
+		{
+			Instance->Log(DEFAULT, "WARNING: Could not add DB with id: %s to the socket engine", host.id.c_str());
+			return;
 		}
+
+		if (pthread_create(&thread, NULL, Entry, this))
+		{
+			Instance->Log(DEFAULT, "WARNING: Could not start a thread for DB with id: %s", host.id.c_str());
+			return;
+		}
+
+		running = true;
 	}
 
 	~SQLConn()
 	{
+		Stop();
+
+		// Left over if the thread never started, or came back since the last HandleEvent()
+		while (SQLite3Query* q = requests.pop())
+			delete q;
+		while (SQLite3Result* res = results.pop())
+			delete res;
+
+		for (std::map<std::string, CachedStatement>::iterator i = statements.begin(); i != statements.end(); i++)
+			sqlite3_finalize(i->second.stmt);
+
 		CloseDB();
+
+		if (this->fd > -1)
+		{
+			Instance->SE->DelFd(this);
+			close(this->fd);
+			close(notifyfd);
+		}
+
+		if (wakefd[0] > -1)
+		{
+			close(wakefd[0]);
+			close(wakefd[1]);
+		}
 	}
 
+	/** Queue a query for the thread
+	 */
 	SQLerror Query(SQLrequest &req)
 	{
-		/* Pointer to the buffer we screw around with substitution in */
-		char* query;
+		if (!running)
+			return SQLerror(BAD_CONN);
+
+		inflight[req.id] = req.GetSource();
+		requests.push(new SQLite3Query(req));
+		stats.Queued(inflight.size());
 
-		/* Pointer to the current end of query, where we append new stuff */
-		char* queryend;
+		// Only if it has said it is waiting, or is about to
+		__sync_synchronize();
+		if (__sync_bool_compare_and_swap(&sleeping, 1, 0))
+			Wake();
 
-		/* Total length of the unescaped parameters */
-		unsigned long paramlen;
+		return SQLerror();
+	}
+
+	/** Let the thread run everything queued, and wait for it to finish
+	 */
+	void Stop()
+	{
+		if (!running)
+			return;
 
-		/* Total length of query, used for binary-safety in mysql_real_query */
-		unsigned long querylength = 0;
+		stopping = 1;
+		__sync_synchronize();
+		Wake();
+		pthread_join(thread, NULL);
+		running = false;
+	}
 
-		paramlen = 0;
-		for(ParamL::iterator i = req.query.p.begin(); i != req.query.p.end(); i++)
+	void Wake()
+	{
+		char c = 0;
+		if (write(wakefd[1], &c, 1) < 0)
 		{
-			paramlen += i->size();
+			// The pipe is full, so the thread has plenty to wake it.
 		}
+	}
 
-		/* To avoid a lot of allocations, allocate enough memory for the biggest the escaped query could possibly be.
-		 * sizeofquery + (totalparamlength*2) + 1
-		 *
-		 * The +1 is for null-terminating the string for mysql_real_escape_string
-		 */
-		query = new char[req.query.q.length() + (paramlen*2) + 1];
-		queryend = query;
+	/** Forget the module queries in progress are for, when it unloads.
+	 * They still run, but their results are dropped.
+	 */
+	void OnUnloadModule(Module* m)
+	{
+		for (std::map<unsigned long, Module*>::iterator i = inflight.begin(); i != inflight.end(); i++)
+			if (i->second == m)
+				i->second = NULL;
+	}
+
+	/** The thread has handed results back
+	 */
+	virtual void HandleEvent(EventType et, int errornum = 0)
+	{
+		char buf[64];
+		while (read(this->fd, buf, sizeof(buf)) > 0);
+
+		// Anything handed back from now on wakes us again
+		signalled = 0;
+		__sync_synchronize();
+
+		SendResults();
+	}
 
-		for(unsigned long i = 0; i < req.query.q.length(); i++)
+	void SendResults()
+	{
+		while (SQLite3Result* res = results.pop())
 		{
-			if(req.query.q[i] == '?')
-			{
-				if(req.query.p.size())
-				{
-					char* escaped;
-					escaped = sqlite3_mprintf("%q", req.query.p.front().c_str());
-					for (char* n = escaped; *n; n++)
-					{
-						*queryend = *n;
-						queryend++;
-					}
-					sqlite3_free(escaped);
-					req.query.p.pop_front();
-				}
-				else
-					break;
-			}
-			else
+			std::map<unsigned long, Module*>::iterator i = inflight.find(res->id);
+			bool wanted = ((i != inflight.end()) && (i->second));
+
+			if (i != inflight.end())
 			{
-				*queryend = req.query.q[i];
-				queryend++;
+				stats.Answered(res->sent, res->started, res->finished, res->error.Id() != NO_ERROR, res->reused);
+				inflight.erase(i);
 			}
-			querylength++;
-		}
-		*queryend = 0;
-		req.query.q = query;
 
-		SQLite3Result* res = new SQLite3Result(mod, req.GetSource(), req.id);
-		res->dbid = host.id;
-		res->query = req.query.q;
-		paramlist params;
-		params.push_back(this);
-		params.push_back(res);
-
-		char *errmsg = 0;
-		sqlite3_update_hook(conn, QueryUpdateHook, &params);
-		if (sqlite3_exec(conn, req.query.q.data(), QueryResult, &params, &errmsg) != SQLITE_OK)
-		{
-			std::string error(errmsg);
-			sqlite3_free(errmsg);
-			delete[] query;
+			/* If the client module is unloaded partway through a query then OnUnloadModule()
+			 * sets its pointer to NULL. We cannot just cancel the query as the result will
+			 * still come through at some point, so it is dropped here instead.
+			 */
+			if (wanted)
+				res->Send();
+
 			delete res;
-			return SQLerror(QSEND_FAIL, error);
 		}
-		delete[] query;
+	}
 
-		results.push_back(res);
-		SendNotify();
-		return SQLerror();
+	/** Return the statistics, with what is queued now. The thread runs one query at a time
+	 * (or one batch), so everything else sent and not yet answered is waiting.
+	 */
+	SQLstats GetStats()
+	{
+		SQLstats now = stats;
+		now.connections = running ? 1 : 0;
+		now.busy = inflight.empty() ? 0 : 1;
+		now.queued = inflight.size() - now.busy;
+		return now;
 	}
 
-	static int QueryResult(void *params, int argc, char **argv, char **azColName)
+	/** Wait until there are requests, on the thread
+	 * @return False if the thread should finish
+	 */
+	bool WaitForRequests()
 	{
-		paramlist* p = (paramlist*)params;
-		((SQLConn*)(*p)[0])->ResultReady(((SQLite3Result*)(*p)[1]), argc, argv, azColName);
-		return 0;
+		while (requests.empty())
+		{
+			if (stopping)
+				return false;
+
+			sleeping = 1;
+			__sync_synchronize();
+
+			if (!requests.empty() || stopping)
+			{
+				/* Something came in as we were about to sleep. If the main thread saw
+				 * us asleep a byte is on its way, which the next wait just reads.
+				 */
+				__sync_bool_compare_and_swap(&sleeping, 1, 0);
+				continue;
+			}
+
+			char buf[64];
+			if ((read(wakefd[0], buf, sizeof(buf)) < 0) && (errno != EINTR))
+				return false;
+		}
+
+		return true;
 	}
 
-	static void QueryUpdateHook(void *params, int eventid, char const * azSQLite, char const * azColName, sqlite_int64 rowid)
+	/** The thread's loop
+	 */
+	void Run()
 	{
-		paramlist* p = (paramlist*)params;
-		((SQLConn*)(*p)[0])->AffectedReady(((SQLite3Result*)(*p)[1]));
+		std::vector<SQLite3Query*> work;
+
+		while (WaitForRequests())
+		{
+			// Take what has built up, so that it can be run in as few transactions as possible
+			SQLite3Query* q;
+			while ((work.size() < batchsize) && (q = requests.pop()))
+				work.push_back(q);
+
+			size_t i = 0;
+			while (i < work.size())
+			{
+				size_t end = i;
+				while ((end < work.size()) && Batchable(work[end]->query.q))
+					end++;
+
+				// Not inside a transaction of the caller's own
+				if ((end - i > 1) && sqlite3_get_autocommit(conn))
+				{
+					RunBatch(work, i, end);
+					i = end;
+				}
+				else
+				{
+					Publish(Execute(work[i]));
+					i++;
+				}
+			}
+
+			for (i = 0; i < work.size(); i++)
+				delete work[i];
+			work.clear();
+		}
 	}
 
-	void ResultReady(SQLite3Result *res, int cols, char **data, char **colnames)
+	/** @return False if a query can't go in a transaction with others, such as one which controls transactions itself
+	 */
+	static bool Batchable(const std::string &q)
 	{
-		res->AddRow(cols, data, colnames);
+		static const char* const keywords[] = { "BEGIN", "COMMIT", "END", "ROLLBACK", "SAVEPOINT", "RELEASE", "VACUUM", "ATTACH", "DETACH", "PRAGMA", NULL };
+
+		size_t start = q.find_first_not_of(" \t\r\n(");
+		if (start == std::string::npos)
+			return false;
+
+		size_t len = q.find_first_of(" \t\r\n;", start);
+		std::string word = q.substr(start, len == std::string::npos ? std::string::npos : len - start);
+
+		for (int i = 0; keywords[i]; i++)
+			if (!strcasecmp(word.c_str(), keywords[i]))
+				return false;
+
+		return true;
 	}
 
-	void AffectedReady(SQLite3Result *res)
+	/** Run work[first] to work[last - 1] in one transaction. If that can't be committed, they are
+	 * run again one at a time, so that only the ones which fail are reported as failing.
+	 */
+	void RunBatch(std::vector<SQLite3Query*> &work, size_t first, size_t last)
 	{
-		res->UpdateAffectedCount();
+		if (sqlite3_exec(conn, "BEGIN", NULL, NULL, NULL) == SQLITE_OK)
+		{
+			// Some errors, such as a full disk, roll the whole transaction back themselves,
+			// and anything after that would be committed on its own, then again below.
+			std::vector<SQLite3Result*> done;
+			for (size_t i = first; (i < last) && !sqlite3_get_autocommit(conn); i++)
+				done.push_back(Execute(work[i]));
+
+			if (!sqlite3_get_autocommit(conn) && (sqlite3_exec(conn, "COMMIT", NULL, NULL, NULL) == SQLITE_OK))
+			{
+				for (size_t i = 0; i < done.size(); i++)
+					Publish(done[i]);
+				return;
+			}
+
+			if (!sqlite3_get_autocommit(conn))
+				sqlite3_exec(conn, "ROLLBACK", NULL, NULL, NULL);
+
+			for (size_t i = 0; i < done.size(); i++)
+				delete done[i];
+		}
+
+		for (size_t i = first; i < last; i++)
+			Publish(Execute(work[i]));
 	}
 
-	int OpenDB()
+	/** Hand a result back to the main thread
+	 */
+	void Publish(SQLite3Result* res)
 	{
-		return sqlite3_open(host.host.c_str(), &conn);
+		results.push(res);
+
+		__sync_synchronize();
+		if (__sync_bool_compare_and_swap(&signalled, 0, 1))
+		{
+			char c = 0;
+			if (write(notifyfd, &c, 1) < 0)
+			{
+				// The pipe is full, so the main thread will be round anyway.
+			}
+		}
 	}
 
-	void CloseDB()
+	virtual std::string Escape(const std::string &param)
 	{
-		sqlite3_interrupt(conn);
-		sqlite3_close(conn);
+		char* escaped = sqlite3_mprintf("%q", param.c_str());
+		std::string ret = escaped;
+		sqlite3_free(escaped);
+		return ret;
 	}
 
-	SQLhost GetConfHost()
+	virtual std::string Placeholder(unsigned int n)
 	{
-		return host;
+		return "?";
 	}
 
-	void SendResults()
+	/** Find the prepared statement for some text, preparing and keeping it if it is new
+	 * @param reused Set to true if it was already prepared
+	 * @return NULL if it is more than one statement, or doesn't prepare (the caller runs
+	 * it as plain text, which reports the error), or no statements are kept
+	 */
+	sqlite3_stmt* GetStatement(const std::string &sql, bool &reused)
 	{
-		while (results.size())
+		std::map<std::string, CachedStatement>::iterator i = statements.find(sql);
+		if (i != statements.end())
 		{
-			SQLite3Result* res = results[0];
-			if (res->GetDest())
-			{
-				res->Send();
-			}
-			else
-			{
-				/* If the client module is unloaded partway through a query then the provider will set
-				 * the pointer to NULL. We cannot just cancel the query as the result will still come
-				 * through at some point...and it could get messy if we play with invalid pointers...
-				 */
-				delete res;
-			}
-			results.pop_front();
+			i->second.lastused = ++statementclock;
+			reused = true;
+			return i->second.stmt;
+		}
+
+		if (!maxstatements)
+			return NULL;
+
+		sqlite3_stmt* stmt;
+		const char* tail;
+		if ((sqlite3_prepare_v2(conn, sql.c_str(), sql.length() + 1, &stmt, &tail) != SQLITE_OK) || !stmt)
+			return NULL;
+
+		while (isspace(*tail))
+			tail++;
+
+		if (*tail)
+		{
+			sqlite3_finalize(stmt);
+			return NULL;
+		}
+
+		if (statements.size() >= maxstatements)
+		{
+			std::map<std::string, CachedStatement>::iterator oldest = statements.begin();
+			for (i = statements.begin(); i != statements.end(); i++)
+				if (i->second.lastused < oldest->second.lastused)
+					oldest = i;
+
+			sqlite3_finalize(oldest->second.stmt);
+			statements.erase(oldest);
 		}
+
+		CachedStatement &entry = statements[sql];
+		entry.stmt = stmt;
+		entry.lastused = ++statementclock;
+		return stmt;
 	}
 
-	void ClearResults()
+	/** Run a query, on the thread
+	 */
+	SQLite3Result* Execute(SQLite3Query* q)
 	{
-		while (results.size())
+		SQLite3Result* res = new SQLite3Result(mod, q->source, q->id);
+		res->dbid = host.id;
+		res->sent = q->sent;
+		res->started = SQLstats::Now();
+
+		std::string sql;
+		ParamL binds;
+		Substitute(q->query, sql, binds, res->query);
+
+		int changes = sqlite3_total_changes(conn);
+
+		sqlite3_stmt* stmt = GetStatement(sql, res->reused);
+		if (stmt)
 		{
-			SQLite3Result* res = results[0];
-			delete res;
-			results.pop_front();
+			for (unsigned int i = 0; i < binds.size(); i++)
+				sqlite3_bind_text(stmt, i + 1, binds[i].data(), binds[i].length(), SQLITE_STATIC);
+
+			Step(stmt, res);
+			sqlite3_reset(stmt);
+			sqlite3_clear_bindings(stmt);
+		}
+		else
+		{
+			RunText(res->query, res);
 		}
+
+		res->AddAffected(sqlite3_total_changes(conn) - changes);
+		res->finished = SQLstats::Now();
+		return res;
 	}
 
-	void SendNotify()
+	/** Step through a statement, copying its rows into a result
+	 * @return False, with the error set in the result, if it failed
+	 */
+	bool Step(sqlite3_stmt* stmt, SQLite3Result* res)
 	{
-		int QueueFD;
-		if ((QueueFD = socket(AF_FAMILY, SOCK_STREAM, 0)) == -1)
+		if (sqlite3_column_count(stmt))
+			res->SetColumns(stmt);
+
+		int ret;
+		while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+			res->AddRow(stmt);
+
+		if (ret != SQLITE_DONE)
 		{
-			/* crap, we're out of sockets... */
-			return;
+			res->error = SQLerror(QREPLY_FAIL, sqlite3_errmsg(conn));
+			return false;
 		}
 
-		insp_sockaddr addr;
+		return true;
+	}
 
-#ifdef IPV6
-		insp_aton("::1", &addr.sin6_addr);
-		addr.sin6_family = AF_FAMILY;
-		addr.sin6_port = htons(resultnotify->GetPort());
-#else
-		insp_inaddr ia;
-		insp_aton("127.0.0.1", &ia);
-		addr.sin_family = AF_FAMILY;
-		addr.sin_addr = ia;
-		addr.sin_port = htons(resultnotify->GetPort());
-#endif
+	/** Run each statement in some text, as sqlite3_exec() would, copying rows into a result
+	 */
+	void RunText(const std::string &text, SQLite3Result* res)
+	{
+		const char* sql = text.c_str();
 
-		if (connect(QueueFD, (sockaddr*)&addr,sizeof(addr)) == -1)
+		while (*sql)
 		{
-			/* wtf, we cant connect to it, but we just created it! */
-			return;
+			sqlite3_stmt* stmt;
+			const char* tail;
+
+			if (sqlite3_prepare_v2(conn, sql, -1, &stmt, &tail) != SQLITE_OK)
+			{
+				res->error = SQLerror(QREPLY_FAIL, sqlite3_errmsg(conn));
+				return;
+			}
+
+			// Only a comment or white space was left
+			if (!stmt)
+				return;
+
+			bool ok = Step(stmt, res);
+			sqlite3_finalize(stmt);
+			if (!ok)
+				return;
+
+			sql = tail;
 		}
 	}
 
+	int OpenDB()
+	{
+		return sqlite3_open(host.host.c_str(), &conn);
+	}
+
+	void CloseDB()
+	{
+		if (!conn)
+			return;
+
+		sqlite3_interrupt(conn);
+		sqlite3_close(conn);
+		conn = NULL;
+	}
+
+	SQLhost GetConfHost()
+	{
+		return host;
+	}
+
+	/** Check whether the settings which aren't part of the SQLhost are still the same
+	 */
+	bool SameSettings(bool walmode, unsigned int batch)
+	{
+		return (wal == walmode) && (batchsize == (batch ? batch : 1));
+	}
 };
 
 
@@ -468,6 +916,10 @@ class ModuleSQLite3 : public Module
 	ModuleSQLite3(InspIRCd* Me)
 	: Module::Module(Me), currid(0)
 	{
+		// Each database is used from its own thread
+		if (!sqlite3_threadsafe())
+			throw ModuleException("m_sqlite3: This SQLite was built without thread support");
+
 		ServerInstance->UseInterface("SQLutils");
 
 		if (!ServerInstance->PublishFeature("SQL", this))
@@ -475,8 +927,6 @@ class ModuleSQLite3 : public Module
 			throw ModuleException("m_sqlite3: Unable to publish feature 'SQL'");
 		}
 
-		resultnotify = new ResultNotifier(ServerInstance, this);
-
 		ReadConf();
 
 		ServerInstance->PublishInterface("SQL", this);
@@ -484,13 +934,7 @@ class ModuleSQLite3 : public Module
 
 	virtual ~ModuleSQLite3()
 	{
-		ClearQueue();
 		ClearAllConnections();
-		resultnotify->SetFd(-1);
-		resultnotify->state = I_ERROR;
-		resultnotify->OnError(I_ERR_SOCKET);
-		resultnotify->ClosePending = true;
-		delete resultnotify;
 		ServerInstance->UnpublishInterface("SQL", this);
 		ServerInstance->UnpublishFeature("SQL");
 		ServerInstance->DoneWithInterface("SQLutils");
@@ -498,23 +942,7 @@ class ModuleSQLite3 : public Module
 
 	void Implements(char* List)
 	{
-		List[I_OnRequest] = List[I_OnRehash] = 1;
-	}
-
-	void SendQueue()
-	{
-		for (ConnMap::iterator iter = connections.begin(); iter != connections.end(); iter++)
-		{
-			iter->second->SendResults();
-		}
-	}
-
-	void ClearQueue()
-	{
-		for (ConnMap::iterator iter = connections.begin(); iter != connections.end(); iter++)
-		{
-			iter->second->ClearResults();
-		}
+		List[I_OnRequest] = List[I_OnRehash] = List[I_OnUnloadModule] = List[I_OnStats] = 1;
 	}
 
 	bool HasHost(const SQLhost &host)
@@ -527,7 +955,7 @@ class ModuleSQLite3 : public Module
 		return false;
 	}
 
-	bool HostInConf(const SQLhost &h)
+	bool HostInConf(SQLConn* c)
 	{
 		ConfigReader conf(ServerInstance);
 		for(int i = 0; i < conf.Enumerate("database"); i++)
@@ -540,7 +968,8 @@ class ModuleSQLite3 : public Module
 			host.user	= conf.ReadValue("database", "username", i);
 			host.pass	= conf.ReadValue("database", "password", i);
 			host.ssl	= conf.ReadFlag("database", "ssl", "0", i);
-			if (h == host)
+			host.statements	= conf.ReadInteger("database", "statements", "32", i, true);
+			if ((c->GetConfHost() == host) && c->SameSettings(conf.ReadFlag("database", "wal", "yes", i), conf.ReadInteger("database", "batch", "64", i, true)))
 				return true;
 		}
 		return false;
@@ -562,15 +991,16 @@ class ModuleSQLite3 : public Module
 			host.user	= conf.ReadValue("database", "username", i);
 			host.pass	= conf.ReadValue("database", "password", i);
 			host.ssl	= conf.ReadFlag("database", "ssl", "0", i);
+			host.statements	= conf.ReadInteger("database", "statements", "32", i, true);
 
 			if (HasHost(host))
 				continue;
 
-			this->AddConn(host);
+			this->AddConn(host, conf.ReadFlag("database", "wal", "yes", i), conf.ReadInteger("database", "batch", "64", i, true));
 		}
 	}
 
-	void AddConn(const SQLhost& hi)
+	void AddConn(const SQLhost& hi, bool wal, unsigned int batch)
 	{
 		if (HasHost(hi))
 		{
@@ -580,23 +1010,26 @@ class ModuleSQLite3 : public Module
 
 		SQLConn* newconn;
 
-		newconn = new SQLConn(ServerInstance, this, hi);
+		newconn = new SQLConn(ServerInstance, this, hi, wal, batch);
 
 		connections.insert(std::make_pair(hi.id, newconn));
 	}
 
 	void ClearOldConnections()
 	{
-		ConnMap::iterator iter,safei;
-		for (iter = connections.begin(); iter != connections.end(); iter++)
+		ConnMap::iterator iter = connections.begin();
+		while (iter != connections.end())
 		{
-			if (!HostInConf(iter->second->GetConfHost()))
+			if (!HostInConf(iter->second))
 			{
+				// Let what was queued finish, and hand back its results
+				iter->second->Stop();
+				iter->second->SendResults();
 				DELETE(iter->second);
-				safei = iter;
-				--iter;
-				connections.erase(safei);
+				connections.erase(iter++);
 			}
+			else
+				iter++;
 		}
 	}
 
@@ -605,8 +1038,8 @@ class ModuleSQLite3 : public Module
 		ConnMap::iterator i;
 		while ((i = connections.begin()) != connections.end())
 		{
-			connections.erase(i);
 			DELETE(i->second);
+			connections.erase(i);
 		}
 	}
 
@@ -615,6 +1048,12 @@ class ModuleSQLite3 : public Module
 		ReadConf();
 	}
 
+	virtual void OnUnloadModule(Module* mod, const std::string& name)
+	{
+		for (ConnMap::iterator iter = connections.begin(); iter != connections.end(); iter++)
+			iter->second->OnUnloadModule(mod);
+	}
+
 	virtual char* OnRequest(Request* request)
 	{
 		if(strcmp(SQLREQID, request->GetId()) == 0)
@@ -633,9 +1072,30 @@ class ModuleSQLite3 : public Module
 				return NULL;
 			}
 		}
+		else if (strcmp(SQLSTATSID, request->GetId()) == 0)
+		{
+			SQLstatsrequest* req = (SQLstatsrequest*)request;
+			ConnMap::iterator iter = connections.find(req->dbid);
+			if (iter == connections.end())
+				return NULL;
+
+			req->stats = iter->second->GetStats();
+			return SQLSUCCESS;
+		}
 		return NULL;
 	}
 
+	virtual int OnStats(char symbol, userrec* user, string_list &results)
+	{
+		if (symbol == 'S')
+		{
+			for (ConnMap::iterator iter = connections.begin(); iter != connections.end(); iter++)
+				results.push_back(std::string(ServerInstance->Config->ServerName) + " 304 " + user->nick + " :SQLSTATS sqlite3 " + iter->first + " " +
+						iter->second->GetStats().Summary());
+		}
+		return 0;
+	}
+
 	unsigned long NewID()
 	{
 		if (currid+1 == 0)
@@ -651,10 +1111,5 @@ class ModuleSQLite3 : public Module
 
 };
 
-void ResultNotifier::Dispatch()
-{
-	((ModuleSQLite3*)mod)->SendQueue();
-}
-
 MODULE_INIT(ModuleSQLite3);
 
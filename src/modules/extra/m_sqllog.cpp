@@ -24,164 +24,233 @@ static std::string dbid;
 
 enum LogTypes { LT_OPER = 1, LT_KILL, LT_SERVLINK, LT_XLINE, LT_CONNECT, LT_DISCONNECT, LT_FLOOD, LT_LOADMODULE };
 
-enum QueryState { FIND_SOURCE, FIND_NICK, FIND_HOST, DONE};
+enum QueryState { FIND_ID, INSERT_ID, FIND_INSERTED };
 
-class QueryInfo;
+class LogEntry;
+class IdLookup;
 
-std::map<unsigned long,QueryInfo*> active_queries;
+/** Remembers the ids of names already looked up. It holds two generations of up
+ * to size names each: a name used from the old one moves to the new one, and when
+ * the new one is full the old one is thrown away, so the cache stays bounded but
+ * keeps the names in use.
+ */
+class IdCache
+{
+	std::map<std::string, int> current;
+	std::map<std::string, int> previous;
+	unsigned int size;
+
+ public:
+	IdCache() : size(1000)
+	{
+	}
+
+	void SetSize(unsigned int s)
+	{
+		size = s ? s : 1;
+	}
+
+	/** Return the id of a name, or -1 if it isn't known
+	 */
+	int Find(const std::string &name)
+	{
+		std::map<std::string, int>::iterator i = current.find(name);
+		if (i != current.end())
+			return i->second;
+
+		i = previous.find(name);
+		if (i == previous.end())
+			return -1;
+
+		int id = i->second;
+		previous.erase(i);
+		Add(name, id);
+		return id;
+	}
 
-class QueryInfo
+	void Add(const std::string &name, int id)
+	{
+		if (current.size() >= size)
+		{
+			previous.clear();
+			previous.swap(current);
+		}
+		current[name] = id;
+	}
+
+	void Clear()
+	{
+		current.clear();
+		previous.clear();
+	}
+};
+
+/** A log entry waiting for the ids of its nick, host and source
+ */
+class LogEntry
 {
-public:
-	QueryState qs;
-	unsigned long id;
+ public:
+	int category;
 	std::string nick;
 	std::string source;
 	std::string hostname;
 	int sourceid;
 	int nickid;
 	int hostid;
-	int category;
 	time_t date;
-	bool insert;
+	/** How many lookups are still to answer for this entry
+	 */
+	int outstanding;
+	/** Set if one of them failed, so the entry can't be written
+	 */
+	bool failed;
+
+	LogEntry(int cat, const std::string &n, const std::string &h, const std::string &s)
+	: category(cat), nick(n), source(s), hostname(h), sourceid(-1), nickid(-1), hostid(-1), date(time(NULL)), outstanding(0), failed(false)
+	{
+	}
+};
 
-	QueryInfo(const std::string &n, const std::string &s, const std::string &h, unsigned long i, int cat)
+/** Finds the id of one name in ircd_log_actors or ircd_log_hosts, adding the name if it
+ * isn't there, for all the entries which are waiting on it.
+ */
+class IdLookup
+{
+ public:
+	bool host;
+	std::string name;
+	QueryState qs;
+	std::vector<LogEntry*> waiting;
+
+	IdLookup(bool h, const std::string &n) : host(h), name(n), qs(FIND_ID)
 	{
-		qs = FIND_SOURCE;
-		nick = n;
-		source = s;
-		hostname = h;
-		id = i;
-		category = cat;
-		sourceid = nickid = hostid = -1;
-		date = time(NULL);
-		insert = false;
 	}
 
-	void Go(SQLresult* res)
+	/** Send the next query
+	 * @return The query ID, or 0 if it couldn't be sent
+	 */
+	unsigned long Send()
 	{
 		SQLrequest req = SQLreq(MyMod, SQLModule, dbid, "", "");
-		switch (qs)
+		if (qs == INSERT_ID)
 		{
-			case FIND_SOURCE:
-				if (res->Rows() && sourceid == -1 && !insert)
-				{
-					sourceid = atoi(res->GetValue(0,0).d.c_str());
-					req = SQLreq(MyMod, SQLModule, dbid, "SELECT id,actor FROM ircd_log_actors WHERE actor='?'", nick);
-					if(req.Send())
-					{
-						insert = false;
-						qs = FIND_NICK;
-						active_queries[req.id] = this;
-					}
-				}
-				else if (res->Rows() && sourceid == -1 && insert)
-				{
-					req = SQLreq(MyMod, SQLModule, dbid, "SELECT id,actor FROM ircd_log_actors WHERE actor='?'", source);
-					if(req.Send())
-					{
-						insert = false;
-						qs = FIND_SOURCE;
-						active_queries[req.id] = this;
-					}
-				}
-				else
-				{
-					req = SQLreq(MyMod, SQLModule, dbid, "INSERT INTO ircd_log_actors (actor) VALUES('?')", source);
-					if(req.Send())
-					{
-						insert = true;
-						qs = FIND_SOURCE;
-						active_queries[req.id] = this;
-					}
-				}
-			break;
+			if (host)
+				req = SQLreq(MyMod, SQLModule, dbid, "INSERT INTO ircd_log_hosts (hostname) VALUES('?')", name);
+			else
+				req = SQLreq(MyMod, SQLModule, dbid, "INSERT INTO ircd_log_actors (actor) VALUES('?')", name);
+		}
+		else
+		{
+			if (host)
+				req = SQLreq(MyMod, SQLModule, dbid, "SELECT id,hostname FROM ircd_log_hosts WHERE hostname='?'", name);
+			else
+				req = SQLreq(MyMod, SQLModule, dbid, "SELECT id,actor FROM ircd_log_actors WHERE actor='?'", name);
+		}
 
-			case FIND_NICK:
-				if (res->Rows() && nickid == -1 && !insert)
-				{
-					nickid = atoi(res->GetValue(0,0).d.c_str());
-					req = SQLreq(MyMod, SQLModule, dbid, "SELECT id,hostname FROM ircd_log_hosts WHERE hostname='?'", hostname);
-					if(req.Send())
-					{
-						insert = false;
-						qs = FIND_HOST;
-						active_queries[req.id] = this;
-					}
-				}
-				else if (res->Rows() && nickid == -1 && insert)
-				{
-					req = SQLreq(MyMod, SQLModule, dbid, "SELECT id,actor FROM ircd_log_actors WHERE actor='?'", nick);
-					if(req.Send())
-					{
-						insert = false;
-						qs = FIND_NICK;
-						active_queries[req.id] = this;
-					}
-				}
-				else
-				{
-					req = SQLreq(MyMod, SQLModule, dbid, "INSERT INTO ircd_log_actors (actor) VALUES('?')",nick);
-					if(req.Send())
-					{
-						insert = true;
-						qs = FIND_NICK;
-						active_queries[req.id] = this;
-					}
-				}
-			break;
+		return req.Send() ? req.id : 0;
+	}
 
-			case FIND_HOST:
-				if (res->Rows() && hostid == -1 && !insert)
-				{
-					hostid = atoi(res->GetValue(0,0).d.c_str());
-					req = SQLreq(MyMod, SQLModule, dbid, "INSERT INTO ircd_log (category_id,nick,host,source,dtime) VALUES("+ConvToStr(category)+","+ConvToStr(nickid)+","+ConvToStr(hostid)+","+ConvToStr(sourceid)+","+ConvToStr(date)+")");
-					if(req.Send())
-					{
-						insert = true;
-						qs = DONE;
-						active_queries[req.id] = this;
-					}
-				}
-				else if (res->Rows() && hostid == -1 && insert)
-				{
-					req = SQLreq(MyMod, SQLModule, dbid, "SELECT id,hostname FROM ircd_log_hosts WHERE hostname='?'", hostname);
-					if(req.Send())
-					{
-						insert = false;
-						qs = FIND_HOST;
-						active_queries[req.id] = this;
-					}
-				}
-				else
+	/** Handle the answer to the last query
+	 * @param id Set to the id once it has been found
+	 * @return False if the lookup is over: the id is found, or it failed and is -1
+	 */
+	bool Go(SQLresult* res, int &id)
+	{
+		switch (qs)
+		{
+			case FIND_ID:
+			case FIND_INSERTED:
+				if (res->error.Id() == NO_ERROR && res->Rows())
 				{
-					req = SQLreq(MyMod, SQLModule, dbid, "INSERT INTO ircd_log_hosts (hostname) VALUES('?')", hostname);
-					if(req.Send())
-					{
-						insert = true;
-						qs = FIND_HOST;
-						active_queries[req.id] = this;
-					}
+					id = atoi(res->GetValue(0,0).d.c_str());
+					return false;
 				}
+				if (res->error.Id() != NO_ERROR || qs == FIND_INSERTED)
+					return false;
+				qs = INSERT_ID;
 			break;
 
-			case DONE:
-				delete active_queries[req.id];
-				active_queries[req.id] = NULL;
+			case INSERT_ID:
+				/* Look again even if the insert failed, as another server may have just added it */
+				qs = FIND_INSERTED;
 			break;
 		}
+		return true;
+	}
+};
+
+/** One row of ircd_log, with its ids found
+ */
+struct LogRow
+{
+	int category;
+	int nickid;
+	int hostid;
+	int sourceid;
+	time_t date;
+};
+
+class ModuleSQLLog;
+
+/** Writes the rows waiting every interval seconds
+ */
+class FlushTimer : public InspTimer
+{
+	ModuleSQLLog* mod;
+ public:
+	FlushTimer(InspIRCd* Instance, ModuleSQLLog* m, long interval) : InspTimer(interval, Instance->Time(), true), mod(m)
+	{
 	}
+
+	virtual void Tick(time_t TIME);
 };
 
 /* $ModDesc: Logs network-wide data to an SQL database */
 
 class ModuleSQLLog : public Module
 {
-	ConfigReader* Conf;
+	/** The ids of actors and hosts already looked up
+	 */
+	IdCache actors;
+	IdCache hosts;
+
+	/** Lookups in progress, by name and by query ID
+	 */
+	std::map<std::string, IdLookup*> actorlookups;
+	std::map<std::string, IdLookup*> hostlookups;
+	std::map<unsigned long, IdLookup*> lookupqueries;
+
+	/** Rows ready to write, and how many rows each INSERT in progress has, by query ID
+	 */
+	std::vector<LogRow> ready;
+	std::map<unsigned long, unsigned int> flushes;
+
+	/** How many entries are waiting for ids or being written, which is
+	 * never more than maxbuffer
+	 */
+	unsigned int buffered;
+
+	/** Settings from <sqllog>
+	 */
+	unsigned int batch;
+	unsigned int maxbuffer;
+	long interval;
+
+	/** Entries written, dropped because the buffer was full, and lost because a query failed
+	 */
+	unsigned long written;
+	unsigned long dropped;
+	unsigned long failed;
+
+	/** Drops already logged
+	 */
+	unsigned long reported;
+
+	FlushTimer* timer;
 
  public:
 	ModuleSQLLog(InspIRCd* Me)
-	: Module::Module(Me)
+	: Module::Module(Me), buffered(0), batch(100), maxbuffer(5000), interval(1), written(0), dropped(0), failed(0), reported(0), timer(NULL)
 	{
 		ServerInstance->UseInterface("SQLutils");
 		ServerInstance->UseInterface("SQL");
@@ -192,13 +261,39 @@ class ModuleSQLLog : public Module
 
 		SQLModule = ServerInstance->FindFeature("SQL");
 
-		OnRehash(NULL,"");
 		MyMod = this;
-		active_queries.clear();
+		OnRehash(NULL,"");
 	}
 
 	virtual ~ModuleSQLLog()
 	{
+		if (timer)
+			ServerInstance->Timers->DelTimer(timer);
+
+		/* Write out the rows which are ready, often the last quits and kills before a
+		 * shutdown. We will be gone before the answer comes, so none is asked for.
+		 */
+		unsigned int sent = ready.size();
+		Flush(false);
+
+		/* Entries still waiting for ids can't be written */
+		unsigned long lost = 0;
+		for (std::map<unsigned long, IdLookup*>::iterator i = lookupqueries.begin(); i != lookupqueries.end(); i++)
+		{
+			for (std::vector<LogEntry*>::iterator e = i->second->waiting.begin(); e != i->second->waiting.end(); e++)
+			{
+				if (!--(*e)->outstanding)
+				{
+					delete *e;
+					lost++;
+				}
+			}
+			delete i->second;
+		}
+
+		if (sent || lost)
+			ServerInstance->Log(DEFAULT, "m_sqllog: Unloading: sent the last %u log entries, lost %lu still waiting for ids", sent, lost);
+
 		ServerInstance->DoneWithInterface("SQL");
 		ServerInstance->DoneWithInterface("SQLutils");
 	}
@@ -207,13 +302,50 @@ class ModuleSQLLog : public Module
 	{
 		List[I_OnRehash] = List[I_OnOper] = List[I_OnGlobalOper] = List[I_OnKill] = 1;
 		List[I_OnPreCommand] = List[I_OnUserConnect] = 1;
-		List[I_OnUserQuit] = List[I_OnLoadModule] = List[I_OnRequest] = 1;
+		List[I_OnUserQuit] = List[I_OnLoadModule] = List[I_OnRequest] = List[I_OnStats] = 1;
 	}
 
 	void ReadConfig()
 	{
 		ConfigReader Conf(ServerInstance);
-		dbid = Conf.ReadValue("sqllog","dbid",0);	// database id of a database configured in sql module
+		std::string newdbid = Conf.ReadValue("sqllog","dbid",0);	// database id of a database configured in sql module
+
+		/* Ids from another database mean nothing in this one */
+		if (newdbid != dbid)
+		{
+			actors.Clear();
+			hosts.Clear();
+		}
+		dbid = newdbid;
+
+		batch = Conf.ReadInteger("sqllog", "batch", "100", 0, true);
+		maxbuffer = Conf.ReadInteger("sqllog", "buffer", "5000", 0, true);
+		long newinterval = Conf.ReadInteger("sqllog", "interval", "1", 0, true);
+		unsigned int cache = Conf.ReadInteger("sqllog", "cache", "1000", 0, true);
+
+		/* SQLite can't take more rows than this in one INSERT before 3.8.8 */
+		if (batch < 1 || batch > 500)
+			batch = 100;
+		if (newinterval < 1)
+			newinterval = 1;
+		if (maxbuffer < batch)
+			maxbuffer = batch;
+
+		actors.SetSize(cache);
+		hosts.SetSize(cache);
+
+		if (timer && newinterval != interval)
+		{
+			ServerInstance->Timers->DelTimer(timer);
+			timer = NULL;
+		}
+		interval = newinterval;
+
+		if (!timer)
+		{
+			timer = new FlushTimer(ServerInstance, this, interval);
+			ServerInstance->Timers->AddTimer(timer);
+		}
 	}
 
 	virtual void OnRehash(userrec* user, const std::string &parameter)
@@ -225,17 +357,31 @@ class ModuleSQLLog : public Module
 	{
 		if(strcmp(SQLRESID, request->GetId()) == 0)
 		{
-			SQLresult* res;
-			std::map<unsigned long, QueryInfo*>::iterator n;
+			SQLresult* res = static_cast<SQLresult*>(request);
 
-			res = static_cast<SQLresult*>(request);
-			n = active_queries.find(res->id);
+			std::map<unsigned long, IdLookup*>::iterator n = lookupqueries.find(res->id);
+			if (n != lookupqueries.end())
+			{
+				IdLookup* lookup = n->second;
+				lookupqueries.erase(n);
+				Continue(lookup, res);
+				return SQLSUCCESS;
+			}
 
-			if (n != active_queries.end())
+			std::map<unsigned long, unsigned int>::iterator f = flushes.find(res->id);
+			if (f != flushes.end())
 			{
-				n->second->Go(res);
-				std::map<unsigned long, QueryInfo*>::iterator n = active_queries.find(res->id);
-				active_queries.erase(n);
+				if (res->error.Id() == NO_ERROR)
+				{
+					written += f->second;
+				}
+				else
+				{
+					failed += f->second;
+					ServerInstance->Log(DEBUG, "m_sqllog: Could not write %u log entries: %s", f->second, res->error.Str());
+				}
+				buffered -= f->second;
+				flushes.erase(f);
 			}
 
 			return SQLSUCCESS;
@@ -244,19 +390,210 @@ class ModuleSQLLog : public Module
 		return NULL;
 	}
 
+	/** Send the next query of a lookup, or hand its id to the entries waiting on it once it is over
+	 */
+	void Continue(IdLookup* lookup, SQLresult* res)
+	{
+		int id = -1;
+		if (lookup->Go(res, id))
+		{
+			unsigned long qid = lookup->Send();
+			if (qid)
+			{
+				lookupqueries[qid] = lookup;
+				return;
+			}
+		}
+		Finish(lookup, id);
+	}
+
+	/** A lookup is over, so give its id to the entries waiting on it, and queue those which have all of theirs
+	 * @param id The id, or -1 if the lookup failed
+	 */
+	void Finish(IdLookup* lookup, int id)
+	{
+		if (lookup->host)
+			hostlookups.erase(lookup->name);
+		else
+			actorlookups.erase(lookup->name);
+
+		if (id != -1)
+		{
+			if (lookup->host)
+				hosts.Add(lookup->name, id);
+			else
+				actors.Add(lookup->name, id);
+		}
+
+		for (std::vector<LogEntry*>::iterator i = lookup->waiting.begin(); i != lookup->waiting.end(); i++)
+		{
+			LogEntry* entry = *i;
+			if (id == -1)
+				entry->failed = true;
+			else
+				Resolve(entry, lookup->host, lookup->name, id);
+
+			if (!--entry->outstanding)
+				Queue(entry);
+		}
+
+		delete lookup;
+	}
+
+	/** Set the ids of an entry which are for a name
+	 */
+	void Resolve(LogEntry* entry, bool host, const std::string &name, int id)
+	{
+		if (host)
+		{
+			if (entry->hostname == name)
+				entry->hostid = id;
+		}
+		else
+		{
+			if (entry->nick == name)
+				entry->nickid = id;
+			if (entry->source == name)
+				entry->sourceid = id;
+		}
+	}
+
+	/** Queue an entry to be written, now its lookups are over
+	 */
+	void Queue(LogEntry* entry)
+	{
+		if (entry->failed)
+		{
+			failed++;
+			buffered--;
+		}
+		else
+		{
+			LogRow row;
+			row.category = entry->category;
+			row.nickid = entry->nickid;
+			row.hostid = entry->hostid;
+			row.sourceid = entry->sourceid;
+			row.date = entry->date;
+			ready.push_back(row);
+
+			if (ready.size() >= batch)
+				Flush();
+		}
+		delete entry;
+	}
+
+	/** Wait for the id of a name, looking it up unless that is already under way
+	 */
+	void Lookup(LogEntry* entry, bool host, const std::string &name)
+	{
+		std::map<std::string, IdLookup*> &lookups = host ? hostlookups : actorlookups;
+		std::map<std::string, IdLookup*>::iterator i = lookups.find(name);
+		IdLookup* lookup;
+
+		if (i != lookups.end())
+		{
+			lookup = i->second;
+		}
+		else
+		{
+			lookup = new IdLookup(host, name);
+			unsigned long qid = lookup->Send();
+			if (!qid)
+			{
+				delete lookup;
+				entry->failed = true;
+				return;
+			}
+			lookups[name] = lookup;
+			lookupqueries[qid] = lookup;
+		}
+
+		lookup->waiting.push_back(entry);
+		entry->outstanding++;
+	}
+
+	/** Write the rows which are ready, in one INSERT
+	 * @param reply False to send it without asking for the result
+	 */
+	void Flush(bool reply = true)
+	{
+		if (ready.empty())
+			return;
+
+		std::string query = "INSERT INTO ircd_log (category_id,nick,host,source,dtime) VALUES";
+		for (std::vector<LogRow>::iterator i = ready.begin(); i != ready.end(); i++)
+		{
+			if (i != ready.begin())
+				query.append(",");
+			query.append("("+ConvToStr(i->category)+","+ConvToStr(i->nickid)+","+ConvToStr(i->hostid)+","+ConvToStr(i->sourceid)+","+ConvToStr(i->date)+")");
+		}
+
+		SQLrequest req = SQLreq(reply ? this : NULL, SQLModule, dbid, query);
+		if (req.Send())
+		{
+			if (reply)
+				flushes[req.id] = ready.size();
+		}
+		else
+		{
+			failed += ready.size();
+			buffered -= ready.size();
+		}
+		ready.clear();
+	}
+
+	/** Called every interval seconds
+	 */
+	void OnTimer()
+	{
+		Flush();
+
+		if (dropped != reported)
+		{
+			ServerInstance->Log(DEFAULT, "m_sqllog: Dropped %lu log entries as the database is not keeping up (%lu in all)", dropped - reported, dropped);
+			reported = dropped;
+		}
+	}
+
 	void AddLogEntry(int category, const std::string &nick, const std::string &host, const std::string &source)
 	{
 		// is the sql module loaded? If not, we don't attempt to do anything.
 		if (!SQLModule)
 			return;
 
-		SQLrequest req = SQLreq(this, SQLModule, dbid, "SELECT id,actor FROM ircd_log_actors WHERE actor='?'", source);
-		if(req.Send())
+		if (buffered >= maxbuffer)
+		{
+			dropped++;
+			return;
+		}
+
+		LogEntry* entry = new LogEntry(category, nick, host, source);
+		buffered++;
+
+		entry->hostid = hosts.Find(host);
+		entry->nickid = actors.Find(nick);
+		entry->sourceid = actors.Find(source);
+
+		if (entry->hostid == -1)
+			Lookup(entry, true, host);
+		if (entry->nickid == -1)
+			Lookup(entry, false, nick);
+		if ((entry->sourceid == -1) && (source != nick))
+			Lookup(entry, false, source);
+
+		if (!entry->outstanding)
+			Queue(entry);
+	}
+
+	virtual int OnStats(char symbol, userrec* user, string_list &results)
+	{
+		if (symbol == 'S')
 		{
-			QueryInfo* i = new QueryInfo(nick, source, host, req.id, category);
-			i->qs = FIND_SOURCE;
-			active_queries[req.id] = i;
+			results.push_back(std::string(ServerInstance->Config->ServerName) + " 304 " + user->nick + " :SQLLOG " + dbid + " " + ConvToStr(buffered) + " buffered, " +
+					ConvToStr(written) + " written, " + ConvToStr(dropped) + " dropped, " + ConvToStr(failed) + " failed");
 		}
+		return 0;
 	}
 
 	virtual void OnOper(userrec* user, const std::string &opertype)
@@ -306,5 +643,10 @@ class ModuleSQLLog : public Module
 	
 };
 
+void FlushTimer::Tick(time_t TIME)
+{
+	mod->OnTimer();
+}
+
 MODULE_INIT(ModuleSQLLog);
 
@@ -0,0 +1,311 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2007 InspIRCd Development Team
+ * See: http://www.inspircd.org/wiki/index.php/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#include "inspircd.h"
+#include "users.h"
+#include "channels.h"
+#include "modules.h"
+#include "m_sqlv2.h"
+
+/* $ModDesc: Runs a set of queries through the SQL provider and checks the answers */
+/* $ModDep: m_sqlv2.h */
+
+/** One query sent, and what it should come back with
+ */
+struct ExpectedResult
+{
+	/** The run it is part of
+	 */
+	unsigned long run;
+	/** Values of the first row, or none if there should be no rows
+	 */
+	std::vector<std::string> values;
+	/** True if the query should fail
+	 */
+	bool fail;
+	/** True to show the whole result to the oper, rather than check it
+	 */
+	bool show;
+};
+
+/** A set of queries started by one SQLTEST
+ */
+struct TestRun
+{
+	std::string nick;
+	std::string dbid;
+	unsigned int sent;
+	unsigned int answered;
+	unsigned int wrong;
+	/** True while queries are still being sent, as a provider may answer at once
+	 */
+	bool sending;
+};
+
+class ModuleSQLTest;
+
+/** Handle /SQLTEST
+ */
+class cmd_sqltest : public command_t
+{
+	ModuleSQLTest* Parent;
+ public:
+	cmd_sqltest(InspIRCd* Me, ModuleSQLTest* p) : command_t(Me, "SQLTEST", 'o', 1), Parent(p)
+	{
+		this->source = "m_sqltest.so";
+		syntax = "<database-id> [<distinct-queries>|:<query>]";
+	}
+
+	CmdResult Handle(const char** parameters, int pcnt, userrec* user);
+};
+
+class ModuleSQLTest : public Module
+{
+	cmd_sqltest* mycommand;
+	std::map<unsigned long, ExpectedResult> pending;
+	std::map<unsigned long, TestRun> runs;
+	unsigned long lastrun;
+
+	void Notice(const std::string &nick, const std::string &text)
+	{
+		userrec* user = ServerInstance->FindNick(nick);
+		if (user)
+			user->WriteServ("NOTICE %s :%s", user->nick, text.c_str());
+		ServerInstance->Log(DEFAULT, "m_sqltest: %s", text.c_str());
+	}
+
+	/** Send one query
+	 * @return False if the provider refused it, which counts as an answer
+	 */
+	bool Send(Module* provider, unsigned long run, const SQLquery &query, const ExpectedResult &expect)
+	{
+		TestRun &r = runs[run];
+		SQLrequest req(this, provider, r.dbid, query);
+		r.sent++;
+		if (req.Send())
+		{
+			pending[req.id] = expect;
+			pending[req.id].run = run;
+			return true;
+		}
+
+		r.answered++;
+		if (!expect.fail)
+		{
+			r.wrong++;
+			Notice(r.nick, "SQLTEST " + r.dbid + ": " + query.q + " was refused: " + req.error.Str());
+		}
+		return false;
+	}
+
+	void Expect(ExpectedResult &e, const char* a = NULL, const char* b = NULL)
+	{
+		e.values.clear();
+		e.fail = e.show = false;
+		if (a)
+			e.values.push_back(a);
+		if (b)
+			e.values.push_back(b);
+	}
+
+	void Finish(unsigned long run)
+	{
+		TestRun &r = runs[run];
+		if ((r.sending) || (r.answered < r.sent))
+			return;
+
+		std::string summary = "SQLTEST " + r.dbid + ": " + ConvToStr(r.sent) + " queries, " + ConvToStr(r.sent - r.wrong) + " as expected";
+		SQLstatsrequest stats(this, ServerInstance->FindFeature("SQL"), r.dbid);
+		if (stats.GetDest() && stats.Send())
+			summary.append(". Provider: " + stats.stats.Summary());
+		Notice(r.nick, summary);
+		runs.erase(run);
+	}
+
+ public:
+	ModuleSQLTest(InspIRCd* Me)
+		: Module::Module(Me), lastrun(0)
+	{
+		ServerInstance->UseInterface("SQL");
+		mycommand = new cmd_sqltest(ServerInstance, this);
+		ServerInstance->AddCommand(mycommand);
+	}
+
+	virtual ~ModuleSQLTest()
+	{
+		ServerInstance->DoneWithInterface("SQL");
+	}
+
+	void Implements(char* List)
+	{
+		List[I_OnRequest] = 1;
+	}
+
+	/** Start a run of the usual checks, or of one query given by the oper
+	 * @param distinct How many different statements to send, more than the provider keeps
+	 * prepared to make it replace them
+	 */
+	CmdResult Start(userrec* user, const std::string &dbid, unsigned int distinct, const char* query)
+	{
+		Module* provider = ServerInstance->FindFeature("SQL");
+		if (!provider)
+		{
+			user->WriteServ("NOTICE %s :*** SQLTEST: No SQL provider is loaded", user->nick);
+			return CMD_FAILURE;
+		}
+
+		unsigned long run = ++lastrun;
+		TestRun &r = runs[run];
+		r.nick = user->nick;
+		r.dbid = dbid;
+		r.sent = r.answered = r.wrong = 0;
+		r.sending = true;
+
+		ExpectedResult e;
+		if (query)
+		{
+			Expect(e);
+			e.show = true;
+			Send(provider, run, SQLquery(query), e);
+			r.sending = false;
+			Finish(run);
+			return CMD_SUCCESS;
+		}
+
+		/* Quotes and backslashes sent apart from the text, or escaped into it */
+		Expect(e, "it's", "back\\slash");
+		Send(provider, run, SQLquery("SELECT '?' AS a, '?' AS b") % "it's" % "back\\slash", e);
+
+		/* The same text again, which a provider should reuse a statement for */
+		for (unsigned int n = 0; n < 3; n++)
+		{
+			std::string value = "round " + ConvToStr(n);
+			Expect(e, value.c_str());
+			Send(provider, run, SQLquery("SELECT '?' AS a") % value, e);
+		}
+
+		/* Different texts, to replace statements */
+		for (unsigned int n = 0; n < distinct; n++)
+		{
+			std::string value = "value " + ConvToStr(n);
+			Expect(e, value.c_str());
+			Send(provider, run, SQLquery("SELECT '?' AS v" + ConvToStr(n)) % value, e);
+		}
+
+		Expect(e);
+		Send(provider, run, SQLquery("SELECT '?' AS a WHERE 1 = 0") % "none", e);
+
+		/* A parameter not in quotes goes into the text */
+		Expect(e, "42");
+		Send(provider, run, SQLquery("SELECT ? AS n") % 42, e);
+
+		Expect(e);
+		e.fail = true;
+		Send(provider, run, SQLquery("SELECT '?' AS a FROM sqltest_no_such_table") % "none", e);
+
+		r.sending = false;
+		Finish(run);
+		return CMD_SUCCESS;
+	}
+
+	virtual char* OnRequest(Request* request)
+	{
+		if (strcmp(SQLRESID, request->GetId()))
+			return NULL;
+
+		SQLresult* res = static_cast<SQLresult*>(request);
+		std::map<unsigned long, ExpectedResult>::iterator i = pending.find(res->id);
+		if (i == pending.end())
+			return NULL;
+
+		ExpectedResult e = i->second;
+		pending.erase(i);
+		std::map<unsigned long, TestRun>::iterator r = runs.find(e.run);
+		if (r == runs.end())
+			return SQLSUCCESS;
+		r->second.answered++;
+
+		std::string prefix = "SQLTEST " + r->second.dbid + ": " + res->query;
+		if (e.show)
+		{
+			if (res->error.Id() != NO_ERROR)
+				Notice(r->second.nick, prefix + " failed: " + res->error.Str());
+			for (int row = 0; (row < res->Rows()) && (row < 10); row++)
+			{
+				std::string line = prefix + " row " + ConvToStr(row) + ":";
+				for (int col = 0; col < res->Cols(); col++)
+				{
+					SQLfield f = res->GetValue(row, col);
+					line.append(" " + res->ColName(col) + "=" + (f.null ? "NULL" : f.d));
+				}
+				Notice(r->second.nick, line);
+			}
+			Notice(r->second.nick, prefix + " gave " + ConvToStr(res->Rows()) + " rows");
+		}
+		else if (res->error.Id() != NO_ERROR)
+		{
+			if (!e.fail)
+			{
+				r->second.wrong++;
+				Notice(r->second.nick, prefix + " failed: " + res->error.Str());
+			}
+		}
+		else if (e.fail)
+		{
+			r->second.wrong++;
+			Notice(r->second.nick, prefix + " should have failed, but did not");
+		}
+		else if ((e.values.empty() != !res->Rows()) || ((res->Rows()) && (res->Cols() != (int)e.values.size())))
+		{
+			r->second.wrong++;
+			Notice(r->second.nick, prefix + " gave " + ConvToStr(res->Rows()) + " rows of " + ConvToStr(res->Cols()) + " columns");
+		}
+		else
+		{
+			for (unsigned int col = 0; col < e.values.size(); col++)
+			{
+				SQLfield f = res->GetValue(0, col);
+				if (f.null || (f.d != e.values[col]))
+				{
+					r->second.wrong++;
+					Notice(r->second.nick, prefix + " gave '" + f.d + "' for " + res->ColName(col) + ", expected '" + e.values[col] + "'");
+					break;
+				}
+			}
+		}
+
+		Finish(e.run);
+		return SQLSUCCESS;
+	}
+
+	virtual Version GetVersion()
+	{
+		return Version(1, 1, 0, 0, VF_VENDOR, API_VERSION);
+	}
+};
+
+CmdResult cmd_sqltest::Handle(const char** parameters, int pcnt, userrec* user)
+{
+	const char* query = NULL;
+	unsigned int distinct = 40;
+	if (pcnt > 1)
+	{
+		if (strchr(parameters[1], ' ') || !atoi(parameters[1]))
+			query = parameters[1];
+		else
+			distinct = atoi(parameters[1]);
+	}
+	return Parent->Start(user, parameters[0], distinct, query);
+}
+
+MODULE_INIT(ModuleSQLTest);
@@ -17,6 +17,7 @@
 #include <string>
 #include <deque>
 #include <map>
+#include <sys/time.h>
 #include "modules.h"
 
 /** SQLreq define.
@@ -29,6 +30,7 @@
  */
 #define SQLREQID "SQLv2 Request"
 #define SQLRESID "SQLv2 Result"
+#define SQLSTATSID "SQLv2 Stats"
 #define SQLSUCCESS "You shouldn't be reading this (success)"
 
 /** Defines the error types which SQLerror may be set to
@@ -235,7 +237,9 @@ public:
 	 *
 	 * SQLrequest req = SQLreq(MyMod, SQLModule, dbid, "INSERT INTO ircd_log_actors VALUES('','?')", nick);
 	 *
-	 * @param s A pointer to the sending module, where the result should be routed
+	 * @param s A pointer to the sending module, where the result should be routed.
+	 * If this is NULL the query is still run, but no result is sent anywhere, for
+	 * writes whose outcome nobody will read, such as from a module's destructor.
 	 * @param d A pointer to the receiving module, identified as implementing the 'SQL' feature
 	 * @param databaseid The database ID to perform the query on. This must match a valid
 	 * database ID from the configuration of the SQL module.
@@ -428,6 +432,181 @@ public:
 	virtual void Free(SQLfieldList* fl) = 0;
 };
 
+/** SQLstats is what every SQL provider counts for each database, so that they can
+ * all be watched the same way, through /STATS S or an SQLstatsrequest.
+ * Times are in microseconds.
+ */
+class SQLstats : public classbase
+{
+ public:
+	/** Connections open to the database, and how many are running a query.
+	 * These and queued are filled in when the statistics are asked for.
+	 */
+	unsigned int connections;
+	unsigned int busy;
+	/** Queries waiting for a connection, and the most there have been
+	 */
+	unsigned long queued;
+	unsigned long peak;
+	/** Queries answered, how many of them failed, and how many reused a prepared statement
+	 */
+	unsigned long queries;
+	unsigned long failed;
+	unsigned long reused;
+	/** Time answered queries spent waiting for a connection and running, and the longest one took
+	 */
+	unsigned long long waited;
+	unsigned long long ran;
+	unsigned long long longest;
+
+	SQLstats()
+	: connections(0), busy(0), queued(0), peak(0), queries(0), failed(0), reused(0), waited(0), ran(0), longest(0)
+	{
+	}
+
+	/** Return the time now, to measure queries by
+	 */
+	static unsigned long long Now()
+	{
+		timeval tv;
+		gettimeofday(&tv, NULL);
+		return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+	}
+
+	/** Note how many queries are waiting
+	 */
+	void Queued(unsigned long count)
+	{
+		if (count > peak)
+			peak = count;
+	}
+
+	/** Count an answered query
+	 * @param sent When the query was sent to the provider
+	 * @param started When it was sent to the database
+	 * @param finished When the database answered
+	 * @param error True if it failed
+	 * @param prepared True if it reused a prepared statement
+	 */
+	void Answered(unsigned long long sent, unsigned long long started, unsigned long long finished, bool error, bool prepared)
+	{
+		// The clock may have been stepped back in between
+		if (started < sent)
+			started = sent;
+		if (finished < started)
+			finished = started;
+
+		queries++;
+		failed += error;
+		reused += prepared;
+		waited += started - sent;
+		ran += finished - started;
+		if (finished - sent > longest)
+			longest = finished - sent;
+	}
+
+	/** Return the statistics as a line for /STATS S
+	 */
+	std::string Summary()
+	{
+		return ConvToStr(busy) + "/" + ConvToStr(connections) + " connections busy, " + ConvToStr(queued) + " queued (peak " + ConvToStr(peak) + "), " +
+			ConvToStr(queries) + " queries " + ConvToStr(failed) + " failed " + ConvToStr(reused) + " prepared, average wait " +
+			Millis(queries ? waited / queries : 0) + " run " + Millis(queries ? ran / queries : 0) + ", longest " + Millis(longest);
+	}
+
+ private:
+	static std::string Millis(unsigned long long usec)
+	{
+		return ConvToStr(usec / 1000) + "." + ConvToStr(usec / 100 % 10) + "ms";
+	}
+};
+
+/** SQLstatsrequest asks the module providing the 'SQL' feature for the statistics of
+ * one of its databases. Send() returns NULL if there is no such database.
+ */
+class SQLstatsrequest : public Request
+{
+ public:
+	/** The database ID to get the statistics of
+	 */
+	std::string dbid;
+	/** Filled in with the statistics
+	 */
+	SQLstats stats;
+
+	SQLstatsrequest(Module* s, Module* d, const std::string &databaseid)
+	: Request(s, d, SQLSTATSID), dbid(databaseid)
+	{
+	}
+};
+
+/** SQLparameters is used by SQL providers which can send a query's parameters apart
+ * from its text, as server-side prepared statements do. A ? alone in quotes ('?') is
+ * such a parameter, and becomes a placeholder in the text to prepare, so that queries
+ * which differ only in those share a statement. Any other ? has its parameter escaped
+ * into the text, as all of them used to be. A query stops at the first ? which has no
+ * parameter.
+ */
+class SQLparameters
+{
+ public:
+	virtual ~SQLparameters()
+	{
+	}
+
+	/** Escape a parameter to go into the query text, without adding quotes
+	 */
+	virtual std::string Escape(const std::string &param) = 0;
+
+	/** Return the placeholder for the nth parameter sent apart, counting from 1
+	 */
+	virtual std::string Placeholder(unsigned int n) = 0;
+
+	/** Split a query up
+	 * @param query The query and its parameters
+	 * @param sql Set to the text to prepare
+	 * @param binds Set to the parameters to send apart from it
+	 * @param text Set to the query with every parameter escaped into it, as it goes in results
+	 */
+	void Substitute(const SQLquery &query, std::string &sql, ParamL &binds, std::string &text)
+	{
+		const std::string &q = query.q;
+		ParamL::const_iterator p = query.p.begin();
+		bool quoted = false;
+
+		for (std::string::size_type i = 0; i < q.length(); i++)
+		{
+			if (!quoted && (q.compare(i, 3, "'?'") == 0) && (q.compare(i + 3, 1, "'") != 0))
+			{
+				if (p == query.p.end())
+					break;
+
+				text.append("'" + Escape(*p) + "'");
+				binds.push_back(*p++);
+				sql.append(Placeholder(binds.size()));
+				i += 2;
+			}
+			else if (q[i] == '?')
+			{
+				if (p == query.p.end())
+					break;
+
+				std::string escaped = Escape(*p++);
+				text.append(escaped);
+				sql.append(escaped);
+			}
+			else
+			{
+				if (q[i] == '\'')
+					quoted = !quoted;
+
+				text.push_back(q[i]);
+				sql.push_back(q[i]);
+			}
+		}
+	}
+};
+
 
 /** SQLHost represents a <database> config line and is useful
  * for storing in a map and iterating on rehash to see which
@@ -444,13 +623,15 @@ class SQLhost
 	std::string		user;	/* Database username */
 	std::string		pass;	/* Database password */
 	bool			ssl;	/* If we should require SSL */
+	unsigned int	poolsize;	/* How many connections to query on at once */
+	unsigned int	statements;	/* How many prepared statements to keep per connection */
 
-	SQLhost()
+	SQLhost() : port(0), ssl(false), poolsize(1), statements(0)
 	{
 	}
 
 	SQLhost(const std::string& i, const std::string& h, unsigned int p, const std::string& n, const std::string& u, const std::string& pa, bool s)
-	: id(i), host(h), port(p), name(n), user(u), pass(pa), ssl(s)
+	: id(i), host(h), port(p), name(n), user(u), pass(pa), ssl(s), poolsize(1), statements(0)
 	{
 	}
 
@@ -464,7 +645,8 @@ class SQLhost
  */
 bool operator== (const SQLhost& l, const SQLhost& r)
 {
-	return (l.id == r.id && l.host == r.host && l.port == r.port && l.name == r.name && l.user == l.user && l.pass == r.pass && l.ssl == r.ssl);
+	return (l.id == r.id && l.host == r.host && l.port == r.port && l.name == r.name && l.user == r.user && l.pass == r.pass && l.ssl == r.ssl &&
+		l.poolsize == r.poolsize && l.statements == r.statements);
 }
 
 
@@ -582,7 +764,8 @@ public:
 private:
 	void DoPurgeModule(Module* mod, ReqDeque& q)
 	{
-		for(ReqDeque::iterator iter = q.begin(); iter != q.end(); iter++)
+		ReqDeque::iterator iter = q.begin();
+		while(iter != q.end())
 		{
 			if(iter->GetSource() == mod)
 			{
@@ -590,6 +773,7 @@ private:
 				{
 					/* It's the currently active query.. :x */
 					iter->SetSource(NULL);
+					iter++;
 				}
 				else
 				{
@@ -597,6 +781,8 @@ private:
 					iter = q.erase(iter);
 				}
 			}
+			else
+				iter++;
 		}
 	}
 };
@@ -15,6 +15,7 @@
 
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
+#include <netdb.h>
 
 #include "inspircd_config.h"
 #include "configreader.h"
@@ -24,6 +25,7 @@
 #include "socket.h"
 #include "hashcomp.h"
 #include "transport.h"
+#include "workerpool.h"
 
 #ifdef WINDOWS
 #pragma comment(lib, "libgnutls-13.lib")
@@ -34,7 +36,7 @@
 /* $ModDesc: Provides SSL support for clients */
 /* $CompileFlags: exec("libgnutls-config --cflags") */
 /* $LinkerFlags: rpath("libgnutls-config --libs") exec("libgnutls-config --libs") */
-/* $ModDep: transport.h */
+/* $ModDep: transport.h workerpool.h */
 
 
 enum issl_status { ISSL_NONE, ISSL_HANDSHAKING_READ, ISSL_HANDSHAKING_WRITE, ISSL_HANDSHAKEN, ISSL_CLOSING, ISSL_CLOSED };
@@ -48,6 +50,33 @@ bool isin(int port, const std::vector<int> &portlist)
 	return false;
 }
 
+/* Session tickets came in GnuTLS 2.10 */
+#if defined(GNUTLS_VERSION_NUMBER) && GNUTLS_VERSION_NUMBER >= 0x020a00
+#define HAVE_SESSION_TICKETS
+#endif
+
+/* Before 2.12, GnuTLS leaves it to the program to make libgcrypt thread safe */
+#if !defined(GNUTLS_VERSION_NUMBER) || GNUTLS_VERSION_NUMBER < 0x020c00
+#include <gcrypt.h>
+#include <errno.h>
+GCRY_THREAD_OPTION_PTHREAD_IMPL;
+#define NEED_GCRYPT_THREADS
+#endif
+
+/** Name the peer of a connected socket as "address/port", to find the session kept for it
+ */
+static std::string PeerName(int fd)
+{
+	sockaddr_storage sa;
+	socklen_t salen = sizeof(sa);
+	char host[NI_MAXHOST], serv[NI_MAXSERV];
+
+	if (getpeername(fd, (sockaddr*)&sa, &salen) || getnameinfo((sockaddr*)&sa, salen, host, sizeof(host), serv, sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV))
+		return "";
+
+	return std::string(host) + "/" + serv;
+}
+
 /** Represents an SSL user's extra data
  */
 class issl_session : public classbase
@@ -59,6 +88,47 @@ public:
 	int inbufoffset;
 	char* inbuf;
 	int fd;
+	bool outbound;
+	std::string peer;	// For outbound sessions, where we connected to, see ModuleSSLGnuTLS::clientsessions.
+	WorkerJob* job;		// The handshake step a thread is working on, while the socket is parked.
+	EventHandler* parked;	// What the socket belongs to, taken out of the socket engine until job is done.
+
+	issl_session() : sess(NULL), status(ISSL_NONE), inbufoffset(0), inbuf(NULL), fd(-1), outbound(false), job(NULL), parked(NULL)
+	{
+	}
+};
+
+/** A session kept so that a client can resume it by its ID
+ */
+struct cached_session
+{
+	std::string data;
+	time_t expires;
+};
+
+class ModuleSSLGnuTLS;
+
+/** One step of an inbound handshake, as far as it can go without waiting for the client,
+ * done on a handshake thread. The socket is out of the socket engine meanwhile, so the
+ * main thread leaves the session alone until Finish().
+ */
+class HandshakeJob : public WorkerJob
+{
+	ModuleSSLGnuTLS* mod;
+	issl_session* session;
+	int ret;
+
+ public:
+	HandshakeJob(ModuleSSLGnuTLS* m, issl_session* s) : mod(m), session(s), ret(0)
+	{
+	}
+
+	virtual void Run()
+	{
+		ret = gnutls_handshake(session->sess);
+	}
+
+	virtual void Finish();
 };
 
 class ModuleSSLGnuTLS : public Module
@@ -85,16 +155,79 @@ class ModuleSSLGnuTLS : public Module
 
 	int clientactive;
 
+	/** Most sessions kept for resuming inbound connections, 0 to keep none
+	 */
+	long sessioncache;
+
+	/** Seconds a session may be resumed for, whether kept here or in a ticket
+	 */
+	long sessionlifetime;
+
+	/** Whether to hand clients session tickets
+	 */
+	bool tickets;
+
+	/** The key session tickets are encrypted with, replaced on each rehash
+	 */
+	gnutls_datum_t ticketkey;
+
+	/** Sessions kept for inbound connections, by session ID
+	 */
+	std::map<std::string, cached_session> cache;
+
+	/** Guards the cache and its counters, which handshake threads use
+	 */
+	pthread_mutex_t cachelock;
+
+	/** Session IDs in the order they were stored, and so the order they expire
+	 * in, to find which to drop first. May hold IDs no longer in the cache.
+	 */
+	std::deque<std::pair<time_t, std::string> > cacheorder;
+
+	/** Times a session was looked for in the cache, and found
+	 */
+	unsigned long cachehits, cachemisses, cacheevicted;
+
+	/** The last session of each outgoing connection, by the address it went to
+	 * (see PeerName()), offered again when we next connect there. Only servers
+	 * we link to are in here, so it needs no bound of its own.
+	 */
+	std::map<std::string, std::string> clientsessions;
+
+	/** Handshakes finished, and how many of those resumed a session, for /STATS t
+	 */
+	unsigned long handshakes_in, resumed_in, handshakes_out, resumed_out;
+
+	/** Threads inbound handshakes are done on, so that the key exchanges in them
+	 * do not hold up everyone else. With no threads they are done inline.
+	 */
+	WorkerPool* pool;
+
+	/** False if the libraries could not be made safe to use from the handshake threads
+	 */
+	bool threadsafe;
+
  public:
 
 	ModuleSSLGnuTLS(InspIRCd* Me)
-		: Module(Me)
+		: Module(Me), sessioncache(0), sessionlifetime(0), tickets(false), cachehits(0), cachemisses(0), cacheevicted(0),
+		  handshakes_in(0), resumed_in(0), handshakes_out(0), resumed_out(0), threadsafe(true)
 	{
+		ticketkey.data = NULL;
+		ticketkey.size = 0;
+		pthread_mutex_init(&cachelock, NULL);
+		pool = new WorkerPool(ServerInstance);
+
 		ServerInstance->PublishInterface("InspSocketHook", this);
 
 		// Not rehashable...because I cba to reduce all the sizes of existing buffers.
 		inbufsize = ServerInstance->Config->NetBufferSize;
 
+#ifdef NEED_GCRYPT_THREADS
+		// Fails if libgcrypt was already set up without them
+		threadsafe = (gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread) == 0);
+#endif
+
 		gnutls_global_init(); // This must be called once in the program
 
 		if(gnutls_certificate_allocate_credentials(&x509_cred) != 0)
@@ -116,6 +249,9 @@ class ModuleSSLGnuTLS : public Module
 		if(param != "ssl")
 			return;
 
+		// Nothing may be mid-handshake while the credentials change under it
+		pool->Wait();
+
 		Conf = new ConfigReader(ServerInstance);
 
 		for(unsigned int i = 0; i < listenports.size(); i++)
@@ -203,8 +339,43 @@ class ModuleSSLGnuTLS : public Module
 		if(keyfile[0] != '/')
 			keyfile = confdir + keyfile;
 
+		sessioncache = Conf->ReadInteger("gnutls", "sessioncache", "20480", 0, true);
+		sessionlifetime = Conf->ReadInteger("gnutls", "sessionlifetime", "3600", 0, true);
+		tickets = Conf->ReadFlag("gnutls", "tickets", "yes", 0);
+
+		if (sessionlifetime < 1)
+			sessionlifetime = 3600;
+
+		unsigned int threads = Conf->ReadInteger("gnutls", "handshakethreads", "0", 0, true);
+		if (threads && !threadsafe)
+		{
+			ServerInstance->Log(DEFAULT, "m_ssl_gnutls.so: Couldn't give libgcrypt its thread callbacks, so handshakes will not be threaded");
+			threads = 0;
+		}
+		if (!pool->SetThreads(threads))
+			ServerInstance->Log(DEFAULT, "m_ssl_gnutls.so: Could only start %u of %u handshake threads", pool->GetThreads(), threads);
+
+		pthread_mutex_lock(&cachelock);
+		PruneCache(sessioncache);
+		pthread_mutex_unlock(&cachelock);
+
 		int ret;
 
+#ifdef HAVE_SESSION_TICKETS
+		// A new key each rehash, so that a leaked one is only good until then.
+		FreeTicketKey();
+		if (tickets && ((ret = gnutls_session_ticket_key_generate(&ticketkey)) < 0))
+		{
+			ServerInstance->Log(DEFAULT, "m_ssl_gnutls.so: Couldn't make a session ticket key, tickets are disabled: %s", gnutls_strerror(ret));
+			ticketkey.data = NULL;
+			tickets = false;
+		}
+#else
+		if (tickets)
+			ServerInstance->Log(DEFAULT, "m_ssl_gnutls.so: This GnuTLS cannot issue session tickets, ignoring <gnutls tickets>");
+		tickets = false;
+#endif
+
 		if((ret =gnutls_certificate_set_x509_trust_file(x509_cred, cafile.c_str(), GNUTLS_X509_FMT_PEM)) < 0)
 			ServerInstance->Log(DEFAULT, "m_ssl_gnutls.so: Failed to set X.509 trust file '%s': %s", cafile.c_str(), gnutls_strerror(ret));
 
@@ -236,8 +407,119 @@ class ModuleSSLGnuTLS : public Module
 			ServerInstance->Log(DEFAULT, "m_ssl_gnutls.so: Failed to generate DH parameters (%d bits): %s", dh_bits, gnutls_strerror(ret));
 	}
 
+	void FreeTicketKey()
+	{
+		if (ticketkey.data)
+		{
+			memset(ticketkey.data, 0, ticketkey.size);
+			gnutls_free(ticketkey.data);
+			ticketkey.data = NULL;
+			ticketkey.size = 0;
+		}
+	}
+
+	/** Drop expired sessions from the cache, then the oldest ones until at most max are left.
+	 * The caller holds cachelock.
+	 */
+	void PruneCache(size_t max)
+	{
+		time_t now = ServerInstance->Time();
+
+		while (!cacheorder.empty() && ((cache.size() > max) || (cacheorder.front().first <= now)))
+		{
+			std::map<std::string, cached_session>::iterator i = cache.find(cacheorder.front().second);
+
+			// The ID may have been removed, or stored again since, in which case a later entry is its own.
+			if ((i != cache.end()) && (i->second.expires == cacheorder.front().first))
+			{
+				if (i->second.expires > now)
+					cacheevicted++;
+				cache.erase(i);
+			}
+
+			cacheorder.pop_front();
+		}
+	}
+
+	static int OnCacheStore(void* ptr, gnutls_datum_t key, gnutls_datum_t data)
+	{
+		ModuleSSLGnuTLS* me = (ModuleSSLGnuTLS*)ptr;
+
+		if (!me->sessioncache)
+			return -1;
+
+		pthread_mutex_lock(&me->cachelock);
+		me->PruneCache(me->sessioncache - 1);
+
+		cached_session &entry = me->cache[std::string((char*)key.data, key.size)];
+		entry.data.assign((char*)data.data, data.size);
+		entry.expires = me->ServerInstance->Time() + me->sessionlifetime;
+		me->cacheorder.push_back(std::make_pair(entry.expires, std::string((char*)key.data, key.size)));
+		pthread_mutex_unlock(&me->cachelock);
+		return 0;
+	}
+
+	static gnutls_datum_t OnCacheRetrieve(void* ptr, gnutls_datum_t key)
+	{
+		ModuleSSLGnuTLS* me = (ModuleSSLGnuTLS*)ptr;
+		gnutls_datum_t ret = { NULL, 0 };
+
+		pthread_mutex_lock(&me->cachelock);
+		std::map<std::string, cached_session>::iterator i = me->cache.find(std::string((char*)key.data, key.size));
+		if ((i == me->cache.end()) || (i->second.expires <= me->ServerInstance->Time()))
+		{
+			me->cachemisses++;
+		}
+		else
+		{
+			// GnuTLS frees this itself
+			ret.data = (unsigned char*)gnutls_malloc(i->second.data.size());
+			if (ret.data)
+			{
+				memcpy(ret.data, i->second.data.data(), i->second.data.size());
+				ret.size = i->second.data.size();
+				me->cachehits++;
+			}
+		}
+		pthread_mutex_unlock(&me->cachelock);
+		return ret;
+	}
+
+	static int OnCacheRemove(void* ptr, gnutls_datum_t key)
+	{
+		ModuleSSLGnuTLS* me = (ModuleSSLGnuTLS*)ptr;
+		pthread_mutex_lock(&me->cachelock);
+		bool found = me->cache.erase(std::string((char*)key.data, key.size));
+		pthread_mutex_unlock(&me->cachelock);
+		return found ? 0 : -1;
+	}
+
+	virtual int OnStats(char symbol, userrec* user, string_list &results)
+	{
+		if (symbol == 't')
+		{
+			std::string sn = ServerInstance->Config->ServerName;
+
+			results.push_back(sn+" 304 "+user->nick+" :SSLSTATS gnutls inbound "+ConvToStr(handshakes_in)+" handshakes "+ConvToStr(resumed_in)+" resumed");
+			results.push_back(sn+" 304 "+user->nick+" :SSLSTATS gnutls outbound "+ConvToStr(handshakes_out)+" handshakes "+ConvToStr(resumed_out)+" resumed, "+
+					ConvToStr(clientsessions.size())+" servers to resume");
+			pthread_mutex_lock(&cachelock);
+			results.push_back(sn+" 304 "+user->nick+" :SSLSTATS gnutls cache "+ConvToStr(cache.size())+"/"+ConvToStr(sessioncache)+" sessions "+
+					ConvToStr(cachehits)+" hits "+ConvToStr(cachemisses)+" misses "+ConvToStr(cacheevicted)+" evicted, lifetime "+ConvToStr(sessionlifetime)+"s, tickets "+
+					(tickets ? "on" : "off"));
+			pthread_mutex_unlock(&cachelock);
+			results.push_back(sn+" 304 "+user->nick+" :SSLSTATS gnutls handshake threads "+ConvToStr(pool->GetThreads())+" queued "+ConvToStr(pool->GetQueued())+
+					" (peak "+ConvToStr(pool->GetPeak())+") steps "+ConvToStr(pool->GetSubmitted()));
+		}
+
+		return 0;
+	}
+
 	virtual ~ModuleSSLGnuTLS()
 	{
+		delete pool;
+		pthread_mutex_destroy(&cachelock);
+		FreeTicketKey();
 		gnutls_dh_params_deinit(dh_params);
 		gnutls_certificate_free_credentials(x509_cred);
 		gnutls_global_deinit();
@@ -288,6 +570,7 @@ class ModuleSSLGnuTLS : public Module
 	{
 		List[I_On005Numeric] = List[I_OnRawSocketConnect] = List[I_OnRawSocketAccept] = List[I_OnRawSocketClose] = List[I_OnRawSocketRead] = List[I_OnRawSocketWrite] = List[I_OnCleanup] = 1;
 		List[I_OnRequest] = List[I_OnSyncUserMetaData] = List[I_OnDecodeMetaData] = List[I_OnUnloadModule] = List[I_OnRehash] = List[I_OnWhois] = List[I_OnPostConnect] = 1;
+		List[I_OnStats] = 1;
 	}
 
 	virtual void On005Numeric(std::string &output)
@@ -353,6 +636,7 @@ class ModuleSSLGnuTLS : public Module
 		session->fd = fd;
 		session->inbuf = new char[inbufsize];
 		session->inbufoffset = 0;
+		session->outbound = false;
 
 		gnutls_init(&session->sess, GNUTLS_SERVER);
 
@@ -372,6 +656,26 @@ class ModuleSSLGnuTLS : public Module
 
 		gnutls_certificate_server_set_request(session->sess, GNUTLS_CERT_REQUEST); // Request client certificate if any.
 
+		// Let the client resume a session from the cache, or from a ticket it holds.
+		gnutls_db_set_ptr(session->sess, this);
+		gnutls_db_set_retrieve_function(session->sess, OnCacheRetrieve);
+		gnutls_db_set_store_function(session->sess, OnCacheStore);
+		gnutls_db_set_remove_function(session->sess, OnCacheRemove);
+		gnutls_db_set_cache_expiration(session->sess, sessionlifetime);
+#ifdef HAVE_SESSION_TICKETS
+		if (tickets)
+			gnutls_session_ticket_enable_server(session->sess, &ticketkey);
+#endif
+
+		if (pool->GetThreads())
+		{
+			/* Users are not in the socket engine yet, so can't be parked. Nothing
+			 * has been sent yet either, so just wait for the client to speak.
+			 */
+			session->status = ISSL_HANDSHAKING_READ;
+			return;
+		}
+
 		Handshake(session);
 	}
 
@@ -382,6 +686,8 @@ class ModuleSSLGnuTLS : public Module
 		session->fd = fd;
 		session->inbuf = new char[inbufsize];
 		session->inbufoffset = 0;
+		session->outbound = true;
+		session->peer = PeerName(fd);
 
 		gnutls_init(&session->sess, GNUTLS_CLIENT);
 
@@ -390,12 +696,29 @@ class ModuleSSLGnuTLS : public Module
 		gnutls_dh_set_prime_bits(session->sess, dh_bits);
 		gnutls_transport_set_ptr(session->sess, (gnutls_transport_ptr_t) fd); // Give gnutls the fd for the socket.
 
+		// Offer the last session we had with this server. If it has run out, the server just ignores it.
+		std::map<std::string, std::string>::iterator i = clientsessions.find(session->peer);
+		if (i != clientsessions.end())
+			gnutls_session_set_data(session->sess, i->second.data(), i->second.size());
+
 		Handshake(session);
 	}
 
 	virtual void OnRawSocketClose(int fd)
 	{
-		CloseSession(&sessions[fd]);
+		issl_session* session = &sessions[fd];
+
+		if (session->job)
+		{
+			// Take the handshake back from the threads, and put the socket back for the core to remove.
+			pool->Cancel(session->job);
+			delete session->job;
+			session->job = NULL;
+			ServerInstance->SE->AddFd(session->parked);
+			session->parked = NULL;
+		}
+
+		CloseSession(session);
 
 		EventHandler* user = ServerInstance->SE->GetRef(fd);
 
@@ -419,6 +742,12 @@ class ModuleSSLGnuTLS : public Module
 			return 1;
 		}
 
+		if (session->job)
+		{
+			errno = EAGAIN;
+			return -1;
+		}
+
 		if (session->status == ISSL_HANDSHAKING_READ)
 		{
 			// The handshake isn't finished, try to finish it.
@@ -500,10 +829,13 @@ class ModuleSSLGnuTLS : public Module
 
 	virtual int OnRawSocketWrite(int fd, const char* buffer, int count)
 	{
-		if (!count)
-			return 0;
-
 		issl_session* session = &sessions[fd];
+
+		/* Nothing new means flush what is waiting, such as lines queued
+		 * during a handshake which has just finished.
+		 */
+		if (!count && session->outbuf.empty())
+			return 0;
 		const char* sendbuffer = buffer;
 
 		if (!session->sess)
@@ -517,6 +849,12 @@ class ModuleSSLGnuTLS : public Module
 		sendbuffer = session->outbuf.c_str();
 		count = session->outbuf.size();
 
+		if (session->job)
+		{
+			// A thread has the session, what is queued goes once it hands it back
+			return 0;
+		}
+
 		if (session->status == ISSL_HANDSHAKING_WRITE)
 		{
 			// The handshake isn't finished, try to finish it.
@@ -548,6 +886,10 @@ class ModuleSSLGnuTLS : public Module
 				else
 				{
 					ServerInstance->Log(DEBUG,"Again please");
+					/* Come back when the socket drains, the core may have nothing more to write */
+					EventHandler* eh = ServerInstance->SE->GetRef(session->fd);
+					if (eh)
+						ServerInstance->SE->WantWrite(eh);
 					errno = EAGAIN;
 					return -1;
 				}
@@ -565,6 +907,11 @@ class ModuleSSLGnuTLS : public Module
 		return ret < 1 ? 0 : ret;
 	}
 
+	virtual size_t OnRawSocketQueued(int fd)
+	{
+		return sessions[fd].outbuf.size();
+	}
+
 	// :kenny.chatspike.net 320 Om Epy|AFK :is a Secure Connection
 	virtual void OnWhois(userrec* source, userrec* dest)
 	{
@@ -609,8 +956,46 @@ class ModuleSSLGnuTLS : public Module
 
 	bool Handshake(issl_session* session)
 	{
-		int ret = gnutls_handshake(session->sess);
+		if (session->job)
+			return false;
+
+		if (!session->outbound && pool->GetThreads())
+		{
+			EventHandler* eh = ServerInstance->SE->GetRef(session->fd);
+			if (eh && ServerInstance->SE->DelFd(eh))
+			{
+				// Park the socket until a thread has done what it can, see HandshakeDone().
+				session->parked = eh;
+				session->job = new HandshakeJob(this, session);
+				pool->Submit(session->job);
+				return false;
+			}
+		}
+
+		return HandshakeResult(session, gnutls_handshake(session->sess));
+	}
+
+	/** Called back on the main thread when a handshake thread is done with a session
+	 */
+	void HandshakeDone(issl_session* session, int ret)
+	{
+		EventHandler* eh = session->parked;
 
+		session->job = NULL;
+		session->parked = NULL;
+		ServerInstance->SE->AddFd(eh);
+
+		HandshakeResult(session, ret);
+
+		// Let the core send anything it queued meanwhile, and notice if the handshake failed.
+		ServerInstance->SE->WantWrite(eh);
+	}
+
+	/** Act on what gnutls_handshake() returned
+	 * @return True if the handshake is complete
+	 */
+	bool HandshakeResult(issl_session* session, int ret)
+	{
 		if (ret < 0)
 		{
 			if(ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED)
@@ -652,6 +1037,19 @@ class ModuleSSLGnuTLS : public Module
 			// Change the seesion state
 			session->status = ISSL_HANDSHAKEN;
 
+			if (session->outbound)
+			{
+				handshakes_out++;
+				if (gnutls_session_is_resumed(session->sess))
+					resumed_out++;
+			}
+			else
+			{
+				handshakes_in++;
+				if (gnutls_session_is_resumed(session->sess))
+					resumed_in++;
+			}
+
 			// Finish writing, if any left
 			MakePollWrite(session);
 
@@ -693,6 +1091,19 @@ class ModuleSSLGnuTLS : public Module
 
 	void CloseSession(issl_session* session)
 	{
+		if (session->sess && session->outbound && !session->peer.empty() && (session->status == ISSL_HANDSHAKEN))
+		{
+			/* Keep the session to offer next time we connect there. This is done at the
+			 * end rather than after the handshake, as with TLS 1.3 it comes afterwards.
+			 */
+			gnutls_datum_t data;
+			if (gnutls_session_get_data2(session->sess, &data) == 0)
+			{
+				clientsessions[session->peer].assign((char*)data.data, data.size);
+				gnutls_free(data.data);
+			}
+		}
+
 		if(session->sess)
 		{
 			gnutls_bye(session->sess, GNUTLS_SHUT_WR);
@@ -705,6 +1116,7 @@ class ModuleSSLGnuTLS : public Module
 		}
 
 		session->outbuf.clear();
+		session->peer.clear();
 		session->inbuf = NULL;
 		session->sess = NULL;
 		session->status = ISSL_NONE;
@@ -839,5 +1251,10 @@ class ModuleSSLGnuTLS : public Module
 
 };
 
+void HandshakeJob::Finish()
+{
+	mod->HandshakeDone(session, ret);
+}
+
 MODULE_INIT(ModuleSSLGnuTLS);
 
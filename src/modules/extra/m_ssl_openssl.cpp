@@ -15,6 +15,13 @@
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+#include <netdb.h>
 
 #ifdef WINDOWS
 #include <openssl/applink.c>
@@ -29,6 +36,7 @@
 #include "hashcomp.h"
 
 #include "transport.h"
+#include "workerpool.h"
 
 #ifdef WINDOWS
 #pragma comment(lib, "libeay32MTd")
@@ -40,7 +48,7 @@
 /* $ModDesc: Provides SSL support for clients */
 /* $CompileFlags: pkgconfversion("openssl","0.9.7") pkgconfincludes("openssl","/openssl/ssl.h","") */
 /* $LinkerFlags: rpath("pkg-config --libs openssl") pkgconflibs("openssl","/libssl.so","-lssl -lcrypto -ldl") */
-/* $ModDep: transport.h */
+/* $ModDep: transport.h workerpool.h */
 
 enum issl_status { ISSL_NONE, ISSL_HANDSHAKING, ISSL_OPEN };
 enum issl_io_status { ISSL_WRITE, ISSL_READ };
@@ -63,6 +71,186 @@ char* get_error()
 
 static int error_callback(const char *str, size_t len, void *u);
 
+/** Name the peer of a connected socket as "address/port", to find the session kept for it
+ */
+static std::string PeerName(int fd)
+{
+	sockaddr_storage sa;
+	socklen_t salen = sizeof(sa);
+	char host[NI_MAXHOST], serv[NI_MAXSERV];
+
+	if (getpeername(fd, (sockaddr*)&sa, &salen) || getnameinfo((sockaddr*)&sa, salen, host, sizeof(host), serv, sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV))
+		return "";
+
+	return std::string(host) + "/" + serv;
+}
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/** Before 1.1.0, OpenSSL only locks what its threads share, such as a context's
+ * session cache, through callbacks the program gives it. Handshake threads need them.
+ */
+static pthread_mutex_t* CryptoLocks = NULL;
+
+static void OnCryptoLock(int mode, int n, const char* file, int line)
+{
+	if (mode & CRYPTO_LOCK)
+		pthread_mutex_lock(&CryptoLocks[n]);
+	else
+		pthread_mutex_unlock(&CryptoLocks[n]);
+}
+
+#if OPENSSL_VERSION_NUMBER < 0x10000000L
+/** Only given before 1.0.0. Later versions tell threads apart by the address of
+ * errno unless told otherwise, and that callback cannot be taken back on unload.
+ */
+static unsigned long OnCryptoThreadId()
+{
+	return (unsigned long)pthread_self();
+}
+#endif
+
+/** Give OpenSSL its locks, unless something else in the process already has
+ */
+static void InstallCryptoLocks()
+{
+	if (CRYPTO_get_locking_callback())
+		return;
+
+	int count = CRYPTO_num_locks();
+	CryptoLocks = new pthread_mutex_t[count];
+	for (int n = 0; n < count; n++)
+		pthread_mutex_init(&CryptoLocks[n], NULL);
+
+#if OPENSSL_VERSION_NUMBER < 0x10000000L
+	CRYPTO_set_id_callback(OnCryptoThreadId);
+#endif
+	CRYPTO_set_locking_callback(OnCryptoLock);
+}
+
+/** Take back the locks InstallCryptoLocks() gave, once no thread can be using them
+ */
+static void RemoveCryptoLocks()
+{
+	if (!CryptoLocks)
+		return;
+
+	CRYPTO_set_locking_callback(NULL);
+#if OPENSSL_VERSION_NUMBER < 0x10000000L
+	CRYPTO_set_id_callback(NULL);
+#endif
+	for (int n = 0; n < CRYPTO_num_locks(); n++)
+		pthread_mutex_destroy(&CryptoLocks[n]);
+	delete[] CryptoLocks;
+	CryptoLocks = NULL;
+}
+#endif
+
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+/** A key for encrypting session tickets, so that clients can hold their own
+ * session and resume it without the server keeping anything.
+ */
+struct ticket_key
+{
+	unsigned char name[16];
+	unsigned char aes[32];
+	unsigned char hmac[32];
+};
+
+/** The current ticket key, and the one before the last rehash. Tickets issued
+ * under the old key are still taken, and swapped for ones under the new key.
+ */
+static ticket_key TicketKeys[2];
+static int TicketKeyCount = 0;
+
+/** Guards the ticket keys, which handshake threads read
+ */
+static pthread_mutex_t TicketKeyLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Make a new ticket key, keeping the current one as the previous one
+ */
+static bool RotateTicketKeys()
+{
+	ticket_key fresh;
+
+	if (RAND_bytes((unsigned char*)&fresh, sizeof(fresh)) <= 0)
+		return false;
+
+	pthread_mutex_lock(&TicketKeyLock);
+	TicketKeys[1] = TicketKeys[0];
+	TicketKeys[0] = fresh;
+	if (TicketKeyCount < 2)
+		TicketKeyCount++;
+	pthread_mutex_unlock(&TicketKeyLock);
+	return true;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX ticket_mac_ctx;
+
+static int SetTicketMac(EVP_MAC_CTX* mctx, ticket_key* key)
+{
+	OSSL_PARAM params[3];
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key->hmac, sizeof(key->hmac));
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char*)"sha256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+	return EVP_MAC_CTX_set_params(mctx, params);
+}
+#else
+typedef HMAC_CTX ticket_mac_ctx;
+
+static int SetTicketMac(HMAC_CTX* hctx, ticket_key* key)
+{
+	return HMAC_Init_ex(hctx, key->hmac, sizeof(key->hmac), EVP_sha256(), NULL);
+}
+#endif
+
+/** Called by OpenSSL to encrypt a new ticket (enc set), or to find the key for one a client offers
+ * @return 1 to use the ticket, 2 to use it and issue a new one, 0 if it is not ours, -1 on error
+ */
+static int OnTicketKey(SSL* ssl, unsigned char* name, unsigned char* iv, EVP_CIPHER_CTX* ectx, ticket_mac_ctx* mctx, int enc)
+{
+	ticket_key keys[2];
+
+	pthread_mutex_lock(&TicketKeyLock);
+	int count = TicketKeyCount;
+	memcpy(keys, TicketKeys, sizeof(keys));
+	pthread_mutex_unlock(&TicketKeyLock);
+
+	if (!count)
+		return enc ? -1 : 0;
+
+	if (enc)
+	{
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0)
+			return -1;
+
+		memcpy(name, keys[0].name, sizeof(keys[0].name));
+		if (!EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, keys[0].aes, iv) || !SetTicketMac(mctx, &keys[0]))
+			return -1;
+		return 1;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		if (!memcmp(name, keys[i].name, sizeof(keys[i].name)))
+		{
+			if (!SetTicketMac(mctx, &keys[i]) || !EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, keys[i].aes, iv))
+				return -1;
+			/* Swap tickets under the old key for ones under the new. TLS 1.3 clients
+			 * use each ticket once, so they need a new one every time.
+			 */
+#ifdef TLS1_3_VERSION
+			if (SSL_version(ssl) >= TLS1_3_VERSION)
+				return 2;
+#endif
+			return i ? 2 : 1;
+		}
+	}
+
+	return 0;
+}
+#endif
+
 /** Represents an SSL user's extra data
  */
 class issl_session : public classbase
@@ -74,16 +262,27 @@ public:
 	issl_io_status wstat;
 
 	unsigned int inbufoffset;
-	char* inbuf; 			// Buffer OpenSSL reads into.
-	std::string outbuf;	// Buffer for outgoing data that OpenSSL will not take.
+	char* inbuf; 			// Holds data read while flushing, until insp asks for it. Allocated when first needed.
+	std::string outbuf;	// Outgoing data not yet taken by OpenSSL, from outbufoffset on.
+	size_t outbufoffset;
 	int fd;
 	bool outbound;
+	bool ktls;		// The kernel encrypts what we send, after the handshake.
+	std::string peer;	// For outbound sessions, where we connected to, see ModuleSSLOpenSSL::clientsessions.
+	WorkerJob* job;		// The handshake step a thread is working on, while the socket is parked.
+	EventHandler* parked;	// What the socket belongs to, taken out of the socket engine until job is done.
 
 	issl_session()
 	{
+		job = NULL;
+		parked = NULL;
 		outbound = false;
+		ktls = false;
 		rstat = ISSL_READ;
 		wstat = ISSL_WRITE;
+		inbuf = NULL;
+		inbufoffset = 0;
+		outbufoffset = 0;
 	}
 };
 
@@ -101,6 +300,36 @@ static int OnVerify(int preverify_ok, X509_STORE_CTX *ctx)
 	return 1;
 }
 
+class ModuleSSLOpenSSL;
+
+/** One step of an inbound handshake, as far as it can go without waiting for the client,
+ * done on a handshake thread. The socket is out of the socket engine meanwhile, so the
+ * main thread leaves the session alone until Finish().
+ */
+class HandshakeJob : public WorkerJob
+{
+	ModuleSSLOpenSSL* mod;
+	issl_session* session;
+	int ret;
+	int err;
+
+ public:
+	HandshakeJob(ModuleSSLOpenSSL* m, issl_session* s) : mod(m), session(s), ret(0), err(SSL_ERROR_NONE)
+	{
+	}
+
+	virtual void Run()
+	{
+		ret = SSL_accept(session->sess);
+		if (ret <= 0)
+			err = SSL_get_error(session->sess, ret);
+		// The error queue is per thread, and nobody reads this one
+		ERR_clear_error();
+	}
+
+	virtual void Finish();
+};
+
 class ModuleSSLOpenSSL : public Module
 {
 
@@ -126,13 +355,47 @@ class ModuleSSLOpenSSL : public Module
 
 	int clientactive;
 
+	/** Whether to ask OpenSSL to hand encryption to the kernel after the handshake
+	 */
+	bool usektls;
+
+	/** Most sessions kept for resuming inbound connections, 0 to keep none
+	 */
+	long sessioncache;
+
+	/** Seconds a session may be resumed for, whether kept here or in a ticket
+	 */
+	long sessionlifetime;
+
+	/** Whether to hand clients session tickets
+	 */
+	bool tickets;
+
+	/** The last session of each outgoing connection, by the address it went to
+	 * (see PeerName()), offered again when we next connect there. Only servers
+	 * we link to are in here, so it needs no bound of its own.
+	 */
+	std::map<std::string, SSL_SESSION*> clientsessions;
+
+	/** Handshakes finished, and how many of those resumed a session, for /STATS t
+	 */
+	unsigned long handshakes_in, resumed_in, handshakes_out, resumed_out;
+
+	/** Threads inbound handshakes are done on, so that the private key operations in
+	 * them do not hold up everyone else. With no threads they are done inline.
+	 */
+	WorkerPool* pool;
+
  public:
 
 	InspIRCd* PublicInstance;
 
 	ModuleSSLOpenSSL(InspIRCd* Me)
-		: Module(Me), PublicInstance(Me)
+		: Module(Me), usektls(false), sessioncache(0), sessionlifetime(0), tickets(false),
+		  handshakes_in(0), resumed_in(0), handshakes_out(0), resumed_out(0), PublicInstance(Me)
 	{
+		pool = new WorkerPool(ServerInstance);
+
 		ServerInstance->PublishInterface("InspSocketHook", this);
 
 		// Not rehashable...because I cba to reduce all the sizes of existing buffers.
@@ -141,6 +404,9 @@ class ModuleSSLOpenSSL : public Module
 		/* Global SSL library initialization*/
 		SSL_library_init();
 		SSL_load_error_strings();
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+		InstallCryptoLocks();
+#endif
 
 		/* Build our SSL contexts:
 		 * NOTE: OpenSSL makes us have two contexts, one for servers and one for clients. ICK.
@@ -151,6 +417,34 @@ class ModuleSSLOpenSSL : public Module
 		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_CLIENT_ONCE, OnVerify);
 		SSL_CTX_set_verify(clictx, SSL_VERIFY_PEER | SSL_VERIFY_CLIENT_ONCE, OnVerify);
 
+		/* Let SSL_write() take part of the buffer, one record at a time, and be
+		 * retried from a buffer which has moved or grown since. This is what lets
+		 * DoWrite() send straight out of outbuf without copying what is left.
+		 */
+		SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+		SSL_CTX_set_mode(clictx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+		/* Sessions are only resumed within the context they were made in, and
+		 * OpenSSL refuses to resume any when we ask for client certificates
+		 * without naming one.
+		 */
+		SSL_CTX_set_session_id_context(ctx, (const unsigned char*)"inspircd", 8);
+
+		/* Outbound sessions are kept by us rather than OpenSSL, per server we
+		 * connect to, since the client side cache has no way to look them up.
+		 */
+		SSL_CTX_set_app_data(clictx, this);
+		SSL_CTX_set_session_cache_mode(clictx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(clictx, OnNewClientSession);
+
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, OnTicketKey);
+#else
+		SSL_CTX_set_tlsext_ticket_key_cb(ctx, OnTicketKey);
+#endif
+#endif
+
 		// Needs the flag as it ignores a plain /rehash
 		OnRehash(NULL,"ssl");
 	}
@@ -160,6 +454,9 @@ class ModuleSSLOpenSSL : public Module
 		if (param != "ssl")
 			return;
 
+		// Nothing may be mid-handshake while the certificates change under it
+		pool->Wait();
+
 		Conf = new ConfigReader(ServerInstance);
 
 		for (unsigned int i = 0; i < listenports.size(); i++)
@@ -233,6 +530,23 @@ class ModuleSSLOpenSSL : public Module
 		if (dhfile.empty())
 			dhfile = "dhparams.pem";
 
+		usektls = Conf->ReadFlag("openssl", "ktls", 0);
+#ifdef SSL_OP_ENABLE_KTLS
+		if (usektls)
+		{
+			SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+			SSL_CTX_set_options(clictx, SSL_OP_ENABLE_KTLS);
+		}
+		else
+		{
+			SSL_CTX_clear_options(ctx, SSL_OP_ENABLE_KTLS);
+			SSL_CTX_clear_options(clictx, SSL_OP_ENABLE_KTLS);
+		}
+#else
+		if (usektls)
+			ServerInstance->Log(DEFAULT, "m_ssl_openssl.so: This OpenSSL cannot use kernel TLS, ignoring <openssl ktls>");
+#endif
+
 		// Prepend relative paths with the path to the config directory.
 		if (cafile[0] != '/')
 			cafile = confdir + cafile;
@@ -246,6 +560,44 @@ class ModuleSSLOpenSSL : public Module
 		if (dhfile[0] != '/')
 			dhfile = confdir + dhfile;
 
+		sessioncache = Conf->ReadInteger("openssl", "sessioncache", "20480", 0, true);
+		sessionlifetime = Conf->ReadInteger("openssl", "sessionlifetime", "3600", 0, true);
+		tickets = Conf->ReadFlag("openssl", "tickets", "yes", 0);
+
+		if (sessionlifetime < 1)
+			sessionlifetime = 3600;
+
+		unsigned int threads = Conf->ReadInteger("openssl", "handshakethreads", "0", 0, true);
+		if (!pool->SetThreads(threads))
+			ServerInstance->Log(DEFAULT, "m_ssl_openssl.so: Could only start %u of %u handshake threads", pool->GetThreads(), threads);
+
+		SSL_CTX_set_session_cache_mode(ctx, sessioncache ? SSL_SESS_CACHE_SERVER : SSL_SESS_CACHE_OFF);
+		SSL_CTX_sess_set_cache_size(ctx, sessioncache);
+		SSL_CTX_set_timeout(ctx, sessionlifetime);
+		SSL_CTX_set_timeout(clictx, sessionlifetime);
+		SSL_CTX_flush_sessions(ctx, time(NULL));
+
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+		if (tickets)
+		{
+			// A new key each rehash, so that a leaked one is only good until then.
+			SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+			if (!RotateTicketKeys())
+			{
+				ServerInstance->Log(DEFAULT, "m_ssl_openssl.so: Couldn't make a session ticket key, tickets are disabled");
+				SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+			}
+		}
+		else
+		{
+			SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+		}
+#else
+		if (tickets)
+			ServerInstance->Log(DEFAULT, "m_ssl_openssl.so: This OpenSSL cannot issue session tickets, ignoring <openssl tickets>");
+		tickets = false;
+#endif
+
 		/* Load our keys and certificates
 		 * NOTE: OpenSSL's error logging API sucks, don't blame us for this clusterfuck.
 		 */
@@ -298,8 +650,61 @@ class ModuleSSLOpenSSL : public Module
 
 	virtual ~ModuleSSLOpenSSL()
 	{
+		delete pool;
+
+		for (std::map<std::string, SSL_SESSION*>::iterator i = clientsessions.begin(); i != clientsessions.end(); i++)
+			SSL_SESSION_free(i->second);
+
 		SSL_CTX_free(ctx);
 		SSL_CTX_free(clictx);
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+		RemoveCryptoLocks();
+#endif
+	}
+
+	/** Called by OpenSSL with each session an outbound connection gets. With TLS 1.3
+	 * these come after the handshake, in tickets, so this is the one place to catch them.
+	 * @return 1 as we keep the reference
+	 */
+	static int OnNewClientSession(SSL* ssl, SSL_SESSION* sess)
+	{
+		ModuleSSLOpenSSL* me = (ModuleSSLOpenSSL*)SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+		std::string peer = me->sessions[SSL_get_fd(ssl)].peer;
+
+		if (peer.empty())
+			return 0;
+
+		std::map<std::string, SSL_SESSION*>::iterator i = me->clientsessions.find(peer);
+		if (i != me->clientsessions.end())
+		{
+			SSL_SESSION_free(i->second);
+			i->second = sess;
+		}
+		else
+		{
+			me->clientsessions[peer] = sess;
+		}
+
+		return 1;
+	}
+
+	virtual int OnStats(char symbol, userrec* user, string_list &results)
+	{
+		if (symbol == 't')
+		{
+			std::string sn = ServerInstance->Config->ServerName;
+
+			results.push_back(sn+" 304 "+user->nick+" :SSLSTATS openssl inbound "+ConvToStr(handshakes_in)+" handshakes "+ConvToStr(resumed_in)+" resumed");
+			results.push_back(sn+" 304 "+user->nick+" :SSLSTATS openssl outbound "+ConvToStr(handshakes_out)+" handshakes "+ConvToStr(resumed_out)+" resumed, "+
+					ConvToStr(clientsessions.size())+" servers to resume");
+			results.push_back(sn+" 304 "+user->nick+" :SSLSTATS openssl cache "+ConvToStr(SSL_CTX_sess_number(ctx))+"/"+ConvToStr(sessioncache)+" sessions "+
+					ConvToStr(SSL_CTX_sess_hits(ctx))+" hits "+ConvToStr(SSL_CTX_sess_misses(ctx))+" misses "+ConvToStr(SSL_CTX_sess_timeouts(ctx))+" expired "+
+					ConvToStr(SSL_CTX_sess_cache_full(ctx))+" evicted, lifetime "+ConvToStr(sessionlifetime)+"s, tickets "+(tickets ? "on" : "off"));
+			results.push_back(sn+" 304 "+user->nick+" :SSLSTATS openssl handshake threads "+ConvToStr(pool->GetThreads())+" queued "+ConvToStr(pool->GetQueued())+
+					" (peak "+ConvToStr(pool->GetPeak())+") steps "+ConvToStr(pool->GetSubmitted()));
+		}
+
+		return 0;
 	}
 
 	virtual void OnCleanup(int target_type, void* item)
@@ -347,6 +752,7 @@ class ModuleSSLOpenSSL : public Module
 	{
 		List[I_OnRawSocketConnect] = List[I_OnRawSocketAccept] = List[I_OnRawSocketClose] = List[I_OnRawSocketRead] = List[I_OnRawSocketWrite] = List[I_OnCleanup] = List[I_On005Numeric] = 1;
 		List[I_OnRequest] = List[I_OnSyncUserMetaData] = List[I_OnDecodeMetaData] = List[I_OnUnloadModule] = List[I_OnRehash] = List[I_OnWhois] = List[I_OnPostConnect] = 1;
+		List[I_OnStats] = 1;
 	}
 
 	virtual char* OnRequest(Request* request)
@@ -401,8 +807,9 @@ class ModuleSSLOpenSSL : public Module
 		issl_session* session = &sessions[fd];
 
 		session->fd = fd;
-		session->inbuf = new char[inbufsize];
 		session->inbufoffset = 0;
+		session->outbufoffset = 0;
+		session->ktls = false;
 		session->sess = SSL_new(ctx);
 		session->status = ISSL_NONE;
 		session->outbound = false;
@@ -416,6 +823,16 @@ class ModuleSSLOpenSSL : public Module
 			return;
 		}
 
+		if (pool->GetThreads())
+		{
+			/* Users are not in the socket engine yet, so can't be parked. Nothing
+			 * has been sent yet either, so just wait for the client to speak.
+			 */
+			session->status = ISSL_HANDSHAKING;
+			session->rstat = session->wstat = ISSL_READ;
+			return;
+		}
+
  		Handshake(session);
 	}
 
@@ -425,11 +842,13 @@ class ModuleSSLOpenSSL : public Module
 		issl_session* session = &sessions[fd];
 
 		session->fd = fd;
-		session->inbuf = new char[inbufsize];
 		session->inbufoffset = 0;
+		session->outbufoffset = 0;
+		session->ktls = false;
 		session->sess = SSL_new(clictx);
 		session->status = ISSL_NONE;
 		session->outbound = true;
+		session->peer = PeerName(fd);
 
 		if (session->sess == NULL)
 			return;
@@ -440,13 +859,40 @@ class ModuleSSLOpenSSL : public Module
 			return;
 		}
 
+		std::map<std::string, SSL_SESSION*>::iterator i = clientsessions.find(session->peer);
+		if (i != clientsessions.end())
+		{
+			// Offer the last session we had with this server, unless it has run out.
+			if (SSL_SESSION_get_time(i->second) + SSL_SESSION_get_timeout(i->second) > (long)ServerInstance->Time())
+			{
+				SSL_set_session(session->sess, i->second);
+			}
+			else
+			{
+				SSL_SESSION_free(i->second);
+				clientsessions.erase(i);
+			}
+		}
+
 		Handshake(session);
 		ServerInstance->Log(DEBUG,"Exiting OnRawSocketConnect");
 	}
 
 	virtual void OnRawSocketClose(int fd)
 	{
-		CloseSession(&sessions[fd]);
+		issl_session* session = &sessions[fd];
+
+		if (session->job)
+		{
+			// Take the handshake back from the threads, and put the socket back for the core to remove.
+			pool->Cancel(session->job);
+			delete session->job;
+			session->job = NULL;
+			ServerInstance->SE->AddFd(session->parked);
+			session->parked = NULL;
+		}
+
+		CloseSession(session);
 
 		EventHandler* user = ServerInstance->SE->GetRef(fd);
 
@@ -473,6 +919,12 @@ class ModuleSSLOpenSSL : public Module
 			return 1;
 		}
 
+		if (session->job)
+		{
+			errno = EAGAIN;
+			return -1;
+		}
+
 		if (session->status == ISSL_HANDSHAKING)
 		{
 			if (session->rstat == ISSL_READ || session->wstat == ISSL_READ)
@@ -503,32 +955,24 @@ class ModuleSSLOpenSSL : public Module
 					return 0;
 			}
 
+			if (session->inbufoffset)
+			{
+				// Hand over what was read while flushing first, it came before anything still in the socket.
+				readresult = session->inbufoffset < count ? session->inbufoffset : count;
+				memcpy(buffer, session->inbuf, readresult);
+				memmove(session->inbuf, session->inbuf + readresult, session->inbufoffset - readresult);
+				session->inbufoffset -= readresult;
+				return 1;
+			}
+
 			if (session->rstat == ISSL_READ)
 			{
-				int ret = DoRead(session);
+				// Decrypt straight into insp's buffer.
+				int ret = DoRead(session, buffer, count);
 
 				if (ret > 0)
 				{
-					if (count <= session->inbufoffset)
-					{
-						memcpy(buffer, session->inbuf, count);
-						// Move the stuff left in inbuf to the beginning of it
-						memcpy(session->inbuf, session->inbuf + count, (session->inbufoffset - count));
-						// Now we need to set session->inbufoffset to the amount of data still waiting to be handed to insp.
-						session->inbufoffset -= count;
-						// Insp uses readresult as the count of how much data there is in buffer, so:
-						readresult = count;
-					}
-					else
-					{
-						// There's not as much in the inbuf as there is space in the buffer, so just copy the whole thing.
-						memcpy(buffer, session->inbuf, session->inbufoffset);
-
-						readresult = session->inbufoffset;
-						// Zero the offset, as there's nothing there..
-						session->inbufoffset = 0;
-					}
-
+					readresult = ret;
 					return 1;
 				}
 				else
@@ -552,7 +996,21 @@ class ModuleSSLOpenSSL : public Module
 			return -1;
 		}
 
-		session->outbuf.append(buffer, count);
+		if (count)
+		{
+			/* Only queue it. The core asks for a write event after every line, and calls us
+			 * with nothing to write when it comes, so everything queued in the meantime goes
+			 * out together in as few records and syscalls as possible.
+			 */
+			session->outbuf.append(buffer, count);
+			return 1;
+		}
+
+		if (session->job)
+		{
+			// A thread has the session, what is queued goes once it hands it back
+			return 1;
+		}
 
 		if (session->status == ISSL_HANDSHAKING)
 		{
@@ -569,7 +1027,7 @@ class ModuleSSLOpenSSL : public Module
 			if (session->rstat == ISSL_WRITE)
 			{
 				ServerInstance->Log(DEBUG,"DoRead");
-				DoRead(session);
+				ReadAhead(session);
 			}
 
 			if (session->wstat == ISSL_WRITE)
@@ -582,96 +1040,138 @@ class ModuleSSLOpenSSL : public Module
 		return 1;
 	}
 
-	int DoWrite(issl_session* session)
+	virtual size_t OnRawSocketQueued(int fd)
 	{
-		if (!session->outbuf.size())
-			return -1;
+		return sessions[fd].outbuf.size() - sessions[fd].outbufoffset;
+	}
 
-		int ret = SSL_write(session->sess, session->outbuf.data(), session->outbuf.size());
+	/** Send as much of outbuf as OpenSSL and the socket will take, a record at a time
+	 */
+	int DoWrite(issl_session* session)
+	{
+		int sent = 0;
 
-		if (ret == 0)
-		{
-			ServerInstance->Log(DEBUG,"Oops, got 0 from SSL_write");
-			CloseSession(session);
-			return 0;
-		}
-		else if (ret < 0)
+		while (session->outbufoffset < session->outbuf.size())
 		{
-			int err = SSL_get_error(session->sess, ret);
+			int ret = SSL_write(session->sess, session->outbuf.data() + session->outbufoffset, session->outbuf.size() - session->outbufoffset);
 
-			if (err == SSL_ERROR_WANT_WRITE)
+			if (ret == 0)
 			{
-				session->wstat = ISSL_WRITE;
-				return -1;
-			}
-			else if (err == SSL_ERROR_WANT_READ)
-			{
-				session->wstat = ISSL_READ;
-				return -1;
-			}
-			else
-			{
-				ServerInstance->Log(DEBUG,"Close due to returned -1 in SSL_Write");
+				ServerInstance->Log(DEBUG,"Oops, got 0 from SSL_write");
 				CloseSession(session);
 				return 0;
 			}
+			else if (ret < 0)
+			{
+				int err = SSL_get_error(session->sess, ret);
+
+				if (err == SSL_ERROR_WANT_WRITE)
+				{
+					session->wstat = ISSL_WRITE;
+					/* Come back when the socket drains */
+					EventHandler* eh = ServerInstance->SE->GetRef(session->fd);
+					if (eh)
+						ServerInstance->SE->WantWrite(eh);
+					break;
+				}
+				else if (err == SSL_ERROR_WANT_READ)
+				{
+					session->wstat = ISSL_READ;
+					break;
+				}
+				else
+				{
+					ServerInstance->Log(DEBUG,"Close due to returned -1 in SSL_Write");
+					CloseSession(session);
+					return 0;
+				}
+			}
+
+			session->wstat = ISSL_WRITE;
+			session->outbufoffset += ret;
+			sent += ret;
 		}
-		else
+
+		if (session->outbufoffset == session->outbuf.size())
 		{
-			session->outbuf = session->outbuf.substr(ret);
-			return ret;
+			/* All gone, keep the storage for next time */
+			session->outbuf.clear();
+			session->outbufoffset = 0;
 		}
+		else if (session->outbufoffset > session->outbuf.size() / 2)
+		{
+			/* Drop the sent part now and then, so that each byte is moved at most once more */
+			session->outbuf.erase(0, session->outbufoffset);
+			session->outbufoffset = 0;
+		}
+
+		return sent ? sent : -1;
 	}
 
-	int DoRead(issl_session* session)
+	/** Decrypt into a buffer, taking whole records while OpenSSL holds more and there is room
+	 * @return Bytes read, 0 if the session was closed, or -1 if nothing could be read yet
+	 */
+	int DoRead(issl_session* session, char* buffer, unsigned int count)
 	{
-		// Is this right? Not sure if the unencrypted data is garaunteed to be the same length.
-		// Read into the inbuffer, offset from the beginning by the amount of data we have that insp hasn't taken yet.
-		
 		ServerInstance->Log(DEBUG,"DoRead");
 
-		int ret = SSL_read(session->sess, session->inbuf + session->inbufoffset, inbufsize - session->inbufoffset);
+		unsigned int got = 0;
 
-		if (ret == 0)
-		{
-			// Client closed connection.
-			ServerInstance->Log(DEBUG,"Oops, got 0 from SSL_read");
-			CloseSession(session);
-			return 0;
-		}
-		else if (ret < 0)
+		do
 		{
-			int err = SSL_get_error(session->sess, ret);
+			int ret = SSL_read(session->sess, buffer + got, count - got);
 
-			if (err == SSL_ERROR_WANT_READ)
+			if (ret == 0)
 			{
-				session->rstat = ISSL_READ;
-				ServerInstance->Log(DEBUG,"Setting want_read");
-				return -1;
-			}
-			else if (err == SSL_ERROR_WANT_WRITE)
-			{
-				session->rstat = ISSL_WRITE;
-				ServerInstance->Log(DEBUG,"Setting want_write");
-				return -1;
-			}
-			else
-			{
-				ServerInstance->Log(DEBUG,"Closed due to returned -1 in SSL_Read");
+				if (got)
+					break;
+				// Client closed connection.
+				ServerInstance->Log(DEBUG,"Oops, got 0 from SSL_read");
 				CloseSession(session);
 				return 0;
 			}
-		}
-		else
-		{
-			// Read successfully 'ret' bytes into inbuf + inbufoffset
-			// There are 'ret' + 'inbufoffset' bytes of data in 'inbuf'
-			// 'buffer' is 'count' long
+			else if (ret < 0)
+			{
+				int err = SSL_get_error(session->sess, ret);
 
-			session->inbufoffset += ret;
+				if (err == SSL_ERROR_WANT_READ)
+				{
+					session->rstat = ISSL_READ;
+					ServerInstance->Log(DEBUG,"Setting want_read");
+				}
+				else if (err == SSL_ERROR_WANT_WRITE)
+				{
+					session->rstat = ISSL_WRITE;
+					ServerInstance->Log(DEBUG,"Setting want_write");
+				}
+				else
+				{
+					ServerInstance->Log(DEBUG,"Closed due to returned -1 in SSL_Read");
+					CloseSession(session);
+					return 0;
+				}
+				break;
+			}
 
-			return ret;
+			session->rstat = ISSL_READ;
+			got += ret;
 		}
+		while ((got < count) && (SSL_pending(session->sess) > 0));
+
+		return got ? (int)got : -1;
+	}
+
+	/** Finish a read which OpenSSL could only do once the socket was writeable, keeping
+	 * the data until insp next asks to read
+	 */
+	void ReadAhead(issl_session* session)
+	{
+		if (!session->inbuf)
+			session->inbuf = new char[inbufsize];
+
+		int ret = DoRead(session, session->inbuf + session->inbufoffset, inbufsize - session->inbufoffset);
+		if (ret > 0)
+			session->inbufoffset += ret;
 	}
 
 	// :kenny.chatspike.net 320 Om Epy|AFK :is a Secure Connection
@@ -721,6 +1221,23 @@ class ModuleSSLOpenSSL : public Module
 		ServerInstance->Log(DEBUG,"Handshake");
 		int ret;
 
+		if (session->job)
+			return true;
+
+		if (!session->outbound && pool->GetThreads())
+		{
+			EventHandler* eh = ServerInstance->SE->GetRef(session->fd);
+			if (eh && ServerInstance->SE->DelFd(eh))
+			{
+				// Park the socket until a thread has done what it can, see HandshakeDone().
+				session->status = ISSL_HANDSHAKING;
+				session->parked = eh;
+				session->job = new HandshakeJob(this, session);
+				pool->Submit(session->job);
+				return true;
+			}
+		}
+
 		if (session->outbound)
 		{
 			ServerInstance->Log(DEBUG,"SSL_connect");
@@ -729,23 +1246,54 @@ class ModuleSSLOpenSSL : public Module
 		else
 			ret = SSL_accept(session->sess);
 
+		return HandshakeResult(session, ret, ret > 0 ? SSL_ERROR_NONE : SSL_get_error(session->sess, ret));
+	}
+
+	/** Called back on the main thread when a handshake thread is done with a session
+	 */
+	void HandshakeDone(issl_session* session, int ret, int err)
+	{
+		EventHandler* eh = session->parked;
+
+		session->job = NULL;
+		session->parked = NULL;
+		ServerInstance->SE->AddFd(eh);
+
+		HandshakeResult(session, ret, err);
+
+		// Let the core send anything it queued meanwhile, and notice if the handshake failed.
+		ServerInstance->SE->WantWrite(eh);
+	}
+
+	/** Act on what SSL_accept() or SSL_connect() returned
+	 * @param ret What it returned
+	 * @param err What SSL_get_error() said about that, if it was not above 0
+	 * @return False if the handshake failed
+	 */
+	bool HandshakeResult(issl_session* session, int ret, int err)
+	{
 		if (ret < 0)
 		{
-			int err = SSL_get_error(session->sess, ret);
-
+			/* Both say which way the handshake is waiting, so that it is only resumed by
+			 * that kind of event. Handshakes parked on a thread would otherwise be sent
+			 * back to it by every write event, and spin there.
+			 */
 			if (err == SSL_ERROR_WANT_READ)
 			{
 				ServerInstance->Log(DEBUG,"Want read, handshaking");
-				session->rstat = ISSL_READ;
+				session->rstat = session->wstat = ISSL_READ;
 				session->status = ISSL_HANDSHAKING;
 				return true;
 			}
 			else if (err == SSL_ERROR_WANT_WRITE)
 			{
 				ServerInstance->Log(DEBUG,"Want write, handshaking");
-				session->wstat = ISSL_WRITE;
+				session->rstat = session->wstat = ISSL_WRITE;
 				session->status = ISSL_HANDSHAKING;
-				MakePollWrite(session);
+				/* Resumed from OnRawSocketWrite() once the socket drains */
+				EventHandler* eh = ServerInstance->SE->GetRef(session->fd);
+				if (eh)
+					ServerInstance->SE->WantWrite(eh);
 				return true;
 			}
 			else
@@ -768,6 +1316,29 @@ class ModuleSSLOpenSSL : public Module
 			}
 
 			session->status = ISSL_OPEN;
+			session->rstat = ISSL_READ;
+			session->wstat = ISSL_WRITE;
+
+			if (session->outbound)
+			{
+				handshakes_out++;
+				if (SSL_session_reused(session->sess))
+					resumed_out++;
+			}
+			else
+			{
+				handshakes_in++;
+				if (SSL_session_reused(session->sess))
+					resumed_in++;
+			}
+
+#ifndef OPENSSL_NO_KTLS
+			if (usektls && BIO_get_ktls_send(SSL_get_wbio(session->sess)))
+			{
+				/* SSL_write() is now a plain write() of our data, the kernel does the rest */
+				session->ktls = true;
+			}
+#endif
 
 			MakePollWrite(session);
 
@@ -775,10 +1346,9 @@ class ModuleSSLOpenSSL : public Module
 		}
 		else if (ret == 0)
 		{
-			int ssl_err = SSL_get_error(session->sess, ret);
 			char buf[1024];
 			ERR_print_errors_fp(stderr);
-			ServerInstance->Log(DEBUG,"Handshake fail 2: %d: %s", ssl_err, ERR_error_string(ssl_err,buf));
+			ServerInstance->Log(DEBUG,"Handshake fail 2: %d: %s", err, ERR_error_string(err,buf));
 			CloseSession(session);
 			return true;
 		}
@@ -804,7 +1374,8 @@ class ModuleSSLOpenSSL : public Module
 
 			VerifyCertificate(&sessions[user->GetFd()], user);
 			if (sessions[user->GetFd()].sess)
-				user->WriteServ("NOTICE %s :*** You are connected using SSL cipher \"%s\"", user->nick, SSL_get_cipher(sessions[user->GetFd()].sess));
+				user->WriteServ("NOTICE %s :*** You are connected using SSL cipher \"%s\"%s", user->nick, SSL_get_cipher(sessions[user->GetFd()].sess),
+						sessions[user->GetFd()].ktls ? " (kernel TLS)" : "");
 		}
 	}
 
@@ -830,6 +1401,10 @@ class ModuleSSLOpenSSL : public Module
 		}
 
 		session->outbuf.clear();
+		session->outbufoffset = 0;
+		session->inbufoffset = 0;
+		session->ktls = false;
+		session->peer.clear();
 		session->inbuf = NULL;
 		session->sess = NULL;
 		session->status = ISSL_NONE;
@@ -890,6 +1465,11 @@ class ModuleSSLOpenSSL : public Module
 	}
 };
 
+void HandshakeJob::Finish()
+{
+	mod->HandshakeDone(session, ret, err);
+}
+
 static int error_callback(const char *str, size_t len, void *u)
 {
 	ModuleSSLOpenSSL* mssl = (ModuleSSLOpenSSL*)u;
@@ -0,0 +1,141 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2007 InspIRCd Development Team
+ * See: http://www.inspircd.org/wiki/index.php/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#include "inspircd.h"
+#include "users.h"
+#include "channels.h"
+#include "modules.h"
+#include "wildcard.h"
+
+/* $ModDesc: Times WHO mask searches through the user indexes against a scan of every user */
+
+/** Number of made up users searched
+ */
+static const unsigned int BenchUsers = 50000;
+
+/** Number of times each search is repeated
+ */
+static const unsigned int BenchRounds = 20;
+
+/** Masks searched for, covering prefixes, suffixes, exact names,
+ * masks with no literal end which the indexes cannot help with,
+ * and masks matching nobody
+ */
+static const char* masks[] = { "bench12345", "bench12*", "*.isp7.net", "10.0.*", "*.cloak.example", "*nch1*", "*", "nobody*", NULL };
+
+class ModuleWhoBench : public Module
+{
+	/** The test cmd_who makes when only nicks, hosts and servers are matched
+	 */
+	static bool Matches(userrec* user, const char* mask)
+	{
+		return (match(user->dhost, mask) || match(user->nick, mask) || match(user->server, mask));
+	}
+
+	static unsigned long Elapsed(const timeval &since)
+	{
+		timeval now;
+		gettimeofday(&now, NULL);
+		return (now.tv_sec - since.tv_sec) * 1000000 + now.tv_usec - since.tv_usec;
+	}
+
+ public:
+	ModuleWhoBench(InspIRCd* Me)
+		: Module::Module(Me)
+	{
+		/* The users are kept out of the real user list and indexes, so
+		 * that nothing else on the server can see them.
+		 */
+		UserIndex index(ServerInstance);
+		std::vector<userrec*> users;
+		char host[MAXBUF];
+
+		for (unsigned int n = 0; n < BenchUsers; n++)
+		{
+			userrec* u = new userrec(ServerInstance);
+			snprintf(u->nick, NICKMAX, "bench%u", n);
+			if (n % 3)
+				snprintf(host, MAXBUF, "host%u.isp%u.net", n, n % 50);
+			else
+				snprintf(host, MAXBUF, "10.%u.%u.%u", n >> 16, (n >> 8) & 255, n & 255);
+			u->SetHost(host);
+			if (!(n % 4))
+				snprintf(host, MAXBUF, "%08X.cloak.example", n * 2654435761U);
+			u->SetDisplayedHost(host);
+			u->registered = REG_ALL;
+			users.push_back(u);
+			index.Add(u);
+		}
+
+		int failed = 0;
+		for (const char** mask = masks; *mask; mask++)
+		{
+			unsigned int scanned = 0;
+			timeval start;
+			gettimeofday(&start, NULL);
+			for (unsigned int r = 0; r < BenchRounds; r++)
+			{
+				scanned = 0;
+				for (std::vector<userrec*>::iterator i = users.begin(); i != users.end(); i++)
+					if (Matches(*i, *mask))
+						scanned++;
+			}
+			unsigned long scantime = Elapsed(start) / BenchRounds;
+
+			unsigned int indexed = 0;
+			bool narrowed = false;
+			gettimeofday(&start, NULL);
+			for (unsigned int r = 0; r < BenchRounds; r++)
+			{
+				std::vector<userrec*> candidates;
+				std::vector<userrec*>* search = &users;
+				narrowed = index.Candidates(*mask, false, candidates);
+				if (narrowed)
+					search = &candidates;
+
+				indexed = 0;
+				for (std::vector<userrec*>::iterator i = search->begin(); i != search->end(); i++)
+					if (Matches(*i, *mask))
+						indexed++;
+			}
+			unsigned long indextime = Elapsed(start) / BenchRounds;
+
+			ServerInstance->Log(DEFAULT, "m_whobench: %-16s %6u matches, scan %6lu us, indexed %6lu us%s", *mask, scanned, scantime, indextime, narrowed ? "" : " (scanned)");
+			if (scanned != indexed)
+			{
+				ServerInstance->Log(DEFAULT, "m_whobench: %s matched %u users through the indexes, but %u by scanning", *mask, indexed, scanned);
+				failed++;
+			}
+		}
+
+		for (std::vector<userrec*>::iterator i = users.begin(); i != users.end(); i++)
+		{
+			index.Del(*i);
+			delete *i;
+		}
+
+		if (failed)
+			throw ModuleException("m_whobench: The indexes missed users for " + ConvToStr(failed) + " masks, see the log");
+	}
+
+	virtual ~ModuleWhoBench()
+	{
+	}
+
+	virtual Version GetVersion()
+	{
+		return Version(1, 1, 0, 0, VF_VENDOR, API_VERSION);
+	}
+};
+
+MODULE_INIT(ModuleWhoBench);
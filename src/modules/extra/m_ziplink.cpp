@@ -435,6 +435,11 @@ class ModuleZLib : public Module
 		 */
 		return ocount;
 	}
+
+	virtual size_t OnRawSocketQueued(int fd)
+	{
+		return sessions[fd].outbuf.size();
+	}
 	
 	void CloseSession(izip_session* session)
 	{
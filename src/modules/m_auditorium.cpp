@@ -74,12 +74,6 @@ class ModuleAuditorium : public Module
 		ShowOps = conf.ReadFlag("auditorium", "showops", 0);
 	}
 
-	Priority Prioritize()
-	{
-		/* To ensure that we get priority over namesx for names list generation on +u channels */
-		return (Priority)ServerInstance->PriorityBefore("m_namesx.so");
-	}
-
 	virtual Version GetVersion()
 	{
 		return Version(1, 1, 0, 0, VF_COMMON | VF_VENDOR, API_VERSION);
@@ -101,12 +95,17 @@ class ModuleAuditorium : public Module
 				 */
 				if (Ptr->GetStatus(user) >= STATUS_OP)
 				{
-					nameslist = Ptr->GetUsers();
 					return 0;
 				}
 
 				/* Show all the opped users */
-				nl = *(Ptr->GetOppedUsers());
+				nl.clear();
+				MemberList* ulist = Ptr->GetUsers();
+				for (MemberList::iterator i = ulist->begin(); i != ulist->end(); i++)
+				{
+					if ((*i)->status & UCMODE_OP)
+						nl[(*i)->user] = (*i)->user->nick;
+				}
 				nl[user] = user->nick;
 				nameslist = &nl;
 				return 0;
@@ -174,8 +173,8 @@ class ModuleAuditorium : public Module
 		{
 			for (UCListIter f = user->chans.begin(); f != user->chans.end(); f++)
 			{
-				if (f->first->IsModeSet('u'))
-					to_leave.push_back(f->first->name);
+				if ((*f)->chan->IsModeSet('u'))
+					to_leave.push_back((*f)->chan->name);
 			}
 			/* We cant do this neatly in one loop, as we are modifying the map we are iterating */
 			for (std::vector<std::string>::iterator n = to_leave.begin(); n != to_leave.end(); n++)
@@ -71,7 +71,7 @@ public:
 		if (chan != NULL)
 		{
 			modelist* list;
-			chan->GetExt(be->GetInfoKey(), list);
+			chan->GetExt(be->GetInfoSlot(), list);
 			
 			if (list)
 			{
@@ -118,7 +118,7 @@ public:
 		if (strcmp("LM_CHECKLIST", request->GetId()) == 0)
 		{
 			modelist* list;
-			LM->chan->GetExt(be->GetInfoKey(), list);
+			LM->chan->GetExt(be->GetInfoSlot(), list);
 			if (list)
 			{
 				char mask[MAXBUF];
@@ -99,8 +99,8 @@ class CGIResolver : public Resolver
 			if (notify)
 				ServerInstance->WriteOpers("*** Connecting user %s detected as using CGI:IRC (%s), changing real host to %s from %s", them->nick, them->host, result.c_str(), typ.c_str());
 
-			strlcpy(them->host, result.c_str(), 63);
-			strlcpy(them->dhost, result.c_str(), 63);
+			them->SetHost(result.c_str());
+			them->SetDisplayedHost(result.c_str());
 			strlcpy(them->ident, "~cgiirc", 8);
 			them->InvalidateCache();
 		}
@@ -287,8 +287,8 @@ public:
 		std::string *webirc_hostname, *webirc_ip;
 		if(user->GetExt("cgiirc_webirc_hostname", webirc_hostname))
 		{
-			strlcpy(user->host,webirc_hostname->c_str(),63);
-			strlcpy(user->dhost,webirc_hostname->c_str(),63);
+			user->SetHost(webirc_hostname->c_str());
+			user->SetDisplayedHost(webirc_hostname->c_str());
 			delete webirc_hostname;
 			user->InvalidateCache();
 			user->Shrink("cgiirc_webirc_hostname");
@@ -308,6 +308,7 @@ public:
 #endif
 
 			delete webirc_ip;
+			user->RefreshIPCache();
 			user->InvalidateCache();
 			user->Shrink("cgiirc_webirc_ip");
 			ServerInstance->AddLocalClone(user);
@@ -322,8 +323,8 @@ public:
 		{
 			user->Extend("cgiirc_realhost", new std::string(user->host));
 			user->Extend("cgiirc_realip", new std::string(user->GetIPString()));
-			strlcpy(user->host, user->password, 64);
-			strlcpy(user->dhost, user->password, 64);
+			user->SetHost(user->password);
+			user->SetDisplayedHost(user->password);
 			user->InvalidateCache();
 
 			bool valid = false;
@@ -337,6 +338,7 @@ public:
 			if (inet_aton(user->password, &((sockaddr_in*)user->ip)->sin_addr))
 				valid = true;
 #endif
+			user->RefreshIPCache();
 			ServerInstance->AddLocalClone(user);
 			ServerInstance->AddGlobalClone(user);
 			user->CheckClass();
@@ -404,13 +406,14 @@ public:
 		else
 #endif
 		inet_aton(newip, &((sockaddr_in*)user->ip)->sin_addr);
+		user->RefreshIPCache();
 		ServerInstance->AddLocalClone(user);
 		ServerInstance->AddGlobalClone(user);
 		user->CheckClass();
 		try
 		{
-			strlcpy(user->host, newip, 16);
-			strlcpy(user->dhost, newip, 16);
+			user->SetHost(newip);
+			user->SetDisplayedHost(newip);
 			strlcpy(user->ident, "~cgiirc", 8);
 
 			bool cached;
@@ -419,16 +422,16 @@ public:
 		}
 		catch (...)
 		{
-			strlcpy(user->host, newip, 16);
-			strlcpy(user->dhost, newip, 16);
+			user->SetHost(newip);
+			user->SetDisplayedHost(newip);
 			strlcpy(user->ident, "~cgiirc", 8);
 			user->InvalidateCache();
 
 			if(NotifyOpers)
 				 ServerInstance->WriteOpers("*** Connecting user %s detected as using CGI:IRC (%s), but i could not resolve their hostname!", user->nick, user->host);
 		}
-		/*strlcpy(user->host, newip, 16);
-		strlcpy(user->dhost, newip, 16);
+		/*user->SetHost(newip);
+		user->SetDisplayedHost(newip);
 		strlcpy(user->ident, "~cgiirc", 8);*/
 
 		return true;
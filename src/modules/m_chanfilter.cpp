@@ -99,7 +99,7 @@ class ModuleChanFilter : public Module
 		irc::string line = text.c_str();
 
 		modelist* list;
-		chan->GetExt(cf->GetInfoKey(), list);
+		chan->GetExt(cf->GetInfoSlot(), list);
 
 		if (list)
 		{
@@ -22,7 +22,10 @@
 #define PROTECT_VALUE 40000
 #define FOUNDER_VALUE 50000
 
-const char* fakevalue = "on";
+/** The channels a user has +q or +a on. Each mode keeps one of these per user
+ * under a single key, so that channel names never become extension keys.
+ */
+typedef std::set<chanrec*> chanlist;
 
 /* When this is set to true, no restrictions apply to setting or
  * removal of +qa. This is used while unloading so that the server
@@ -30,23 +33,54 @@ const char* fakevalue = "on";
  */
 bool unload_kludge = false;
 
+/** Check whether a user has +q or +a on a channel
+ * @param item The list of channels kept for the mode
+ */
+static bool HasStatus(const ExtensionItem<chanlist> &item, userrec* user, chanrec* channel)
+{
+	chanlist* chans = item.Get(user);
+	return ((chans) && (chans->find(channel) != chans->end()));
+}
+
+/** Give a user +q or +a on a channel, or take it away
+ * @param item The list of channels kept for the mode
+ */
+static void SetStatus(const ExtensionItem<chanlist> &item, userrec* user, chanrec* channel, bool on)
+{
+	chanlist* chans = item.Get(user);
+	if (on)
+	{
+		if (!chans)
+		{
+			chans = new chanlist;
+			item.Set(user, chans);
+		}
+		chans->insert(channel);
+	}
+	else if (chans)
+	{
+		chans->erase(channel);
+		if (chans->empty())
+			item.Unset(user);
+	}
+}
+
 /** Handles basic operation of +qa channel modes
  */
 class FounderProtectBase
 {
  private:
 	InspIRCd* MyInstance;
-	std::string extend;
 	std::string type;
 	int list;
 	int end;
-	char* dummyptr;
  protected:
+	ExtensionItem<chanlist>& ext;
 	bool& remove_own_privs;
 	bool& remove_other_privs;
  public:
-	FounderProtectBase(InspIRCd* Instance, const std::string &ext, const std::string &mtype, int l, int e, bool &remove_own, bool &remove_others) :
-		MyInstance(Instance), extend(ext), type(mtype), list(l), end(e), remove_own_privs(remove_own), remove_other_privs(remove_others)
+	FounderProtectBase(InspIRCd* Instance, ExtensionItem<chanlist> &e_item, const std::string &mtype, int l, int e, bool &remove_own, bool &remove_others) :
+		MyInstance(Instance), type(mtype), list(l), end(e), ext(e_item), remove_own_privs(remove_own), remove_other_privs(remove_others)
 	{
 	}
 
@@ -61,8 +95,7 @@ class FounderProtectBase
 			}
 			else
 			{
-				std::string item = extend+std::string(channel->name);
-				if (x->GetExt(item,dummyptr))
+				if (HasStatus(ext, x, channel))
 				{
 					return std::make_pair(true, x->nick);
 				}
@@ -78,19 +111,18 @@ class FounderProtectBase
 	void RemoveMode(chanrec* channel, char mc)
 	{
 		unload_kludge = true;
-		CUList* cl = channel->GetUsers();
-		std::string item = extend + std::string(channel->name);
+		MemberList* cl = channel->GetUsers();
 		const char* mode_junk[MAXMODES+2];
 		userrec* n = new userrec(MyInstance);
 		n->SetFd(FD_MAGIC_NUMBER);
 		mode_junk[0] = channel->name;
 		irc::modestacker modestack(false);
 		std::deque<std::string> stackresult;				
-		for (CUList::iterator i = cl->begin(); i != cl->end(); i++)
+		for (MemberList::iterator i = cl->begin(); i != cl->end(); i++)
 		{
-			if (i->first->GetExt(item, dummyptr))
+			if (HasStatus(ext, (*i)->user, channel))
 			{
-				modestack.Push(mc, i->first->nick);
+				modestack.Push(mc, (*i)->user->nick);
 			}
 		}
 
@@ -109,13 +141,12 @@ class FounderProtectBase
 
 	void DisplayList(userrec* user, chanrec* channel)
 	{
-		CUList* cl = channel->GetUsers();
-		std::string item = extend+std::string(channel->name);
-		for (CUList::reverse_iterator i = cl->rbegin(); i != cl->rend(); ++i)
+		MemberList* cl = channel->GetUsers();
+		for (MemberList::reverse_iterator i = cl->rbegin(); i != cl->rend(); ++i)
 		{
-			if (i->first->GetExt(item, dummyptr))
+			if (HasStatus(ext, (*i)->user, channel))
 			{
-				user->WriteServ("%d %s %s %s", list, user->nick, channel->name,i->first->nick);
+				user->WriteServ("%d %s %s %s", list, user->nick, channel->name,(*i)->user->nick);
 			}
 		}
 		user->WriteServ("%d %s %s :End of channel %s list", end, user->nick, channel->name, type.c_str());
@@ -134,31 +165,16 @@ class FounderProtectBase
 
 	bool CanRemoveOthers(userrec* u1, userrec* u2, chanrec* c)
 	{
-		std::string item = extend+std::string(c->name);
-		return (u1->GetExt(item, dummyptr) && u2->GetExt(item, dummyptr));
+		return (HasStatus(ext, u1, c) && HasStatus(ext, u2, c));
 	}
 
 	ModeAction HandleChange(userrec* source, userrec* theuser, bool adding, chanrec* channel, std::string &parameter)
 	{
-		std::string item = extend+std::string(channel->name);
-
-		if (adding)
+		if (adding != HasStatus(ext, theuser, channel))
 		{
-			if (!theuser->GetExt(item, dummyptr))
-			{
-				theuser->Extend(item, fakevalue);
-				parameter = theuser->nick;
-				return MODEACTION_ALLOW;
-			}
-		}
-		else
-		{
-			if (theuser->GetExt(item, dummyptr))
-			{
-				theuser->Shrink(item);
-				parameter = theuser->nick;
-				return MODEACTION_ALLOW;
-			}
+			SetStatus(ext, theuser, channel, adding);
+			parameter = theuser->nick;
+			return MODEACTION_ALLOW;
 		}
 		return MODEACTION_DENY;
 	}
@@ -168,11 +184,10 @@ class FounderProtectBase
  */
 class ChanFounder : public ModeHandler, public FounderProtectBase
 {
-	char* dummyptr;
  public:
-	ChanFounder(InspIRCd* Instance, bool using_prefixes, bool &depriv_self, bool &depriv_others)
+	ChanFounder(InspIRCd* Instance, ExtensionItem<chanlist> &founder, bool using_prefixes, bool &depriv_self, bool &depriv_others)
 		: ModeHandler(Instance, 'q', 1, 1, true, MODETYPE_CHANNEL, false, using_prefixes ? '~' : 0),
-		  FounderProtectBase(Instance, "cm_founder_", "founder", 386, 387, depriv_self, depriv_others) { }
+		  FounderProtectBase(Instance, founder, "founder", 386, 387, depriv_self, depriv_others) { }
 
 	unsigned int GetPrefixRank()
 	{
@@ -230,11 +245,11 @@ class ChanFounder : public ModeHandler, public FounderProtectBase
  */
 class ChanProtect : public ModeHandler, public FounderProtectBase
 {
-	char* dummyptr;
+	ExtensionItem<chanlist>& founder;
  public:
-	ChanProtect(InspIRCd* Instance, bool using_prefixes, bool &depriv_self, bool &depriv_others)
+	ChanProtect(InspIRCd* Instance, ExtensionItem<chanlist> &protect, ExtensionItem<chanlist> &f, bool using_prefixes, bool &depriv_self, bool &depriv_others)
 		: ModeHandler(Instance, 'a', 1, 1, true, MODETYPE_CHANNEL, false, using_prefixes ? '&' : 0),
-		  FounderProtectBase(Instance,"cm_protect_","protected user", 388, 389, depriv_self, depriv_others) { }
+		  FounderProtectBase(Instance, protect, "protected user", 388, 389, depriv_self, depriv_others), founder(f) { }
 
 	unsigned int GetPrefixRank()
 	{
@@ -262,14 +277,12 @@ class ChanProtect : public ModeHandler, public FounderProtectBase
 		if (!theuser)
 			return MODEACTION_DENY;
 
-		std::string founder = "cm_founder_"+std::string(channel->name);
-
 		if ((!adding) && FounderProtectBase::CanRemoveOthers(source, theuser, channel))
 		{
 			return FounderProtectBase::HandleChange(source, theuser, adding, channel, parameter);
 		}
 		// source has +q, is a server, or ulined, we'll let them +-a the user.
-		if ((unload_kludge) || ((source == theuser) && (!adding) && (FounderProtectBase::remove_own_privs)) || (ServerInstance->ULine(source->nick)) || (ServerInstance->ULine(source->server)) || (!*source->server) || (source->GetExt(founder,dummyptr)) || (!IS_LOCAL(source)))
+		if ((unload_kludge) || ((source == theuser) && (!adding) && (FounderProtectBase::remove_own_privs)) || (ServerInstance->ULine(source->nick)) || (ServerInstance->ULine(source->server)) || (!*source->server) || (HasStatus(founder, source, channel)) || (!IS_LOCAL(source)))
 		{
 			return FounderProtectBase::HandleChange(source, theuser, adding, channel, parameter);
 		}
@@ -296,14 +309,16 @@ class ModuleChanProtect : public Module
 	bool DeprivSelf;
 	bool DeprivOthers;
 	bool booting;
+	ExtensionItem<chanlist> founder;
+	ExtensionItem<chanlist> protect;
 	ChanProtect* cp;
 	ChanFounder* cf;
-	char* dummyptr;
 	
  public:
  
 	ModuleChanProtect(InspIRCd* Me)
-		: Module(Me), FirstInGetsFounder(false), QAPrefixes(false), DeprivSelf(false), DeprivOthers(false), booting(true)
+		: Module(Me), FirstInGetsFounder(false), QAPrefixes(false), DeprivSelf(false), DeprivOthers(false), booting(true),
+		  founder("cm_founder"), protect("cm_protect")
 	{	
 		/* Load config stuff */
 		OnRehash(NULL,"");
@@ -311,8 +326,8 @@ class ModuleChanProtect : public Module
 
 		/* Initialise module variables */
 
-		cp = new ChanProtect(ServerInstance,QAPrefixes,DeprivSelf,DeprivOthers);
-		cf = new ChanFounder(ServerInstance,QAPrefixes,DeprivSelf,DeprivOthers);
+		cp = new ChanProtect(ServerInstance,protect,founder,QAPrefixes,DeprivSelf,DeprivOthers);
+		cf = new ChanFounder(ServerInstance,founder,QAPrefixes,DeprivSelf,DeprivOthers);
 
 		if (!ServerInstance->AddMode(cp, 'a') || !ServerInstance->AddMode(cf, 'q'))
 			throw ModuleException("Could not add new modes!");
@@ -326,15 +341,15 @@ class ModuleChanProtect : public Module
 	virtual void OnUserKick(userrec* source, userrec* user, chanrec* chan, const std::string &reason, bool &silent)
 	{
 		// FIX: when someone gets kicked from a channel we must remove their Extensibles!
-		user->Shrink("cm_founder_"+std::string(chan->name));
-		user->Shrink("cm_protect_"+std::string(chan->name));
+		SetStatus(founder, user, chan, false);
+		SetStatus(protect, user, chan, false);
 	}
 
 	virtual void OnUserPart(userrec* user, chanrec* channel, const std::string &partreason, bool &silent)
 	{
 		// FIX: when someone parts a channel we must remove their Extensibles!
-		user->Shrink("cm_founder_"+std::string(channel->name));
-		user->Shrink("cm_protect_"+std::string(channel->name));
+		SetStatus(founder, user, channel, false);
+		SetStatus(protect, user, channel, false);
 	}
 
 	virtual void OnRehash(userrec* user, const std::string &parameter)
@@ -363,8 +378,8 @@ class ModuleChanProtect : public Module
 			ServerInstance->Modes->DelMode(cf);
 			DELETE(cp);
 			DELETE(cf);
-			cp = new ChanProtect(ServerInstance,QAPrefixes,DeprivSelf,DeprivOthers);
-			cf = new ChanFounder(ServerInstance,QAPrefixes,DeprivSelf,DeprivOthers);
+			cp = new ChanProtect(ServerInstance,protect,founder,QAPrefixes,DeprivSelf,DeprivOthers);
+			cf = new ChanFounder(ServerInstance,founder,QAPrefixes,DeprivSelf,DeprivOthers);
 			/* These wont fail, we already owned the mode characters before */
 			ServerInstance->AddMode(cp, 'a');
 			ServerInstance->AddMode(cf, 'q');
@@ -383,13 +398,13 @@ class ModuleChanProtect : public Module
 				// we're using Extensible::Extend to add data into user objects.
 				// this way is best as it adds data thats accessible to other modules
 				// (so long as you document your code properly) without breaking anything
-				// because its encapsulated neatly in a map.
+				// because its encapsulated neatly in the user's cm_founder channel list.
 
 				// Change requested by katsklaw... when the first in is set to get founder,
 				// to make it clearer that +q has been given, send that one user the +q notice
 				// so that their client's syncronization and their sanity are left intact.
 				user->WriteServ("MODE %s +q %s",channel->name,user->nick);
-				user->Extend("cm_founder_"+std::string(channel->name),fakevalue);
+				SetStatus(founder, user, channel, true);
 			}
 		}
 	}
@@ -411,19 +426,16 @@ class ModuleChanProtect : public Module
 		if ((ServerInstance->ULine(source->nick)) || (ServerInstance->ULine(source->server)) || (!*source->server))
 			return ACR_ALLOW;
 
-		std::string founder = "cm_founder_"+std::string(channel->name);
-		std::string protect = "cm_protect_"+std::string(channel->name);
-
 		switch (access_type)
 		{
 			// a user has been deopped. Do we let them? hmmm...
 			case AC_DEOP:
-				if (dest->GetExt(founder,dummyptr))
+				if (HasStatus(founder, dest, channel))
 				{
 					source->WriteServ("484 "+std::string(source->nick)+" "+std::string(channel->name)+" :Can't deop "+std::string(dest->nick)+" as they're a channel founder");
 					return ACR_DENY;
 				}
-				if ((dest->GetExt(protect,dummyptr)) && (!source->GetExt(protect,dummyptr)))
+				if ((HasStatus(protect, dest, channel)) && (!HasStatus(protect, source, channel)))
 				{
 					source->WriteServ("484 "+std::string(source->nick)+" "+std::string(channel->name)+" :Can't deop "+std::string(dest->nick)+" as they're protected (+a)");
 					return ACR_DENY;
@@ -432,12 +444,12 @@ class ModuleChanProtect : public Module
 
 			// a user is being kicked. do we chop off the end of the army boot?
 			case AC_KICK:
-				if (dest->GetExt(founder,dummyptr))
+				if (HasStatus(founder, dest, channel))
 				{
 					source->WriteServ("484 "+std::string(source->nick)+" "+std::string(channel->name)+" :Can't kick "+std::string(dest->nick)+" as they're a channel founder");
 					return ACR_DENY;
 				}
-				if ((dest->GetExt(protect,dummyptr)) && (!source->GetExt(protect,dummyptr)))
+				if ((HasStatus(protect, dest, channel)) && (!HasStatus(protect, source, channel)))
 				{
 					source->WriteServ("484 "+std::string(source->nick)+" "+std::string(channel->name)+" :Can't kick "+std::string(dest->nick)+" as they're protected (+a)");
 					return ACR_DENY;
@@ -446,12 +458,12 @@ class ModuleChanProtect : public Module
 
 			// a user is being dehalfopped. Yes, we do disallow -h of a +ha user
 			case AC_DEHALFOP:
-				if (dest->GetExt(founder,dummyptr))
+				if (HasStatus(founder, dest, channel))
 				{
 					source->WriteServ("484 "+std::string(source->nick)+" "+std::string(channel->name)+" :Can't de-halfop "+std::string(dest->nick)+" as they're a channel founder");
 					return ACR_DENY;
 				}
-				if ((dest->GetExt(protect,dummyptr)) && (!source->GetExt(protect,dummyptr)))
+				if ((HasStatus(protect, dest, channel)) && (!HasStatus(protect, source, channel)))
 				{
 					source->WriteServ("484 "+std::string(source->nick)+" "+std::string(channel->name)+" :Can't de-halfop "+std::string(dest->nick)+" as they're protected (+a)");
 					return ACR_DENY;
@@ -460,12 +472,12 @@ class ModuleChanProtect : public Module
 
 			// same with devoice.
 			case AC_DEVOICE:
-				if (dest->GetExt(founder,dummyptr))
+				if (HasStatus(founder, dest, channel))
 				{
 					source->WriteServ("484 "+std::string(source->nick)+" "+std::string(channel->name)+" :Can't devoice "+std::string(dest->nick)+" as they're a channel founder");
 					return ACR_DENY;
 				}
-				if ((dest->GetExt(protect,dummyptr)) && (!source->GetExt(protect,dummyptr)))
+				if ((HasStatus(protect, dest, channel)) && (!HasStatus(protect, source, channel)))
 				{
 					source->WriteServ("484 "+std::string(source->nick)+" "+std::string(channel->name)+" :Can't devoice "+std::string(dest->nick)+" as they're protected (+a)");
 					return ACR_DENY;
@@ -500,21 +512,19 @@ class ModuleChanProtect : public Module
 			// this is called when the server is linking into a net and wants to sync channel data.
 			// we should send our mode changes for the channel here to ensure that other servers
 			// know whos +q/+a on the channel.
-			CUList* cl = chan->GetUsers();
+			MemberList* cl = chan->GetUsers();
 			string_list commands;
-			std::string founder = "cm_founder_"+std::string(chan->name);
-			std::string protect = "cm_protect_"+std::string(chan->name);
 			irc::modestacker modestack(true);
 			std::deque<std::string> stackresult;
-			for (CUList::iterator i = cl->begin(); i != cl->end(); i++)
+			for (MemberList::iterator i = cl->begin(); i != cl->end(); i++)
 			{
-				if (i->first->GetExt(founder,dummyptr))
+				if (HasStatus(founder, (*i)->user, chan))
 				{
-					modestack.Push('q',i->first->nick);
+					modestack.Push('q',(*i)->user->nick);
 				}
-				if (i->first->GetExt(protect,dummyptr))
+				if (HasStatus(protect, (*i)->user, chan))
 				{
-					modestack.Push('a',i->first->nick);
+					modestack.Push('a',(*i)->user->nick);
 				}
 			}
 			while (modestack.GetStackedLine(stackresult))
@@ -113,16 +113,16 @@ class cmd_check : public command_t
 			
 			/* now the ugly bit, spool current members of a channel. :| */
 
-			CUList *ulist= targchan->GetUsers();
+			MemberList *ulist= targchan->GetUsers();
 
 			/* note that unlike /names, we do NOT check +i vs in the channel */
-			for (CUList::iterator i = ulist->begin(); i != ulist->end(); i++)
+			for (MemberList::iterator i = ulist->begin(); i != ulist->end(); i++)
 			{
 				char tmpbuf[MAXBUF];
 				/*
 				 * Unlike Asuka, I define a clone as coming from the same host. --w00t
 				 */
-				snprintf(tmpbuf, MAXBUF, "%lu    %s%s (%s@%s) %s ", i->first->GlobalCloneCount(), targchan->GetAllPrefixChars(i->first), i->first->nick, i->first->ident, i->first->dhost, i->first->fullname);
+				snprintf(tmpbuf, MAXBUF, "%lu    %s%s (%s@%s) %s ", (*i)->user->GlobalCloneCount(), targchan->GetAllPrefixChars(*i), (*i)->user->nick, (*i)->user->ident, (*i)->user->dhost, (*i)->user->fullname);
 				user->WriteServ(checkstr + " member " + tmpbuf);
 			}
 		}
@@ -16,23 +16,125 @@
 #include "channels.h"
 #include "modules.h"
 #include "m_hash.h"
+#include <list>
+#include <deque>
 
 /* $ModDesc: Provides masking of user hostnames */
 /* $ModDep: m_hash.h */
 
+/** Slot marking users whose cloak has been worked out before they connect
+ */
+static ExtensionSlot precloakslot;
+
 /* Used to vary the output a little more depending on the cloak keys */
 static const char* xtab[] = {"F92E45D871BCA630", "A1B9D80C72E653F4", "1ABC078934DEF562", "ABCDEF5678901234"};
 
+/** The values a cloak is generated from. Cloaks only change when these do.
+ */
+class CloakKeys
+{
+ public:
+	unsigned int key[4];
+	std::string prefix;
+
+	CloakKeys() : prefix("")
+	{
+		key[0] = key[1] = key[2] = key[3] = 0;
+	}
+
+	bool operator==(const CloakKeys &other) const
+	{
+		return ((!memcmp(key, other.key, sizeof(key))) && (prefix == other.prefix));
+	}
+};
+
+/** A bounded least-recently-used map of real host to cloak
+ */
+class CloakCache
+{
+	typedef std::list<std::pair<std::string, std::string> > LRUList;
+	typedef nspace::hash_map<std::string, LRUList::iterator> LRUIndex;
+
+	/** Entries, most recently used first */
+	LRUList lru;
+	/** Entries by key */
+	LRUIndex index;
+	/** Maximum number of entries, 0 to disable caching */
+	size_t maxsize;
+
+ public:
+	/** Lookups answered from the cache, and lookups which were not */
+	unsigned long hits, misses;
+
+	CloakCache() : maxsize(0), hits(0), misses(0)
+	{
+	}
+
+	bool Get(const std::string &key, std::string &cloak)
+	{
+		LRUIndex::iterator i = index.find(key);
+		if (i == index.end())
+		{
+			misses++;
+			return false;
+		}
+		hits++;
+		lru.splice(lru.begin(), lru, i->second);
+		cloak = i->second->second;
+		return true;
+	}
+
+	void Put(const std::string &key, const std::string &cloak)
+	{
+		if (!maxsize)
+			return;
+
+		LRUIndex::iterator i = index.find(key);
+		if (i != index.end())
+		{
+			i->second->second = cloak;
+			lru.splice(lru.begin(), lru, i->second);
+			return;
+		}
+
+		lru.push_front(std::make_pair(key, cloak));
+		index[key] = lru.begin();
+		Trim();
+	}
+
+	void Trim()
+	{
+		while (index.size() > maxsize)
+		{
+			index.erase(lru.back().first);
+			lru.pop_back();
+		}
+	}
+
+	void SetMax(size_t max)
+	{
+		maxsize = max;
+		Trim();
+	}
+
+	size_t Size()
+	{
+		return index.size();
+	}
+
+	void Clear()
+	{
+		lru.clear();
+		index.clear();
+	}
+};
+
 /** Handles user mode +x
  */
 class CloakUser : public ModeHandler
 {
 	
-	std::string prefix;
-	unsigned int key1;
-	unsigned int key2;
-	unsigned int key3;
-	unsigned int key4;
+	CloakKeys keys;
 	Module* Sender;
 	Module* HashProvider;
 
@@ -68,6 +170,9 @@ class CloakUser : public ModeHandler
 	}
 	
  public:
+	/** Recently generated cloaks, keyed by protocol family and real host */
+	CloakCache cache;
+
 	CloakUser(InspIRCd* Instance, Module* Source, Module* Hash) : ModeHandler(Instance, 'x', 0, 0, false, MODETYPE_USER, false), Sender(Source), HashProvider(Hash)
 	{
 	}
@@ -87,67 +192,14 @@ class CloakUser : public ModeHandler
 		{
 			if(!dest->IsModeSet('x'))
 			{
-				/* The mode is being turned on - so attempt to
-				 * allocate the user a cloaked host using a non-reversible
-				 * algorithm (its simple, but its non-reversible so the
-				 * simplicity doesnt really matter). This algorithm
-				 * will not work if the user has only one level of domain
-				 * naming in their hostname (e.g. if they are on a lan or
-				 * are connecting via localhost) -- this doesnt matter much.
+				/* InspIRCd users have two hostnames; A displayed
+				 * hostname which can be modified by modules (e.g.
+				 * to create vhosts, implement chghost, etc) and a
+				 * 'real' hostname which you shouldnt write to.
 				 */
-
-				char* n1 = strchr(dest->host,'.');
-				char* n2 = strchr(dest->host,':');
-			
-				if (n1 || n2)
-				{
-					/* InspIRCd users have two hostnames; A displayed
-					 * hostname which can be modified by modules (e.g.
-					 * to create vhosts, implement chghost, etc) and a
-					 * 'real' hostname which you shouldnt write to.
-					 */
-
-					unsigned int iv[] = { key1, key2, key3, key4 };
-					std::string a = LastTwoDomainParts(dest->host);
-					std::string b;
-
-					/** Reset the Hash module, and send it our IV and hex table */
-					HashResetRequest(Sender, HashProvider).Send();
-					HashKeyRequest(Sender, HashProvider, iv).Send();
-					HashHexRequest(Sender, HashProvider, xtab[(*dest->host) % 4]);
-
-					/* Generate a cloak using specialized Hash */
-					std::string hostcloak = prefix + "-" + std::string(HashSumRequest(Sender, HashProvider, dest->host).Send()).substr(0,8) + a;
-
-					/* Fix by brain - if the cloaked host is > the max length of a host (64 bytes
-					 * according to the DNS RFC) then tough titty, they get cloaked as an IP. 
-					 * Their ISP shouldnt go to town on subdomains, or they shouldnt have a kiddie
-					 * vhost.
-					 */
-#ifdef IPV6
-					in6_addr testaddr;
-					in_addr testaddr2;
-					if ((dest->GetProtocolFamily() == AF_INET6) && (inet_pton(AF_INET6,dest->host,&testaddr) < 1) && (hostcloak.length() <= 64))
-						/* Invalid ipv6 address, and ipv6 user (resolved host) */
-						b = hostcloak;
-					else if ((dest->GetProtocolFamily() == AF_INET) && (inet_aton(dest->host,&testaddr2) < 1) && (hostcloak.length() <= 64))
-						/* Invalid ipv4 address, and ipv4 user (resolved host) */
-						b = hostcloak;
-					else
-						/* Valid ipv6 or ipv4 address (not resolved) ipv4 or ipv6 user */
-						b = ((!strchr(dest->host,':')) ? Cloak4(dest->host) : Cloak6(dest->host));
-#else
-					in_addr testaddr;
-					if ((inet_aton(dest->host,&testaddr) < 1) && (hostcloak.length() <= 64))
-						/* Invalid ipv4 address, and ipv4 user (resolved host) */
-						b = hostcloak;
-					else
-						/* Valid ipv4 address (not resolved) ipv4 user */
-						b = Cloak4(dest->host);
-#endif
-
+				std::string b = GetCloak(dest);
+				if (!b.empty())
 					dest->ChangeDisplayedHost(b.c_str());
-				}
 				
 				dest->SetMode('x',true);
 				return MODEACTION_ALLOW;
@@ -169,9 +221,80 @@ class CloakUser : public ModeHandler
 		return MODEACTION_DENY;
 	}
 
-	std::string Cloak4(const char* ip)
+	/** Get the cloak for a user under the current keys, from the cache if possible.
+	 * @return The cloaked host, or an empty string if the host can't be cloaked
+	 */
+	std::string GetCloak(userrec* dest)
+	{
+		std::string key = ConvToStr(dest->GetProtocolFamily()) + "/" + dest->host;
+		std::string cloak;
+
+		if (!cache.Get(key, cloak))
+		{
+			cloak = GenerateCloak(keys, dest);
+			cache.Put(key, cloak);
+		}
+
+		return cloak;
+	}
+
+	/** Generate a user's cloak under the given keys
+	 * @return The cloaked host, or an empty string if the host can't be cloaked
+	 */
+	std::string GenerateCloak(const CloakKeys &k, userrec* dest)
 	{
-		unsigned int iv[] = { key1, key2, key3, key4 };
+		/* Allocate the user a cloaked host using a non-reversible
+		 * algorithm (its simple, but its non-reversible so the
+		 * simplicity doesnt really matter). This algorithm
+		 * will not work if the user has only one level of domain
+		 * naming in their hostname (e.g. if they are on a lan or
+		 * are connecting via localhost) -- this doesnt matter much.
+		 */
+		if ((!strchr(dest->host,'.')) && (!strchr(dest->host,':')))
+			return "";
+
+		unsigned int iv[] = { k.key[0], k.key[1], k.key[2], k.key[3] };
+		std::string a = LastTwoDomainParts(dest->host);
+
+		/** Reset the Hash module, and send it our IV and hex table */
+		HashResetRequest(Sender, HashProvider).Send();
+		HashKeyRequest(Sender, HashProvider, iv).Send();
+		HashHexRequest(Sender, HashProvider, xtab[(*dest->host) % 4]);
+
+		/* Generate a cloak using specialized Hash */
+		std::string hostcloak = k.prefix + "-" + std::string(HashSumRequest(Sender, HashProvider, dest->host).Send()).substr(0,8) + a;
+
+		/* Fix by brain - if the cloaked host is > the max length of a host (64 bytes
+		 * according to the DNS RFC) then tough titty, they get cloaked as an IP. 
+		 * Their ISP shouldnt go to town on subdomains, or they shouldnt have a kiddie
+		 * vhost.
+		 */
+#ifdef IPV6
+		in6_addr testaddr;
+		in_addr testaddr2;
+		if ((dest->GetProtocolFamily() == AF_INET6) && (inet_pton(AF_INET6,dest->host,&testaddr) < 1) && (hostcloak.length() <= 64))
+			/* Invalid ipv6 address, and ipv6 user (resolved host) */
+			return hostcloak;
+		else if ((dest->GetProtocolFamily() == AF_INET) && (inet_aton(dest->host,&testaddr2) < 1) && (hostcloak.length() <= 64))
+			/* Invalid ipv4 address, and ipv4 user (resolved host) */
+			return hostcloak;
+		else
+			/* Valid ipv6 or ipv4 address (not resolved) ipv4 or ipv6 user */
+			return ((!strchr(dest->host,':')) ? Cloak4(k, dest->host) : Cloak6(k, dest->host));
+#else
+		in_addr testaddr;
+		if ((inet_aton(dest->host,&testaddr) < 1) && (hostcloak.length() <= 64))
+			/* Invalid ipv4 address, and ipv4 user (resolved host) */
+			return hostcloak;
+		else
+			/* Valid ipv4 address (not resolved) ipv4 user */
+			return Cloak4(k, dest->host);
+#endif
+	}
+
+	std::string Cloak4(const CloakKeys &k, const char* ip)
+	{
+		unsigned int iv[] = { k.key[0], k.key[1], k.key[2], k.key[3] };
 		irc::sepstream seps(ip, '.');
 		std::string ra[4];;
 		std::string octet[4];
@@ -201,15 +324,15 @@ class CloakUser : public ModeHandler
 		return std::string().append(ra[0]).append(".").append(ra[1]).append(".").append(ra[2]).append(".").append(ra[3]);
 	}
 
-	std::string Cloak6(const char* ip)
+	std::string Cloak6(const CloakKeys &k, const char* ip)
 	{
 		/* Theyre using 4in6 (YUCK). Translate as ipv4 cloak */
 		if (!strncmp(ip, "0::ffff:", 8))
-			return Cloak4(ip + 8);
+			return Cloak4(k, ip + 8);
 
 		/* If we get here, yes it really is an ipv6 ip */
-		unsigned int iv[] = { key1, key2, key3, key4 };
-		std::vector<std::string> hashies;
+		unsigned int iv[] = { k.key[0], k.key[1], k.key[2], k.key[3] };
+		std::string cloak;
 		std::string item;
 		int rounds = 0;
 
@@ -223,8 +346,10 @@ class CloakUser : public ModeHandler
 			if (item.length() > 7)
 			{
 				/* Send the Hash module a different hex table for each octet group's Hash sum */
-				HashHexRequest(Sender, HashProvider, xtab[(key1+rounds) % 4]).Send();
-				hashies.push_back(std::string(HashSumRequest(Sender, HashProvider, item).Send()).substr(0,8));
+				HashHexRequest(Sender, HashProvider, xtab[(k.key[0]+rounds) % 4]).Send();
+				if (!cloak.empty())
+					cloak.append(":");
+				cloak.append(std::string(HashSumRequest(Sender, HashProvider, item).Send()).substr(0,8));
 				item.clear();
 			}
 			rounds++;
@@ -232,44 +357,81 @@ class CloakUser : public ModeHandler
 		if (!item.empty())
 		{
 			/* Send the Hash module a different hex table for each octet group's Hash sum */
-			HashHexRequest(Sender, HashProvider, xtab[(key1+rounds) % 4]).Send();
-			hashies.push_back(std::string(HashSumRequest(Sender, HashProvider, item).Send()).substr(0,8));
+			HashHexRequest(Sender, HashProvider, xtab[(k.key[0]+rounds) % 4]).Send();
+			if (!cloak.empty())
+				cloak.append(":");
+			cloak.append(std::string(HashSumRequest(Sender, HashProvider, item).Send()).substr(0,8));
 			item.clear();
 		}
 		/* Stick them all together */
-		return irc::stringjoiner(":", hashies, 0, hashies.size() - 1).GetJoined();
+		return cloak;
+	}
+
+	/** Get the keys cloaks are currently generated with
+	 */
+	const CloakKeys& GetKeys()
+	{
+		return keys;
 	}
 	
-	void DoRehash()
+	/** Read the cloak configuration
+	 * @return True if the keys or prefix changed, so that existing cloaks are now stale
+	 */
+	bool DoRehash()
 	{
 		ConfigReader Conf(ServerInstance);
-		key1 = key2 = key3 = key4 = 0;
-		key1 = Conf.ReadInteger("cloak","key1",0,true);
-		key2 = Conf.ReadInteger("cloak","key2",0,true);
-		key3 = Conf.ReadInteger("cloak","key3",0,true);
-		key4 = Conf.ReadInteger("cloak","key4",0,true);
-		prefix = Conf.ReadValue("cloak","prefix",0);
+		CloakKeys newkeys;
+		newkeys.key[0] = Conf.ReadInteger("cloak","key1",0,true);
+		newkeys.key[1] = Conf.ReadInteger("cloak","key2",0,true);
+		newkeys.key[2] = Conf.ReadInteger("cloak","key3",0,true);
+		newkeys.key[3] = Conf.ReadInteger("cloak","key4",0,true);
+		newkeys.prefix = Conf.ReadValue("cloak","prefix",0);
 
-		if (prefix.empty())
-			prefix = ServerInstance->Config->Network;
+		if (newkeys.prefix.empty())
+			newkeys.prefix = ServerInstance->Config->Network;
 
-		if (!key1 || !key2 || !key3 || !key4)
+		if (!newkeys.key[0] || !newkeys.key[1] || !newkeys.key[2] || !newkeys.key[3])
 		{
 			std::string detail;
-			if (!key1)
+			if (!newkeys.key[0])
 				detail = "<cloak:key1> is not valid, it may be set to a too high/low value, or it may not exist.";
-			else if (!key2)
+			else if (!newkeys.key[1])
 				detail = "<cloak:key2> is not valid, it may be set to a too high/low value, or it may not exist.";
-			else if (!key3)
+			else if (!newkeys.key[2])
 				detail = "<cloak:key3> is not valid, it may be set to a too high/low value, or it may not exist.";
-			else if (!key4)
+			else if (!newkeys.key[3])
 				detail = "<cloak:key4> is not valid, it may be set to a too high/low value, or it may not exist.";
 
 			throw ModuleException("You have not defined cloak keys for m_cloaking!!! THIS IS INSECURE AND SHOULD BE CHECKED! - " + detail);
 		}
+
+		std::string size = Conf.ReadValue("cloak","cachesize",0);
+		cache.SetMax(size.empty() ? 8192 : atoi(size.c_str()));
+
+		if (newkeys == keys)
+			return false;
+
+		cache.Clear();
+		keys = newkeys;
+		return true;
 	}
 };
 
+class ModuleCloaking;
+
+/** Recloaks users in batches after the cloak keys change, so that a large
+ * server does not stall for the length of a rehash
+ */
+class RecloakTimer : public InspTimer
+{
+	ModuleCloaking* mod;
+ public:
+	RecloakTimer(InspIRCd* Instance, ModuleCloaking* m) : InspTimer(1, Instance->Time(), true), mod(m)
+	{
+	}
+
+	virtual void Tick(time_t TIME);
+};
 
 class ModuleCloaking : public Module
 {
@@ -278,11 +440,21 @@ class ModuleCloaking : public Module
  	CloakUser* cu;
 	Module* HashModule;
 
+	/** Running recloak job, or NULL */
+	RecloakTimer* recloak;
+	/** Local users still to be recloaked, with their fd at the time */
+	std::deque<std::pair<userrec*, int> > pending;
+	/** Key sets the pending users may still be cloaked with */
+	std::vector<CloakKeys> stale;
+	/** Number of users to recloak each second */
+	unsigned int batch;
+
  public:
 	ModuleCloaking(InspIRCd* Me)
-		: Module(Me)
+		: Module(Me), recloak(NULL), batch(500)
 	{
 		ServerInstance->UseInterface("HashRequest");
+		precloakslot = Extensible::RegisterExt("cloak_precomputed");
 
 		/* Attempt to locate the md5 service provider, bail if we can't find it */
 		HashModule = ServerInstance->FindModule("m_md5.so");
@@ -301,6 +473,8 @@ class ModuleCloaking : public Module
 	
 	virtual ~ModuleCloaking()
 	{
+		if (recloak)
+			ServerInstance->Timers->DelTimer(recloak);
 		ServerInstance->Modes->DelMode(cu);
 		DELETE(cu);
 		ServerInstance->DoneWithInterface("HashRequest");
@@ -315,13 +489,103 @@ class ModuleCloaking : public Module
 
 	virtual void OnRehash(userrec* user, const std::string &parameter)
 	{
-		cu->DoRehash();
+		CloakKeys old = cu->GetKeys();
+		bool first = old.prefix.empty();
+
+		if (cu->DoRehash() && !first)
+			StartRecloak(old);
+
+		ConfigReader Conf(ServerInstance);
+		std::string b = Conf.ReadValue("cloak","recloakbatch",0);
+		batch = b.empty() ? 500 : atoi(b.c_str());
+		if (!batch)
+			batch = 500;
+	}
+
+	/** Queue every local +x user for recloaking under the new keys
+	 * @param old The keys their current cloaks were generated with
+	 */
+	void StartRecloak(const CloakKeys &old)
+	{
+		stale.push_back(old);
+		pending.clear();
+		for (std::vector<userrec*>::iterator i = ServerInstance->local_users.begin(); i != ServerInstance->local_users.end(); i++)
+			if ((*i)->IsModeSet('x'))
+				pending.push_back(std::make_pair(*i, (*i)->GetFd()));
+
+		if (!recloak)
+		{
+			recloak = new RecloakTimer(ServerInstance, this);
+			ServerInstance->Timers->AddTimer(recloak);
+		}
+	}
+
+	/** Recloak the next batch of users
+	 * @return False when there is nothing left to do
+	 */
+	bool RecloakBatch()
+	{
+		for (unsigned int n = 0; (n < batch) && (!pending.empty()); n++)
+		{
+			userrec* u = pending.front().first;
+			int fd = pending.front().second;
+			pending.pop_front();
+
+			/* Check the user still exists, and still has a cloak we gave them */
+			if ((u != ServerInstance->SE->GetRef(fd)) || (!u->IsModeSet('x')))
+				continue;
+
+			for (std::vector<CloakKeys>::iterator k = stale.begin(); k != stale.end(); k++)
+			{
+				if (cu->GenerateCloak(*k, u) == u->dhost)
+				{
+					std::string b = cu->GetCloak(u);
+					if (!b.empty())
+						u->ChangeDisplayedHost(b.c_str());
+					break;
+				}
+			}
+		}
+
+		if (!pending.empty())
+			return true;
+
+		stale.clear();
+		recloak = NULL;
+		return false;
+	}
+
+	virtual bool OnCheckReady(userrec* user)
+	{
+		/* Work the cloak out once the hostname lookup is over, so setting +x
+		 * when they connect is cheap. Other modules may hold the user here
+		 * for a while, so only do it the first time.
+		 */
+		if ((IS_LOCAL(user)) && (user->dns_done) && (user->registered == REG_NICKUSER) && (user->Extend(precloakslot)))
+			cu->GetCloak(user);
+		return true;
+	}
+
+	virtual int OnStats(char symbol, userrec* user, string_list &results)
+	{
+		if (symbol != 'x')
+			return 0;
+
+		results.push_back(std::string(ServerInstance->Config->ServerName) + " 304 " + user->nick + " :CLOAKSTATS cache " + ConvToStr(cu->cache.Size()) +
+				" entries, " + ConvToStr(cu->cache.hits) + " hits, " + ConvToStr(cu->cache.misses) + " misses, " + ConvToStr(pending.size()) + " waiting to be recloaked");
+		return 0;
 	}
 
 	void Implements(char* List)
 	{
-		List[I_OnRehash] = 1;
+		List[I_OnRehash] = List[I_OnCheckReady] = List[I_OnStats] = 1;
 	}
 };
 
+void RecloakTimer::Tick(time_t TIME)
+{
+	if (!mod->RecloakBatch())
+		this->CancelRepeat();
+}
+
 MODULE_INIT(ModuleCloaking)
@@ -30,13 +30,12 @@ class cmd_clones : public command_t
 		syntax = "<limit>";
 	}
 
-	std::string FindMatchingIP(const irc::string &ipaddr)
+	userrec* FindMatchingIP(const irc::sockets::ipaddr_key &ipaddr)
 	{
-		std::string n = assign(ipaddr);
 		for (user_hash::const_iterator a = ServerInstance->clientlist->begin(); a != ServerInstance->clientlist->end(); a++)
-			if (a->second->GetIPString() == n)
-				return a->second->GetFullRealHost();
-		return "<?>";
+			if (a->second->ipkey == ipaddr)
+				return a->second;
+		return NULL;
 	}
 
 	CmdResult Handle (const char** parameters, int pcnt, userrec *user)
@@ -55,11 +54,20 @@ class cmd_clones : public command_t
 
 		user->WriteServ(clonesstr + " START");
 
-		/* hostname or other */
+		/* The IP is shown as the users have it, so a v4-mapped IPv6 address
+		 * is shown in the same form as in WHOIS, not as plain IPv4
+		 */
+		char ipbuf[48];
 		for (clonemap::iterator x = ServerInstance->global_clones.begin(); x != ServerInstance->global_clones.end(); x++)
 		{
 			if (x->second >= limit)
-				user->WriteServ(clonesstr + " "+ ConvToStr(x->second) + " " + assign(x->first) + " " + FindMatchingIP(x->first));
+			{
+				userrec* u = FindMatchingIP(x->first);
+				if (u)
+					user->WriteServ(clonesstr + " "+ ConvToStr(x->second) + " " + u->GetIPString() + " " + u->GetFullRealHost());
+				else
+					user->WriteServ(clonesstr + " "+ ConvToStr(x->second) + " " + irc::sockets::IPKeyToString(x->first, ipbuf) + " <?>");
+			}
 		}
 
 		user->WriteServ(clonesstr + " END");
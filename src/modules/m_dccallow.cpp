@@ -44,6 +44,9 @@ typedef std::vector<userrec *> userlist;
 userlist ul;
 typedef std::vector<DCCAllow> dccallowlist;
 dccallowlist* dl;
+/** Each user's DCCALLOW list, deleted along with the user
+ */
+static ExtensionItem<dccallowlist>* dccallow;
 typedef std::vector<BannedFileList> bannedfilelist;
 bannedfilelist bfl;
 
@@ -94,7 +97,7 @@ class cmd_dccallow : public command_t
 				
 				if (action == '-')
 				{
-					user->GetExt("dccallow_list", dl);
+					dl = dccallow->Get(user);
 					// check if it contains any entries
 					if (dl)
 					{
@@ -114,8 +117,7 @@ class cmd_dccallow : public command_t
 					}
 					else
 					{
-						DELETE(dl);
-						user->Shrink("dccallow_list");
+						dccallow->Unset(user);
 				
 						// remove from userlist
 						for (userlist::iterator j = ul.begin(); j != ul.end(); ++j)
@@ -132,12 +134,12 @@ class cmd_dccallow : public command_t
 				else if (action == '+')
 				{
 					// fetch current DCCALLOW list
-					user->GetExt("dccallow_list", dl);
+					dl = dccallow->Get(user);
 					// they don't have one, create it
 					if (!dl)
 					{
 						dl = new dccallowlist;
-						user->Extend("dccallow_list", dl);
+						dccallow->Set(user, dl);
 						// add this user to the userlist
 						ul.push_back(user);
 					}
@@ -230,7 +232,7 @@ class cmd_dccallow : public command_t
 	{
 		 // display current DCCALLOW list
 		user->WriteServ("990 %s :Users on your DCCALLOW list:", user->nick);
-		user->GetExt("dccallow_list", dl);
+		dl = dccallow->Get(user);
 		
 		if (dl)
 		{
@@ -253,6 +255,7 @@ class ModuleDCCAllow : public Module
 	ModuleDCCAllow(InspIRCd* Me)
 		: Module(Me)
 	{
+		dccallow = new ExtensionItem<dccallowlist>("dccallow_list");
 		Conf = new ConfigReader(ServerInstance);
 		mycommand = new cmd_dccallow(ServerInstance);
 		ServerInstance->AddCommand(mycommand);
@@ -275,11 +278,10 @@ class ModuleDCCAllow : public Module
 		dccallowlist* dl;
 	
 		// remove their DCCALLOW list if they have one
-		user->GetExt("dccallow_list", dl);
+		dl = dccallow->Get(user);
 		if (dl)
 		{
-			DELETE(dl);
-			user->Shrink("dccallow_list");
+			dccallow->Unset(user);
 			RemoveFromUserlist(user);
 		}
 		
@@ -322,7 +324,7 @@ class ModuleDCCAllow : public Module
 					
 				if (strncmp(text.c_str(), "\1DCC ", 5) == 0)
 				{
-					u->GetExt("dccallow_list", dl);
+					dl = dccallow->Get(u);
 		
 					if (dl && dl->size())
 					{
@@ -387,7 +389,7 @@ class ModuleDCCAllow : public Module
 		for (userlist::iterator iter = ul.begin(); iter != ul.end(); ++iter)
 		{
 			userrec* u = (userrec*)(*iter);
-			u->GetExt("dccallow_list", dl);
+			dl = dccallow->Get(u);
 	
 			if (dl)
 			{
@@ -421,7 +423,7 @@ class ModuleDCCAllow : public Module
 		for (userlist::iterator iter = ul.begin(); iter != ul.end(); ++iter)
 		{
 			userrec *u = (userrec*)(*iter);
-			u->GetExt("dccallow_list", dl);
+			dl = dccallow->Get(u);
 	
 			if (dl)
 			{
@@ -478,6 +480,7 @@ class ModuleDCCAllow : public Module
 
 	virtual ~ModuleDCCAllow()
 	{
+		delete dccallow;
 	}
 
 	virtual Version GetVersion()
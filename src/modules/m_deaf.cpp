@@ -77,30 +77,18 @@ class ModuleDeaf : public Module
 
 	virtual void OnBuildExemptList(MessageType message_type, chanrec* chan, userrec* sender, char status, CUList &exempt_list)
 	{
-		CUList *ulist;
-		switch (status)
-		{
-			case '@':
-				ulist = chan->GetOppedUsers();
-				break;
-			case '%':
-				ulist = chan->GetHalfoppedUsers();
-				break;
-			case '+':
-				ulist = chan->GetVoicedUsers();
-				break;
-			default:
-				ulist = chan->GetUsers();
-				break;
-		}
+		MemberList *ulist = chan->GetUsers();
+		char mask = chanrec::StatusToMask(status);
 
-		for (CUList::iterator i = ulist->begin(); i != ulist->end(); i++)
+		for (MemberList::iterator i = ulist->begin(); i != ulist->end(); i++)
 		{
-			if (IS_LOCAL(i->first))
+			if ((mask) && (!((*i)->status & mask)))
+				continue;
+			if (IS_LOCAL((*i)->user))
 			{
-				if (i->first->IsModeSet('d'))
+				if ((*i)->user->IsModeSet('d'))
 				{
-					exempt_list[i->first] = i->first->nick;
+					exempt_list[(*i)->user] = (*i)->user->nick;
 				}
 			}
 		}
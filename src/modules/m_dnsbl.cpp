@@ -27,6 +27,34 @@
 
 /* $ModDesc: Provides handling of DNS blacklists */
 
+/** A cached answer from a DNSBL, for one address or, with cacheprefix, one range
+ */
+class DNSBLVerdict
+{
+ public:
+	/** Last octet of the returned A record, or 0 if the address is not listed */
+	unsigned int result;
+	/** When this answer expires */
+	time_t expires;
+};
+
+/** An in-flight lookup, and the users waiting on its answer
+ */
+class DNSBLPending
+{
+ public:
+	/** Users waiting on the answer, with the fd they had when they joined */
+	std::vector<std::pair<userrec*, int> > waiters;
+	/** When the query was sent */
+	timeval started;
+};
+
+/** Verdicts keyed by masked IPv4 address, in host byte order */
+typedef nspace::hash_map<unsigned int, DNSBLVerdict> DNSBLCache;
+
+/** In-flight lookups keyed by masked IPv4 address, in host byte order */
+typedef nspace::hash_map<unsigned int, DNSBLPending> DNSBLPendingMap;
+
 /* Class holding data for a single entry */
 class DNSBLConfEntry
 {
@@ -36,120 +64,35 @@ class DNSBLConfEntry
 		EnumBanaction banaction;
 		long duration;
 		int bitmask;
+		unsigned int cachemask;
+		long negativettl;
 		unsigned long stats_hits, stats_misses;
-		DNSBLConfEntry(): duration(86400),bitmask(0),stats_hits(0), stats_misses(0) {}
+		unsigned long stats_cached, stats_coalesced, stats_lookups, stats_answered, stats_latency;
+		DNSBLCache cache;
+		DNSBLPendingMap pending;
+		DNSBLConfEntry(): duration(86400),bitmask(0),cachemask(0xFFFFFFFF),negativettl(300),stats_hits(0), stats_misses(0),
+			stats_cached(0), stats_coalesced(0), stats_lookups(0), stats_answered(0), stats_latency(0) {}
 		~DNSBLConfEntry() { }
 };
 
+class ModuleDNSBL;
 
-/** Resolver for CGI:IRC hostnames encoded in ident/GECOS
+/** Resolver for DNSBL lookups. The answer is handed back to the module,
+ * which caches it and applies it to every user waiting on it.
  */
 class DNSBLResolver : public Resolver
 {
-	int theirfd;
-	userrec* them;
+	ModuleDNSBL* mod;
 	DNSBLConfEntry *ConfEntry;
+	unsigned int key;
 
  public:
 
-	DNSBLResolver(Module *me, InspIRCd *ServerInstance, const std::string &hostname, userrec* u, int userfd, DNSBLConfEntry *conf, bool &cached)
-		: Resolver(ServerInstance, hostname, DNS_QUERY_A, cached, me)
-	{
-		theirfd = userfd;
-		them = u;
-		ConfEntry = conf;
-	}
-
-	virtual void OnLookupComplete(const std::string &result, unsigned int ttl, bool cached)
-	{
-		/* Check the user still exists */
-		if ((them) && (them == ServerInstance->SE->GetRef(theirfd)))
-		{
-			// Now we calculate the bitmask: 256*(256*(256*a+b)+c)+d
-			if(result.length())
-			{
-				unsigned int bitmask = 0;
-				bool show = false;
-				in_addr resultip;
-
-				/* Convert the result to an in_addr (we can gaurantee we got ipv4)
-				 * Whoever did the loop that was here before, I AM CONFISCATING
-				 * YOUR CRACKPIPE. you know who you are. -- Brain
-				 */
-				inet_aton(result.c_str(), &resultip);
-				bitmask = resultip.s_addr >> 24; /* Last octet (network byte order */
-
-				bitmask &= ConfEntry->bitmask;
+	DNSBLResolver(ModuleDNSBL *me, InspIRCd *ServerInstance, const std::string &hostname, DNSBLConfEntry *conf, unsigned int k, bool &cached);
 
-				if (bitmask != 0)
-				{
-					std::string reason = ConfEntry->reason;
-					std::string::size_type x = reason.find("%ip%");
-					while (x != std::string::npos)
-					{
-						reason.erase(x, 4);
-						reason.insert(x, them->GetIPString());
-						x = reason.find("%ip%");
-					}
-
-					ConfEntry->stats_hits++;
-
-					switch (ConfEntry->banaction)
-					{
-						case DNSBLConfEntry::I_KILL:
-						{
-							userrec::QuitUser(ServerInstance, them, std::string("Killed (") + reason + ")");
-							break;
-						}
-						case DNSBLConfEntry::I_KLINE:
-						{
-							std::string ban = std::string("*@") + them->GetIPString();
-							if (show)
-								ServerInstance->XLines->apply_lines(APPLY_KLINES);								
-							show = ServerInstance->XLines->add_kline(ConfEntry->duration, ServerInstance->Config->ServerName, reason.c_str(), ban.c_str());
-							FOREACH_MOD(I_OnAddKLine,OnAddKLine(ConfEntry->duration, NULL, reason, ban));
-							break;
-						}
-						case DNSBLConfEntry::I_GLINE:
-						{
-							std::string ban = std::string("*@") + them->GetIPString();
-							show = ServerInstance->XLines->add_gline(ConfEntry->duration, ServerInstance->Config->ServerName, reason.c_str(), ban.c_str());
-							if (show)
-								ServerInstance->XLines->apply_lines(APPLY_GLINES);
-							FOREACH_MOD(I_OnAddGLine,OnAddGLine(ConfEntry->duration, NULL, reason, ban));
-							break;
-						}
-						case DNSBLConfEntry::I_ZLINE:
-						{
-							show = ServerInstance->XLines->add_zline(ConfEntry->duration, ServerInstance->Config->ServerName, reason.c_str(), them->GetIPString());
-							if (show)
-								ServerInstance->XLines->apply_lines(APPLY_ZLINES);
-							FOREACH_MOD(I_OnAddZLine,OnAddZLine(ConfEntry->duration, NULL, reason, them->GetIPString()));
-							break;
-						}
-						case DNSBLConfEntry::I_UNKNOWN:
-						{
-							break;
-						}
-						break;
-					}
-
-					if (show)
-					{
-						ServerInstance->WriteOpers("*** Connecting user %s detected as being on a DNS blacklist (%s) with result %d", them->GetFullRealHost(), ConfEntry->name.c_str(), bitmask);
-					}
-				}
-				else
-					ConfEntry->stats_misses++;
-			}
-			else
-				ConfEntry->stats_misses++;
-		}
-	}
+	virtual void OnLookupComplete(const std::string &result, unsigned int ttl, bool cached);
 
-	virtual void OnError(ResolverError e, const std::string &errormessage)
-	{
-	}
+	virtual void OnError(ResolverError e, const std::string &errormessage);
 
 	virtual ~DNSBLResolver()
 	{
@@ -161,6 +104,14 @@ class ModuleDNSBL : public Module
  private:
 	std::vector<DNSBLConfEntry *> DNSBLConfEntries;
 
+	/** Entries removed by a rehash which still have lookups in flight.
+	 * They are deleted when their last lookup completes.
+	 */
+	std::vector<DNSBLConfEntry *> RetiredEntries;
+
+	/** Last time expired verdicts were pruned */
+	time_t lastprune;
+
 	/*
 	 *	Convert a string to EnumBanaction
 	 */
@@ -177,8 +128,91 @@ class ModuleDNSBL : public Module
 
 		return DNSBLConfEntry::I_UNKNOWN;
 	}
+
+	/** Apply a DNSBL answer to one user
+	 */
+	void Apply(DNSBLConfEntry* ConfEntry, userrec* them, unsigned int result)
+	{
+		unsigned int bitmask = result & ConfEntry->bitmask;
+		bool show = false;
+
+		if (bitmask == 0)
+		{
+			ConfEntry->stats_misses++;
+			return;
+		}
+
+		std::string reason = ConfEntry->reason;
+		std::string::size_type x = reason.find("%ip%");
+		while (x != std::string::npos)
+		{
+			reason.erase(x, 4);
+			reason.insert(x, them->GetIPString());
+			x = reason.find("%ip%");
+		}
+
+		ConfEntry->stats_hits++;
+
+		switch (ConfEntry->banaction)
+		{
+			case DNSBLConfEntry::I_KILL:
+			{
+				userrec::QuitUser(ServerInstance, them, std::string("Killed (") + reason + ")");
+				break;
+			}
+			case DNSBLConfEntry::I_KLINE:
+			{
+				std::string ban = std::string("*@") + them->GetIPString();
+				if (show)
+					ServerInstance->XLines->apply_lines(APPLY_KLINES);								
+				show = ServerInstance->XLines->add_kline(ConfEntry->duration, ServerInstance->Config->ServerName, reason.c_str(), ban.c_str());
+				FOREACH_MOD(I_OnAddKLine,OnAddKLine(ConfEntry->duration, NULL, reason, ban));
+				break;
+			}
+			case DNSBLConfEntry::I_GLINE:
+			{
+				std::string ban = std::string("*@") + them->GetIPString();
+				show = ServerInstance->XLines->add_gline(ConfEntry->duration, ServerInstance->Config->ServerName, reason.c_str(), ban.c_str());
+				if (show)
+					ServerInstance->XLines->apply_lines(APPLY_GLINES);
+				FOREACH_MOD(I_OnAddGLine,OnAddGLine(ConfEntry->duration, NULL, reason, ban));
+				break;
+			}
+			case DNSBLConfEntry::I_ZLINE:
+			{
+				show = ServerInstance->XLines->add_zline(ConfEntry->duration, ServerInstance->Config->ServerName, reason.c_str(), them->GetIPString());
+				if (show)
+					ServerInstance->XLines->apply_lines(APPLY_ZLINES);
+				FOREACH_MOD(I_OnAddZLine,OnAddZLine(ConfEntry->duration, NULL, reason, them->GetIPString()));
+				break;
+			}
+			case DNSBLConfEntry::I_UNKNOWN:
+			{
+				break;
+			}
+			break;
+		}
+
+		if (show)
+		{
+			ServerInstance->WriteOpers("*** Connecting user %s detected as being on a DNS blacklist (%s) with result %d", them->GetFullRealHost(), ConfEntry->name.c_str(), bitmask);
+		}
+	}
+
+	/** Drop verdicts which have passed their TTL
+	 */
+	void PruneCache(DNSBLConfEntry* e, time_t now)
+	{
+		for (DNSBLCache::iterator i = e->cache.begin(); i != e->cache.end(); )
+		{
+			DNSBLCache::iterator n = i++;
+			if (n->second.expires <= now)
+				e->cache.erase(n);
+		}
+	}
+
  public:
-	ModuleDNSBL(InspIRCd *Me) : Module(Me)
+	ModuleDNSBL(InspIRCd *Me) : Module(Me), lastprune(0)
 	{
 		ReadConf();
 	}
@@ -186,6 +220,8 @@ class ModuleDNSBL : public Module
 	virtual ~ModuleDNSBL()
 	{
 		ClearEntries();
+		for (std::vector<DNSBLConfEntry *>::iterator i = RetiredEntries.begin(); i != RetiredEntries.end(); i++)
+			delete *i;
 	}
 
 	virtual Version GetVersion()
@@ -195,16 +231,21 @@ class ModuleDNSBL : public Module
 
 	void Implements(char* List)
 	{
-		List[I_OnRehash] = List[I_OnUserRegister] = List[I_OnStats] = 1;
+		List[I_OnRehash] = List[I_OnUserRegister] = List[I_OnStats] = List[I_OnBackgroundTimer] = 1;
 	}
 
-	/** Clear entries and free the mem it was using
+	/** Clear entries and free the mem it was using.
+	 * Entries with lookups still in flight are kept until those complete.
 	 */
 	void ClearEntries()
 	{
-		std::vector<DNSBLConfEntry *>::iterator i;
 		for (std::vector<DNSBLConfEntry *>::iterator i = DNSBLConfEntries.begin(); i != DNSBLConfEntries.end(); i++)
-			delete *i;
+		{
+			if ((*i)->pending.empty())
+				delete *i;
+			else
+				RetiredEntries.push_back(*i);
+		}
 		DNSBLConfEntries.clear();
 	}
 
@@ -226,6 +267,14 @@ class ModuleDNSBL : public Module
 			e->duration = ServerInstance->Duration(MyConf->ReadValue("dnsbl", "duration", i));
 			e->bitmask = MyConf->ReadInteger("dnsbl", "bitmask", i, false);
 
+			int prefix = MyConf->ReadInteger("dnsbl", "cacheprefix", i, false);
+			if ((prefix > 0) && (prefix < 32))
+				e->cachemask = 0xFFFFFFFF << (32 - prefix);
+
+			std::string negttl = MyConf->ReadValue("dnsbl", "negativettl", i);
+			if (!negttl.empty())
+				e->negativettl = ServerInstance->Duration(negttl);
+
 			/* yeah, logic here is a little messy */
 			if (e->bitmask <= 0)
 			{
@@ -268,6 +317,65 @@ class ModuleDNSBL : public Module
 		ReadConf();
 	}
 
+	/** Called by DNSBLResolver when a lookup completes or fails.
+	 * The answer, if there is one, is cached and applied to every
+	 * user who was waiting on it.
+	 * @param ConfEntry The blacklist which was queried
+	 * @param key The cache key of the query
+	 * @param answered True if we got an answer (including NXDOMAIN)
+	 * @param result The last octet of the answer, or 0 if not listed
+	 * @param ttl How long the answer may be cached for
+	 */
+	void LookupComplete(DNSBLConfEntry* ConfEntry, unsigned int key, bool answered, unsigned int result, long ttl)
+	{
+		DNSBLPendingMap::iterator p = ConfEntry->pending.find(key);
+		if (p == ConfEntry->pending.end())
+			return;
+
+		if (answered)
+		{
+			timeval now;
+			gettimeofday(&now, NULL);
+			ConfEntry->stats_answered++;
+			ConfEntry->stats_latency += (now.tv_sec - p->second.started.tv_sec) * 1000 + (now.tv_usec - p->second.started.tv_usec) / 1000;
+
+			if (ttl > 0)
+			{
+				DNSBLVerdict& v = ConfEntry->cache[key];
+				v.result = result;
+				v.expires = ServerInstance->Time() + ttl;
+			}
+		}
+
+		/* Take the waiters out first; applying a ban may quit other users */
+		std::vector<std::pair<userrec*, int> > waiters;
+		waiters.swap(p->second.waiters);
+		ConfEntry->pending.erase(p);
+
+		if (answered)
+		{
+			for (std::vector<std::pair<userrec*, int> >::iterator i = waiters.begin(); i != waiters.end(); i++)
+			{
+				/* Check the user still exists */
+				if (i->first == ServerInstance->SE->GetRef(i->second))
+					Apply(ConfEntry, i->first, result);
+			}
+		}
+
+		if (ConfEntry->pending.empty())
+		{
+			for (std::vector<DNSBLConfEntry *>::iterator i = RetiredEntries.begin(); i != RetiredEntries.end(); i++)
+			{
+				if (*i == ConfEntry)
+				{
+					RetiredEntries.erase(i);
+					delete ConfEntry;
+					break;
+				}
+			}
+		}
+	}
+
 	virtual int OnUserRegister(userrec* user)
 	{
 		/* only do lookups on local users */
@@ -310,22 +418,72 @@ class ModuleDNSBL : public Module
 			snprintf(reversedipbuf, 128, "%d.%d.%d.%d", d, c, b, a);
 			reversedip = std::string(reversedipbuf);
 
+			unsigned int address = ntohl(in.s_addr);
+
 			// For each DNSBL, we will run through this lookup
 			for (std::vector<DNSBLConfEntry *>::iterator i = DNSBLConfEntries.begin(); i != DNSBLConfEntries.end(); i++)
 			{
+				DNSBLConfEntry* e = *i;
+				unsigned int key = address & e->cachemask;
+
+				/* A recent answer for this address (or range) needs no query at all */
+				DNSBLCache::iterator v = e->cache.find(key);
+				if (v != e->cache.end())
+				{
+					if (v->second.expires > ServerInstance->Time())
+					{
+						e->stats_cached++;
+						Apply(e, user, v->second.result);
+						continue;
+					}
+					e->cache.erase(v);
+				}
+
+				/* Someone else from here is already being looked up, wait for their answer */
+				DNSBLPendingMap::iterator p = e->pending.find(key);
+				if (p != e->pending.end())
+				{
+					e->stats_coalesced++;
+					p->second.waiters.push_back(std::make_pair(user, user->GetFd()));
+					continue;
+				}
+
+				DNSBLPending& pend = e->pending[key];
+				pend.waiters.push_back(std::make_pair(user, user->GetFd()));
+				gettimeofday(&pend.started, NULL);
+				e->stats_lookups++;
+
 				// Fill hostname with a dnsbl style host (d.c.b.a.domain.tld)
-				std::string hostname = reversedip + "." + (*i)->domain;
+				std::string hostname = reversedip + "." + e->domain;
 
 				/* now we'd need to fire off lookups for `hostname'. */
-				bool cached;
-				DNSBLResolver *r = new DNSBLResolver(this, ServerInstance, hostname, user, user->GetFd(), *i, cached);
-				ServerInstance->AddResolver(r, cached);
+				try
+				{
+					bool cached;
+					DNSBLResolver *r = new DNSBLResolver(this, ServerInstance, hostname, e, key, cached);
+					ServerInstance->AddResolver(r, cached);
+				}
+				catch (ModuleException& ex)
+				{
+					LookupComplete(e, key, false, 0, 0);
+				}
 			}
 		}
 
 		/* don't do anything with this hot potato */
 		return 0;
 	}
+
+	virtual void OnBackgroundTimer(time_t curtime)
+	{
+		if (curtime - lastprune < 60)
+			return;
+
+		for (std::vector<DNSBLConfEntry*>::iterator i = DNSBLConfEntries.begin(); i != DNSBLConfEntries.end(); i++)
+			PruneCache(*i, curtime);
+
+		lastprune = curtime;
+	}
 	
 	virtual int OnStats(char symbol, userrec* user, string_list &results)
 	{
@@ -336,11 +494,18 @@ class ModuleDNSBL : public Module
 
 		for (std::vector<DNSBLConfEntry*>::iterator i = DNSBLConfEntries.begin(); i != DNSBLConfEntries.end(); i++)
 		{
-			total_hits += (*i)->stats_hits;
-			total_misses += (*i)->stats_misses;
+			DNSBLConfEntry* e = *i;
+			unsigned long checks = e->stats_cached + e->stats_coalesced + e->stats_lookups;
+
+			total_hits += e->stats_hits;
+			total_misses += e->stats_misses;
 			
-			results.push_back(std::string(ServerInstance->Config->ServerName) + " 304 " + user->nick + " :DNSBLSTATS DNSbl \"" + (*i)->name + "\" had " +
-					ConvToStr((*i)->stats_hits) + " hits and " + ConvToStr((*i)->stats_misses) + " misses");
+			results.push_back(std::string(ServerInstance->Config->ServerName) + " 304 " + user->nick + " :DNSBLSTATS DNSbl \"" + e->name + "\" had " +
+					ConvToStr(e->stats_hits) + " hits and " + ConvToStr(e->stats_misses) + " misses");
+			results.push_back(std::string(ServerInstance->Config->ServerName) + " 304 " + user->nick + " :DNSBLSTATS DNSbl \"" + e->name + "\" cache " +
+					ConvToStr(e->stats_cached) + " coalesced " + ConvToStr(e->stats_coalesced) + " lookups " + ConvToStr(e->stats_lookups) +
+					" (" + ConvToStr(checks ? (e->stats_cached + e->stats_coalesced) * 100 / checks : 0) + "% saved), " +
+					ConvToStr(e->cache.size()) + " cached, avg latency " + ConvToStr(e->stats_answered ? e->stats_latency / e->stats_answered : 0) + "ms");
 		}
 		
 		results.push_back(std::string(ServerInstance->Config->ServerName) + " 304 " + user->nick + " :DNSBLSTATS Total hits: " + ConvToStr(total_hits));
@@ -350,4 +515,41 @@ class ModuleDNSBL : public Module
 	}
 };
 
+DNSBLResolver::DNSBLResolver(ModuleDNSBL *me, InspIRCd *ServerInstance, const std::string &hostname, DNSBLConfEntry *conf, unsigned int k, bool &cached)
+	: Resolver(ServerInstance, hostname, DNS_QUERY_A, cached, me), mod(me), ConfEntry(conf), key(k)
+{
+}
+
+void DNSBLResolver::OnLookupComplete(const std::string &result, unsigned int ttl, bool cached)
+{
+	unsigned int bitmask = 0;
+
+	if (result.length())
+	{
+		in_addr resultip;
+
+		/* Convert the result to an in_addr (we can gaurantee we got ipv4)
+		 * Whoever did the loop that was here before, I AM CONFISCATING
+		 * YOUR CRACKPIPE. you know who you are. -- Brain
+		 */
+		inet_aton(result.c_str(), &resultip);
+		bitmask = resultip.s_addr >> 24; /* Last octet (network byte order */
+	}
+
+	mod->LookupComplete(ConfEntry, key, true, bitmask, ttl);
+}
+
+void DNSBLResolver::OnError(ResolverError e, const std::string &errormessage)
+{
+	/* The module is going away, and its entries with it */
+	if (e == RESLOVER_FORCEUNLOAD)
+		return;
+
+	/* Not being listed is an answer too, and worth caching */
+	if (e == RESOLVER_NXDOMAIN)
+		mod->LookupComplete(ConfEntry, key, true, 0, ConfEntry->negativettl);
+	else
+		mod->LookupComplete(ConfEntry, key, false, 0, 0);
+}
+
 MODULE_INIT(ModuleDNSBL)
@@ -27,9 +27,15 @@ class ModuleFilter : public FilterBase
  
  filter_t filters;
 
+ /* Filters in prefilter id order, valid while !dirty */
+ std::vector<FilterResult*> compiled;
+ FilterPrefilter prefilter;
+ std::vector<unsigned int> candidates;
+ bool dirty;
+
  public:
 	ModuleFilter(InspIRCd* Me)
-	: FilterBase(Me, "m_filter.so")
+	: FilterBase(Me, "m_filter.so"), dirty(true)
 	{
 		OnRehash(NULL,"");
 	}
@@ -38,26 +44,41 @@ class ModuleFilter : public FilterBase
 	{
 	}
 
+	void Compile()
+	{
+		compiled.clear();
+		prefilter.Clear();
+		for (filter_t::iterator n = filters.begin(); n != filters.end(); n++)
+		{
+			compiled.push_back(n->second);
+			prefilter.Add(FilterPrefilter::GlobFragment(n->first));
+		}
+		prefilter.Compile();
+		dirty = false;
+	}
+
 	virtual FilterResult* FilterMatch(userrec* user, const std::string &text, int flags)
 	{
-		for (filter_t::iterator index = filters.begin(); index != filters.end(); index++)
+		if (dirty)
+			this->Compile();
+
+		prefilter.GetCandidates(text, candidates);
+
+		for (std::vector<unsigned int>::iterator i = candidates.begin(); i != candidates.end(); i++)
 		{
+			FilterResult* fr = compiled[*i];
 
 			/* Skip ones that dont apply to us */
-			if (!FilterBase::AppliesToMe(user, index->second, flags))
+			if (!FilterBase::AppliesToMe(user, fr, flags))
 				continue;
 
-			if (ServerInstance->MatchText(text,index->first))
-			{
-				FilterResult* fr = index->second;
-				if (index != filters.begin())
-				{
-					std::string pat = index->first;
-					filters.erase(index);
-					filters.insert(filters.begin(), std::make_pair(pat,fr));
-				}
+			timeval start;
+			gettimeofday(&start, NULL);
+			bool matched = ServerInstance->MatchText(text, fr->freeform);
+			fr->Account(start, matched);
+
+			if (matched)
 				return fr;
-			}
 		}
 		return NULL;
 	}
@@ -68,6 +89,7 @@ class ModuleFilter : public FilterBase
 		{
 			delete (filters.find(freeform))->second;
 			filters.erase(filters.find(freeform));
+			dirty = true;
 			return true;
 		}
 		return false;
@@ -82,6 +104,7 @@ class ModuleFilter : public FilterBase
 
 		FilterResult* x = new FilterResult(freeform, reason, type, duration, flags);
 		filters[freeform] = x;
+		dirty = true;
 
 		return std::make_pair(true, "");
 	}
@@ -115,6 +138,7 @@ class ModuleFilter : public FilterBase
 			filters[pattern] = x;
 		}
 		DELETE(MyConf);
+		dirty = true;
 	}
 
 	virtual int OnStats(char symbol, userrec* user, string_list &results)
@@ -125,6 +149,7 @@ class ModuleFilter : public FilterBase
 			for (filter_t::iterator n = filters.begin(); n != filters.end(); n++)
 			{
 				results.push_back(sn+" 223 "+user->nick+" :GLOB:"+n->second->freeform+" "+n->second->flags+" "+n->second->action+" "+ConvToStr(n->second->gline_time)+" :"+n->second->reason);
+				this->StatsCounters(user, n->second, results);
 			}
 		}
 		return 0;
@@ -36,8 +36,19 @@ class FilterResult : public classbase
 	bool flag_privmsg;
 	bool flag_notice;
 
+	/** Number of times this filter has matched a line
+	 */
+	unsigned long hits;
+	/** Number of times this filter has been fully evaluated against a line
+	 * (that is, the prefilter could not rule it out)
+	 */
+	unsigned long evaluations;
+	/** Total time spent fully evaluating this filter, in microseconds
+	 */
+	unsigned long usecs;
+
 	FilterResult(const std::string free, const std::string &rea, const std::string &act, long gt, const std::string &fla) : freeform(free), reason(rea),
-									action(act), gline_time(gt), flags(fla)
+									action(act), gline_time(gt), flags(fla), hits(0), evaluations(0), usecs(0)
 	{
 		this->FillFlags(flags);
 	}
@@ -79,8 +90,20 @@ class FilterResult : public classbase
 		return 0;
 	}
 
-	FilterResult()
+	FilterResult() : hits(0), evaluations(0), usecs(0)
+	{
+	}
+
+	/** Record one full evaluation of this filter which started at 'start'
+	 */
+	void Account(const timeval &start, bool matched)
 	{
+		timeval now;
+		gettimeofday(&now, NULL);
+		evaluations++;
+		usecs += (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_usec - start.tv_usec);
+		if (matched)
+			hits++;
 	}
 
 	virtual ~FilterResult()
@@ -88,6 +111,423 @@ class FilterResult : public classbase
 	}
 };
 
+/** FilterPrefilter is an Aho-Corasick automaton built over one literal
+ * fragment taken from each filter. Any line which a filter can match must
+ * contain that filter's fragment, so one pass over the line yields the
+ * (usually very short) list of filters which need to be fully evaluated,
+ * rather than running every glob or regexp against every line.
+ *
+ * Fragments and text are both folded through lowermap, which keeps the
+ * prefilter a necessary condition for case sensitive regexps as well as
+ * for case insensitive globs. A filter which yields no usable fragment
+ * (e.g. "*" or a regexp with top level alternation) is always a candidate.
+ */
+class FilterPrefilter : public classbase
+{
+	/** Literal fragment for each filter id, already folded
+	 */
+	std::vector<std::string> literals;
+	/** Maps a raw input byte to its (folded) alphabet class. Class 0 is
+	 * every byte which appears in no fragment.
+	 */
+	unsigned char charclass[256];
+	/** Size of the compressed alphabet
+	 */
+	unsigned int classes;
+	/** Transition table, states * classes entries
+	 */
+	std::vector<int> delta;
+	/** First filter id whose fragment ends at each state, or -1
+	 */
+	std::vector<int> outhead;
+	/** Next filter id sharing the same fragment, indexed by filter id
+	 */
+	std::vector<int> outnext;
+	/** Nearest state on the failure chain which has output, or -1
+	 */
+	std::vector<int> outlink;
+	/** Filter ids with no fragment, in ascending order
+	 */
+	std::vector<unsigned int> always;
+	/** Per filter generation marks used to deduplicate candidates
+	 */
+	std::vector<unsigned int> seen;
+	unsigned int generation;
+
+ public:
+	FilterPrefilter() : classes(1), generation(0)
+	{
+		this->Clear();
+	}
+
+	/** Remove all fragments. Compile() must be called before the next match.
+	 */
+	void Clear()
+	{
+		literals.clear();
+		always.clear();
+		delta.assign(1, 0);
+		outhead.assign(1, -1);
+		outlink.assign(1, -1);
+		outnext.clear();
+		seen.clear();
+		classes = 1;
+		memset(charclass, 0, sizeof(charclass));
+	}
+
+	/** Add a fragment for the next filter id. An empty fragment makes the
+	 * filter a candidate for every line.
+	 * @return The filter id, which is simply the insertion index
+	 */
+	unsigned int Add(const std::string &literal)
+	{
+		std::string folded = literal;
+		for (std::string::iterator n = folded.begin(); n != folded.end(); n++)
+			*n = lowermap[(unsigned char)*n];
+		literals.push_back(folded);
+		return literals.size() - 1;
+	}
+
+	/** Build the automaton from the fragments added since Clear()
+	 */
+	void Compile()
+	{
+		unsigned char folded_class[256];
+		memset(folded_class, 0, sizeof(folded_class));
+		classes = 1;
+
+		for (std::vector<std::string>::iterator i = literals.begin(); i != literals.end(); i++)
+			for (std::string::iterator n = i->begin(); n != i->end(); n++)
+				if (!folded_class[(unsigned char)*n])
+					folded_class[(unsigned char)*n] = classes++;
+
+		for (int c = 0; c < 256; c++)
+			charclass[c] = folded_class[lowermap[c]];
+
+		/* Build the trie. Missing edges are -1 until the failure pass below. */
+		delta.assign(classes, -1);
+		outhead.assign(1, -1);
+		outnext.assign(literals.size(), -1);
+		always.clear();
+		seen.assign(literals.size(), 0);
+		generation = 0;
+
+		for (unsigned int id = 0; id < literals.size(); id++)
+		{
+			if (literals[id].empty())
+			{
+				always.push_back(id);
+				continue;
+			}
+
+			int state = 0;
+			for (std::string::iterator n = literals[id].begin(); n != literals[id].end(); n++)
+			{
+				int& next = delta[state * classes + folded_class[(unsigned char)*n]];
+				if (next < 0)
+				{
+					next = outhead.size();
+					outhead.push_back(-1);
+					delta.resize(delta.size() + classes, -1);
+				}
+				state = delta[state * classes + folded_class[(unsigned char)*n]];
+			}
+
+			/* Keep each state's output list in ascending id order */
+			int* tail = &outhead[state];
+			while (*tail >= 0)
+				tail = &outnext[*tail];
+			*tail = id;
+		}
+
+		/* Breadth first pass to fill in failure transitions */
+		std::vector<int> fail(outhead.size(), 0);
+		outlink.assign(outhead.size(), -1);
+		std::deque<int> queue;
+
+		for (unsigned int c = 0; c < classes; c++)
+		{
+			if (delta[c] < 0)
+				delta[c] = 0;
+			else
+				queue.push_back(delta[c]);
+		}
+
+		while (!queue.empty())
+		{
+			int state = queue.front();
+			queue.pop_front();
+
+			for (unsigned int c = 0; c < classes; c++)
+			{
+				int& next = delta[state * classes + c];
+				int via = delta[fail[state] * classes + c];
+				if (next < 0)
+				{
+					next = via;
+				}
+				else
+				{
+					fail[next] = via;
+					outlink[next] = (outhead[via] >= 0) ? via : outlink[via];
+					queue.push_back(next);
+				}
+			}
+		}
+	}
+
+	/** Find every filter whose fragment occurs in the text.
+	 * @param text The line to scan
+	 * @param result Filled with candidate filter ids in ascending order
+	 */
+	void GetCandidates(const std::string &text, std::vector<unsigned int> &result)
+	{
+		result.clear();
+
+		if (++generation == 0)
+		{
+			seen.assign(seen.size(), 0);
+			generation = 1;
+		}
+
+		int state = 0;
+		for (std::string::const_iterator n = text.begin(); n != text.end(); n++)
+		{
+			state = delta[state * classes + charclass[(unsigned char)*n]];
+			for (int s = (outhead[state] >= 0) ? state : outlink[state]; s >= 0; s = outlink[s])
+			{
+				for (int id = outhead[s]; id >= 0; id = outnext[id])
+				{
+					if (seen[id] != generation)
+					{
+						seen[id] = generation;
+						result.push_back(id);
+					}
+				}
+			}
+		}
+
+		result.insert(result.end(), always.begin(), always.end());
+		std::sort(result.begin(), result.end());
+	}
+
+	/** Number of filters which are candidates for every line
+	 */
+	unsigned int Unfiltered()
+	{
+		return always.size();
+	}
+
+	/** Number of automaton states
+	 */
+	unsigned int States()
+	{
+		return outhead.size();
+	}
+
+	/** Returns the longest run of non-wildcard characters in a glob,
+	 * which every string matching the glob must contain.
+	 */
+	static std::string GlobFragment(const std::string &glob)
+	{
+		std::string best;
+		std::string::size_type start = 0;
+		while (start < glob.length())
+		{
+			std::string::size_type end = glob.find_first_of("*?", start);
+			if (end == std::string::npos)
+				end = glob.length();
+			if (end - start > best.length())
+				best = glob.substr(start, end - start);
+			start = end + 1;
+		}
+		return best;
+	}
+
+	/** Returns the longest literal run which every string matched by the
+	 * regexp must contain, or an empty string if none can be proven.
+	 * Only the top level of the pattern is examined: groups, classes and
+	 * anything optional simply end the current run. A top level alternation
+	 * or any inline option (which might be (?x)) gives up entirely.
+	 */
+	static std::string RegexFragment(const std::string &regexp)
+	{
+		std::string best;
+		std::string run;
+		std::string::size_type n = 0;
+
+		while (n < regexp.length())
+		{
+			char c = regexp[n];
+			switch (c)
+			{
+				case '|':
+					return "";
+				case '(':
+				{
+					if ((n + 1 < regexp.length()) && (regexp[n + 1] == '?'))
+						return "";
+					/* Skip the whole group, it may be optional or alternated */
+					int depth = 0;
+					bool inclass = false;
+					while (n < regexp.length())
+					{
+						if (regexp[n] == '\\')
+						{
+							n = SkipEscape(regexp, n);
+							continue;
+						}
+						else if (inclass)
+							inclass = (regexp[n] != ']');
+						else if (regexp[n] == '[')
+							inclass = true;
+						else if (regexp[n] == '(')
+							depth++;
+						else if ((regexp[n] == ')') && (--depth == 0))
+							break;
+						n++;
+					}
+					run.clear();
+					n++;
+				}
+				break;
+				case '[':
+					/* Skip a character class, allowing a leading ] or ^] */
+					n++;
+					if ((n < regexp.length()) && (regexp[n] == '^'))
+						n++;
+					if ((n < regexp.length()) && (regexp[n] == ']'))
+						n++;
+					while ((n < regexp.length()) && (regexp[n] != ']'))
+						n = (regexp[n] == '\\') ? SkipEscape(regexp, n) : n + 1;
+					run.clear();
+					n++;
+				break;
+				case '?':
+				case '*':
+				case '{':
+					/* The previous character is optional */
+					if (!run.empty())
+						run.erase(run.length() - 1);
+					if (run.length() > best.length())
+						best = run;
+					run.clear();
+					if (c == '{')
+						while ((n < regexp.length()) && (regexp[n] != '}'))
+							n++;
+					n++;
+					/* Lazy or possessive quantifier suffix */
+					if ((n < regexp.length()) && ((regexp[n] == '?') || (regexp[n] == '+')))
+						n++;
+				break;
+				case '+':
+					/* The previous character is required but may repeat */
+					if (run.length() > best.length())
+						best = run;
+					run.clear();
+					n++;
+					if ((n < regexp.length()) && ((regexp[n] == '?') || (regexp[n] == '+')))
+						n++;
+				break;
+				case '.':
+				case '^':
+				case '$':
+				case ')':
+					if (run.length() > best.length())
+						best = run;
+					run.clear();
+					n++;
+				break;
+				case '\\':
+					if ((n + 1 < regexp.length()) && (!isalnum(regexp[n + 1])))
+					{
+						/* Escaped punctuation is a literal */
+						run += regexp[n + 1];
+						n += 2;
+					}
+					else
+					{
+						/* Character types, code points, backreferences, \Q..\E and friends */
+						if ((n + 1 < regexp.length()) && (regexp[n + 1] == 'Q'))
+							return "";
+						if (run.length() > best.length())
+							best = run;
+						run.clear();
+						n = SkipEscape(regexp, n);
+					}
+				break;
+				default:
+					run += c;
+					n++;
+				break;
+			}
+		}
+
+		if (run.length() > best.length())
+			best = run;
+		return best;
+	}
+
+ private:
+	/** Returns the index just past the escape sequence starting at the
+	 * backslash at n. Escapes which carry an argument (\x41, \x{41}, \101,
+	 * \0, \cA, \o{101}, \N{U+41}, \p{L}, \g{-1}, \k<name>...) are taken
+	 * whole, so that the argument is not mistaken for literal text. Where
+	 * PCRE might stop earlier, such as a run of digits, taking more only
+	 * costs the fragment some length.
+	 */
+	static std::string::size_type SkipEscape(const std::string &regexp, std::string::size_type n)
+	{
+		std::string::size_type len = regexp.length();
+		if (++n >= len)
+			return len;
+
+		char e = regexp[n++];
+		char open = (n < len) ? regexp[n] : 0;
+		char close = (open == '{') ? '}' : (open == '<') ? '>' : (open == '\'') ? '\'' : 0;
+
+		switch (e)
+		{
+			case 'x':
+				if (open == '{')
+					break;
+				for (int digits = 0; (digits < 2) && (n < len) && isxdigit(regexp[n]); digits++)
+					n++;
+				return n;
+			case 'o':
+			case 'N':
+				if (open == '{')
+					break;
+				return n;
+			case 'p':
+			case 'P':
+				if (open == '{')
+					break;
+				return (n < len) ? n + 1 : len;
+			case 'g':
+			case 'k':
+				if (close)
+					break;
+				if ((n < len) && ((regexp[n] == '-') || (regexp[n] == '+')))
+					n++;
+				while ((n < len) && isdigit(regexp[n]))
+					n++;
+				return n;
+			case 'c':
+				return (n < len) ? n + 1 : len;
+			default:
+				if (isdigit(e))
+					while ((n < len) && isdigit(regexp[n]))
+						n++;
+				return n;
+		}
+
+		/* A braced (or bracketed) argument */
+		std::string::size_type end = regexp.find(close, n + 1);
+		return (end == std::string::npos) ? len : end + 1;
+	}
+};
+
 class cmd_filter;
 
 class FilterBase : public Module
@@ -114,6 +554,7 @@ class FilterBase : public Module
 	virtual int OnStats(char symbol, userrec* user, string_list &results) = 0;
 	virtual int OnPreCommand(const std::string &command, const char** parameters, int pcnt, userrec *user, bool validated, const std::string &original_line);
 	bool AppliesToMe(userrec* user, FilterResult* filter, int flags);
+	void StatsCounters(userrec* user, FilterResult* filter, string_list &results);
 };
 
 class cmd_filter : public command_t
@@ -390,6 +831,12 @@ void FilterBase::OnRehash(userrec* user, const std::string &parameter)
 {
 }
 	
+void FilterBase::StatsCounters(userrec* user, FilterResult* filter, string_list &results)
+{
+	results.push_back(std::string(ServerInstance->Config->ServerName)+" 223 "+user->nick+" :HITS:"+filter->freeform+" "+ConvToStr(filter->hits)+" "+
+			ConvToStr(filter->evaluations)+" "+ConvToStr(filter->usecs));
+}
+
 Version FilterBase::GetVersion()
 {
 	return Version(1,1,0,2,VF_VENDOR|VF_COMMON,API_VERSION);
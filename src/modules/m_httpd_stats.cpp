@@ -105,6 +105,9 @@ class ModuleHttpStats : public Module
 				data << "<tr><td>Channels</td><td>" << ServerInstance->chanlist->size() << "</td></tr>";
 				data << "<tr><td>Opers</td><td>" << ServerInstance->all_opers.size() << "</td></tr>";
 				data << "<tr><td>Sockets</td><td>" << (ServerInstance->SE->GetMaxFds() - ServerInstance->SE->GetRemainingFds()) << " (Max: " << ServerInstance->SE->GetMaxFds() << " via socket engine '" << ServerInstance->SE->GetName() << "')</td></tr>";
+				const DNSCache* dc = ServerInstance->Res->GetCacheStats();
+				data << "<tr><td>DNS cache</td><td>" << dc->size() << " (Max: " << dc->GetMaxSize() << ")</td></tr>";
+				data << "<tr><td>DNS cache hits</td><td>" << dc->GetHits() << " (Negative: " << dc->GetNegativeHits() << ", Misses: " << dc->GetMisses() << ", Evicted: " << dc->GetEvictions() << ")</td></tr>";
 				data << "</table>";
 				data << "</div>";
 
@@ -137,9 +140,9 @@ class ModuleHttpStats : public Module
 					if (c)
 					{
 						data << "<tr><td>" << a->first << "</td><td>" << a->second << "</td>";
-						data << "<td>" << c->GetOppedUsers()->size() << "</td>";
-						data << "<td>" << c->GetHalfoppedUsers()->size() << "</td>";
-						data << "<td>" << c->GetVoicedUsers()->size() << "</td>";
+						data << "<td>" << c->GetUsers()->count(UCMODE_OP) << "</td>";
+						data << "<td>" << c->GetUsers()->count(UCMODE_HOP) << "</td>";
+						data << "<td>" << c->GetUsers()->count(UCMODE_VOICE) << "</td>";
 						data << "<td>" << c->topic << "</td>";
 						data << "</tr>";
 					}
@@ -206,7 +209,7 @@ class ModuleHttpStats : public Module
 	{
 		for (UCListIter v = user->chans.begin(); v != user->chans.end(); v++)
 		{
-			chanrec* c = v->first;
+			chanrec* c = (*v)->chan;
 			StatsIter a = sh->find(c->name);
 			if (a != sh->end())
 			{
@@ -45,7 +45,7 @@ class RFC1413 : public InspSocket
 		if (u && (Instance->SE->GetRef(ufd) == u))
 		{
 			u->Shrink("ident_data");
-			Instance->next_call = Instance->Time();
+			Instance->ConnectWhenReady(u);
 		}
 	}
 
@@ -116,7 +116,7 @@ class RFC1413 : public InspSocket
 		// Fixes issue reported by webs, 7 Jun 2006
 		if (u && (Instance->SE->GetRef(ufd) == u))
 		{
-			Instance->next_call = Instance->Time();
+			Instance->ConnectWhenReady(u);
 			u->Shrink("ident_data");
 		}
 	}
@@ -128,7 +128,7 @@ class RFC1413 : public InspSocket
 			if (*u->ident == '~')
 				u->WriteServ("NOTICE "+std::string(u->nick)+" :*** Could not find your ident, using "+std::string(u->ident)+" instead.");
 
-			Instance->next_call = Instance->Time();
+			Instance->ConnectWhenReady(u);
 			u->Shrink("ident_data");
 		}
 	}
@@ -248,7 +248,7 @@ class ModuleIdent : public Module
 		else
 		{
 			user->WriteServ("NOTICE "+std::string(user->nick)+" :*** Could not find your ident, using "+std::string(user->ident)+" instead.");
-			ServerInstance->next_call = ServerInstance->Time();
+			ServerInstance->ConnectWhenReady(user);
 		}
 		return 0;
 	}
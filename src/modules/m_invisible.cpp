@@ -52,7 +52,10 @@ class InvisibleMode : public ModeHandler
 	{
 		for (user_hash::iterator i = ServerInstance->clientlist->begin(); i != ServerInstance->clientlist->end(); i++)
 			if (i->second->Visibility == qo)
+			{
 				i->second->Visibility = NULL;
+				i->second->InvalidateCache();
+			}
 		delete qo;
 	}
 
@@ -85,25 +88,26 @@ class InvisibleMode : public ModeHandler
 
 			/* Set visibility handler object */
 			dest->Visibility = adding ? qo : NULL;
+			dest->InvalidateCache();
 
 			/* User appears to vanish or appear from nowhere */
 			for (UCListIter f = dest->chans.begin(); f != dest->chans.end(); f++)
 			{
-				CUList *ulist = f->first->GetUsers();
+				MemberList *ulist = (*f)->chan->GetUsers();
 				char tb[MAXBUF];
 
-				snprintf(tb,MAXBUF,":%s %s %s", dest->GetFullHost(), adding ? "PART" : "JOIN", f->first->name);
+				snprintf(tb,MAXBUF,":%s %s %s", dest->GetFullHost(), adding ? "PART" : "JOIN", (*f)->chan->name);
 				std::string out = tb;
-				std::string n = this->ServerInstance->Modes->ModeString(dest, f->first);
+				std::string n = this->ServerInstance->Modes->ModeString(dest, (*f)->chan);
 
-				for (CUList::iterator i = ulist->begin(); i != ulist->end(); i++)
+				for (MemberList::iterator i = ulist->begin(); i != ulist->end(); i++)
 				{
 					/* User only appears to vanish for non-opers */
-					if (IS_LOCAL(i->first) && !IS_OPER(i->first))
+					if (IS_LOCAL((*i)->user) && !IS_OPER((*i)->user))
 					{
-						i->first->Write(out);
+						(*i)->user->Write(out);
 						if (!n.empty() && !adding)
-							i->first->WriteServ("MODE %s +%s", f->first->name, n.c_str());
+							(*i)->user->WriteServ("MODE %s +%s", (*f)->chan->name, n.c_str());
 					}
 				}
 
@@ -216,7 +220,7 @@ class ModuleInvisible : public Module
 			if (parthandler)
 			{
 				for (UCListIter f = user->chans.begin(); f != user->chans.end(); f++)
-						to_leave.push_back(f->first->name);
+						to_leave.push_back((*f)->chan->name);
 				/* We cant do this neatly in one loop, as we are modifying the map we are iterating */
 				for (std::vector<std::string>::iterator n = to_leave.begin(); n != to_leave.end(); n++)
 				{
@@ -260,14 +264,14 @@ class ModuleInvisible : public Module
 		va_end(argsPtr);
 		snprintf(tb,MAXBUF,":%s %s",user->GetFullHost(),textbuffer);
 		
-		CUList *ulist = channel->GetUsers();
+		MemberList *ulist = channel->GetUsers();
 		
-		for (CUList::iterator i = ulist->begin(); i != ulist->end(); i++)
+		for (MemberList::iterator i = ulist->begin(); i != ulist->end(); i++)
 		{
 			/* User only appears to vanish for non-opers */
-			if (IS_LOCAL(i->first) && IS_OPER(i->first))
+			if (IS_LOCAL((*i)->user) && IS_OPER((*i)->user))
 			{
-				i->first->Write(std::string(tb));
+				(*i)->user->Write(std::string(tb));
 			}
 		}
 	}
@@ -69,7 +69,7 @@ public:
 		if(chan != NULL)
 		{
 			modelist* list;
-			chan->GetExt(ie->GetInfoKey(), list);
+			chan->GetExt(ie->GetInfoSlot(), list);
 			if (list)
 			{
 				char mask[MAXBUF];
@@ -95,7 +95,7 @@ public:
 		if (strcmp("LM_CHECKLIST", request->GetId()) == 0)
 		{
 			modelist* list;
-			LM->chan->GetExt(ie->GetInfoKey(), list);
+			LM->chan->GetExt(ie->GetInfoSlot(), list);
 			if (list)
 			{
 				char mask[MAXBUF];
@@ -18,6 +18,10 @@
 
 /* $ModDesc: Provides channel mode +f (message flood protection) */
 
+/** Slot holding each channel's floodsettings
+ */
+static ExtensionSlot floodslot;
+
 /** Holds flood settings and state for mode +f
  */
 class floodsettings : public classbase
@@ -83,7 +87,7 @@ class MsgFlood : public ModeHandler
 	ModePair ModeSet(userrec* source, userrec* dest, chanrec* channel, const std::string &parameter)
 	{
 		floodsettings* x;
-		if (channel->GetExt("flood",x))
+		if (channel->GetExt(floodslot, x))
 			return std::make_pair(true, (x->ban ? "*" : "")+ConvToStr(x->lines)+":"+ConvToStr(x->secs));
 		else
 			return std::make_pair(false, parameter);
@@ -140,11 +144,11 @@ class MsgFlood : public ModeHandler
 				}
 				else
 				{
-					if (!channel->GetExt("flood", f))
+					if (!channel->GetExt(floodslot, f))
 					{
 						parameter = std::string(ban ? "*" : "") + ConvToStr(nlines) + ":" +ConvToStr(nsecs);
 						floodsettings *f = new floodsettings(ban,nsecs,nlines);
-						channel->Extend("flood",f);
+						channel->Extend(floodslot, f);
 						channel->SetMode('f', true);
 						channel->SetModeParam('f', parameter.c_str(), true);
 						return MODEACTION_ALLOW;
@@ -164,8 +168,8 @@ class MsgFlood : public ModeHandler
 							{
 								delete f;
 								floodsettings *f = new floodsettings(ban,nsecs,nlines);
-								channel->Shrink("flood");
-								channel->Extend("flood",f);
+								channel->Shrink(floodslot);
+								channel->Extend(floodslot, f);
 								channel->SetModeParam('f', cur_param.c_str(), false);
 								channel->SetModeParam('f', parameter.c_str(), true);
 								return MODEACTION_ALLOW;
@@ -187,10 +191,10 @@ class MsgFlood : public ModeHandler
 		}
 		else
 		{
-			if (channel->GetExt("flood", f))
+			if (channel->GetExt(floodslot, f))
 			{
 				DELETE(f);
-				channel->Shrink("flood");
+				channel->Shrink(floodslot);
 				channel->SetMode('f', false);
 				return MODEACTION_ALLOW;
 			}
@@ -211,6 +215,7 @@ class ModuleMsgFlood : public Module
 		: Module(Me)
 	{
 		
+		floodslot = Extensible::RegisterExt("flood");
 		mf = new MsgFlood(ServerInstance);
 		if (!ServerInstance->AddMode(mf, 'f'))
 			throw ModuleException("Could not add new modes!");
@@ -224,7 +229,7 @@ class ModuleMsgFlood : public Module
 		}
 
 		floodsettings *f;
-		if (dest->GetExt("flood", f))
+		if (dest->GetExt(floodslot, f))
 		{
 			f->addmessage(user);
 			if (f->shouldkick(user))
@@ -278,10 +283,10 @@ class ModuleMsgFlood : public Module
 	void OnChannelDelete(chanrec* chan)
 	{
 		floodsettings* f;
-		if (chan->GetExt("flood", f))
+		if (chan->GetExt(floodslot, f))
 		{
 			DELETE(f);
-			chan->Shrink("flood");
+			chan->Shrink(floodslot);
 		}
 	}
 
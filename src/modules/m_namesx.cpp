@@ -31,11 +31,14 @@ class ModuleNamesX : public Module
 
 	void Implements(char* List)
 	{
-		List[I_OnSyncUserMetaData] = List[I_OnPreCommand] = List[I_OnUserList] = List[I_On005Numeric] = 1;
+		List[I_OnSyncUserMetaData] = List[I_OnPreCommand] = List[I_On005Numeric] = 1;
 	}
 
 	virtual ~ModuleNamesX()
 	{
+		/* Nobody has the capability once the module is gone */
+		for (std::vector<userrec*>::const_iterator i = ServerInstance->local_users.begin(); i != ServerInstance->local_users.end(); i++)
+			(*i)->NamesFormat &= ~NAMES_ALLPREFIXES;
 	}
 
 	void OnSyncUserMetaData(userrec* user, Module* proto,void* opaque, const std::string &extname, bool displayable)
@@ -67,61 +70,13 @@ class ModuleNamesX : public Module
 			if ((pcnt) && (!strcasecmp(parameters[0],"NAMESX")))
 			{
 				user->Extend("NAMESX",dummy);
+				/* The core formats NAMES replies from here on */
+				user->NamesFormat |= NAMES_ALLPREFIXES;
 				return 1;
 			}
 		}
 		return 0;
 	}
-
-	virtual int OnUserList(userrec* user, chanrec* Ptr, CUList* &ulist)
-	{
-		if (user->GetExt("NAMESX"))
-		{
-			char list[MAXBUF];
-			size_t dlen, curlen;
-			dlen = curlen = snprintf(list,MAXBUF,"353 %s = %s :", user->nick, Ptr->name);
-			int numusers = 0;
-			char* ptr = list + dlen;
-
-			if (!ulist)
-				ulist = Ptr->GetUsers();
-
-			bool has_user = Ptr->HasUser(user);
-			for (CUList::iterator i = ulist->begin(); i != ulist->end(); i++)
-			{
-				if ((!has_user) && (i->first->IsModeSet('i')))
-					continue;
-
-				if (i->first->Visibility && !i->first->Visibility->VisibleTo(user))
-					continue;
-
-				size_t ptrlen = snprintf(ptr, MAXBUF, "%s%s ", Ptr->GetAllPrefixChars(i->first), i->second.c_str());
-				/* OnUserList can change this - reset it back to normal */
-				i->second = i->first->nick;
-				curlen += ptrlen;
-				ptr += ptrlen;
-				numusers++;
-				if (curlen > (480-NICKMAX))
-				{
-					/* list overflowed into multiple numerics */
-					user->WriteServ(std::string(list));
-					/* reset our lengths */
-					dlen = curlen = snprintf(list,MAXBUF,"353 %s = %s :", user->nick, Ptr->name);
-					ptr = list + dlen;
-					ptrlen = 0;
-					numusers = 0;
-				}
-			}
-			/* if whats left in the list isnt empty, send it */
-			if (numusers)
-			{
-				user->WriteServ(std::string(list));
-			}
-			user->WriteServ("366 %s %s :End of /NAMES list.", user->nick, Ptr->name);
-			return 1;
-		}
-		return 0;		
- 	}
 };
 
 MODULE_INIT(ModuleNamesX)
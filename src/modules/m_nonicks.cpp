@@ -82,7 +82,7 @@ class ModuleNoNickChange : public Module
 		{
 			for (UCListIter i = user->chans.begin(); i != user->chans.end(); i++)
 			{
-				chanrec* curr = i->first;
+				chanrec* curr = (*i)->chan;
 
 				if (curr->IsModeSet('N'))
 				{
@@ -40,6 +40,13 @@ class RemoveBase
 	}		
  
 	enum ModeLevel { PEON = 0, HALFOP = 1, OP = 2, ADMIN = 3, OWNER = 4, ULINE = 5 };	 
+
+	/** Check the list m_chanprotect keeps of the channels a user has +q (cm_founder) or +a (cm_protect) on */
+	bool HasStatus(userrec* user, const std::string &key, chanrec* channel)
+	{
+		std::set<chanrec*>* chans;
+		return (user->GetExt(key, chans) && (chans->find(channel) != chans->end()));
+	}
  
 	/* This little function just converts a chanmode character (U ~ & @ & +) into an integer (5 4 3 2 1 0) */
 	/* XXX - We should probably use the new mode prefix rank stuff
@@ -83,8 +90,6 @@ class RemoveBase
 		ModeLevel tlevel;
 		ModeLevel ulevel;
 		std::string reason;
-		std::string protectkey;
-		std::string founderkey;
 		bool hasnokicks;
 		
 		/* Set these to the parameters needed, the new version of this module switches it's parameters around
@@ -116,18 +121,15 @@ class RemoveBase
 		
 		/* This is adding support for the +q and +a channel modes, basically if they are enabled, and the remover has them set.
 		 * Then we change the @|%|+ to & if they are +a, or ~ if they are +q */
-		protectkey = "cm_protect_" + std::string(channel->name);
-		founderkey = "cm_founder_" + std::string(channel->name);
-		
 		if (ServerInstance->ULine(user->server) || ServerInstance->ULine(user->nick))
 		{
 			ulevel = chartolevel("U");
 		}
-		if (user->GetExt(founderkey))
+		if (HasStatus(user, "cm_founder", channel))
 		{
 			ulevel = chartolevel("~");
 		}
-		else if (user->GetExt(protectkey))
+		else if (HasStatus(user, "cm_protect", channel))
 		{
 			ulevel = chartolevel("&");
 		}
@@ -141,11 +143,11 @@ class RemoveBase
 		{
 			tlevel = chartolevel("U");
 		}
-		else if (target->GetExt(founderkey))
+		else if (HasStatus(target, "cm_founder", channel))
 		{
 			tlevel = chartolevel("~");
 		}
-		else if (target->GetExt(protectkey))
+		else if (HasStatus(target, "cm_protect", channel))
 		{
 			tlevel = chartolevel("&");
 		}
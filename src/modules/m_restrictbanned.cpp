@@ -65,7 +65,7 @@ class ModuleRestrictBanned : public Module
 		/* bit of a special case. */
 		for (UCListIter i = user->chans.begin(); i != user->chans.end(); i++)
 		{
-			if (CheckRestricted(user, i->first, "change your nickname") == 1)
+			if (CheckRestricted(user, (*i)->chan, "change your nickname") == 1)
 				return 1;
 		}
 
@@ -115,8 +115,11 @@ class ModuleServicesAccount : public Module
 	AChannel_R* m1;
 	AChannel_M* m2;
 	AUser_R* m3;
+	/** The account name of each identified user, deleted along with the user
+	 */
+	ExtensionItem<std::string> accountname;
  public:
-	ModuleServicesAccount(InspIRCd* Me) : Module(Me)
+	ModuleServicesAccount(InspIRCd* Me) : Module(Me), accountname("accountname")
 	{
 		
 		m1 = new AChannel_R(ServerInstance);
@@ -129,8 +132,7 @@ class ModuleServicesAccount : public Module
 	/* <- :twisted.oscnet.org 330 w00t2 w00t2 w00t :is logged in as */
 	virtual void OnWhois(userrec* source, userrec* dest)
 	{
-		std::string *account;
-		dest->GetExt("accountname", account);
+		std::string* account = accountname.Get(dest);
 
 		if (account)
 		{
@@ -141,7 +143,7 @@ class ModuleServicesAccount : public Module
 	void Implements(char* List)
 	{
 		List[I_OnWhois] = List[I_OnUserPreMessage] = List[I_OnUserPreNotice] = List[I_OnUserPreJoin] = 1;
-		List[I_OnSyncUserMetaData] = List[I_OnUserQuit] = List[I_OnCleanup] = List[I_OnDecodeMetaData] = 1;
+		List[I_OnSyncUserMetaData] = List[I_OnCleanup] = List[I_OnDecodeMetaData] = 1;
 	}
 
 	virtual int OnUserPreMessage(userrec* user,void* dest,int target_type, std::string &text, char status, CUList &exempt_list)
@@ -151,7 +153,7 @@ class ModuleServicesAccount : public Module
 		if (!IS_LOCAL(user))
 			return 0;
 
-		user->GetExt("accountname", account);
+		account = accountname.Get(user);
 		
 		if (target_type == TYPE_CHANNEL)
 		{
@@ -197,8 +199,7 @@ class ModuleServicesAccount : public Module
 	 
 	virtual int OnUserPreJoin(userrec* user, chanrec* chan, const char* cname, std::string &privs)
 	{
-		std::string *account;
-		user->GetExt("accountname", account);
+		std::string* account = accountname.Get(user);
 		
 		if (chan)
 		{
@@ -231,8 +232,7 @@ class ModuleServicesAccount : public Module
 		if (extname == "accountname")
 		{
 			// check if this user has an swhois field to send
-			std::string* account;
-			user->GetExt("accountname", account);
+			std::string* account = accountname.Get(user);
 			if (account)
 			{
 				// remove any accidental leading/trailing spaces
@@ -245,31 +245,13 @@ class ModuleServicesAccount : public Module
 		}
 	}
 
-	// when a user quits, tidy up their metadata
-	virtual void OnUserQuit(userrec* user, const std::string &message, const std::string &oper_message)
-	{
-		std::string* account;
-		user->GetExt("accountname", account);
-		if (account)
-		{
-			user->Shrink("accountname");
-			delete account;
-		}
-	}
-
 	// if the module is unloaded, tidy up all our dangling metadata
 	virtual void OnCleanup(int target_type, void* item)
 	{
 		if (target_type == TYPE_USER)
 		{
 			userrec* user = (userrec*)item;
-			std::string* account;
-			user->GetExt("accountname", account);
-			if (account)
-			{
-				user->Shrink("accountname");
-				delete account;
-			}
+			accountname.Unset(user);
 		}
 	}
 
@@ -290,24 +272,17 @@ class ModuleServicesAccount : public Module
 			/* logging them out? */
 			if (extdata.empty())
 			{
-				std::string* account;
-				dest->GetExt("accountname", account);
-				if (account)
-				{
-					dest->Shrink("accountname");
-					delete account;
-				}
+				accountname.Unset(dest);
 			}
 			else
 			{
 				// if they dont already have an accountname field, accept the remote server's
-				std::string* text;
-				if (!dest->GetExt("accountname", text))
+				if (!accountname.Get(dest))
 				{
-					text = new std::string(extdata);
+					std::string* text = new std::string(extdata);
 					// remove any accidental leading/trailing spaces
 					trim(*text);
-					dest->Extend("accountname", text);
+					accountname.Set(dest, text);
 				}
 			}
 		}
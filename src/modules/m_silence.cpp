@@ -28,8 +28,9 @@ typedef std::map<irc::string, time_t> silencelist;
 class cmd_silence : public command_t
 {
 	unsigned int& maxsilence;
+	ExtensionItem<silencelist>& silence;
  public:
-	cmd_silence (InspIRCd* Instance, unsigned int &max) : command_t(Instance,"SILENCE", 0, 0), maxsilence(max)
+	cmd_silence (InspIRCd* Instance, unsigned int &max, ExtensionItem<silencelist> &sil) : command_t(Instance,"SILENCE", 0, 0), maxsilence(max), silence(sil)
 	{
 		this->source = "m_silence.so";
 		syntax = "{[+|-]<mask>}";
@@ -40,9 +41,8 @@ class cmd_silence : public command_t
 		if (!pcnt)
 		{
 			// no parameters, show the current silence list.
-			// Use Extensible::GetExt to fetch the silence list
-			silencelist* sl;
-			user->GetExt("silence_list", sl);
+			// fetch the silence list
+			silencelist* sl = silence.Get(user);
 			// if the user has a silence list associated with their user record, show it
 			if (sl)
 			{
@@ -72,8 +72,7 @@ class cmd_silence : public command_t
 			if (action == '-')
 			{
 				// fetch their silence list
-				silencelist* sl;
-				user->GetExt("silence_list", sl);
+				silencelist* sl = silence.Get(user);
 				// does it contain any entries and does it exist?
 				if (sl)
 				{
@@ -86,8 +85,7 @@ class cmd_silence : public command_t
 						{
 							// tidy up -- if a user's list is empty, theres no use having it
 							// hanging around in the user record.
-							DELETE(sl);
-							user->Shrink("silence_list");
+							silence.Unset(user);
 						}
 					}
 					else
@@ -97,13 +95,12 @@ class cmd_silence : public command_t
 			else if (action == '+')
 			{
 				// fetch the user's current silence list
-				silencelist* sl;
-				user->GetExt("silence_list", sl);
+				silencelist* sl = silence.Get(user);
 				// what, they dont have one??? WE'RE ALL GONNA DIE! ...no, we just create an empty one.
 				if (!sl)
 				{
 					sl = new silencelist;
-					user->Extend("silence_list", sl);
+					silence.Set(user, sl);
 				}
 				silencelist::iterator n = sl->find(mask.c_str());
 				if (n != sl->end())
@@ -130,19 +127,22 @@ class ModuleSilence : public Module
 	
 	cmd_silence* mycommand;
 	unsigned int maxsilence;
+	/** Each user's silence list, deleted along with the user
+	 */
+	ExtensionItem<silencelist> silence;
  public:
  
 	ModuleSilence(InspIRCd* Me)
-		: Module(Me), maxsilence(32)
+		: Module(Me), maxsilence(32), silence("silence_list")
 	{
 		OnRehash(NULL, "");
-		mycommand = new cmd_silence(ServerInstance, maxsilence);
+		mycommand = new cmd_silence(ServerInstance, maxsilence, silence);
 		ServerInstance->AddCommand(mycommand);
 	}
 
 	void Implements(char* List)
 	{
-		List[I_OnRehash] = List[I_OnUserQuit] = List[I_On005Numeric] = List[I_OnUserPreNotice] = List[I_OnUserPreMessage] = 1;
+		List[I_OnRehash] = List[I_On005Numeric] = List[I_OnUserPreNotice] = List[I_OnUserPreMessage] = 1;
 	}
 
 	virtual void OnRehash(userrec* user, const std::string &parameter)
@@ -153,19 +153,6 @@ class ModuleSilence : public Module
 			maxsilence = 32;
 	}
 
-	virtual void OnUserQuit(userrec* user, const std::string &reason, const std::string &oper_message)
-	{
-		// when the user quits tidy up any silence list they might have just to keep things tidy
-		// and to prevent a HONKING BIG MEMORY LEAK!
-		silencelist* sl;
-		user->GetExt("silence_list", sl);
-		if (sl)
-		{
-			DELETE(sl);
-			user->Shrink("silence_list");
-		}
-	}
-
 	virtual void On005Numeric(std::string &output)
 	{
 		// we don't really have a limit...
@@ -181,8 +168,7 @@ class ModuleSilence : public Module
 		if ((target_type == TYPE_USER) && (IS_LOCAL(user)))
 		{
 			userrec* u = (userrec*)dest;
-			silencelist* sl;
-			u->GetExt("silence_list", sl);
+			silencelist* sl = silence.Get(u);
 			if (sl)
 			{
 				for (silencelist::const_iterator c = sl->begin(); c != sl->end(); c++)
@@ -280,30 +280,18 @@ class ModuleSilence : public Module
 	virtual void OnBuildExemptList(MessageType message_type, chanrec* chan, userrec* sender, char status, CUList &exempt_list)
 	{
 		int public_silence = (message_type == MSG_PRIVMSG ? SILENCE_CHANNEL : SILENCE_CNOTICE);
-		CUList *ulist;
-		switch (status)
-		{
-			case '@':
-				ulist = chan->GetOppedUsers();
-				break;
-			case '%':
-				ulist = chan->GetHalfoppedUsers();
-				break;
-			case '+':
-				ulist = chan->GetVoicedUsers();
-				break;
-			default:
-				ulist = chan->GetUsers();
-				break;
-		}
+		MemberList *ulist = chan->GetUsers();
+		char mask = chanrec::StatusToMask(status);
 
-		for (CUList::iterator i = ulist->begin(); i != ulist->end(); i++)
+		for (MemberList::iterator i = ulist->begin(); i != ulist->end(); i++)
 		{
-			if (IS_LOCAL(i->first))
+			if ((mask) && (!((*i)->status & mask)))
+				continue;
+			if (IS_LOCAL((*i)->user))
 			{
-				if (MatchPattern(i->first, sender, public_silence) == 1)
+				if (MatchPattern((*i)->user, sender, public_silence) == 1)
 				{
-					exempt_list[i->first] = i->first->nick;
+					exempt_list[(*i)->user] = (*i)->user->nick;
 				}
 			}
 		}
@@ -128,9 +128,11 @@ int TreeServer::QuitUsers(const std::string &reason)
 {
 	const char* reason_s = reason.c_str();
 	std::vector<userrec*> time_to_die;
+	/* Users hold the shared copy of their server name, so compare pointers */
+	const char* sname = ServerInstance->FindServerNamePtr(this->ServerName.c_str());
 	for (user_hash::iterator n = ServerInstance->clientlist->begin(); n != ServerInstance->clientlist->end(); n++)
 	{
-		if (!strcmp(n->second->server, this->ServerName.c_str()))
+		if (n->second->server == sname)
 		{
 			time_to_die.push_back(n->second);
 		}
@@ -729,6 +729,7 @@ bool TreeSocket::ForceTopic(const std::string &source, std::deque<std::string> &
 			strlcpy(c->topic,params[3].c_str(),MAXTOPIC);
 			strlcpy(c->setby,params[2].c_str(),127);
 			c->topicset = ts;
+			this->Instance->Directory->Retopic(c);
 			/* if the topic text is the same as the current topic,
 			 * dont bother to send the TOPIC command out, just silently
 			 * update the set time and set nick.
@@ -920,7 +921,9 @@ bool TreeSocket::IntroduceClient(const std::string &source, std::deque<std::stri
 	}
 
 	time_t age = ConvToInt(params[0]);
-	const char* tempnick = params[1].c_str();
+	/* Hash the nick under the same truncated name the user will carry */
+	char tempnick[NICKMAX];
+	strlcpy(tempnick, params[1].c_str(), NICKMAX-1);
 	std::string empty;
 
 	cmd_validation valid[] = { {"Nickname", 1, NICKMAX}, {"Hostname", 2, 64}, {"Displayed hostname", 3, 64}, {"Ident", 4, IDENTMAX}, {"GECOS", 7, MAXGECOS}, {"", 0, 0} };
@@ -964,13 +967,14 @@ bool TreeSocket::IntroduceClient(const std::string &source, std::deque<std::stri
 	(*(this->Instance->clientlist))[tempnick] = _new;
 	_new->SetFd(FD_MAGIC_NUMBER);
 	strlcpy(_new->nick, tempnick,NICKMAX-1);
-	strlcpy(_new->host, params[2].c_str(),64);
-	strlcpy(_new->dhost, params[3].c_str(),64);
+	_new->SetHost(params[2].c_str());
+	_new->SetDisplayedHost(params[3].c_str());
 	_new->server = this->Instance->FindServerNamePtr(source.c_str());
 	strlcpy(_new->ident, params[4].c_str(),IDENTMAX);
 	strlcpy(_new->fullname, params[7].c_str(),MAXGECOS);
 	_new->registered = REG_ALL;
 	_new->signon = age;
+	this->Instance->Indexes->Add(_new);
 
 	/* we need to remove the + from the modestring, so we can do our stuff */
 	std::string::size_type pos_after_plus = params[5].find_first_not_of('+');
@@ -1036,14 +1040,14 @@ void TreeSocket::SendFJoins(TreeServer* Current, chanrec* c)
 	int numusers = 0;
 	char* ptr = list + dlen;
 
-	CUList *ulist = c->GetUsers();
+	MemberList *ulist = c->GetUsers();
 	std::string modes;
 	std::string params;
 
-	for (CUList::iterator i = ulist->begin(); i != ulist->end(); i++)
+	for (MemberList::iterator i = ulist->begin(); i != ulist->end(); i++)
 	{
 		// The first parameter gets a : before it
-		size_t ptrlen = snprintf(ptr, MAXBUF, " %s%s,%s", !numusers ? ":" : "", c->GetAllPrefixChars(i->first), i->first->nick);
+		size_t ptrlen = snprintf(ptr, MAXBUF, " %s%s,%s", !numusers ? ":" : "", c->GetAllPrefixChars(*i), (*i)->user->nick);
 
 		curlen += ptrlen;
 		ptr += ptrlen;
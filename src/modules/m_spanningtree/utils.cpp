@@ -214,27 +214,16 @@ void SpanningTreeUtilities::AddThisServer(TreeServer* server, TreeServerList &li
 /* returns a list of DIRECT servernames for a specific channel */
 void SpanningTreeUtilities::GetListOfServersForChannel(chanrec* c, TreeServerList &list, char status, const CUList &exempt_list)
 {
-	CUList *ulist;
-	switch (status)
+	MemberList *ulist = c->GetUsers();
+	char mask = chanrec::StatusToMask(status);
+	for (MemberList::iterator i = ulist->begin(); i != ulist->end(); i++)
 	{
-		case '@':
-			ulist = c->GetOppedUsers();
-		break;
-		case '%':
-			ulist = c->GetHalfoppedUsers();
-		break;
-		case '+':
-			ulist = c->GetVoicedUsers();
-		break;
-		default:
-			ulist = c->GetUsers();
-		break;
-	}
-	for (CUList::iterator i = ulist->begin(); i != ulist->end(); i++)
-	{
-		if ((i->first->GetFd() < 0) && (exempt_list.find(i->first) == exempt_list.end()))
+		userrec* u = (*i)->user;
+		if ((mask) && (!((*i)->status & mask)))
+			continue;
+		if ((u->GetFd() < 0) && (exempt_list.find(u) == exempt_list.end()))
 		{
-			TreeServer* best = this->BestRouteTo(i->first->server);
+			TreeServer* best = this->BestRouteTo(u->server);
 			if (best)
 				AddThisServer(best,list);
 		}
@@ -34,11 +34,11 @@ void spy_userlist(userrec *user, chanrec *c)
 	int numusers = 0;
 	char* ptr = list + dlen;
 
-	CUList *ulist= c->GetUsers();
+	MemberList *ulist= c->GetUsers();
 
-	for (CUList::iterator i = ulist->begin(); i != ulist->end(); i++)
+	for (MemberList::iterator i = ulist->begin(); i != ulist->end(); i++)
 	{
-		size_t ptrlen = snprintf(ptr, MAXBUF, "%s%s ", c->GetPrefixChar(i->first), i->first->nick);
+		size_t ptrlen = snprintf(ptr, MAXBUF, "%s%s ", c->GetPrefixChar(*i), (*i)->user->nick);
 
 		curlen += ptrlen;
 		ptr += ptrlen;
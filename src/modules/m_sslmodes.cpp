@@ -35,10 +35,10 @@ class SSLMode : public ModeHandler
 			{
 				if (IS_LOCAL(source))
 				{
-					CUList* userlist = channel->GetUsers();
-					for(CUList::iterator i = userlist->begin(); i != userlist->end(); i++)
+					MemberList* userlist = channel->GetUsers();
+					for(MemberList::iterator i = userlist->begin(); i != userlist->end(); i++)
 					{
-						if(!i->first->GetExt("ssl", dummy))
+						if(!(*i)->user->GetExt("ssl", dummy))
 						{
 							source->WriteServ("490 %s %s :all members of the channel must be connected via SSL", source->nick, channel->name);
 							return MODEACTION_DENY;
@@ -22,7 +22,6 @@ static const char* dummy = "ON";
 
 class ModuleUHNames : public Module
 {
-	CUList nl;
  public:
 	
 	ModuleUHNames(InspIRCd* Me)
@@ -32,11 +31,14 @@ class ModuleUHNames : public Module
 
 	void Implements(char* List)
 	{
-		List[I_OnSyncUserMetaData] = List[I_OnPreCommand] = List[I_OnUserList] = List[I_On005Numeric] = 1;
+		List[I_OnSyncUserMetaData] = List[I_OnPreCommand] = List[I_On005Numeric] = 1;
 	}
 
 	virtual ~ModuleUHNames()
 	{
+		/* Nobody has the capability once the module is gone */
+		for (std::vector<userrec*>::const_iterator i = ServerInstance->local_users.begin(); i != ServerInstance->local_users.end(); i++)
+			(*i)->NamesFormat &= ~NAMES_FULLHOST;
 	}
 
 	void OnSyncUserMetaData(userrec* user, Module* proto,void* opaque, const std::string &extname, bool displayable)
@@ -55,11 +57,6 @@ class ModuleUHNames : public Module
 		output.append(" UHNAMES");
 	}
 
-	Priority Prioritize()
-	{
-		return (Priority)ServerInstance->PriorityBefore("m_namesx.so");
-	}
-
 	virtual int OnPreCommand(const std::string &command, const char** parameters, int pcnt, userrec *user, bool validated, const std::string &original_line)
 	{
 		irc::string c = command.c_str();
@@ -73,25 +70,13 @@ class ModuleUHNames : public Module
 			if ((pcnt) && (!strcasecmp(parameters[0],"UHNAMES")))
 			{
 				user->Extend("UHNAMES",dummy);
+				/* The core formats NAMES replies from here on */
+				user->NamesFormat |= NAMES_FULLHOST;
 				return 1;
 			}
 		}
 		return 0;
 	}
-
-	/* IMPORTANT: This must be prioritized above NAMESX! */
-	virtual int OnUserList(userrec* user, chanrec* Ptr, CUList* &ulist)
-	{
-		if (user->GetExt("UHNAMES"))
-		{
-			if (!ulist)
-				ulist = Ptr->GetUsers();
-
-			for (CUList::iterator i = ulist->begin(); i != ulist->end(); i++)
-				i->second = i->first->GetFullHost();
-		}
-		return 0;		
- 	}
 };
 
 MODULE_INIT(ModuleUHNames)
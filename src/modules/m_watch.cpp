@@ -78,6 +78,10 @@ typedef std::map<irc::string, std::string> watchlist;
  */
 watchentries* whos_watching_me;
 
+/** Slot holding each user's watchlist
+ */
+static ExtensionSlot watchslot;
+
 /** Handle /WATCH
  */
 class cmd_watch : public command_t
@@ -94,7 +98,7 @@ class cmd_watch : public command_t
 		}
 
 		watchlist* wl;
-		if (user->GetExt("watchlist", wl))
+		if (user->GetExt(watchslot, wl))
 		{
 			/* Yup, is on my list */
 			watchlist::iterator n = wl->find(nick);
@@ -110,7 +114,7 @@ class cmd_watch : public command_t
 
 			if (!wl->size())
 			{
-				user->Shrink("watchlist");
+				user->Shrink(watchslot);
 				delete wl;
 			}
 
@@ -144,10 +148,10 @@ class cmd_watch : public command_t
 		}
 
 		watchlist* wl;
-		if (!user->GetExt("watchlist", wl))
+		if (!user->GetExt(watchslot, wl))
 		{
 			wl = new watchlist();
-			user->Extend("watchlist", wl);
+			user->Extend(watchslot, wl);
 		}
 
 		if (wl->size() == MAX_WATCH)
@@ -207,7 +211,7 @@ class cmd_watch : public command_t
 		if (!pcnt)
 		{
 			watchlist* wl;
-			if (user->GetExt("watchlist", wl))
+			if (user->GetExt(watchslot, wl))
 			{
 				for (watchlist::iterator q = wl->begin(); q != wl->end(); q++)
 				{
@@ -226,7 +230,7 @@ class cmd_watch : public command_t
 				{
 					// watch clear
 					watchlist* wl;
-					if (user->GetExt("watchlist", wl))
+					if (user->GetExt(watchslot, wl))
 					{
 						for (watchlist::iterator i = wl->begin(); i != wl->end(); i++)
 						{
@@ -245,13 +249,13 @@ class cmd_watch : public command_t
 						}
 
 						delete wl;
-						user->Shrink("watchlist");
+						user->Shrink(watchslot);
 					}
 				}
 				else if (!strcasecmp(nick,"L"))
 				{
 					watchlist* wl;
-					if (user->GetExt("watchlist", wl))
+					if (user->GetExt(watchslot, wl))
 					{
 						for (watchlist::iterator q = wl->begin(); q != wl->end(); q++)
 						{
@@ -270,7 +274,7 @@ class cmd_watch : public command_t
 					int youre_on = 0;
 					std::string list;
 
-					if (user->GetExt("watchlist", wl))
+					if (user->GetExt(watchslot, wl))
 					{
 						for (watchlist::iterator q = wl->begin(); q != wl->end(); q++)
 							list.append(q->first.c_str()).append(" ");
@@ -312,6 +316,7 @@ class Modulewatch : public Module
 		: Module(Me), maxwatch(32)
 	{
 		OnRehash(NULL, "");
+		watchslot = Extensible::RegisterExt("watchlist");
 		whos_watching_me = new watchentries();
 		mycommand = new cmd_watch(ServerInstance, maxwatch);
 		ServerInstance->AddCommand(mycommand);
@@ -341,7 +346,7 @@ class Modulewatch : public Module
 					(*n)->WriteServ("601 %s %s %s %s %lu :went offline", (*n)->nick ,user->nick, user->ident, user->dhost, ServerInstance->Time());
 
 				watchlist* wl;
-				if ((*n)->GetExt("watchlist", wl))
+				if ((*n)->GetExt(watchslot, wl))
 					/* We were on somebody's notify list, set ourselves offline */
 					(*wl)[user->nick] = "";
 			}
@@ -349,7 +354,7 @@ class Modulewatch : public Module
 
 		/* Now im quitting, if i have a notify list, im no longer watching anyone */
 		watchlist* wl;
-		if (user->GetExt("watchlist", wl))
+		if (user->GetExt(watchslot, wl))
 		{
 			/* Iterate every user on my watch list, and take me out of the whos_watching_me map for each one we're watching */
 			for (watchlist::iterator i = wl->begin(); i != wl->end(); i++)
@@ -391,9 +396,9 @@ class Modulewatch : public Module
 			watchlist* wl;
 			userrec* user = (userrec*)item;
 
-			if (user->GetExt("watchlist", wl))
+			if (user->GetExt(watchslot, wl))
 			{
-				user->Shrink("watchlist");
+				user->Shrink(watchslot);
 				delete wl;
 			}
 		}
@@ -410,7 +415,7 @@ class Modulewatch : public Module
 					(*n)->WriteServ("600 %s %s %s %s %lu :arrived online", (*n)->nick, user->nick, user->ident, user->dhost, user->age);
 
 				watchlist* wl;
-				if ((*n)->GetExt("watchlist", wl))
+				if ((*n)->GetExt(watchslot, wl))
 					/* We were on somebody's notify list, set ourselves online */
 					(*wl)[user->nick] = std::string(user->ident).append(" ").append(user->dhost).append(" ").append(ConvToStr(user->age));
 			}
@@ -427,7 +432,7 @@ class Modulewatch : public Module
 			for (std::deque<userrec*>::iterator n = new_online->second.begin(); n != new_online->second.end(); n++)
 			{
 				watchlist* wl;
-				if ((*n)->GetExt("watchlist", wl))
+				if ((*n)->GetExt(watchslot, wl))
 				{
 					(*wl)[user->nick] = std::string(user->ident).append(" ").append(user->dhost).append(" ").append(ConvToStr(user->age));
 					if (!user->Visibility || user->Visibility->VisibleTo(user))
@@ -441,7 +446,7 @@ class Modulewatch : public Module
 			for (std::deque<userrec*>::iterator n = new_offline->second.begin(); n != new_offline->second.end(); n++)
 			{
 				watchlist* wl;
-				if ((*n)->GetExt("watchlist", wl))
+				if ((*n)->GetExt(watchslot, wl))
 				{
 					if (!user->Visibility || user->Visibility->VisibleTo(user))
 	 					(*n)->WriteServ("601 %s %s %s %s %lu :went offline", (*n)->nick, oldnick.c_str(), user->ident, user->dhost, user->age);
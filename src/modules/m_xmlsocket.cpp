@@ -139,6 +139,10 @@ class ModuleXMLSocket : public Module
 
 	virtual int OnRawSocketWrite(int fd, const char* buffer, int count)
 	{
+		/* Everything was put in the sendq already */
+		if (!count)
+			return 1;
+
 		userrec* user = dynamic_cast<userrec*>(ServerInstance->FindDescriptor(fd));
 
 		if (user == NULL)
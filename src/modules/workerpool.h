@@ -0,0 +1,341 @@
+/*       +------------------------------------+
+ *       | Inspire Internet Relay Chat Daemon |
+ *       +------------------------------------+
+ *
+ *  InspIRCd: (C) 2002-2007 InspIRCd Development Team
+ * See: http://www.inspircd.org/wiki/index.php/Credits
+ *
+ * This program is free but copyrighted software; see
+ *            the file COPYING for details.
+ *
+ * ---------------------------------------------------
+ */
+
+#ifndef __WORKERPOOL_H__
+#define __WORKERPOOL_H__
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include "inspircd.h"
+#include "socketengine.h"
+
+/** A piece of work for a WorkerPool.
+ * Run() is called on one of the pool's threads, so it must not touch
+ * anything the main thread uses (including logging) unless that is
+ * locked. Finish() is then called on the main thread, where it may do
+ * anything, after which the job is deleted.
+ */
+class WorkerJob : public classbase
+{
+ public:
+	virtual ~WorkerJob() { }
+
+	/** Do the work, on a worker thread
+	 */
+	virtual void Run() = 0;
+
+	/** Act on the result, back on the main thread
+	 */
+	virtual void Finish() = 0;
+};
+
+/** Runs WorkerJobs on a set of threads and hands each back to the main
+ * thread when it is done. The threads wake the main loop by writing to
+ * a pipe whose read end sits in the socket engine, as an event handler.
+ *
+ * With no threads, jobs are run there and then by Submit(), and
+ * finished straight after, so a module can use one code path whether
+ * or not threads are configured.
+ */
+class WorkerPool : public EventHandler
+{
+	InspIRCd* ServerInstance;
+
+	/** Guards everything below it
+	 */
+	pthread_mutex_t lock;
+
+	/** Signalled when a job is queued, or the threads should stop
+	 */
+	pthread_cond_t wake;
+
+	/** Signalled when a thread finishes running a job
+	 */
+	pthread_cond_t finished;
+
+	/** Jobs waiting for a thread
+	 */
+	std::deque<WorkerJob*> queue;
+
+	/** Jobs being run
+	 */
+	std::vector<WorkerJob*> running;
+
+	/** Jobs run but not yet finished by the main thread
+	 */
+	std::deque<WorkerJob*> done;
+
+	std::vector<pthread_t> threads;
+
+	/** Tells the threads to exit once the queue is empty
+	 */
+	bool stopping;
+
+	/** The write end of the pipe, the read end is our fd
+	 */
+	int notify;
+
+	/** Jobs submitted, and the longest the queue has been
+	 */
+	unsigned long submitted, peak;
+
+	static void* Entry(void* arg)
+	{
+		WorkerPool* pool = (WorkerPool*)arg;
+		pthread_mutex_lock(&pool->lock);
+		while (true)
+		{
+			while (pool->queue.empty() && !pool->stopping)
+				pthread_cond_wait(&pool->wake, &pool->lock);
+
+			if (pool->queue.empty())
+				break;
+
+			WorkerJob* job = pool->queue.front();
+			pool->queue.pop_front();
+			pool->running.push_back(job);
+			pthread_mutex_unlock(&pool->lock);
+
+			job->Run();
+
+			pthread_mutex_lock(&pool->lock);
+			pool->running.erase(std::find(pool->running.begin(), pool->running.end(), job));
+			bool wasempty = pool->done.empty();
+			pool->done.push_back(job);
+			pthread_cond_broadcast(&pool->finished);
+
+			// One byte covers every job finished before the main thread gets round to them
+			if (wasempty)
+			{
+				char c = 0;
+				if (write(pool->notify, &c, 1) < 0)
+				{
+					// The pipe is full, so the main thread has been woken already.
+				}
+			}
+		}
+		pthread_mutex_unlock(&pool->lock);
+		return NULL;
+	}
+
+ public:
+	WorkerPool(InspIRCd* Instance) : ServerInstance(Instance), stopping(false), notify(-1), submitted(0), peak(0)
+	{
+		pthread_mutex_init(&lock, NULL);
+		pthread_cond_init(&wake, NULL);
+		pthread_cond_init(&finished, NULL);
+
+		int fds[2];
+		if (pipe(fds))
+			throw ModuleException("Could not create a pipe for worker threads: " + std::string(strerror(errno)));
+
+		fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+		fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL, 0) | O_NONBLOCK);
+		this->SetFd(fds[0]);
+		notify = fds[1];
+
+		if (!ServerInstance->SE->AddFd(this))
+		{
+			close(fds[0]);
+			close(fds[1]);
+			throw ModuleException("Could not add the worker thread pipe to the socket engine");
+		}
+	}
+
+	virtual ~WorkerPool()
+	{
+		SetThreads(0);
+		HandleEvent(EVENT_READ);
+
+		ServerInstance->SE->DelFd(this);
+		close(this->GetFd());
+		close(notify);
+
+		pthread_cond_destroy(&finished);
+		pthread_cond_destroy(&wake);
+		pthread_mutex_destroy(&lock);
+	}
+
+	/** Change the number of threads. Any running jobs are waited for when
+	 * there are fewer, and with none, anything still queued is run here.
+	 * @param count The number of threads to run jobs on
+	 * @return False if a thread could not be started, in which case there are as many as could be
+	 */
+	bool SetThreads(unsigned int count)
+	{
+		if (count == threads.size())
+			return true;
+
+		if (count < threads.size())
+		{
+			// Stop them all and start what is wanted, rather than picking which to stop.
+			pthread_mutex_lock(&lock);
+			stopping = true;
+			pthread_cond_broadcast(&wake);
+			pthread_mutex_unlock(&lock);
+
+			for (std::vector<pthread_t>::iterator i = threads.begin(); i != threads.end(); i++)
+				pthread_join(*i, NULL);
+
+			threads.clear();
+			stopping = false;
+		}
+
+		while (threads.size() < count)
+		{
+			pthread_t thread;
+			if (pthread_create(&thread, NULL, Entry, this))
+				return false;
+			threads.push_back(thread);
+		}
+
+		if (threads.empty() && !queue.empty())
+		{
+			while (!queue.empty())
+			{
+				WorkerJob* job = queue.front();
+				queue.pop_front();
+				job->Run();
+				done.push_back(job);
+			}
+
+			char c = 0;
+			if (write(notify, &c, 1) < 0)
+			{
+				// As in Entry()
+			}
+		}
+
+		return true;
+	}
+
+	/** Queue a job for a thread. With no threads it is run and finished before this returns.
+	 * @param job The job, which the pool deletes once it is finished
+	 */
+	void Submit(WorkerJob* job)
+	{
+		submitted++;
+
+		if (threads.empty())
+		{
+			job->Run();
+			job->Finish();
+			delete job;
+			return;
+		}
+
+		pthread_mutex_lock(&lock);
+		queue.push_back(job);
+		if (queue.size() > peak)
+			peak = queue.size();
+		pthread_cond_signal(&wake);
+		pthread_mutex_unlock(&lock);
+	}
+
+	/** Take a job back out of the pool without finishing it. If a thread is
+	 * running it, this waits until it has.
+	 * @param job A job passed to Submit() and not yet finished
+	 * @return True if the job was run, false if it was still queued
+	 */
+	bool Cancel(WorkerJob* job)
+	{
+		bool ran = true;
+
+		pthread_mutex_lock(&lock);
+		std::deque<WorkerJob*>::iterator q = std::find(queue.begin(), queue.end(), job);
+		if (q != queue.end())
+		{
+			queue.erase(q);
+			ran = false;
+		}
+		else
+		{
+			while (std::find(running.begin(), running.end(), job) != running.end())
+				pthread_cond_wait(&finished, &lock);
+
+			std::deque<WorkerJob*>::iterator d = std::find(done.begin(), done.end(), job);
+			if (d != done.end())
+				done.erase(d);
+		}
+		pthread_mutex_unlock(&lock);
+
+		return ran;
+	}
+
+	/** Wait for the threads to run everything queued, so that what the jobs
+	 * use can be changed safely. They are left for HandleEvent() to finish.
+	 */
+	void Wait()
+	{
+		pthread_mutex_lock(&lock);
+		while (!queue.empty() || !running.empty())
+			pthread_cond_wait(&finished, &lock);
+		pthread_mutex_unlock(&lock);
+	}
+
+	/** Finish the jobs the threads are done with
+	 */
+	virtual void HandleEvent(EventType et, int errornum = 0)
+	{
+		char buf[64];
+		while (read(this->GetFd(), buf, sizeof(buf)) > 0);
+
+		std::deque<WorkerJob*> finishing;
+		pthread_mutex_lock(&lock);
+		finishing.swap(done);
+		pthread_mutex_unlock(&lock);
+
+		for (std::deque<WorkerJob*>::iterator i = finishing.begin(); i != finishing.end(); i++)
+		{
+			(*i)->Finish();
+			delete *i;
+		}
+	}
+
+	/** @return The number of threads
+	 */
+	unsigned int GetThreads()
+	{
+		return threads.size();
+	}
+
+	/** @return Jobs waiting for a thread right now
+	 */
+	unsigned long GetQueued()
+	{
+		pthread_mutex_lock(&lock);
+		unsigned long n = queue.size();
+		pthread_mutex_unlock(&lock);
+		return n;
+	}
+
+	/** @return The longest the queue has been
+	 */
+	unsigned long GetPeak()
+	{
+		return peak;
+	}
+
+	/** @return Jobs submitted since the pool was made
+	 */
+	unsigned long GetSubmitted()
+	{
+		return submitted;
+	}
+};
+
+#endif
@@ -17,6 +17,7 @@
 #include "socket.h"
 #include "socketengine.h"
 #include "wildcard.h"
+#include "xline.h"
 
 using namespace irc::sockets;
 
@@ -104,6 +105,18 @@ void ListenSocket::HandleEvent(EventType et, int errornum)
 		}
 
 		NonBlocking(incomingSockfd);
+
+		/* Turn away Z-lined, denied and throttled clients before anything is allocated for them */
+		if (ServerInstance->Admission->Admit(incomingSockfd, in_port, client) != ADMIT_OK)
+		{
+			shutdown(incomingSockfd,2);
+			close(incomingSockfd);
+			ServerInstance->stats->statsRefused++;
+			delete[] client;
+			delete[] sock_us;
+			return;
+		}
+
 		if (ServerInstance->Config->GetIOHook(in_port))
 		{
 			try
@@ -565,3 +578,333 @@ int irc::sockets::insp_aton(const char* a, insp_inaddr* n)
 	return inet_pton(AF_FAMILY, a, n);
 }
 
+/* Prefix of an IPv4-mapped IPv6 address, ::ffff:0:0/96 */
+static const unsigned char v4mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+bool irc::sockets::ipaddr_key::IsIPv4() const
+{
+	return !memcmp(bytes, v4mapped, sizeof(v4mapped));
+}
+
+size_t irc::sockets::ipaddr_hash::operator()(const ipaddr_key &key) const
+{
+	/* Only the last eight bytes of an IPv4 key vary, and those of an IPv6
+	 * key are mostly the interface id; fold all four words regardless.
+	 */
+	unsigned int words[4];
+	memcpy(words, key.bytes, sizeof(words));
+	size_t t = 0;
+	for (int i = 0; i < 4; i++)
+		t = (t ^ words[i]) * 0x9E3779B1;
+	return t ^ (t >> 15);
+}
+
+void irc::sockets::MakeIPKey(const sockaddr* addr, ipaddr_key &key)
+{
+	switch (addr->sa_family)
+	{
+		case AF_INET:
+			memcpy(key.bytes, v4mapped, sizeof(v4mapped));
+			memcpy(key.bytes + sizeof(v4mapped), &((const sockaddr_in*)addr)->sin_addr, 4);
+		break;
+#ifdef SUPPORT_IP6LINKS
+		case AF_INET6:
+			memcpy(key.bytes, &((const sockaddr_in6*)addr)->sin6_addr, sizeof(key.bytes));
+		break;
+#endif
+		default:
+			memset(key.bytes, 0, sizeof(key.bytes));
+		break;
+	}
+}
+
+bool irc::sockets::MakeIPKey(const char* address, ipaddr_key &key)
+{
+	in_addr v4;
+	if (inet_pton(AF_INET, address, &v4) > 0)
+	{
+		memcpy(key.bytes, v4mapped, sizeof(v4mapped));
+		memcpy(key.bytes + sizeof(v4mapped), &v4, 4);
+		return true;
+	}
+#ifdef SUPPORT_IP6LINKS
+	/* Accept the '0' prefixed form produced by GetIPString() */
+	if ((*address == '0') && (address[1] == ':') && (address[2] == ':'))
+		address++;
+	if (inet_pton(AF_INET6, address, key.bytes) > 0)
+		return true;
+#endif
+	memset(key.bytes, 0, sizeof(key.bytes));
+	return false;
+}
+
+const char* irc::sockets::IPKeyToString(const ipaddr_key &key, char* buf)
+{
+	*buf = 0;
+#ifdef SUPPORT_IP6LINKS
+	if (!key.IsIPv4())
+	{
+		/* IP addresses starting with a : on irc are a Bad Thing (tm) */
+		inet_ntop(AF_INET6, key.bytes, buf + 1, 47);
+		if (buf[1] == ':')
+			*buf = '0';
+		else
+			memmove(buf, buf + 1, strlen(buf + 1) + 1);
+		return buf;
+	}
+#endif
+	inet_ntop(AF_INET, key.bytes + sizeof(v4mapped), buf, 16);
+	return buf;
+}
+
+
+void irc::sockets::ipaddr_key::Mask(unsigned int bits)
+{
+	if (bits >= sizeof(bytes) * 8)
+		return;
+	unsigned int whole = bits / 8;
+	bytes[whole] &= inverted_bits[bits % 8];
+	memset(bytes + whole + 1, 0, sizeof(bytes) - whole - 1);
+}
+
+bool irc::sockets::MakeCIDRKey(const char* mask, ipaddr_key &key, unsigned int &bits)
+{
+	char address[48];
+	const char* slash = strchr(mask, '/');
+	size_t len = slash ? (size_t)(slash - mask) : strlen(mask);
+
+	if (len >= sizeof(address))
+		return false;
+
+	memcpy(address, mask, len);
+	address[len] = 0;
+
+	if (!MakeIPKey(address, key))
+		return false;
+
+	unsigned int family_bits = key.IsIPv4() ? 32 : 128;
+	bits = family_bits;
+
+	if (slash)
+	{
+		const char* p = slash + 1;
+		if (!*p)
+			return false;
+		bits = 0;
+		for (; *p; p++)
+		{
+			if ((*p < '0') || (*p > '9') || (bits > family_bits))
+				return false;
+			bits = bits * 10 + (*p - '0');
+		}
+		if (bits > family_bits)
+			return false;
+	}
+
+	if (key.IsIPv4())
+		bits += 96;
+
+	key.Mask(bits);
+	return true;
+}
+
+const char* irc::sockets::SockaddrToString(const sockaddr* addr, char* buf)
+{
+	*buf = 0;
+	switch (addr->sa_family)
+	{
+#ifdef SUPPORT_IP6LINKS
+		case AF_INET6:
+			inet_ntop(AF_INET6, &((const sockaddr_in6*)addr)->sin6_addr, buf + 1, 47);
+			/* IP addresses starting with a : on irc are a Bad Thing (tm) */
+			if (buf[1] == ':')
+				*buf = '0';
+			else
+				memmove(buf, buf + 1, strlen(buf + 1) + 1);
+		break;
+#endif
+		case AF_INET:
+			inet_ntop(AF_INET, &((const sockaddr_in*)addr)->sin_addr, buf, 16);
+		break;
+		default:
+		break;
+	}
+	return buf;
+}
+
+AdmissionManager::AdmissionManager(InspIRCd* Instance) : ServerInstance(Instance), lastprune(0)
+{
+	memset(counters, 0, sizeof(counters));
+}
+
+bool AdmissionManager::Consume(BucketMap &buckets, const ipaddr_key &key, unsigned long burst, unsigned long rate)
+{
+	time_t now = ServerInstance->Time();
+	BucketMap::iterator i = buckets.find(key);
+
+	if (i == buckets.end())
+	{
+		Bucket& b = buckets[key];
+		b.level = (burst - 1) * 60;
+		b.last = now;
+		return true;
+	}
+
+	Bucket& b = i->second;
+	if (now > b.last)
+	{
+		b.level += (unsigned long)(now - b.last) * rate;
+		if (b.level > burst * 60)
+			b.level = burst * 60;
+	}
+	b.last = now;
+
+	if (b.level < 60)
+		return false;
+
+	b.level -= 60;
+	return true;
+}
+
+void AdmissionManager::Prune(BucketMap &buckets, unsigned long burst, unsigned long rate)
+{
+	time_t now = ServerInstance->Time();
+	for (BucketMap::iterator i = buckets.begin(); i != buckets.end(); )
+	{
+		BucketMap::iterator n = i++;
+		if ((!rate) || (n->second.level + (unsigned long)(now - n->second.last) * rate >= burst * 60))
+			buckets.erase(n);
+	}
+}
+
+void AdmissionManager::ResetThrottles()
+{
+	ipbuckets.clear();
+	cidrbuckets.clear();
+}
+
+void AdmissionManager::Reject(int fd, int port, const char* ipaddr, const char* reason)
+{
+	/* Don't write plaintext to a port which expects a handshake */
+	if (ServerInstance->Config->GetIOHook(port))
+		return;
+
+	char buf[MAXBUF];
+	int len = snprintf(buf, MAXBUF, "ERROR :Closing link (unknown@%s) [%s]\r\n", ipaddr, reason);
+	if (len > 0)
+		send(fd, buf, len > MAXBUF - 1 ? MAXBUF - 1 : len, 0);
+}
+
+AdmissionResult AdmissionManager::Admit(int fd, int port, const sockaddr* client)
+{
+	ServerConfig* Config = ServerInstance->Config;
+	char ipaddr[48];
+	char reason[MAXBUF];
+	ipaddr_key key;
+
+	SockaddrToString(client, ipaddr);
+	MakeIPKey(client, key);
+
+	if (ServerInstance->Time() - lastprune >= 60)
+	{
+		Prune(ipbuckets, Config->ThrottleIPBurst, Config->ThrottleIPRate);
+		Prune(cidrbuckets, Config->ThrottleCIDRBurst, Config->ThrottleCIDRRate);
+		lastprune = ServerInstance->Time();
+	}
+
+	bool exempt = (ServerInstance->XLines->matches_exception("unknown", ipaddr, ipaddr) != NULL);
+
+	if (!exempt)
+	{
+		ZLine* z = ServerInstance->XLines->matches_zline(key, ipaddr);
+		if (z)
+		{
+			if ((*Config->MoronBanner) && (!Config->GetIOHook(port)))
+			{
+				int len = snprintf(reason, MAXBUF, ":%s NOTICE %d-unknown :*** %s\r\n", Config->ServerName, fd, Config->MoronBanner);
+				if (len > 0)
+					send(fd, reason, len > MAXBUF - 1 ? MAXBUF - 1 : len, 0);
+			}
+			snprintf(reason, MAXBUF, "Z-Lined: %s", z->reason);
+			Reject(fd, port, ipaddr, reason);
+			counters[ADMIT_ZLINED]++;
+			return ADMIT_ZLINED;
+		}
+	}
+
+	/* Mirrors userrec::GetClass(), at a point where the host is still the IP */
+	ConnectClass* c = NULL;
+	for (ClassVector::iterator i = Config->Classes.begin(); i != Config->Classes.end(); i++)
+	{
+		if ((match(ipaddr, i->GetHost().c_str(), true)) || (match(ipaddr, i->GetHost().c_str())))
+		{
+			if ((i->GetPort()) && (i->GetPort() != port))
+				continue;
+			c = &(*i);
+			break;
+		}
+	}
+
+	if (!c)
+	{
+		Reject(fd, port, ipaddr, "Access denied by configuration");
+		counters[ADMIT_DENIED]++;
+		return ADMIT_DENIED;
+	}
+
+	if (c->GetType() == CC_DENY)
+	{
+		Reject(fd, port, ipaddr, "Unauthorised connection");
+		counters[ADMIT_DENIED]++;
+		return ADMIT_DENIED;
+	}
+
+	if (c->GetMaxLocal())
+	{
+		clonemap::iterator x = ServerInstance->local_clones.find(key);
+		if ((x != ServerInstance->local_clones.end()) && (x->second >= c->GetMaxLocal()))
+		{
+			Reject(fd, port, ipaddr, "No more connections allowed from your host via this connect class (local)");
+			ServerInstance->WriteOpers("*** WARNING: maximum LOCAL connections (%ld) exceeded for IP %s", c->GetMaxLocal(), ipaddr);
+			counters[ADMIT_LOCALCLONES]++;
+			return ADMIT_LOCALCLONES;
+		}
+	}
+
+	if (c->GetMaxGlobal())
+	{
+		clonemap::iterator x = ServerInstance->global_clones.find(key);
+		if ((x != ServerInstance->global_clones.end()) && (x->second >= c->GetMaxGlobal()))
+		{
+			Reject(fd, port, ipaddr, "No more connections allowed from your host via this connect class (global)");
+			ServerInstance->WriteOpers("*** WARNING: maximum GLOBAL connections (%ld) exceeded for IP %s", c->GetMaxGlobal(), ipaddr);
+			counters[ADMIT_GLOBALCLONES]++;
+			return ADMIT_GLOBALCLONES;
+		}
+	}
+
+	if (!exempt)
+	{
+		if ((Config->ThrottleIPBurst) && (Config->ThrottleIPRate) && (!Consume(ipbuckets, key, Config->ThrottleIPBurst, Config->ThrottleIPRate)))
+		{
+			Reject(fd, port, ipaddr, "Connecting too fast, please wait and try again");
+			counters[ADMIT_THROTTLE_IP]++;
+			return ADMIT_THROTTLE_IP;
+		}
+
+		if ((Config->ThrottleCIDRBurst) && (Config->ThrottleCIDRRate))
+		{
+			ipaddr_key range = key;
+			range.Mask(key.IsIPv4() ? Config->ThrottleIPv4CIDR + 96 : Config->ThrottleIPv6CIDR);
+			if (!Consume(cidrbuckets, range, Config->ThrottleCIDRBurst, Config->ThrottleCIDRRate))
+			{
+				Reject(fd, port, ipaddr, "Too many connections from your network, please wait and try again");
+				counters[ADMIT_THROTTLE_CIDR]++;
+				return ADMIT_THROTTLE_CIDR;
+			}
+		}
+	}
+
+	counters[ADMIT_OK]++;
+	return ADMIT_OK;
+}
@@ -144,10 +144,12 @@ int SelectEngine::DispatchEvents()
 			{
 				if (writeable[ev[i]->GetFd()])
 				{
+					/* Clear this first, as the other engines do, so that the
+					 * handler can ask for another write event.
+					 */
+					writeable[ev[i]->GetFd()] = false;
 					if (ev[i])
 						ev[i]->HandleEvent(EVENT_WRITE);
-					writeable[ev[i]->GetFd()] = false;
-
 				}
 				else
 				{
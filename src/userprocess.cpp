@@ -301,5 +301,34 @@ void InspIRCd::DoBackgroundUserStuff(time_t TIME)
 			next_call = TIME + 1;
 			delta = 1;
 		}
+
+		/* Anything due this second waits for the next tick. Users who become
+		 * ready to connect before then are handled by ConnectReadyUsers().
+		 */
+		if (next_call <= TIME)
+			next_call = TIME + 1;
+	}
+}
+
+void InspIRCd::ConnectWhenReady(userrec* user)
+{
+	if (std::find(ready_users.begin(), ready_users.end(), user) == ready_users.end())
+		ready_users.push_back(user);
+}
+
+void InspIRCd::ConnectReadyUsers()
+{
+	if (ready_users.empty())
+		return;
+
+	/* Connecting a user runs module hooks, which may queue more */
+	std::vector<userrec*> check;
+	check.swap(ready_users);
+
+	for (std::vector<userrec*>::iterator i = check.begin(); i != check.end(); i++)
+	{
+		userrec* curr = *i;
+		if ((!curr->muted) && (curr->registered == REG_NICKUSER) && (curr->dns_done) && (AllModulesReportReady(curr)))
+			curr->FullConnect();
 	}
 }
@@ -16,10 +16,12 @@
 #include "channels.h"
 #include "users.h"
 #include <stdarg.h>
+#include <algorithm>
 #include "socketengine.h"
 #include "wildcard.h"
 #include "xline.h"
 #include "commands/cmd_whowas.h"
+#include "slabpool.h"
 
 static unsigned long already_sent[MAX_DESCRIPTORS] = {0};
 
@@ -136,12 +138,71 @@ std::string userrec::ProcessNoticeMasks(const char *sm)
 	return output;
 }
 
+/** Microseconds from one time to another */
+static unsigned long Elapsed(const timeval &since, const timeval &now)
+{
+	return (now.tv_sec - since.tv_sec) * 1000000 + now.tv_usec - since.tv_usec;
+}
+
+/** Mark a user's hostname lookup finished. If it has already sent
+ * NICK and USER, it is connected straight away if nothing else
+ * holds it up, rather than on the next pass over the users.
+ */
+static void LookupDone(InspIRCd* Instance, userrec* user)
+{
+	user->dns_done = true;
+	Instance->ConnectWhenReady(user);
+}
+
+/** Give a user the hostname its IP was confirmed to have */
+static void UseResolvedHost(InspIRCd* Instance, userrec* user, std::string hostname, bool cached)
+{
+	if (hostname.length() < 65)
+	{
+		/* Hostnames starting with : are not a good thing (tm) */
+		if (*(hostname.c_str()) == ':')
+			hostname.insert(0, "0");
+
+		user->WriteServ("NOTICE Auth :*** Found your hostname (%s)%s", hostname.c_str(), (cached ? " -- cached" : ""));
+		LookupDone(Instance, user);
+		user->SetDisplayedHost(hostname.c_str());
+		user->SetHost(hostname.c_str());
+		/* Invalidate cache */
+		user->InvalidateCache();
+	}
+	else
+	{
+		user->WriteServ("NOTICE Auth :*** Your hostname is longer than the maximum of 64 characters, using your IP address (%s) instead.", user->GetIPString());
+		LookupDone(Instance, user);
+	}
+}
+
+/** Tell a user its hostname did not resolve back to its IP */
+static void HostMismatch(InspIRCd* Instance, userrec* user)
+{
+	user->WriteServ("NOTICE Auth :*** Your hostname does not match up with your IP address. Sorry, using your IP address (%s) instead.", user->GetIPString());
+	LookupDone(Instance, user);
+}
+
 void userrec::StartDNSLookup()
 {
+	const char* ip = this->GetIPString();
+
+	/* Someone from this IP connected recently and was looked up both ways already */
+	CachedQuery* verdict = ServerInstance->Res->GetConfirmedHost(ip);
+	if (verdict)
+	{
+		if (verdict->negative)
+			HostMismatch(ServerInstance, this);
+		else
+			UseResolvedHost(ServerInstance, this, verdict->data, true);
+		ServerInstance->stats->statsDnsConnect.Add(0);
+		return;
+	}
+
 	try
 	{
 		bool cached;
-		const char* ip = this->GetIPString();
 
 		/* Special case for 4in6 (Have i mentioned i HATE 4in6?) */
 		if (!strncmp(ip, "0::ffff:", 8))
@@ -158,16 +219,22 @@ void userrec::StartDNSLookup()
 }
 
 UserResolver::UserResolver(InspIRCd* Instance, userrec* user, std::string to_resolve, QueryType qt, bool &cache) :
-	Resolver(Instance, to_resolve, qt, cache), bound_user(user)
+	Resolver(Instance, to_resolve, qt, cache), bound_user(user), bound_ip(user->GetIPString()), reversettl(0)
 {
 	this->fwd = (qt == DNS_QUERY_A || qt == DNS_QUERY_AAAA);
 	this->bound_fd = user->GetFd();
+	gettimeofday(&this->started, NULL);
+	this->reversed = this->started;
 }
 
 void UserResolver::OnLookupComplete(const std::string &result, unsigned int ttl, bool cached)
 {
+	timeval now;
+	gettimeofday(&now, NULL);
+
 	if ((!this->fwd) && (ServerInstance->SE->GetRef(this->bound_fd) == this->bound_user))
 	{
+		ServerInstance->stats->statsDnsReverse.Add(Elapsed(this->started, now));
 		this->bound_user->stored_host = result;
 		try
 		{
@@ -179,14 +246,17 @@ void UserResolver::OnLookupComplete(const std::string &result, unsigned int ttl,
 				if (this->bound_user->GetProtocolFamily() == AF_INET6)
 				{
 					/* IPV6 forward lookup (with possibility of 4in6) */
-					const char* ip = this->bound_user->GetIPString();
-					bound_user->res_forward = new UserResolver(this->ServerInstance, this->bound_user, result, (!strncmp(ip, "0::ffff:", 8) ? DNS_QUERY_A : DNS_QUERY_AAAA), cached);
+					bound_user->res_forward = new UserResolver(this->ServerInstance, this->bound_user, result, (!strncmp(this->bound_ip.c_str(), "0::ffff:", 8) ? DNS_QUERY_A : DNS_QUERY_AAAA), cached);
 				}
 				else
 					/* IPV4 lookup (mixed protocol mode) */
 #endif
 				/* IPV4 lookup (ipv4 only mode) */
 				bound_user->res_forward = new UserResolver(this->ServerInstance, this->bound_user, result, DNS_QUERY_A, cached);
+				bound_user->res_forward->bound_ip = this->bound_ip;
+				bound_user->res_forward->started = this->started;
+				bound_user->res_forward->reversed = now;
+				bound_user->res_forward->reversettl = ttl;
 				this->ServerInstance->AddResolver(bound_user->res_forward, cached);
 			}
 		}
@@ -197,45 +267,25 @@ void UserResolver::OnLookupComplete(const std::string &result, unsigned int ttl,
 	}
 	else if ((this->fwd) && (ServerInstance->SE->GetRef(this->bound_fd) == this->bound_user))
 	{
+		ServerInstance->stats->statsDnsForward.Add(Elapsed(this->reversed, now));
+
 		/* Both lookups completed */
 		std::string result2("0::ffff:");
 		result2.append(result);
-		if (this->bound_user->GetIPString() == result || this->bound_user->GetIPString() == result2)
-		{
-			std::string hostname = this->bound_user->stored_host;
-			if (hostname.length() < 65)
-			{
-				/* Check we didnt time out */
-				if ((this->bound_user->registered != REG_ALL) && (!this->bound_user->dns_done))
-				{
-					/* Hostnames starting with : are not a good thing (tm) */
-					if (*(hostname.c_str()) == ':')
-						hostname.insert(0, "0");
-
-					this->bound_user->WriteServ("NOTICE Auth :*** Found your hostname (%s)%s", hostname.c_str(), (cached ? " -- cached" : ""));
-					this->bound_user->dns_done = true;
-					strlcpy(this->bound_user->dhost, hostname.c_str(),64);
-					strlcpy(this->bound_user->host, hostname.c_str(),64);
-					/* Invalidate cache */
-					this->bound_user->InvalidateCache();
-				}
-			}
-			else
-			{
-				if (!this->bound_user->dns_done)
-				{
-					this->bound_user->WriteServ("NOTICE Auth :*** Your hostname is longer than the maximum of 64 characters, using your IP address (%s) instead.", this->bound_user->GetIPString());
-					this->bound_user->dns_done = true;
-				}
-			}
-		}
-		else
+		bool matched = (this->bound_ip == result || this->bound_ip == result2);
+
+		/* The outcome stands for as long as both answers do, for the IP that was looked up */
+		ServerInstance->Res->AddConfirmedHost(this->bound_ip, this->bound_user->stored_host, std::min(ttl, this->reversettl), matched);
+
+		/* Check we didnt time out */
+		if (!this->bound_user->dns_done)
 		{
-			if (!this->bound_user->dns_done)
-			{
-				this->bound_user->WriteServ("NOTICE Auth :*** Your hostname does not match up with your IP address. Sorry, using your IP address (%s) instead.", this->bound_user->GetIPString());
-				this->bound_user->dns_done = true;
-			}
+			ServerInstance->stats->statsDnsConnect.Add(Elapsed(this->started, now));
+			/* A hostname for the IP the user had before is no use to it now */
+			if ((!matched) || (this->bound_ip != this->bound_user->GetIPString()))
+				HostMismatch(ServerInstance, this->bound_user);
+			else if (this->bound_user->registered != REG_ALL)
+				UseResolvedHost(ServerInstance, this->bound_user, this->bound_user->stored_host, cached);
 		}
 	}
 }
@@ -244,13 +294,21 @@ void UserResolver::OnError(ResolverError e, const std::string &errormessage)
 {
 	if (ServerInstance->SE->GetRef(this->bound_fd) == this->bound_user)
 	{
+		timeval now;
+		gettimeofday(&now, NULL);
+		if (this->fwd)
+			ServerInstance->stats->statsDnsForward.Add(Elapsed(this->reversed, now));
+		else
+			ServerInstance->stats->statsDnsReverse.Add(Elapsed(this->started, now));
+
 		/* Since dns timeout is implemented outside of the resolver, this was a race condition that could result in this message being sent *after*
 		 * the user was fully connected. This check fixes that issue  - Special */
 		if (!this->bound_user->dns_done)
 		{
+			ServerInstance->stats->statsDnsConnect.Add(Elapsed(this->started, now));
 			/* Error message here */
 			this->bound_user->WriteServ("NOTICE Auth :*** Could not resolve your hostname: %s; using your IP address (%s) instead.", errormessage.c_str(), this->bound_user->GetIPString());
-			this->bound_user->dns_done = true;
+			LookupDone(ServerInstance, this->bound_user);
 		}
 	}
 }
@@ -319,10 +377,26 @@ void userrec::DecrementModes()
 	}
 }
 
+/** Every connection, local or remote, allocates a userrec, so they are kept
+ * together in a pool which a mass quit can empty out
+ */
+static SlabPool UserPool("userrec", sizeof(userrec));
+
+void* userrec::operator new(size_t size)
+{
+	return UserPool.Allocate(size);
+}
+
+void userrec::operator delete(void* p, size_t size)
+{
+	UserPool.Free(p, size);
+}
+
 userrec::userrec(InspIRCd* Instance) : ServerInstance(Instance)
 {
 	// the PROPER way to do it, AVOID bzero at *ALL* costs
-	*password = *nick = *ident = *host = *dhost = *fullname = *awaymsg = *oper = 0;
+	*password = *nick = *ident = *fullname = *awaymsg = 0;
+	host = dhost = oper = "";
 	server = (char*)Instance->FindServerNamePtr(Instance->Config->ServerName);
 	reset_due = ServerInstance->Time();
 	age = ServerInstance->Time(true);
@@ -335,7 +409,11 @@ userrec::userrec(InspIRCd* Instance) : ServerInstance(Instance)
 	WriteError.clear();
 	res_forward = res_reverse = NULL;
 	Visibility = NULL;
+	NamesFormat = 0;
+	listing = NULL;
 	ip = NULL;
+	*ipstring = 0;
+	memset(&ipkey, 0, sizeof(ipkey));
 	chans.clear();
 	invites.clear();
 	memset(modes,0,sizeof(modes));
@@ -346,7 +424,7 @@ userrec::userrec(InspIRCd* Instance) : ServerInstance(Instance)
 
 void userrec::RemoveCloneCounts()
 {
-	clonemap::iterator x = ServerInstance->local_clones.find(this->GetIPString());
+	clonemap::iterator x = ServerInstance->local_clones.find(this->ipkey);
 	if (x != ServerInstance->local_clones.end())
 	{
 		x->second--;
@@ -356,7 +434,7 @@ void userrec::RemoveCloneCounts()
 		}
 	}
 	
-	clonemap::iterator y = ServerInstance->global_clones.find(this->GetIPString());
+	clonemap::iterator y = ServerInstance->global_clones.find(this->ipkey);
 	if (y != ServerInstance->global_clones.end())
 	{
 		y->second--;
@@ -369,10 +447,15 @@ void userrec::RemoveCloneCounts()
 
 userrec::~userrec()
 {
+	ServerInstance->Indexes->Del(this);
+	ServerInstance->Directory->EndList(this);
 	this->InvalidateCache();
 	this->DecrementModes();
 	if (operquit)
 		free(operquit);
+	ServerInstance->Strings->Release(host);
+	ServerInstance->Strings->Release(dhost);
+	ServerInstance->Strings->Release(oper);
 	if (ip)
 	{
 		this->RemoveCloneCounts();
@@ -401,7 +484,7 @@ char* userrec::MakeHost()
 	for(char* n = ident; *n; n++)
 		*t++ = *n;
 	*t++ = '@';
-	for(char* n = host; *n; n++)
+	for(const char* n = host; *n; n++)
 		*t++ = *n;
 	*t = 0;
 
@@ -449,7 +532,7 @@ char* userrec::GetFullHost()
 	for(char* n = ident; *n; n++)
 		*t++ = *n;
 	*t++ = '@';
-	for(char* n = dhost; *n; n++)
+	for(const char* n = dhost; *n; n++)
 		*t++ = *n;
 	*t = 0;
 
@@ -464,7 +547,7 @@ char* userrec::MakeWildHost()
 	char* t = nresult;
 	*t++ = '*';	*t++ = '!';
 	*t++ = '*';	*t++ = '@';
-	for(char* n = dhost; *n; n++)
+	for(const char* n = dhost; *n; n++)
 		*t++ = *n;
 	*t = 0;
 	return nresult;
@@ -498,7 +581,7 @@ char* userrec::GetFullRealHost()
 	for(char* n = ident; *n; n++)
 		*t++ = *n;
 	*t++ = '@';
-	for(char* n = host; *n; n++)
+	for(const char* n = host; *n; n++)
 		*t++ = *n;
 	*t = 0;
 
@@ -720,6 +803,15 @@ void userrec::FlushWriteBuf()
 		{
 			sendq.clear();
 		}
+		else if (sendq.empty())
+		{
+			/* A module wrapping the socket does its own buffering. Now the
+			 * socket is writeable, let it send what it has queued.
+			 */
+			Module* hook = ServerInstance->Config->GetIOHook(this->GetPort());
+			if (hook)
+				hook->OnRawSocketWrite(this->fd, NULL, 0);
+		}
 		if ((sendq.length()) && (this->fd != FD_MAGIC_NUMBER))
 		{
 			int old_sendq_length = sendq.length();
@@ -766,6 +858,8 @@ void userrec::FlushWriteBuf()
 
 	if (this->sendq.empty())
 	{
+		if (this->listing)
+			ServerInstance->Directory->ContinueList(this);
 		FOREACH_MOD(I_OnBufferFlushed,OnBufferFlushed(this));
 	}
 }
@@ -798,7 +892,7 @@ void userrec::Oper(const std::string &opertype)
 		this->WriteServ("MODE %s :+o", this->nick);
 		FOREACH_MOD(I_OnOper, OnOper(this, opertype));
 		ServerInstance->Log(DEFAULT,"OPER: %s!%s@%s opered as type: %s", this->nick, this->ident, this->host, opertype.c_str());
-		strlcpy(this->oper, opertype.c_str(), NICKMAX - 1);
+		this->SetOperType(opertype.c_str());
 		ServerInstance->all_opers.push_back(this);
 		FOREACH_MOD(I_OnPostOper,OnPostOper(this, opertype));
 	}
@@ -816,7 +910,7 @@ void userrec::UnOper()
 		if (IS_OPER(this))
 		{
 			// unset their oper type (what IS_OPER checks), and remove +o
-			*this->oper = 0;
+			this->SetOperType("");
 			this->modes[UM_OPERATOR] = 0;
 
 			// remove them from the opers list.
@@ -868,7 +962,6 @@ void userrec::AddClient(InspIRCd* Instance, int socket, int port, bool iscached,
 #endif
 	inet_ntop(AF_INET, &((const sockaddr_in*)ip)->sin_addr, ipaddr, sizeof(ipaddr));
 	userrec* New;
-	int j = 0;
 
 	Instance->unregistered_count++;
 
@@ -903,10 +996,8 @@ void userrec::AddClient(InspIRCd* Instance, int socket, int port, bool iscached,
 
 	New->SetSockAddr(socketfamily, ipaddr, port);
 
-	/* Smarter than your average bear^H^H^H^Hset of strlcpys. */
-	for (const char* temp = New->GetIPString(); *temp && j < 64; temp++, j++)
-		New->dhost[j] = New->host[j] = *temp;
-	New->dhost[j] = New->host[j] = 0;
+	New->SetHost(New->GetIPString());
+	New->SetDisplayedHost(New->host);
 
 	Instance->AddLocalClone(New);
 	Instance->AddGlobalClone(New);
@@ -960,20 +1051,11 @@ void userrec::AddClient(InspIRCd* Instance, int socket, int port, bool iscached,
 	}
 #endif
 
+	/* Z-lines are not checked here: the AdmissionManager has already turned away
+	 * any Z-lined address before the user was created. The exemption is still
+	 * needed for the G-line and K-line checks in FullConnect.
+	 */
 	New->exempt = (Instance->XLines->matches_exception(New) != NULL);
-	if (!New->exempt)
-	{
-		ZLine* r = Instance->XLines->matches_zline(ipaddr);
-		if (r)
-		{
-			char reason[MAXBUF];
-			if (*Instance->Config->MoronBanner)
-				New->WriteServ("NOTICE %s :*** %s", New->nick, Instance->Config->MoronBanner);
-			snprintf(reason,MAXBUF,"Z-Lined: %s",r->reason);
-			userrec::QuitUser(Instance, New, reason);
-			return;
-		}
-	}
 
 	if (socket > -1)
 	{
@@ -988,11 +1070,19 @@ void userrec::AddClient(InspIRCd* Instance, int socket, int port, bool iscached,
 	 * BOPM and other stuff requires it.
 	 */
 	New->WriteServ("NOTICE Auth :*** Looking up your hostname...");
+
+	/* Start on the hostname now rather than when NICK arrives, so it
+	 * has the whole time the client takes to register to come back in
+	 */
+	if (Instance->Config->NoUserDns)
+		New->dns_done = true;
+	else
+		New->StartDNSLookup();
 }
 
 unsigned long userrec::GlobalCloneCount()
 {
-	clonemap::iterator x = ServerInstance->global_clones.find(this->GetIPString());
+	clonemap::iterator x = ServerInstance->global_clones.find(this->ipkey);
 	if (x != ServerInstance->global_clones.end())
 		return x->second;
 	else
@@ -1001,7 +1091,7 @@ unsigned long userrec::GlobalCloneCount()
 
 unsigned long userrec::LocalCloneCount()
 {
-	clonemap::iterator x = ServerInstance->local_clones.find(this->GetIPString());
+	clonemap::iterator x = ServerInstance->local_clones.find(this->ipkey);
 	if (x != ServerInstance->local_clones.end())
 		return x->second;
 	else
@@ -1112,6 +1202,7 @@ void userrec::FullConnect()
 	FOREACH_MOD(I_OnUserConnect,OnUserConnect(this));
 
 	this->registered = REG_ALL;
+	ServerInstance->Indexes->Add(this);
 
 	FOREACH_MOD(I_OnPostConnect,OnPostConnect(this));
 
@@ -1136,8 +1227,8 @@ userrec* userrec::UpdateNickHash(const char* New)
 			return NULL; /* doesnt exist */
 
 		userrec* olduser = oldnick->second;
-		(*(ServerInstance->clientlist))[New] = olduser;
 		ServerInstance->clientlist->erase(oldnick);
+		(*(ServerInstance->clientlist))[New] = olduser;
 		return olduser;
 	}
 
@@ -1160,6 +1251,9 @@ void userrec::InvalidateCache()
 	if (cached_fullrealhost)
 		free(cached_fullrealhost);
 	cached_fullhost = cached_hostip = cached_makehost = cached_fullrealhost = NULL;
+
+	for (UCListIter i = chans.begin(); i != chans.end(); i++)
+		(*i)->chan->InvalidateNames();
 }
 
 bool userrec::ForceNickChange(const char* newnick)
@@ -1226,6 +1320,7 @@ void userrec::SetSockAddr(int protocol_family, const char* ip, int port)
 			ServerInstance->Log(DEBUG,"Ut oh, I dont know protocol %d to be set on '%s'!", protocol_family, this->nick);
 		break;
 	}
+	this->RefreshIPCache();
 }
 
 int userrec::GetPort()
@@ -1264,86 +1359,22 @@ int userrec::GetProtocolFamily()
 	return sin->sin_family;
 }
 
-const char* userrec::GetIPString()
+void userrec::RefreshIPCache()
 {
-	static char buf[1024];
+	*ipstring = 0;
+	memset(&ipkey, 0, sizeof(ipkey));
 
 	if (this->ip == NULL)
-		return "";
-
-	switch (this->GetProtocolFamily())
-	{
-#ifdef SUPPORT_IP6LINKS
-		case AF_INET6:
-		{
-			static char temp[1024];
+		return;
 
-			sockaddr_in6* sin = (sockaddr_in6*)this->ip;
-			inet_ntop(sin->sin6_family, &sin->sin6_addr, buf, sizeof(buf));
-			/* IP addresses starting with a : on irc are a Bad Thing (tm) */
-			if (*buf == ':')
-			{
-				strlcpy(&temp[1], buf, sizeof(temp) - 1);
-				*temp = '0';
-				return temp;
-			}
-			return buf;
-		}
-		break;
-#endif
-		case AF_INET:
-		{
-			sockaddr_in* sin = (sockaddr_in*)this->ip;
-			inet_ntop(sin->sin_family, &sin->sin_addr, buf, sizeof(buf));
-			return buf;
-		}
-		break;
-		default:
-		break;
-	}
-	return "";
+	irc::sockets::MakeIPKey(this->ip, this->ipkey);
+	irc::sockets::SockaddrToString(this->ip, this->ipstring);
 }
 
 const char* userrec::GetIPString(char* buf)
 {
-	if (this->ip == NULL)
-	{
-		*buf = 0;
-		return buf;
-	}
-
-	switch (this->GetProtocolFamily())
-	{
-#ifdef SUPPORT_IP6LINKS
-		case AF_INET6:
-		{
-			static char temp[1024];
-
-			sockaddr_in6* sin = (sockaddr_in6*)this->ip;
-			inet_ntop(sin->sin6_family, &sin->sin6_addr, buf, sizeof(buf));
-			/* IP addresses starting with a : on irc are a Bad Thing (tm) */
-			if (*buf == ':')
-			{
-				strlcpy(&temp[1], buf, sizeof(temp) - 1);
-				*temp = '0';
-				strlcpy(buf, temp, sizeof(temp));
-			}
-			return buf;
-		}
-		break;
-#endif
-		case AF_INET:
-		{
-			sockaddr_in* sin = (sockaddr_in*)this->ip;
-			inet_ntop(sin->sin_family, &sin->sin_addr, buf, sizeof(buf));
-			return buf;
-		}
-		break;
-
-		default:
-		break;
-	}
-	return "";
+	strlcpy(buf, ipstring, sizeof(ipstring));
+	return buf;
 }
 
 /** NOTE: We cannot pass a const reference to this method.
@@ -1514,13 +1545,14 @@ void userrec::WriteCommon(const std::string &text)
 
 		for (UCListIter v = this->chans.begin(); v != this->chans.end(); v++)
 		{
-			CUList* ulist = v->first->GetUsers();
-			for (CUList::iterator i = ulist->begin(); i != ulist->end(); i++)
+			MemberList* ulist = (*v)->chan->GetUsers();
+			for (MemberList::iterator i = ulist->begin(); i != ulist->end(); i++)
 			{
-				if ((IS_LOCAL(i->first)) && (already_sent[i->first->fd] != uniq_id))
+				userrec* u = (*i)->user;
+				if ((IS_LOCAL(u)) && (already_sent[u->fd] != uniq_id))
 				{
-					already_sent[i->first->fd] = uniq_id;
-					i->first->Write(out);
+					already_sent[u->fd] = uniq_id;
+					u->Write(out);
 					sent_to_at_least_one = true;
 				}
 			}
@@ -1575,15 +1607,16 @@ void userrec::WriteCommonQuit(const std::string &normal_text, const std::string
 
 	for (UCListIter v = this->chans.begin(); v != this->chans.end(); v++)
 	{
-		CUList *ulist = v->first->GetUsers();
-		for (CUList::iterator i = ulist->begin(); i != ulist->end(); i++)
+		MemberList *ulist = (*v)->chan->GetUsers();
+		for (MemberList::iterator i = ulist->begin(); i != ulist->end(); i++)
 		{
-			if (this != i->first)
+			userrec* u = (*i)->user;
+			if (this != u)
 			{
-				if ((IS_LOCAL(i->first)) && (already_sent[i->first->fd] != uniq_id))
+				if ((IS_LOCAL(u)) && (already_sent[u->fd] != uniq_id))
 				{
-					already_sent[i->first->fd] = uniq_id;
-					i->first->Write(IS_OPER(i->first) ? out2 : out1);
+					already_sent[u->fd] = uniq_id;
+					u->Write(IS_OPER(u) ? out2 : out1);
 				}
 			}
 		}
@@ -1604,15 +1637,16 @@ void userrec::WriteCommonExcept(const std::string &text)
 
 	for (UCListIter v = this->chans.begin(); v != this->chans.end(); v++)
 	{
-		CUList *ulist = v->first->GetUsers();
-		for (CUList::iterator i = ulist->begin(); i != ulist->end(); i++)
+		MemberList *ulist = (*v)->chan->GetUsers();
+		for (MemberList::iterator i = ulist->begin(); i != ulist->end(); i++)
 		{
-			if (this != i->first)
+			userrec* u = (*i)->user;
+			if (this != u)
 			{
-				if ((IS_LOCAL(i->first)) && (already_sent[i->first->fd] != uniq_id))
+				if ((IS_LOCAL(u)) && (already_sent[u->fd] != uniq_id))
 				{
-					already_sent[i->first->fd] = uniq_id;
-					i->first->Write(out1);
+					already_sent[u->fd] = uniq_id;
+					u->Write(out1);
 				}
 			}
 		}
@@ -1671,7 +1705,7 @@ bool userrec::SharesChannelWith(userrec *other)
 		/* Eliminate the inner loop (which used to be ~equal in size to the outer loop)
 		 * by replacing it with a map::find which *should* be more efficient
 		 */
-		if (i->first->HasUser(other))
+		if ((*i)->chan->HasUser(other))
 			return true;
 	}
 	return false;
@@ -1711,8 +1745,7 @@ bool userrec::ChangeDisplayedHost(const char* host)
 	if (this->ServerInstance->Config->CycleHosts)
 		this->WriteCommonExcept("QUIT :Changing hosts");
 
-	/* Fix by Om: userrec::dhost is 65 long, this was truncating some long hosts */
-	strlcpy(this->dhost,host,64);
+	this->SetDisplayedHost(host);
 
 	this->InvalidateCache();
 
@@ -1720,10 +1753,11 @@ bool userrec::ChangeDisplayedHost(const char* host)
 	{
 		for (UCListIter i = this->chans.begin(); i != this->chans.end(); i++)
 		{
-			i->first->WriteAllExceptSender(this, false, 0, "JOIN %s", i->first->name);
-			std::string n = this->ServerInstance->Modes->ModeString(this, i->first);
+			chanrec* c = (*i)->chan;
+			c->WriteAllExceptSender(this, false, 0, "JOIN %s", c->name);
+			std::string n = this->ServerInstance->Modes->ModeString(this, c);
 			if (n.length() > 0)
-				i->first->WriteAllExceptSender(this, true, 0, "MODE %s +%s", i->first->name, n.c_str());
+				c->WriteAllExceptSender(this, true, 0, "MODE %s +%s", c->name, n.c_str());
 		}
 	}
 
@@ -1733,6 +1767,25 @@ bool userrec::ChangeDisplayedHost(const char* host)
 	return true;
 }
 
+void userrec::SetHost(const char* newhost)
+{
+	ServerInstance->Strings->Assign(this->host, newhost, 64);
+	if (this->registered == REG_ALL)
+		ServerInstance->Indexes->Update(this);
+}
+
+void userrec::SetDisplayedHost(const char* newhost)
+{
+	ServerInstance->Strings->Assign(this->dhost, newhost, 64);
+	if (this->registered == REG_ALL)
+		ServerInstance->Indexes->Update(this);
+}
+
+void userrec::SetOperType(const char* opertype)
+{
+	ServerInstance->Strings->Assign(this->oper, opertype, NICKMAX - 1);
+}
+
 bool userrec::ChangeIdent(const char* newident)
 {
 	if (!strcmp(newident, this->ident))
@@ -1749,10 +1802,11 @@ bool userrec::ChangeIdent(const char* newident)
 	{
 		for (UCListIter i = this->chans.begin(); i != this->chans.end(); i++)
 		{
-			i->first->WriteAllExceptSender(this, false, 0, "JOIN %s", i->first->name);
-			std::string n = this->ServerInstance->Modes->ModeString(this, i->first);
+			chanrec* c = (*i)->chan;
+			c->WriteAllExceptSender(this, false, 0, "JOIN %s", c->name);
+			std::string n = this->ServerInstance->Modes->ModeString(this, c);
 			if (n.length() > 0)
-				i->first->WriteAllExceptSender(this, true, 0, "MODE %s +%s", i->first->name, n.c_str());
+				c->WriteAllExceptSender(this, true, 0, "MODE %s +%s", c->name, n.c_str());
 		}
 	}
 
@@ -1790,9 +1844,10 @@ std::string userrec::ChannelList(userrec* source)
 			 * If the channel is NOT private/secret OR the user shares a common channel
 			 * If the user is an oper, and the <options:operspywhois> option is set.
 			 */
-			if ((source == this) || (IS_OPER(source) && ServerInstance->Config->OperSpyWhois) || (((!i->first->IsModeSet('p')) && (!i->first->IsModeSet('s'))) || (i->first->HasUser(source))))
+			chanrec* c = (*i)->chan;
+			if ((source == this) || (IS_OPER(source) && ServerInstance->Config->OperSpyWhois) || (((!c->IsModeSet('p')) && (!c->IsModeSet('s'))) || (c->HasUser(source))))
 			{
-				list.append(i->first->GetPrefixChar(this)).append(i->first->name).append(" ");
+				list.append(c->GetPrefixChar(*i)).append(c->name).append(" ");
 			}
 		}
 		return list;
@@ -1880,15 +1935,17 @@ void userrec::PurgeEmptyChannels()
 	std::vector<chanrec*> to_delete;
 
 	// firstly decrement the count on each channel
-	for (UCListIter f = this->chans.begin(); f != this->chans.end(); f++)
+	for (UCListIter f = this->chans.begin(); f != this->chans.end(); )
 	{
-		f->first->RemoveAllPrefixes(this);
-		if (f->first->DelUser(this) == 0)
+		/* DelUser frees the membership, so step past it first */
+		chanrec* c = (*f++)->chan;
+		c->RemoveAllPrefixes(this);
+		if (c->DelUser(this) == 0)
 		{
 			/* No users left in here, mark it for deletion */
 			try
 			{
-				to_delete.push_back(f->first);
+				to_delete.push_back(c);
 			}
 			catch (...)
 			{
@@ -1903,10 +1960,9 @@ void userrec::PurgeEmptyChannels()
 		chan_hash::iterator i2 = ServerInstance->chanlist->find(thischan->name);
 		if (i2 != ServerInstance->chanlist->end())
 		{
-			FOREACH_MOD(I_OnChannelDelete,OnChannelDelete(i2->second));
-			DELETE(i2->second);
 			ServerInstance->chanlist->erase(i2);
-			this->chans.erase(*n);
+			FOREACH_MOD(I_OnChannelDelete,OnChannelDelete(thischan));
+			DELETE(thischan);
 		}
 	}
 
@@ -2005,3 +2061,138 @@ bool VisData::VisibleTo(userrec* user)
 	return true;
 }
 
+
+UserIndex::UserIndex(InspIRCd* Instance) : ServerInstance(Instance)
+{
+}
+
+std::string UserIndex::Fold(const char* name, size_t len, bool reverse)
+{
+	std::string folded(len, 0);
+	for (size_t i = 0; i < len; i++)
+		folded[reverse ? len - i - 1 : i] = lowermap[(unsigned char)name[i]];
+	return folded;
+}
+
+void UserIndex::Add(userrec* user)
+{
+	if (entries.find(user) != entries.end())
+		return;
+
+	Entry& e = entries[user];
+	size_t nlen = strlen(user->nick);
+	size_t dlen = strlen(user->dhost);
+	e.nick = nicks.insert(std::make_pair(Fold(user->nick, nlen, false), user));
+	e.rnick = rnicks.insert(std::make_pair(Fold(user->nick, nlen, true), user));
+	e.dhost = dhosts.insert(std::make_pair(Fold(user->dhost, dlen, false), user));
+	e.rdhost = rdhosts.insert(std::make_pair(Fold(user->dhost, dlen, true), user));
+
+	/* Only hosts which WHO could not already find through the displayed host */
+	e.realhost = (strcasecmp(user->host, user->dhost) != 0);
+	if (e.realhost)
+	{
+		size_t hlen = strlen(user->host);
+		e.host = hosts.insert(std::make_pair(Fold(user->host, hlen, false), user));
+		e.rhost = rhosts.insert(std::make_pair(Fold(user->host, hlen, true), user));
+	}
+
+	servers[user->server].insert(user);
+}
+
+void UserIndex::Del(userrec* user)
+{
+	EntryMap::iterator i = entries.find(user);
+	if (i == entries.end())
+		return;
+
+	Entry& e = i->second;
+	nicks.erase(e.nick);
+	rnicks.erase(e.rnick);
+	dhosts.erase(e.dhost);
+	rdhosts.erase(e.rdhost);
+	if (e.realhost)
+	{
+		hosts.erase(e.host);
+		rhosts.erase(e.rhost);
+	}
+	entries.erase(i);
+
+	ServerIndex::iterator s = servers.find(user->server);
+	if (s != servers.end())
+	{
+		s->second.erase(user);
+		if (s->second.empty())
+			servers.erase(s);
+	}
+}
+
+void UserIndex::Update(userrec* user)
+{
+	if (entries.find(user) == entries.end())
+		return;
+
+	Del(user);
+	Add(user);
+}
+
+bool UserIndex::Range(NameIndex& index, const std::string& prefix, std::vector<userrec*>& out, size_t limit)
+{
+	for (NameIndex::iterator i = index.lower_bound(prefix); i != index.end(); i++)
+	{
+		if (i->first.compare(0, prefix.length(), prefix))
+			break;
+		if (out.size() >= limit)
+			return false;
+		out.push_back(i->second);
+	}
+	return true;
+}
+
+bool UserIndex::Candidates(const char* mask, bool realhost, std::vector<userrec*>& out)
+{
+	/* A user can only match if its nick, host or server begins with the
+	 * literal text before the first wildcard and ends with the literal
+	 * text after the last one, so search on whichever is longer.
+	 */
+	size_t len = strlen(mask);
+	size_t head = strcspn(mask, "*?");
+	size_t tail = 0;
+	while ((tail < len - head) && (mask[len - tail - 1] != '*') && (mask[len - tail - 1] != '?'))
+		tail++;
+
+	if ((!head) && (!tail))
+		return false;
+
+	/* Walking an index is slower per user than matching, so once a good
+	 * part of the network is a candidate, a plain scan is cheaper.
+	 */
+	size_t limit = entries.size() / 8 + 64;
+	std::vector<userrec*> found;
+	if (head >= tail)
+	{
+		std::string key = Fold(mask, head, false);
+		if ((!Range(nicks, key, found, limit)) || (!Range(dhosts, key, found, limit)) || ((realhost) && (!Range(hosts, key, found, limit))))
+			return false;
+	}
+	else
+	{
+		std::string key = Fold(mask + len - tail, tail, true);
+		if ((!Range(rnicks, key, found, limit)) || (!Range(rdhosts, key, found, limit)) || ((realhost) && (!Range(rhosts, key, found, limit))))
+			return false;
+	}
+
+	for (ServerIndex::iterator s = servers.begin(); s != servers.end(); s++)
+	{
+		if (match(s->first, mask))
+		{
+			if (found.size() + s->second.size() > limit)
+				return false;
+			found.insert(found.end(), s->second.begin(), s->second.end());
+		}
+	}
+
+	std::sort(found.begin(), found.end());
+	found.erase(std::unique(found.begin(), found.end()), found.end());
+	out.insert(out.end(), found.begin(), found.end());
+	return true;
+}
@@ -214,6 +214,7 @@ bool XLineManager::add_zline(long duration, const char* source, const char* reas
 	{
 		pzlines.push_back(item);
 	}
+	zline_index_dirty = true;
 	return true;
 }
 
@@ -347,6 +348,7 @@ bool XLineManager::del_zline(const char* ipaddr, bool simulate)
 			{
 				delete *i;
 				zlines.erase(i);
+				zline_index_dirty = true;
 			}
 			return true;
 		}
@@ -359,6 +361,7 @@ bool XLineManager::del_zline(const char* ipaddr, bool simulate)
 			{
 				delete *i;
 				pzlines.erase(i);
+				zline_index_dirty = true;
 			}
 			return true;
 		}
@@ -449,18 +452,21 @@ GLine* XLineManager::matches_gline(userrec* user, bool permonly)
 }
 
 ELine* XLineManager::matches_exception(userrec* user, bool permonly)
+{
+	return matches_exception(user->ident, user->host, user->GetIPString(), permonly);
+}
+
+ELine* XLineManager::matches_exception(const char* ident, const char* host, const char* ip, bool permonly)
 {
 	if ((elines.empty()) && (pelines.empty()))
 		return NULL;
-	char host2[MAXBUF];
-	snprintf(host2,MAXBUF,"*@%s",user->host);
 	if (!permonly)
 	{
 		for (std::vector<ELine*>::iterator i = elines.begin(); i != elines.end(); i++)
 		{
-			if ((match(user->ident,(*i)->identmask)))
+			if ((match(ident,(*i)->identmask)))
 			{
-				if ((match(user->host,(*i)->hostmask, true)) || (match(user->GetIPString(),(*i)->hostmask, true)))
+				if ((match(host,(*i)->hostmask, true)) || (match(ip,(*i)->hostmask, true)))
 				{
 					return (*i);
 				}
@@ -469,9 +475,9 @@ ELine* XLineManager::matches_exception(userrec* user, bool permonly)
 	}
 	for (std::vector<ELine*>::iterator i = pelines.begin(); i != pelines.end(); i++)
 	{
-		if ((match(user->ident,(*i)->identmask)))
+		if ((match(ident,(*i)->identmask)))
 		{
-			if ((match(user->host,(*i)->hostmask, true)) || (match(user->GetIPString(),(*i)->hostmask, true)))
+			if ((match(host,(*i)->hostmask, true)) || (match(ip,(*i)->hostmask, true)))
 			{
 				return (*i);
 			}
@@ -587,6 +593,59 @@ ZLine* XLineManager::matches_zline(const char* ipaddr, bool permonly)
 	return NULL;
 }
 
+void XLineManager::RebuildZLineIndex()
+{
+	zline_index.clear();
+	zline_wild.clear();
+
+	/* Temporary lines first, so that the index agrees with the linear search on overlaps */
+	std::vector<ZLine*>* lists[2] = { &zlines, &pzlines };
+	for (int l = 0; l < 2; l++)
+	{
+		for (std::vector<ZLine*>::iterator i = lists[l]->begin(); i != lists[l]->end(); i++)
+		{
+			irc::sockets::ipaddr_key key;
+			unsigned int bits;
+
+			if ((strpbrk((*i)->ipaddr, "*?")) || (!irc::sockets::MakeCIDRKey((*i)->ipaddr, key, bits)))
+			{
+				zline_wild.push_back(*i);
+				continue;
+			}
+
+			ZLineKeyMap& bylength = zline_index[bits];
+			if (bylength.find(key) == bylength.end())
+				bylength[key] = *i;
+		}
+	}
+
+	zline_index_dirty = false;
+}
+
+ZLine* XLineManager::matches_zline(const irc::sockets::ipaddr_key &key, const char* ipaddr)
+{
+	if ((zlines.empty()) && (pzlines.empty()))
+		return NULL;
+
+	if (zline_index_dirty)
+		RebuildZLineIndex();
+
+	for (ZLineIndex::iterator n = zline_index.begin(); n != zline_index.end(); n++)
+	{
+		irc::sockets::ipaddr_key masked = key;
+		masked.Mask(n->first);
+		ZLineKeyMap::iterator z = n->second.find(masked);
+		if (z != n->second.end())
+			return z->second;
+	}
+
+	for (std::vector<ZLine*>::iterator i = zline_wild.begin(); i != zline_wild.end(); i++)
+		if (match(ipaddr,(*i)->ipaddr, true))
+			return (*i);
+
+	return NULL;
+}
+
 // returns a pointer to the reason if a host matches a kline, NULL if it didnt match
 
 KLine* XLineManager::matches_kline(userrec* user, bool permonly)
@@ -674,6 +733,7 @@ void XLineManager::expire_lines()
 		std::vector<ZLine*>::iterator i = zlines.begin();
 		ServerInstance->SNO->WriteToSnoMask('x',"Expiring timed Z-Line %s (set by %s %d seconds ago)",(*i)->ipaddr,(*i)->source,(*i)->duration);
 		zlines.erase(i);
+		zline_index_dirty = true;
 	}
 
 	while ((klines.size()) && (current > (*klines.begin())->expiry))
@@ -892,6 +952,6 @@ void XLineManager::stats_e(userrec* user, string_list &results)
 		results.push_back(sn+" 223 "+user->nick+" :"+(*i)->identmask+"@"+(*i)->hostmask+" "+ConvToStr((*i)->set_time)+" "+ConvToStr((*i)->duration)+" "+(*i)->source+" :"+(*i)->reason);
 }
 
-XLineManager::XLineManager(InspIRCd* Instance) : ServerInstance(Instance)
+XLineManager::XLineManager(InspIRCd* Instance) : ServerInstance(Instance), zline_index_dirty(true)
 {
 }